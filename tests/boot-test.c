@@ -0,0 +1,261 @@
+/* make test: the boot queue. Launch jobs do nothing here, a vm boots until the
+ * test marks its guest ready; cpu and io pressure come from a temporary
+ * VIRT_PSI_DIR. */
+#define VIRT_TEST
+#include "../virt-server.c"
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static void launch_nothing(job_t *job)
+{
+}
+
+/* a launch as try_launch_qemu leaves it once admitted */
+static qemu_proc_t *vm_launch(int vm_id, int priority)
+{
+    qemu_proc_t *vm = create_qemu_proc(vm_id, &qemu_profiles[0]);
+    job_t *job = job_new("launch", launch_nothing, NULL, NULL);
+
+    if (vm == NULL || job == NULL) {
+        ERR_EXIT("Error: launch vm %d\n", vm_id);
+    }
+    vm->state = QEMU_LAUNCHING;
+    vm->boot_priority = priority;
+    CHECK(boot_submit(vm, job) == 0);
+
+    return vm;
+}
+
+/* qemu is up and the guest answered */
+static void vm_ready(qemu_proc_t *vm)
+{
+    vm->state = QEMU_RUNNING;
+    clock_gettime(CLOCK_MONOTONIC, &vm->launched);
+    vm->ready = true;
+}
+
+static void vms_free(void)
+{
+    qemu_proc_t *vm;
+
+    while ((vm = virt_server.qemu_head) != NULL) {
+        unlink_qemu_proc(vm);
+        free(vm);
+    }
+}
+
+static void set_psi(const char *dir, double cpu, double io)
+{
+    char path[PATH_MAX];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/cpu", dir);
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        ERR_EXIT("Error: write %s\n", path);
+    }
+    fprintf(fp, "some avg10=%.2f avg60=0.00 avg300=0.00 total=0\n", cpu);
+    fclose(fp);
+
+    snprintf(path, sizeof(path), "%s/io", dir);
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        ERR_EXIT("Error: write %s\n", path);
+    }
+    fprintf(fp, "some avg10=%.2f avg60=0.00 avg300=0.00 total=0\n", io);
+    fclose(fp);
+}
+
+/* no more than the limit boot at once, the rest wait until a guest is ready */
+static void test_limit(void)
+{
+    qemu_proc_t *vm1, *vm2, *vm3;
+    int waiting;
+    struct timespec now;
+
+    memset(&boot_ctl, 0, sizeof(boot_ctl));
+    boot_ctl.limit = 2;
+    vm1 = vm_launch(1, 0);
+    vm2 = vm_launch(2, 0);
+    vm3 = vm_launch(3, 0);
+    CHECK(vm1->state == QEMU_LAUNCHING && vm2->state == QEMU_LAUNCHING);
+    CHECK(vm3->state == QEMU_QUEUED && vm3->pending_job != NULL);
+    CHECK(boot_ctl.queued == 1);
+
+    /* running but not ready still holds its slot */
+    vm1->state = QEMU_RUNNING;
+    clock_gettime(CLOCK_MONOTONIC, &vm1->launched);
+    boot_kick();
+    CHECK(vm3->state == QEMU_QUEUED);
+
+    vm_ready(vm1);
+    boot_kick();
+    CHECK(vm3->state == QEMU_LAUNCHING && vm3->pending_job == NULL);
+    CHECK(boot_ctl.dequeued == 1);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    CHECK(boot_count(NULL, &now, &waiting) == 2 && waiting == 0);
+
+    /* a guest that never answers gives its slot back after VIRT_BOOT_HOLD */
+    vm_ready(vm2);
+    vm3->state = QEMU_RUNNING;
+    vm3->launched.tv_sec -= virt_conf.boot_hold + 1;
+    CHECK(boot_count(NULL, &now, &waiting) == 0);
+    boot_tick();
+    CHECK(vm3->boot_held && boot_ctl.held == 1);
+
+    vms_free();
+}
+
+/* the highest priority leaves first, arrival order among equals */
+static void test_priority(void)
+{
+    qemu_proc_t *vm1, *vm2, *vm3, *vm4;
+
+    memset(&boot_ctl, 0, sizeof(boot_ctl));
+    boot_ctl.limit = 1;
+    vm1 = vm_launch(1, 0);
+    vm2 = vm_launch(2, 0);
+    vm3 = vm_launch(3, 0);
+    vm4 = vm_launch(4, 5);
+    CHECK(vm1->state == QEMU_LAUNCHING);
+
+    vm_ready(vm1);
+    boot_kick();
+    CHECK(vm4->state == QEMU_LAUNCHING);
+    CHECK(vm2->state == QEMU_QUEUED && vm3->state == QEMU_QUEUED);
+    CHECK(boot_ctl.passed == 1);
+
+    vm_ready(vm4);
+    boot_kick();
+    CHECK(vm2->state == QEMU_LAUNCHING && vm3->state == QEMU_QUEUED);
+
+    vm_ready(vm2);
+    boot_kick();
+    CHECK(vm3->state == QEMU_LAUNCHING);
+    CHECK(boot_ctl.passed == 1 && boot_ctl.dequeued == 3);
+
+    /* nothing waits and a slot is free, a launch boots right away */
+    vm_ready(vm3);
+    boot_ctl.limit = 2;
+    vm1 = vm_launch(5, 0);
+    CHECK(vm1->state == QEMU_LAUNCHING);
+
+    vms_free();
+}
+
+/* pressure halves the limit once per BOOT_BACKOFF, an idle host grows it by one
+ * while launches wait for it */
+static void test_backoff(const char *psi)
+{
+    int i;
+
+    memset(&boot_ctl, 0, sizeof(boot_ctl));
+    virt_conf.boot_max = 8;
+    boot_init();
+    CHECK(boot_ctl.limit == 4);
+
+    for (i = 1; i <= 4; i++) {
+        vm_launch(i, 0);
+    }
+    set_psi(psi, BOOT_PSI_HIGH, 0);
+    boot_tick();
+    CHECK(boot_ctl.limit == 2 && boot_ctl.shrinks == 1);
+    CHECK(boot_ctl.cpu_psi == BOOT_PSI_HIGH);
+
+    /* avg10 falls slowly, no second halving right away */
+    set_psi(psi, 0, BOOT_PSI_HIGH * 2);
+    boot_tick();
+    CHECK(boot_ctl.limit == 2 && boot_ctl.shrinks == 1);
+
+    boot_ctl.shrunk.tv_sec -= BOOT_BACKOFF;
+    boot_tick();
+    CHECK(boot_ctl.limit == BOOT_MIN && boot_ctl.shrinks == 2);
+    boot_ctl.shrunk.tv_sec -= BOOT_BACKOFF;
+    boot_tick();
+    CHECK(boot_ctl.limit == BOOT_MIN && boot_ctl.shrinks == 2);
+
+    /* in between, nothing changes */
+    set_psi(psi, (BOOT_PSI_HIGH + BOOT_PSI_LOW) / 2, 0);
+    vm_launch(5, 0);
+    boot_tick();
+    CHECK(boot_ctl.limit == BOOT_MIN);
+
+    /* idle, one more a tick while the limit holds a launch back */
+    set_psi(psi, 0, 0);
+    boot_tick();
+    CHECK(boot_ctl.limit == BOOT_MIN + 1 && boot_ctl.grows == 1);
+    for (i = 0; i < 10; i++) {
+        boot_tick();
+    }
+    CHECK(boot_ctl.limit == 5);
+    CHECK(boot_ctl.grows == 4);
+
+    vms_free();
+
+    /* halved from what boots, not from a limit far above it */
+    boot_ctl.limit = 8;
+    boot_ctl.shrunk.tv_sec = 0;
+    vm_launch(1, 0);
+    vm_launch(2, 0);
+    set_psi(psi, BOOT_PSI_HIGH, 0);
+    boot_tick();
+    CHECK(boot_ctl.limit == 1);
+
+    vms_free();
+}
+
+/* run the event loop's side of the pool until every job is done */
+static void jobs_drain(void)
+{
+    struct pollfd pfd = { .fd = job_pool.event_fd, .events = POLLIN };
+
+    while (job_pool.completed < job_pool.submitted) {
+        if (poll(&pfd, 1, 10000) <= 0) {
+            CHECK(!"job did not finish");
+            return;
+        }
+        job_complete_events();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char psi[] = "/tmp/virt-boot-XXXXXX";
+    char path[PATH_MAX];
+
+    load_conf();
+    virt_server.log_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    if (mkdtemp(psi) == NULL) {
+        ERR_EXIT("Error: mkdtemp\n");
+    }
+    virt_conf.psi_dir = psi;
+    virt_conf.boot_max = 8;
+    set_psi(psi, 0, 0);
+    job_pool_init();
+
+    test_limit();
+    test_priority();
+    test_backoff(psi);
+    jobs_drain();
+
+    snprintf(path, sizeof(path), "%s/cpu", psi);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/io", psi);
+    unlink(path);
+    rmdir(psi);
+
+    if (failures) {
+        fprintf(stderr, "boot-test: %d failed\n", failures);
+        return 1;
+    }
+    printf("boot-test: ok\n");
+    return 0;
+}
@@ -0,0 +1,160 @@
+/* make test: the cgroup v2 tree a vm gets, on a plain directory as
+ * VIRT_CGROUP_ROOT; a cgroupfs would refuse files it doesn't know. */
+#define VIRT_TEST
+#include "../virt-server.c"
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static bool file_is(const char *dir, const char *file, const char *want)
+{
+    char val[256];
+
+    if (sysfs_read(dir, file, val, sizeof(val)) < 0) {
+        return want == NULL;
+    }
+    return want != NULL && strcmp(val, want) == 0;
+}
+
+/* files only, a leaf has no children here */
+static void rm_dir(const char *dir)
+{
+    char path[PATH_MAX];
+    struct dirent *ent;
+    DIR *dp = opendir(dir);
+
+    if (dp == NULL) {
+        return;
+    }
+    while ((ent = readdir(dp)) != NULL) {
+        if (ent->d_type == DT_REG) {
+            snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dp);
+    rmdir(dir);
+}
+
+static void test_init(const char *root)
+{
+    cgroup_init();
+    CHECK(file_is(root, "cgroup.subtree_control", CGROUP_CONTROLLERS));
+}
+
+static void test_create_limits(const char *root)
+{
+    qemu_profile_t profile = { .name = "test", .smp = 2, .mem = 1024, .cpu_weight = 200,
+            .cpu_quota = 150, .mem_overhead = 256, .io_weight = 50 };
+    qemu_proc_t vm = { .vm_id = 1, .profile = &profile };
+    char path[PATH_MAX];
+    char val[64];
+    int fd;
+
+    fd = cgroup_create(&vm);
+    CHECK(fd != -1);
+    close_cgroup_fd(&fd);
+    CHECK(fd == -1);
+
+    cgroup_path(vm.vm_id, path, sizeof(path));
+    CHECK(strncmp(path, root, strlen(root)) == 0 && strcmp(path + strlen(root), "/vm-001") == 0);
+    CHECK(file_is(path, "cpu.weight", "200"));
+    snprintf(val, sizeof(val), "%u %u", 150 * (CPU_MAX_PERIOD / 100), CPU_MAX_PERIOD);
+    CHECK(file_is(path, "cpu.max", val));
+    snprintf(val, sizeof(val), "%" PRIu64, (uint64_t)1280 << 20);
+    CHECK(file_is(path, "memory.max", val));
+    snprintf(val, sizeof(val), "%" PRIu64, (uint64_t)1152 << 20);
+    CHECK(file_is(path, "memory.high", val));
+    CHECK(file_is(path, "io.weight", "default 50"));
+    /* not pinned, the leaf takes its cores from the root */
+    CHECK(file_is(path, "cpuset.cpus", NULL));
+    /* memory on the nodes the root allows */
+    CHECK(file_is(path, "cpuset.mems", "0-1"));
+
+    rm_dir(path);
+}
+
+/* what a profile leaves out stays the kernel default, cpu.max excepted */
+static void test_create_defaults(void)
+{
+    qemu_profile_t profile = { .name = "test", .smp = 1, .mem = 512 };
+    qemu_proc_t vm = { .vm_id = 2, .profile = &profile, .numa_nodes = 1u << 1 };
+    char path[PATH_MAX];
+    char val[64];
+    int fd;
+
+    fd = cgroup_create(&vm);
+    CHECK(fd != -1);
+    close_cgroup_fd(&fd);
+
+    cgroup_path(vm.vm_id, path, sizeof(path));
+    snprintf(val, sizeof(val), "max %u", CPU_MAX_PERIOD);
+    CHECK(file_is(path, "cpu.max", val));
+    CHECK(file_is(path, "cpu.weight", NULL));
+    CHECK(file_is(path, "memory.max", NULL));
+    CHECK(file_is(path, "memory.high", NULL));
+    CHECK(file_is(path, "io.weight", NULL));
+    /* guest RAM on the node of its cores */
+    CHECK(file_is(path, "cpuset.mems", "1"));
+
+    rm_dir(path);
+}
+
+/* a grown vm keeps memory.max above what it holds */
+static void test_set_mem(void)
+{
+    char path[PATH_MAX];
+    char val[64];
+
+    cgroup_path(3, path, sizeof(path));
+    CHECK(mkdir(path, 0755) == 0);
+    cgroup_set_mem(path, 2048, 512);
+    snprintf(val, sizeof(val), "%" PRIu64, (uint64_t)2560 << 20);
+    CHECK(file_is(path, "memory.max", val));
+    snprintf(val, sizeof(val), "%" PRIu64, (uint64_t)2304 << 20);
+    CHECK(file_is(path, "memory.high", val));
+
+    /* an empty leaf goes, a missing one is no error */
+    unlink(strcat(path, "/memory.max"));
+    cgroup_path(3, path, sizeof(path));
+    unlink(strcat(path, "/memory.high"));
+    cgroup_path(3, path, sizeof(path));
+    cgroup_destroy(3);
+    CHECK(access(path, F_OK) == -1 && errno == ENOENT);
+    cgroup_destroy(3);
+}
+
+int main(int argc, char *argv[])
+{
+    char root[] = "/tmp/virt-cgroup-XXXXXX";
+
+    load_conf();
+    virt_server.log_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    if (mkdtemp(root) == NULL) {
+        ERR_EXIT("Error: mkdtemp\n");
+    }
+    virt_conf.cgroup_root = root;
+    if (sysfs_write(root, "cpuset.mems.effective", "0-1\n") == -1) {
+        ERR_EXIT("Error: write %s\n", root);
+    }
+
+    test_init(root);
+    test_create_limits(root);
+    test_create_defaults();
+    test_set_mem();
+    rm_dir(root);
+
+    if (failures) {
+        fprintf(stderr, "cgroup-test: %d failed\n", failures);
+        return 1;
+    }
+    printf("cgroup-test: ok\n");
+    return 0;
+}
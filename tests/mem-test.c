@@ -0,0 +1,367 @@
+/* make test: guest memory under host pressure. PSI, /proc, KSM's sysfs and the
+ * vms' QMP monitors live in a temporary directory; a monitor is a thread that
+ * serves one client at a time like qemu's and remembers the balloon it was set to. */
+#define VIRT_TEST
+#include "../virt-server.c"
+#include <ftw.h>
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+typedef struct monitor {
+    int vm_id;
+    int listen_fd;
+    pthread_mutex_t lock;
+    int commands;
+    uint64_t balloon;       /* bytes */
+} monitor_t;
+
+static void monitor_serve(monitor_t *mon, int fd)
+{
+    const char *greeting = "{\"QMP\": {\"version\": {}, \"capabilities\": []}}\r\n";
+    const char *ok = "{\"return\": {}}\r\n";
+    char line[1024];
+    char *value;
+    FILE *fp = fdopen(fd, "r+");
+
+    if (fp == NULL) {
+        close(fd);
+        return;
+    }
+    setvbuf(fp, NULL, _IONBF, 0);
+    fputs(greeting, fp);
+    while (fgets(line, sizeof(line), fp)) {
+        pthread_mutex_lock(&mon->lock);
+        mon->commands++;
+        value = strstr(line, "\"value\":");
+        if (strstr(line, "\"balloon\"") && value) {
+            mon->balloon = strtoull(value + strlen("\"value\":"), NULL, 10);
+        }
+        pthread_mutex_unlock(&mon->lock);
+        fputs(ok, fp);
+    }
+    fclose(fp);
+}
+
+static void *monitor_thread(void *arg)
+{
+    monitor_t *mon = arg;
+    int fd;
+
+    while ((fd = accept(mon->listen_fd, NULL, NULL)) != -1) {
+        monitor_serve(mon, fd);
+    }
+
+    return NULL;
+}
+
+static void monitor_start(monitor_t *mon, int vm_id)
+{
+    struct sockaddr_un addr;
+    pthread_t thread;
+
+    mon->vm_id = vm_id;
+    pthread_mutex_init(&mon->lock, NULL);
+    qmp_addr(vm_id, &addr);
+    mon->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (mon->listen_fd == -1 || bind(mon->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(mon->listen_fd, 8) == -1) {
+        ERR_EXIT("Error: monitor %s\n", addr.sun_path);
+    }
+    pthread_create(&thread, NULL, monitor_thread, mon);
+    pthread_detach(thread);
+}
+
+static uint64_t monitor_balloon(monitor_t *mon)
+{
+    uint64_t val;
+
+    pthread_mutex_lock(&mon->lock);
+    val = mon->balloon;
+    pthread_mutex_unlock(&mon->lock);
+
+    return val;
+}
+
+static void write_file(const char *dir, const char *name, const char *fmt, ...)
+{
+    char path[PATH_MAX];
+    va_list args;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        ERR_EXIT("Error: write %s\n", path);
+    }
+    va_start(args, fmt);
+    vfprintf(fp, fmt, args);
+    va_end(args);
+    fclose(fp);
+}
+
+static void set_psi(const char *dir, double some)
+{
+    write_file(dir, "memory", "some avg10=%.2f avg60=0.00 avg300=0.00 total=0\n"
+            "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n", some);
+}
+
+static qemu_proc_t *vm_start(const char *proc, int vm_id, qemu_profile_t *profile, uint32_t rss)
+{
+    qemu_proc_t *vm = create_qemu_proc(vm_id, profile);
+    char dir[PATH_MAX];
+
+    if (vm == NULL) {
+        ERR_EXIT("Error: create vm %d\n", vm_id);
+    }
+    vm->state = QEMU_RUNNING;
+    vm->pid = 100 + vm_id;
+    snprintf(dir, sizeof(dir), "%s/%d", proc, vm->pid);
+    mkdir(dir, 0755);
+    write_file(dir, "status", "Name:\tqemu\nVmRSS:\t%u kB\n", rss << 10);
+
+    return vm;
+}
+
+static void vm_stop(qemu_proc_t *vm)
+{
+    unlink_qemu_proc(vm);
+    free(vm);
+}
+
+/* run the event loop's side of the pool until every job is done */
+static void jobs_drain(void)
+{
+    struct pollfd pfd = { .fd = job_pool.event_fd, .events = POLLIN };
+
+    while (job_pool.completed < job_pool.submitted) {
+        if (poll(&pfd, 1, 10000) <= 0) {
+            CHECK(!"job did not finish");
+            return;
+        }
+        job_complete_events();
+    }
+}
+
+static void balloon_pass(void)
+{
+    balloon_reclaim();
+    jobs_drain();
+}
+
+/* the guest using little of its RAM gives first, each at most BALLOON_STEP a
+ * pass, and one at its floor does not stop the other */
+static void test_balloon(const char *psi, const char *proc)
+{
+    qemu_profile_t idle = { .name = "idle", .smp = 1, .mem = 4096, .balloon_floor = 1024 };
+    qemu_profile_t busy = { .name = "busy", .smp = 1, .mem = 4096, .balloon_floor = 3072 };
+    monitor_t mon1, mon2;
+    qemu_proc_t *vm1, *vm2;
+    int i;
+
+    monitor_start(&mon1, 1);
+    monitor_start(&mon2, 2);
+    vm1 = vm_start(proc, 1, &idle, 1000);
+    vm2 = vm_start(proc, 2, &busy, 4000);
+
+    /* between the thresholds nothing moves */
+    set_psi(psi, (BALLOON_PSI_HIGH + BALLOON_PSI_LOW) / 2);
+    balloon_pass();
+    CHECK(vm1->balloon_target == 4096 && vm2->balloon_target == 4096);
+    CHECK(vm1->rss == 1000 && vm2->rss == 4000);
+
+    set_psi(psi, BALLOON_PSI_HIGH * 2);
+    balloon_pass();
+    CHECK(vm1->balloon_target == 4096 - BALLOON_STEP);
+    CHECK(vm2->balloon_target == 4096 - BALLOON_STEP);
+    CHECK(monitor_balloon(&mon1) == (uint64_t)(4096 - BALLOON_STEP) << 20);
+    CHECK(balloon_ctl.inflates == 2);
+
+    for (i = 0; i < 4; i++) {
+        balloon_pass();
+    }
+    CHECK(vm2->balloon_target == 3072);
+    CHECK(vm1->balloon_target == 4096 - 5 * BALLOON_STEP);
+    CHECK(monitor_balloon(&mon1) == (uint64_t)vm1->balloon_target << 20);
+    CHECK(monitor_balloon(&mon2) == (uint64_t)3072 << 20);
+    CHECK(balloon_ctl.reclaimed == 5 * BALLOON_STEP + 1024);
+
+    /* pressure gone, both get memory back */
+    set_psi(psi, BALLOON_PSI_LOW / 2);
+    balloon_pass();
+    CHECK(vm1->balloon_target == 4096 - 4 * BALLOON_STEP);
+    CHECK(vm2->balloon_target == 3072 + BALLOON_STEP);
+    CHECK(balloon_ctl.deflates == 2);
+    CHECK(balloon_ctl.failed == 0);
+
+    vm_stop(vm1);
+    vm_stop(vm2);
+}
+
+/* a balloon qemu never took leaves the target where it was */
+static void test_balloon_failed(const char *psi, const char *proc)
+{
+    qemu_profile_t idle = { .name = "idle", .smp = 1, .mem = 2048, .balloon_floor = 1024 };
+    qemu_proc_t *vm = vm_start(proc, 3, &idle, 500);
+    uint64_t failed = balloon_ctl.failed;
+
+    set_psi(psi, BALLOON_PSI_HIGH * 2);
+    balloon_pass();
+    CHECK(balloon_ctl.failed == failed + 1);
+    CHECK(vm->balloon_target == 2048);
+
+    vm_stop(vm);
+}
+
+static bool args_have(const arglist_t *args, const char *want)
+{
+    int i;
+
+    for (i = 0; i < args->argc; i++) {
+        if (args->argv[i] && strstr(args->argv[i], want)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* qemu merges by default, a profile that didn't opt in must say so */
+static void test_mem_merge_arg(void)
+{
+    qemu_profile_t profile = qemu_profiles[0];
+    arglist_t args = { 0 };
+    qemu_proc_t *vm;
+
+    profile.mem_merge = true;
+    vm = create_qemu_proc(4, &profile);
+    fill_arglist(vm, &args);
+    CHECK(args_have(&args, "mem-merge=on") && !args_have(&args, "mem-merge=off"));
+    arg_free(&args);
+
+    profile.mem_merge = false;
+    fill_arglist(vm, &args);
+    CHECK(args_have(&args, "mem-merge=off") && !args_have(&args, "mem-merge=on"));
+    arg_free(&args);
+
+    vm_stop(vm);
+}
+
+static uint64_t ksm_value(const char *file)
+{
+    uint64_t val = 0;
+
+    CHECK(ksm_read(file, &val) == 0);
+    return val;
+}
+
+/* ksmd runs only while a mem-merge vm does, scans faster while merging pays
+ * and backs off when it doesn't or when ksmd costs too much */
+static void test_ksm(const char *ksm, const char *proc)
+{
+    qemu_profile_t merge = { .name = "merge", .smp = 1, .mem = 1024, .mem_merge = true };
+    qemu_profile_t plain = { .name = "plain", .smp = 1, .mem = 1024 };
+    char ksmd[PATH_MAX], dir[PATH_MAX];
+    qemu_proc_t *vm;
+
+    write_file(ksm, "run", "0\n");
+    write_file(ksm, "pages_sharing", "0\n");
+    write_file(ksm, "pages_shared", "0\n");
+    write_file(ksm, "pages_to_scan", "1000\n");
+    write_file(ksm, "sleep_millisecs", "200\n");
+    snprintf(ksmd, sizeof(ksmd), "%s/50", proc);
+    mkdir(ksmd, 0755);
+    write_file(ksmd, "comm", "ksmd\n");
+    write_file(ksmd, "stat", "50 (ksmd) S 2 0 0 0 -1 2129984 0 0 0 0 10 5 0 0\n");
+
+    /* a vm that didn't opt in doesn't start it */
+    vm = vm_start(proc, 5, &plain, 512);
+    ksm_tune();
+    CHECK(ksm_value("run") == 0 && !ksm_ctl.running);
+    vm_stop(vm);
+
+    vm = vm_start(proc, 6, &merge, 512);
+    snprintf(dir, sizeof(dir), "%s/%d", proc, vm->pid);
+    write_file(dir, "ksm_merging_pages", "500\n");
+
+    /* nothing merged yet, scan slower */
+    ksm_tune();
+    CHECK(ksm_value("run") == 1 && ksm_ctl.running);
+    CHECK(ksm_ctl.ksmd == 50);
+    CHECK(vm->ksm_pages == 500);
+    CHECK(ksm_value("pages_to_scan") == 500 && ksm_value("sleep_millisecs") == 400);
+
+    /* merging pays and ksmd is idle, scan faster */
+    write_file(ksm, "pages_sharing", "%d\n", 100 * KSM_GAIN_MIN);
+    ksm_tune();
+    CHECK(ksm_ctl.gain == 100 * KSM_GAIN_MIN);
+    CHECK(ksm_value("pages_to_scan") == 1000 && ksm_value("sleep_millisecs") == 200);
+
+    /* it still pays but ksmd burnt seconds of cpu in no time */
+    write_file(ksm, "pages_sharing", "%d\n", 200 * KSM_GAIN_MIN);
+    write_file(ksmd, "stat", "50 (ksmd) S 2 0 0 0 -1 2129984 0 0 0 0 100000 5 0 0\n");
+    ksm_tune();
+    CHECK(ksm_ctl.cpu > KSM_CPU_MAX);
+    CHECK(ksm_value("pages_to_scan") == 500 && ksm_value("sleep_millisecs") == 400);
+
+    /* the last one gone, ksmd stops */
+    vm_stop(vm);
+    ksm_tune();
+    CHECK(ksm_value("run") == 0 && !ksm_ctl.running);
+
+    /* an admin's ksmd is left running */
+    write_file(ksm, "run", "1\n");
+    ksm_tune();
+    CHECK(ksm_value("run") == 1 && !ksm_ctl.running);
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    remove(path);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char root[] = "/tmp/virt-mem-XXXXXX";
+    char psi[PATH_MAX], proc[PATH_MAX], qmp[PATH_MAX], ksm[PATH_MAX];
+
+    load_conf();
+    virt_server.log_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    if (mkdtemp(root) == NULL) {
+        ERR_EXIT("Error: mkdtemp\n");
+    }
+    snprintf(psi, sizeof(psi), "%s/psi", root);
+    snprintf(proc, sizeof(proc), "%s/proc", root);
+    snprintf(qmp, sizeof(qmp), "%s/qmp", root);
+    snprintf(ksm, sizeof(ksm), "%s/ksm", root);
+    mkdir(psi, 0755);
+    mkdir(proc, 0755);
+    mkdir(qmp, 0755);
+    mkdir(ksm, 0755);
+    virt_conf.psi_dir = psi;
+    virt_conf.proc_root = proc;
+    virt_conf.qmp_dir = qmp;
+    virt_conf.ksm_dir = ksm;
+    job_pool_init();
+
+    test_balloon(psi, proc);
+    test_balloon_failed(psi, proc);
+    test_mem_merge_arg();
+    test_ksm(ksm, proc);
+
+    nftw(root, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    if (failures) {
+        fprintf(stderr, "mem-test: %d failed\n", failures);
+        return 1;
+    }
+    printf("mem-test: ok\n");
+    return 0;
+}
@@ -0,0 +1,323 @@
+/* make test: placement against a synthetic host, no qemu or root needed.
+ * NUMA nodes come from a fake VIRT_NODE_SYSFS tree, federation nodes from
+ * their last announce as the coordinator keeps it. */
+#define VIRT_TEST
+#include "../virt-server.c"
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+/* cpus cores in the pool, nodes of equal size over consecutive cores, 1 is none */
+static void host_reset(int cpus, int nodes)
+{
+    int i;
+
+    free(host_cap.cpu_used);
+    memset(&host_cap, 0, sizeof(host_cap));
+    memset(&numa_host, 0, sizeof(numa_host));
+    memset(numa_host.node_of, -1, sizeof(numa_host.node_of));
+
+    host_cap.nr_cpus = cpus;
+    host_cap.cpu_cap = 4 * VCPU_UNIT;
+    host_cap.cpu_used = calloc(cpus, sizeof(uint32_t));
+    for (i = 0; i < cpus; i++) {
+        CPU_SET(i, &host_cap.pool);
+    }
+    host_cap.mem_total = cpus * 4096ULL;
+
+    if (nodes > 1) {
+        for (i = 0; i < cpus; i++) {
+            numa_host.node_of[i] = i * nodes / cpus;
+            CPU_SET(i, &numa_host.cpus[numa_host.node_of[i]]);
+        }
+        for (i = 0; i < nodes; i++) {
+            numa_host.nodes |= 1u << i;
+            numa_host.mem_total[i] = host_cap.mem_total / nodes;
+        }
+        numa_host.nr_nodes = nodes;
+    }
+}
+
+static int count_on(const cpu_set_t *cpus, int node)
+{
+    cpu_set_t both;
+
+    CPU_AND(&both, cpus, &numa_host.cpus[node]);
+    return CPU_COUNT(&both);
+}
+
+/* free slots 2/5/5 over three nodes, 8 needed: the two big nodes, not all three */
+static void test_numa_take_fewest_nodes(void)
+{
+    cpu_slot_t slots[12];
+    cpu_set_t cpus;
+    int i, nr = 0;
+
+    host_reset(15, 3);
+    for (i = 0; i < 15; i++) {
+        if (i < 2 || i >= 5) {
+            slots[nr].free = VCPU_UNIT;
+            slots[nr++].cpu = i;
+        }
+    }
+
+    CPU_ZERO(&cpus);
+    numa_take(slots, nr, 8, -1, &cpus);
+    CHECK(CPU_COUNT(&cpus) == 8);
+    CHECK(numa_nodes_of(&cpus) == ((1u << 1) | (1u << 2)));
+    CHECK(count_on(&cpus, 0) == 0);
+}
+
+static void test_numa_take_one_node(void)
+{
+    cpu_slot_t slots[15];
+    cpu_set_t cpus;
+    int i;
+
+    host_reset(15, 3);
+    for (i = 0; i < 15; i++) {
+        slots[i].free = VCPU_UNIT;
+        slots[i].cpu = i;
+    }
+
+    CPU_ZERO(&cpus);
+    numa_take(slots, 15, 4, 2, &cpus);
+    CHECK(CPU_COUNT(&cpus) == 4);
+    CHECK(count_on(&cpus, 2) == 4);
+
+    /* more than the node has spills onto the next biggest */
+    CPU_ZERO(&cpus);
+    numa_take(slots, 15, 7, 0, &cpus);
+    CHECK(CPU_COUNT(&cpus) == 7);
+    CHECK(count_on(&cpus, 0) == 5);
+    CHECK(__builtin_popcount(numa_nodes_of(&cpus)) == 2);
+}
+
+/* cores on no node are taken only when the nodes ran out */
+static void test_numa_take_no_node_last(void)
+{
+    cpu_slot_t slots[8];
+    cpu_set_t cpus;
+    int i;
+
+    host_reset(8, 2);
+    numa_host.node_of[0] = numa_host.node_of[1] = -1;
+    CPU_CLR(0, &numa_host.cpus[0]);
+    CPU_CLR(1, &numa_host.cpus[0]);
+    for (i = 0; i < 8; i++) {
+        slots[i].free = VCPU_UNIT;
+        slots[i].cpu = i;
+    }
+
+    CPU_ZERO(&cpus);
+    numa_take(slots, 8, 6, -1, &cpus);
+    CHECK(CPU_COUNT(&cpus) == 6);
+    CHECK(!CPU_ISSET(0, &cpus) && !CPU_ISSET(1, &cpus));
+
+    CPU_ZERO(&cpus);
+    numa_take(slots, 8, 7, -1, &cpus);
+    CHECK(CPU_COUNT(&cpus) == 7);
+}
+
+/* the node whose cores fit the vm the tightest, and only one with memory left */
+static void test_numa_pick(void)
+{
+    qemu_profile_t profile = { .name = "test", .smp = 2, .mem = 1024 };
+    cpu_set_t cpus;
+
+    host_reset(8, 2);
+    host_cap.cpu_used[4] = host_cap.cpu_used[5] = 2 * VCPU_UNIT;
+    CHECK(sched_fit(&profile, &cpus) == FIT_OK);
+    CHECK(CPU_ISSET(4, &cpus) && CPU_ISSET(5, &cpus));
+
+    numa_host.mem_used[1] = numa_host.mem_total[1];
+    CHECK(sched_fit(&profile, &cpus) == FIT_OK);
+    CHECK(count_on(&cpus, 0) == 2);
+}
+
+/* best fit: the cores with the least room that still carry the vm */
+static void test_best_fit(void)
+{
+    qemu_profile_t profile = { .name = "test", .smp = 1, .mem = 1024, .mem_overhead = 256 };
+    qemu_proc_t vm = { .vm_id = 1, .profile = &profile };
+    cpu_set_t cpus;
+
+    host_reset(4, 1);
+    host_cap.cpu_used[1] = 3 * VCPU_UNIT;
+    host_cap.cpu_used[2] = VCPU_UNIT;
+    host_cap.cpu_used[3] = 4 * VCPU_UNIT;
+
+    CHECK(sched_fit(&profile, &cpus) == FIT_OK);
+    CHECK(CPU_COUNT(&cpus) == 1 && CPU_ISSET(1, &cpus));
+
+    profile.smp = 2;
+    CHECK(sched_fit(&profile, &cpus) == FIT_OK);
+    CHECK(CPU_COUNT(&cpus) == 2 && CPU_ISSET(1, &cpus) && CPU_ISSET(2, &cpus));
+
+    CHECK(sched_admit(&vm) == FIT_OK);
+    CHECK(host_cap.cpu_used[1] == 4 * VCPU_UNIT && host_cap.cpu_used[2] == 2 * VCPU_UNIT);
+    CHECK(host_cap.mem_used == 1280);
+    sched_release(&vm);
+    CHECK(!vm.admitted);
+    CHECK(host_cap.cpu_used[1] == 3 * VCPU_UNIT && host_cap.cpu_used[2] == VCPU_UNIT);
+    CHECK(host_cap.mem_used == 0);
+}
+
+static void test_fit_refused(void)
+{
+    qemu_profile_t profile = { .name = "test", .smp = 2, .mem = 1024 };
+    cpu_set_t cpus;
+    int i;
+
+    host_reset(2, 1);
+    for (i = 0; i < 2; i++) {
+        host_cap.cpu_used[i] = 4 * VCPU_UNIT;
+    }
+    CHECK(sched_fit(&profile, &cpus) == FIT_NO_CPU);
+
+    host_reset(2, 1);
+    host_cap.mem_used = host_cap.mem_total - 512;
+    CHECK(sched_fit(&profile, &cpus) == FIT_NO_MEM);
+
+    /* never, whatever leaves */
+    profile.mem = host_cap.mem_total + 1;
+    CHECK(sched_fit(&profile, &cpus) == FIT_NEVER);
+    profile.mem = 1024;
+    profile.smp = 9;
+    CHECK(sched_fit(&profile, &cpus) == FIT_NEVER);
+}
+
+static void write_file(const char *dir, const char *name, const char *val)
+{
+    char path[PATH_MAX];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        ERR_EXIT("Error: write %s\n", path);
+    }
+    fputs(val, fp);
+    fclose(fp);
+}
+
+/* two nodes of cores 1:3 in memory, a third with memory only is left out */
+static void test_numa_init(void)
+{
+    char root[] = "/tmp/virt-test-XXXXXX";
+    char dir[PATH_MAX];
+    int n;
+
+    if (mkdtemp(root) == NULL) {
+        ERR_EXIT("Error: mkdtemp\n");
+    }
+    write_file(root, "online", "0-2\n");
+    for (n = 0; n < 3; n++) {
+        snprintf(dir, sizeof(dir), "%s/node%d", root, n);
+        mkdir(dir, 0755);
+    }
+    write_file(root, "node0/cpulist", "0-3\n");
+    write_file(root, "node0/meminfo", "Node 0 MemTotal:        1048576 kB\n");
+    write_file(root, "node1/cpulist", "4-7\n");
+    write_file(root, "node1/meminfo", "Node 1 MemTotal:        3145728 kB\n");
+    write_file(root, "node2/cpulist", "\n");
+    write_file(root, "node2/meminfo", "Node 2 MemTotal:        8388608 kB\n");
+
+    host_reset(8, 1);
+    virt_conf.node_sysfs = root;
+    numa_init();
+    CHECK(numa_host.nr_nodes == 2);
+    CHECK(numa_host.nodes == 3);
+    CHECK(numa_host.node_of[3] == 0 && numa_host.node_of[4] == 1);
+    CHECK(numa_host.mem_total[0] == host_cap.mem_total / 4);
+    CHECK(numa_host.mem_total[1] == host_cap.mem_total * 3 / 4);
+
+    /* one node is as good as none */
+    write_file(root, "online", "0\n");
+    host_reset(8, 1);
+    numa_init();
+    CHECK(numa_host.nr_nodes == 0 && numa_host.node_of[0] == -1);
+
+    for (n = 0; n < 3; n++) {
+        snprintf(dir, sizeof(dir), "%s/node%d/cpulist", root, n);
+        unlink(dir);
+        snprintf(dir, sizeof(dir), "%s/node%d/meminfo", root, n);
+        unlink(dir);
+        snprintf(dir, sizeof(dir), "%s/node%d", root, n);
+        rmdir(dir);
+    }
+    snprintf(dir, sizeof(dir), "%s/online", root);
+    unlink(dir);
+    rmdir(root);
+}
+
+static void fed_node_set(int i, bool alive, int fit, int cpu_used, int mem_used)
+{
+    fed_node_t *node = &fed.nodes[i];
+
+    snprintf(node->path, sizeof(node->path), "/tmp/node%d.sock", i);
+    node->alive = alive;
+    node->fit = fit;
+    node->cpu_used = cpu_used;
+    node->cpu_cap = 16 * VCPU_UNIT;
+    node->mem_used = mem_used;
+    node->mem_total = 16384;
+    if (fed.nr_nodes <= i) {
+        fed.nr_nodes = i + 1;
+    }
+}
+
+/* the least loaded alive node the profile fits, more memory left on a tie */
+static void test_fed_place(void)
+{
+    qemu_profile_t *profile = &qemu_profiles[0];
+    int bit = 1 << 0;
+
+    memset(&fed, 0, sizeof(fed));
+    CHECK(fed_place(profile) == -1);
+
+    fed_node_set(0, false, bit, 0, 0);
+    fed_node_set(1, true, 0, 0, 0);
+    fed_node_set(2, true, bit, 8 * VCPU_UNIT, 4096);
+    fed_node_set(3, true, bit, 4 * VCPU_UNIT, 8192);
+    fed_node_set(4, true, bit, 4 * VCPU_UNIT, 2048);
+    CHECK(fed_place(profile) == 4);
+
+    /* a claim counts until the node announces it */
+    fed_claim(&fed.nodes[4], 1, profile);
+    CHECK(fed_place(profile) == 3);
+    CHECK(fed_find_vm(1) == 4);
+
+    fed.nodes[3].mem_used = fed.nodes[3].mem_total;
+    fed.nodes[4].alive = false;
+    CHECK(fed_place(profile) == 2);
+    CHECK(fed_find_vm(1) == -1);
+}
+
+int main(int argc, char *argv[])
+{
+    load_conf();
+    virt_server.log_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    test_numa_take_fewest_nodes();
+    test_numa_take_one_node();
+    test_numa_take_no_node_last();
+    test_numa_pick();
+    test_best_fit();
+    test_fit_refused();
+    test_numa_init();
+    test_fed_place();
+
+    if (failures) {
+        fprintf(stderr, "sched-test: %d failed\n", failures);
+        return 1;
+    }
+    printf("sched-test: ok\n");
+    return 0;
+}
@@ -0,0 +1,175 @@
+/* make test: the status table seqlock, the server's writer against libvirtc's
+ * reader on a table in a temporary file instead of VIRT_STATUS_SHM. */
+#define VIRT_TEST
+#include "../virt-server.c"
+
+#define WRITES 200000
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static bool writing;
+
+/* every field of a write carries its generation, a torn copy mixes two;
+ * generation 1 is the empty table status_init left */
+static void *writer(void *arg)
+{
+    uint64_t gen;
+    int i;
+
+    for (gen = 2; gen <= WRITES + 1; gen++) {
+        status_write_begin();
+        status_table->generation = gen;
+        status_table->nr_vms = gen % (MAX_VM_NUM + 1);
+        for (i = 0; i < MAX_VM_NUM; i++) {
+            status_table->vms[i].vm_id = i;
+            status_table->vms[i].smp = gen;
+            status_table->vms[i].mem = gen;
+            status_table->vms[i].ksm_pages = gen;
+        }
+        status_table->heartbeat = gen;
+        status_write_end();
+    }
+    __atomic_store_n(&writing, false, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static void test_concurrent_reads(const char *path)
+{
+    virtc_status_t *st;
+    virt_status_t table;
+    pthread_t thread;
+    int err, i, reads = 0;
+
+    st = virtc_status_open(path, &err);
+    CHECK(st != NULL && err == 0);
+    if (st == NULL) {
+        return;
+    }
+
+    writing = true;
+    pthread_create(&thread, NULL, writer, NULL);
+    while (__atomic_load_n(&writing, __ATOMIC_ACQUIRE)) {
+        err = virtc_status_read(st, &table);
+        /* the writer may be preempted inside a write */
+        if (err == -VIRTC_ETIMEDOUT) {
+            continue;
+        }
+        CHECK(err == 0);
+        if (err != 0) {
+            break;
+        }
+        if (table.generation < 2) {
+            continue;
+        }
+        reads++;
+        CHECK(table.heartbeat == table.generation);
+        CHECK(table.nr_vms == (int)(table.generation % (MAX_VM_NUM + 1)));
+        for (i = 0; i < MAX_VM_NUM; i++) {
+            if (table.vms[i].smp != table.generation || table.vms[i].mem != table.generation ||
+                    table.vms[i].ksm_pages != table.generation) {
+                CHECK(!"torn vm entry");
+                break;
+            }
+        }
+    }
+    pthread_join(thread, NULL);
+
+    CHECK(reads > 0);
+    CHECK(virtc_status_generation(st) == WRITES + 1);
+    virtc_status_close(st);
+}
+
+/* a writer that never finishes, and a table of another layout */
+static void test_refused_reads(const char *path)
+{
+    virtc_status_t *st;
+    virt_status_t table;
+    int err;
+
+    st = virtc_status_open(path, &err);
+    CHECK(st != NULL);
+    if (st == NULL) {
+        return;
+    }
+
+    status_write_begin();
+    CHECK(virtc_status_read(st, &table) == -VIRTC_ETIMEDOUT);
+    status_write_end();
+    CHECK(virtc_status_read(st, &table) == 0);
+
+    status_write_begin();
+    status_table->size--;
+    status_write_end();
+    CHECK(virtc_status_read(st, &table) == -VIRTC_EPROTO);
+
+    status_write_begin();
+    status_table->size++;
+    status_table->nr_vms = MAX_VM_NUM + 1;
+    status_write_end();
+    CHECK(virtc_status_read(st, &table) == -VIRTC_EPROTO);
+
+    virtc_status_close(st);
+}
+
+/* a server restarted over a table it left halfway through a write */
+static void test_reinit(const char *path)
+{
+    virtc_status_t *st;
+    virt_status_t table;
+    uint64_t gen;
+    int err;
+
+    status_write_begin();
+    gen = status_table->generation;
+    status_init();
+    CHECK((status_table->seq & 1) == 0);
+    CHECK(status_table->generation == gen + 1);
+
+    st = virtc_status_open(path, &err);
+    CHECK(st != NULL);
+    if (st != NULL) {
+        CHECK(virtc_status_read(st, &table) == 0);
+        CHECK(table.nr_vms == 0 && table.server_pid == getpid());
+        virtc_status_close(st);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char path[] = "/tmp/virt-status-XXXXXX";
+    int fd;
+
+    load_conf();
+    virt_server.log_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    fd = mkstemp(path);
+    if (fd == -1) {
+        ERR_EXIT("Error: mkstemp\n");
+    }
+    close(fd);
+    virt_conf.status_shm = path;
+    status_init();
+    if (status_table == NULL) {
+        ERR_EXIT("Error: status table %s\n", path);
+    }
+
+    test_concurrent_reads(path);
+    test_refused_reads(path);
+    test_reinit(path);
+    unlink(path);
+
+    if (failures) {
+        fprintf(stderr, "status-test: %d failed\n", failures);
+        return 1;
+    }
+    printf("status-test: ok\n");
+    return 0;
+}
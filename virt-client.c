@@ -1,22 +1,14 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <time.h>
-#include <fcntl.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <stdarg.h>
-#include <sys/wait.h>
 #include <errno.h>
-#include <sys/select.h>
-#include <sys/socket.h>
-#include <sys/un.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <ctype.h>
 
-#define LIBVIRTD_SOCKET "/home/alan/libvirt/libvirtd.socket"
+#include "virtc.h"
 
 #define ERR_EXIT(m) \
 do \
@@ -26,15 +18,15 @@ do \
 } \
 while (0); \
 
-static int client_sockfd;
+static virtc_t *client;
 
-typedef enum MESSAGE_TYPE {
-    MES_QUREY_QEMU,
-    MES_LAUNCH_QEMU,
-    MES_KILL_QEMU,
-    MES_GET_CPU_AFFINITY,
-    MES_ACK,
-} MESSAGE_TYPE_T;
+static char *job_state_str[] = {
+    "unknown",
+    "queued",
+    "running",
+    "done",
+    "failed",
+};
 
 static void print_intro()
 {
@@ -43,6 +35,16 @@ static void print_intro()
             "\tb- kill a qemu\n"
             "\tc- query qemu status\n"
             "\td- get vm cpu affinity\n"
+            "\te- launch a qemu with a profile\n"
+            "\tf- query a launch/kill job\n"
+            "\tg- show server statistics\n"
+            "\th- check whether a profile fits on the host\n"
+            "\ti- switch launch tracing on/off or dump it\n"
+            "\tj- wait until a guest is ready\n"
+            "\tk- limit the disk I/O of a vm\n"
+            "\tl- set the I/O budget of a group of vms\n"
+            "\tm- read the vm status table the server shares\n"
+            "\tn- launch a qemu with a profile and a boot priority\n"
             "Please follow the tips and type correct choice.\n\n");
 }
 
@@ -51,170 +53,364 @@ static void print_message_option()
     printf( "========== Options ===========\n"
             "|    l.query qemu status     |\n"
             "|    s.launch qemu           |\n"
+            "|    p.launch with profile   |\n"
             "|    k.kill qemu             |\n"
             "|    c.get vm cpu affinity   |\n"
+            "|    j.query job             |\n"
+            "|    t.server statistics     |\n"
+            "|    f.would a profile fit   |\n"
+            "|    r.trace on/off/dump     |\n"
+            "|    w.wait guest ready      |\n"
+            "|    o.vm disk I/O limits    |\n"
+            "|    g.I/O group budget      |\n"
+            "|    v.status table          |\n"
+            "|    u.launch with priority  |\n"
             "|    h.print options         |\n"
             "|    q.quit                  |\n"
             "========== Options ===========\n\n\n");
 }
 
-static void recv_ack(void)
+/* The interactive client asks one thing at a time, block until it's answered. */
+static void wait_reply(int ret)
 {
-    int ack, ret;
-    ret = read(client_sockfd, &ack, sizeof(ack));
-    if (ret == -1) {
-        ERR_EXIT("recv ack error");
+    if (ret < 0) {
+        printf("%s\n", virtc_strerror(ret));
+        return;
     }
 
-    if (ack != MES_ACK) {
-        ERR_EXIT("Message ACK error");
+    ret = virtc_wait(client, -1);
+    if (ret < 0) {
+        if (ret == -VIRTC_ESYS) {
+            ERR_EXIT("recv error");
+        }
+        printf("%s, exit now.\n", virtc_strerror(ret));
+        exit(EXIT_FAILURE);
     }
 }
 
-static void send_message(int mes_type)
+static void print_text(virtc_t *vc, const virtc_reply_t *reply, void *arg)
 {
-    int ret;
-    ret = write(client_sockfd, &mes_type, sizeof(mes_type));
-    if (ret == -1) {
-        ERR_EXIT("send_message error");
+    if (reply->err) {
+        printf("%s\n", virtc_strerror(reply->err));
+        return;
     }
+    printf("%s\n", reply->text);
+}
 
-    recv_ack();
-    // printf("send_message successfully.\n\n");
+/* launch and kill are run by the server in the background, it answers with a job id */
+static void print_job_id(virtc_t *vc, const virtc_reply_t *reply, void *arg)
+{
+    if (reply->err) {
+        printf("%s\n", virtc_strerror(reply->err));
+        return;
+    }
+    printf("job id %d\n", reply->job_id);
 }
 
-static void handle_query_qemu(void)
+static void print_job(virtc_t *vc, const virtc_reply_t *reply, void *arg)
 {
-    int lenth, ret;
-    char query_buf[1024];
+    int num = *(int *)arg;
+    int state = reply->state;
 
-    /* printf("query qemu\n"); */
-    ret = read(client_sockfd, &lenth, sizeof(lenth));
-    if (ret == -1) {
-        ERR_EXIT("recv ack error");
+    if (reply->err) {
+        printf("%s\n", virtc_strerror(reply->err));
+        return;
     }
 
-    if (lenth > 1024) {
-        lenth = 1024;
+    if (state < 0 || state >= sizeof(job_state_str) / sizeof(job_state_str[0])) {
+        state = 0;
     }
-
-    memset(query_buf, 0, 1024);
-    ret = read(client_sockfd, query_buf, lenth);
-    if (ret == -1) {
-        ERR_EXIT("recv ack error");
+    if (reply->result < 0) {
+        printf("job %d: %s (%s)\n", num, job_state_str[state], strerror(-reply->result));
+    } else {
+        printf("job %d: %s\n", num, job_state_str[state]);
     }
+}
+
+static int get_int(const char *prompt)
+{
+    int num = -1;
 
-    printf("%s\n", query_buf);
+    printf("%s", prompt);
+    if (fscanf(stdin, "%d", &num) != 1) {
+        num = -1;
+    }
+    while(fgetc(stdin) != '\n' && !feof(stdin));
+    return num;
 }
 
 static int get_vm_id(void)
 {
-    int num;
+    return get_int("Enter vm_id: ");
+}
 
-    printf("Enter vm_id: ");
-    fscanf(stdin, "%d", &num);
-    while(fgetc(stdin) != '\n');
-    return num;
+static void get_profile(char *name, int size)
+{
+    printf("Enter profile: ");
+    if (fgets(name, size, stdin) == NULL) {
+        ERR_EXIT("read profile error");
+    }
+    name[strcspn(name, "\n")] = '\0';
+}
+
+static void handle_query_qemu(void)
+{
+    wait_reply(virtc_query_qemu(client, print_text, NULL));
 }
 
 static void handle_launch_qemu(void)
 {
-    int ret;
     int num = get_vm_id();
-    ret = write(client_sockfd, &num, sizeof(num));
-    if (ret == -1) {
-        ERR_EXIT("send_message error");
-    }
 
-    recv_ack();
+    wait_reply(virtc_launch(client, num, NULL, print_job_id, NULL));
 }
 
+static void handle_launch_qemu_profile(void)
+{
+    char name[MAX_PROFILE_NAME];
+    int num = get_vm_id();
+
+    get_profile(name, sizeof(name));
+    wait_reply(virtc_launch(client, num, name, print_job_id, NULL));
+}
+
+static void handle_launch_qemu_priority(void)
+{
+    char name[MAX_PROFILE_NAME];
+    int num = get_vm_id();
+    int priority;
+
+    get_profile(name, sizeof(name));
+    priority = get_int("Enter priority (0 normal, higher boots first): ");
+    wait_reply(virtc_launch_priority(client, num, name, priority, print_job_id, NULL));
+}
 
 static void handle_kill_qemu(void)
 {
-    int ret;
     int num = get_vm_id();
-    if (num == -1) {
+
+    wait_reply(virtc_kill(client, num, print_job_id, NULL));
+}
+
+static void handle_query_job(void)
+{
+    int num = get_int("Enter job id: ");
+
+    wait_reply(virtc_query_job(client, num, print_job, &num));
+}
+
+static void handle_query_stats(void)
+{
+    wait_reply(virtc_query_stats(client, print_text, NULL));
+}
+
+static void handle_query_fit(void)
+{
+    char name[MAX_PROFILE_NAME];
+
+    get_profile(name, sizeof(name));
+    wait_reply(virtc_query_fit(client, name, print_text, NULL));
+}
+
+static void handle_trace(void)
+{
+    int op = get_int("Enter trace op (0 off, 1 on, 2 dump): ");
+
+    wait_reply(virtc_trace(client, op, print_text, NULL));
+}
+
+static void print_ready(virtc_t *vc, const virtc_reply_t *reply, void *arg)
+{
+    if (reply->err) {
+        printf("%s\n", virtc_strerror(reply->err));
         return;
     }
+    printf("vm %d ready %d ms after launch\n", *(int *)arg, reply->ready_ms);
+}
 
-    ret = write(client_sockfd, &num, sizeof(num));
-    if (ret == -1) {
-        ERR_EXIT("send_message error");
-    }
+static void handle_wait_ready(void)
+{
+    int num = get_vm_id();
+    int secs = get_int("Enter timeout in seconds: ");
 
-    recv_ack();
+    wait_reply(virtc_wait_ready(client, num, secs * 1000, print_ready, &num));
 }
 
-static void handle_get_cpu_affinity(void)
+static void print_done(virtc_t *vc, const virtc_reply_t *reply, void *arg)
 {
-    int lenth, ret;
-    char cpu_buf[1024];
+    printf("%s\n", reply->err ? virtc_strerror(reply->err) : "done");
+}
 
-    int num = get_vm_id();
-    if (num == -1) {
-        return;
+/* false when the first number is negative */
+static bool get_io(virtc_io_t *io, const char *prompt)
+{
+    io->iops = get_int(prompt);
+    if (io->iops < 0) {
+        return false;
     }
+    io->iops_burst = get_int("Enter burst IOPS (0 no burst): ");
+    io->mbps = get_int("Enter MB/s (0 unlimited): ");
+    io->mbps_burst = get_int("Enter burst MB/s (0 no burst): ");
+    io->burst = get_int("Enter seconds a burst may last: ");
+    return true;
+}
 
-    ret = write(client_sockfd, &num, sizeof(num));
-    if (ret == -1) {
-        ERR_EXIT("send_message error");
+static void get_group(char *name, int size)
+{
+    printf("Enter I/O group (- none): ");
+    if (fgets(name, size, stdin) == NULL) {
+        ERR_EXIT("read group error");
     }
+    name[strcspn(name, "\n")] = '\0';
+}
+
+static void handle_set_io_limits(void)
+{
+    char group[MAX_IO_GROUP];
+    virtc_io_t io;
+    int num = get_vm_id();
+    bool own = get_io(&io, "Enter IOPS (0 unlimited, -1 the profile's limits): ");
+
+    get_group(group, sizeof(group));
+    wait_reply(virtc_set_io_limits(client, num, own ? &io : NULL,
+            strcmp(group, "-") ? group : NULL, print_done, NULL));
+}
 
-    recv_ack();
+static void handle_set_io_group(void)
+{
+    char group[MAX_IO_GROUP];
+    virtc_io_t io;
 
-    ret = read(client_sockfd, &lenth, sizeof(lenth));
-    if (ret == -1) {
-        ERR_EXIT("recv ack error");
+    get_group(group, sizeof(group));
+    if (!get_io(&io, "Enter IOPS (0 unlimited, -1 removes the group): ")) {
+        memset(&io, 0, sizeof(io));
     }
+    wait_reply(virtc_set_io_group(client, group, &io, print_done, NULL));
+}
+
+static const char *vm_state_str[] = {
+    [VM_LAUNCHING] = "launching",
+    [VM_RUNNING] = "running",
+    [VM_PENDING] = "pending",
+    [VM_QUEUED] = "queued",
+    [VM_KILLING] = "killing",
+};
 
-    if (lenth > 1024) {
-        lenth = 1024;
+/* straight from shared memory, the server isn't asked */
+static void handle_status(void)
+{
+    virtc_status_t *st;
+    virt_status_t table;
+    virt_status_vm_t *vm;
+    int err, i;
+
+    st = virtc_status_open(NULL, &err);
+    if (st == NULL) {
+        printf("%s\n", err == -VIRTC_ESYS ? strerror(errno) : virtc_strerror(err));
+        return;
+    }
+    err = virtc_status_read(st, &table);
+    virtc_status_close(st);
+    if (err < 0) {
+        printf("%s\n", virtc_strerror(err));
+        return;
     }
 
-    memset(cpu_buf, 0, 1024);
-    ret = read(client_sockfd, cpu_buf, lenth);
-    if (ret == -1) {
-        ERR_EXIT("recv ack error");
+    printf("server %d, generation %" PRIu64 ", %d vms\n", table.server_pid, table.generation, table.nr_vms);
+    for (i = 0; i < table.nr_vms; i++) {
+        vm = &table.vms[i];
+        printf("vm %d pid %d %s %s%s: %u vCPU %.2f busy, %u MB rss %u MB, %u IOPS %u KB/s",
+                vm->vm_id, vm->pid, vm->profile,
+                vm->state >= 0 && vm->state <= VM_KILLING ? vm_state_str[vm->state] : "?",
+                vm->flags & VM_READY ? " ready" : "", vm->smp, vm->cpu_usage / 1000.0,
+                vm->mem, vm->rss, vm->iops, vm->io_kbps);
+        if (vm->ready_ms >= 0) {
+            printf(", ready after %d ms", vm->ready_ms);
+        }
+        printf("\n");
     }
+}
 
-    printf("%s\n", cpu_buf);
+static void handle_get_cpu_affinity(void)
+{
+    int num = get_vm_id();
+
+    wait_reply(virtc_cpu_affinity(client, num, print_text, NULL));
 }
 
 static void loop_event()
 {
-    char ch;
+    int ch;
 
     print_intro();
     print_message_option();
     while (1) {
-        printf("Enter Option [l/s/k/c/h/q]: ");
+        printf("Enter Option [l/s/p/k/c/j/t/f/r/w/o/g/v/u/h/q]: ");
 
         ch = fgetc(stdin);
+        if (ch == EOF) {
+            ch = 'q';
+        }
         /* discard all rest characters until the '\n' (include) */
-        while(fgetc(stdin) != '\n');
+        while(fgetc(stdin) != '\n' && !feof(stdin));
 
         switch (ch) {
             case 'l':
-                send_message(MES_QUREY_QEMU);
                 printf("--->> query qemu status\n");
                 handle_query_qemu();
                 continue;
             case 's':
-                send_message(MES_LAUNCH_QEMU);
                 printf("--->> launch qemu with vm id\n");
                 handle_launch_qemu();
                 continue;
+            case 'p':
+                printf("--->> launch qemu with vm id and profile\n");
+                handle_launch_qemu_profile();
+                continue;
             case 'k':
-                send_message(MES_KILL_QEMU);
                 printf("--->> kill qemu with vm id\n");
                 handle_kill_qemu();
                 continue;
             case 'c':
-                send_message(MES_GET_CPU_AFFINITY);
                 printf("--->> get cpu affinity with vm id\n");
                 handle_get_cpu_affinity();
                 continue;
+            case 'j':
+                printf("--->> query job with job id\n");
+                handle_query_job();
+                continue;
+            case 't':
+                printf("--->> server statistics\n");
+                handle_query_stats();
+                continue;
+            case 'f':
+                printf("--->> dry-run launch of a profile\n");
+                handle_query_fit();
+                continue;
+            case 'r':
+                printf("--->> launch tracing\n");
+                handle_trace();
+                continue;
+            case 'w':
+                printf("--->> wait until the guest is ready\n");
+                handle_wait_ready();
+                continue;
+            case 'o':
+                printf("--->> disk I/O limits of a vm\n");
+                handle_set_io_limits();
+                continue;
+            case 'g':
+                printf("--->> I/O budget of a group\n");
+                handle_set_io_group();
+                continue;
+            case 'v':
+                printf("--->> status table\n");
+                handle_status();
+                continue;
+            case 'u':
+                printf("--->> launch qemu with a boot priority\n");
+                handle_launch_qemu_priority();
+                continue;
             case 'h':
                 print_message_option();
                 continue;
@@ -231,23 +427,11 @@ static void loop_event()
 
 static void init_socket()
 {
-    struct sockaddr_un server_addr;
-    int ret;
-    int lenth;
-
-    client_sockfd = socket(PF_UNIX, SOCK_STREAM, 0);
-    if (client_sockfd == -1) {
-        ERR_EXIT("socket error\n");
-    }
-
-    memset(&server_addr, 0, sizeof(struct sockaddr_un));
-    server_addr.sun_family = AF_UNIX;
-    strcpy(server_addr.sun_path, LIBVIRTD_SOCKET);
+    int err;
 
-    lenth = strlen(server_addr.sun_path) + sizeof(server_addr.sun_family);
-    ret = connect(client_sockfd, (struct sockaddr *)&server_addr, lenth);
-    if (ret == -1) {
-       ERR_EXIT("connect error");
+    client = virtc_open(NULL, &err);
+    if (client == NULL) {
+        ERR_EXIT("connect error");
     }
 
     printf("connected, please follow hint\n");
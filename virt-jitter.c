@@ -0,0 +1,165 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+/*
+ * virt-jitter - scheduling latency probe.
+ *
+ * Sleeps until an absolute deadline every interval and measures how late it
+ * wakes up, like cyclictest. Run it inside a realtime guest to see what the
+ * guest's own tasks get, or on a realtime core of the host to check the core
+ * is quiet before guests go there.
+ *
+ *   virt-jitter [-c cpu] [-p prio] [-i interval us] [-d seconds]
+ *
+ * prio 0 keeps the normal scheduler, to compare against.
+ */
+
+#define INTERVAL 1000           /* us */
+#define DURATION 10             /* seconds */
+#define PRIO 80
+#define HIST_US 1000            /* 1 us buckets up to here, the rest in one */
+
+#define ERR_EXIT(m) \
+do \
+{ \
+    perror(m); \
+    exit(EXIT_FAILURE); \
+} \
+while (0); \
+
+static volatile sig_atomic_t stop;
+
+static uint64_t hist[HIST_US + 1];
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+static uint64_t ts_ns(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/* the latency in us below which pct of the samples fall */
+static uint64_t percentile(uint64_t samples, double pct)
+{
+    uint64_t want = samples * pct / 100, seen = 0;
+    int us;
+
+    for (us = 0; us <= HIST_US; us++) {
+        seen += hist[us];
+        if (seen > want) {
+            break;
+        }
+    }
+
+    return us;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-c cpu] [-p prio] [-i interval us] [-d seconds]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sched_param param = { .sched_priority = PRIO };
+    struct timespec next, now;
+    long interval = INTERVAL, duration = DURATION;
+    int cpu = -1, opt;
+    uint64_t lat, samples = 0, sum = 0, min = UINT64_MAX, max = 0, end;
+    cpu_set_t mask;
+
+    while ((opt = getopt(argc, argv, "c:p:i:d:")) != -1) {
+        switch (opt) {
+            case 'c':
+                cpu = atoi(optarg);
+                break;
+            case 'p':
+                param.sched_priority = atoi(optarg);
+                break;
+            case 'i':
+                interval = atol(optarg);
+                break;
+            case 'd':
+                duration = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (interval <= 0 || duration <= 0 || param.sched_priority < 0 || param.sched_priority > 99) {
+        usage(argv[0]);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    /* a page fault in the loop would be measured as jitter */
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+        perror("mlockall");
+    }
+
+    if (cpu >= 0) {
+        CPU_ZERO(&mask);
+        CPU_SET(cpu, &mask);
+        if (sched_setaffinity(0, sizeof(mask), &mask) == -1) {
+            ERR_EXIT("sched_setaffinity");
+        }
+    }
+    if (param.sched_priority > 0 && sched_setscheduler(0, SCHED_FIFO, &param) == -1) {
+        ERR_EXIT("sched_setscheduler");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    end = ts_ns(&next) + duration * 1000000000ULL;
+
+    while (!stop) {
+        next.tv_nsec += interval * 1000;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0) {
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        lat = ts_ns(&now) - ts_ns(&next);
+        hist[lat / 1000 < HIST_US ? lat / 1000 : HIST_US]++;
+        sum += lat;
+        min = lat < min ? lat : min;
+        max = lat > max ? lat : max;
+        samples++;
+
+        if (ts_ns(&now) >= end) {
+            break;
+        }
+    }
+
+    if (samples == 0) {
+        return EXIT_FAILURE;
+    }
+
+    printf("cpu %d, %s %d, interval %ld us, %" PRIu64 " samples\n", cpu >= 0 ? cpu : sched_getcpu(),
+            param.sched_priority ? "SCHED_FIFO" : "SCHED_OTHER", param.sched_priority,
+            interval, samples);
+    printf("latency us: min %" PRIu64 ", avg %" PRIu64 ", p99 %" PRIu64 ", p99.9 %" PRIu64 ", max %" PRIu64 "\n",
+            min / 1000, sum / samples / 1000, percentile(samples, 99), percentile(samples, 99.9), max / 1000);
+    printf("over %d us: %" PRIu64 "\n", HIST_US, hist[HIST_US]);
+
+    return 0;
+}
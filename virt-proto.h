@@ -0,0 +1,159 @@
+#ifndef VIRT_PROTO_H
+#define VIRT_PROTO_H
+
+#include <stdint.h>
+
+/*
+ * Wire protocol shared by virt-server, virt-client and libvirtc.
+ *
+ * All values are native ints. A request is the message type followed by its
+ * fields, the server answers the type and then every field with MES_ACK, or
+ * MES_NACK when it refuses the field. The fields behind a refused one are
+ * still read and answered, the request just gets no reply then. A refused
+ * message type is the exception: its fields are read as the next requests.
+ * Otherwise the reply follows:
+ *
+ *   MES_QUREY_QEMU            -                 text
+ *   MES_LAUNCH_QEMU           vm_id             job id, -1 refused
+ *   MES_KILL_QEMU             vm_id             job id, -1 refused
+ *   MES_GET_CPU_AFFINITY      vm_id             text
+ *   MES_LAUNCH_QEMU_PROFILE   vm_id, string     job id, -1 refused
+ *   MES_QUERY_JOB             job id            state, result
+ *   MES_QUERY_STATS           -                 text
+ *   MES_QUERY_FIT             string            text
+ *   MES_TRACE                 op                text
+ *   MES_WAIT_READY            vm_id, ms         launch-to-ready ms, or -errno
+ *   MES_NODE_ANNOUNCE         fit, cpu used,    0, -1 not a coordinator
+ *                             cpu cap, mem used,
+ *                             mem total, n,
+ *                             n vm ids, string
+ *   MES_SET_IO_LIMITS         vm_id, iops,      0, -1 refused
+ *                             iops burst, MB/s,
+ *                             MB/s burst, burst
+ *                             seconds, string
+ *   MES_SET_IO_GROUP          iops, iops burst, 0, -1 refused
+ *                             MB/s, MB/s burst,
+ *                             burst seconds,
+ *                             string
+ *   MES_LAUNCH_QEMU_PRIORITY  vm_id, priority,  job id, -1 refused
+ *                             string
+ *
+ * MES_WAIT_READY answers once the guest agent of the vm responds, the vm goes
+ * away (-ESRCH) or the wait times out (-ETIMEDOUT); -ENOENT for an unknown vm.
+ * Requests sent behind it on the same connection wait for that answer.
+ *
+ * MES_NODE_ANNOUNCE is how a node of a federation reports to its coordinator:
+ * a bit per profile that fits now (profile n is bit n of virt-server's profile
+ * table), vCPU in thousandths and memory in MB used and in total, the vms it
+ * holds in any state and the socket it listens on. A coordinator answers
+ * every other request for the whole federation, forwarding it to a node.
+ *
+ * MES_SET_IO_LIMITS sets the guest disk limits of a vm, now if it runs and for
+ * its next launches, 0 is unlimited and a burst no higher than its sustained
+ * rate is no burst. A negative field gives the vm its profile's limits back.
+ * The string names the I/O group the vm joins, "-" none. MES_SET_IO_GROUP sets
+ * the budget a group's vms on one host share, all zero removes the group.
+ *
+ * MES_LAUNCH_QEMU_PRIORITY launches with a profile, "-" the default one, and a
+ * priority for the queue of launches waiting to boot: higher boots first, 0 is
+ * what the other launches get, below 0 waits behind them.
+ *
+ * A string or text is its lenth followed by the characters, without '\0'.
+ * Requests may be pipelined; the server handles each one once all of it has
+ * arrived, and closes a connection whose request is longer than it buffers.
+ */
+
+/* local socket connect */
+#define LIBVIRTD_SOCKET "/home/alan/libvirt/libvirtd.socket"
+
+#define MAX_VM_NUM 20
+#define MAX_PROFILE_NAME 64     /* including the '\0' */
+#define MAX_NODE_PATH 108       /* a node's socket path, sun_path with the '\0' */
+#define MAX_IO_GROUP 32         /* including the '\0' */
+
+/* new messages are only ever appended, the values are on the wire */
+typedef enum MESSAGE_TYPE {
+    MES_QUREY_QEMU,
+    MES_LAUNCH_QEMU,
+    MES_KILL_QEMU,
+    MES_GET_CPU_AFFINITY,
+    MES_ACK,
+    MES_LAUNCH_QEMU_PROFILE,
+    MES_QUERY_JOB,
+    MES_QUERY_STATS,
+    MES_QUERY_FIT,
+    MES_TRACE,
+    MES_NACK,
+    MES_WAIT_READY,
+    MES_NODE_ANNOUNCE,
+    MES_SET_IO_LIMITS,
+    MES_SET_IO_GROUP,
+    MES_LAUNCH_QEMU_PRIORITY,
+} MESSAGE_TYPE_T;
+
+/*
+ * Status table: the server keeps its vms in a shared memory file at
+ * VIRT_STATUS_SHM (or $VIRT_STATUS_SHM) that local readers map read-only,
+ * no request needed. The header and the vm entries are guarded by a seqlock:
+ * seq is odd while the server writes, a copy taken between two reads of the
+ * same even seq is consistent. generation grows whenever a vm changes, the
+ * heartbeat every second or so while the server lives. libvirtc reads it with
+ * virtc_status_read().
+ */
+#define VIRT_STATUS_SHM "/dev/shm/virt-status"
+#define VIRT_STATUS_MAGIC 0x56535431    /* "VST1" */
+#define VIRT_STATUS_CPUS 1024
+
+typedef enum VM_STATE {
+    VM_LAUNCHING,
+    VM_RUNNING,
+    VM_PENDING,             /* queued until capacity frees up */
+    VM_QUEUED,              /* admitted, waiting for a boot slot */
+    VM_KILLING,             /* killed, holds its capacity until qemu exits */
+} VM_STATE_T;
+
+#define VM_STARTED  (1 << 0)    /* QMP answered */
+#define VM_READY    (1 << 1)    /* the guest agent answered */
+#define VM_PINNED   (1 << 2)
+#define VM_REALTIME (1 << 3)
+
+typedef struct virt_status_vm {
+    int32_t vm_id;
+    int32_t pid;
+    int32_t state;          /* VM_STATE_T */
+    uint32_t flags;         /* VM_* */
+    char profile[MAX_PROFILE_NAME];
+    uint64_t cpus[VIRT_STATUS_CPUS / 64];   /* bit n: may run on cpu n */
+    uint32_t smp;
+    uint32_t mem;           /* MB of guest RAM */
+    uint32_t balloon;       /* MB the balloon leaves the guest */
+    uint32_t rss;           /* MB */
+    uint32_t cpu_usage;     /* thousandths of a core */
+    uint32_t cpu_wait;      /* thousandths of a second on a run queue per second */
+    int32_t ready_ms;       /* launch request to guest ready, -1 not yet */
+    uint32_t iops;
+    uint32_t io_kbps;       /* KB/s */
+    uint32_t moves;         /* by the rebalancer */
+    uint64_t ksm_pages;
+} virt_status_vm_t;
+
+typedef struct virt_status {
+    uint32_t magic;
+    uint32_t size;          /* of this struct, a reader built for another layout stops */
+    uint64_t seq;
+    uint64_t generation;
+    uint64_t heartbeat;     /* CLOCK_MONOTONIC seconds */
+    int32_t server_pid;
+    int32_t nr_vms;
+    virt_status_vm_t vms[MAX_VM_NUM];
+} virt_status_t;
+
+typedef enum JOB_STATE {
+    JOB_UNKNOWN,
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+} JOB_STATE_T;
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -10,28 +11,180 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <linux/sockios.h>
+#include <linux/mempolicy.h>
 
-#define __USE_GNU
 #include <sched.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
-/* Modify this to your own environment path. */
+#include "virtc.h"
+
+/* Modify this to your own environment path, or set VIRT_SOCKET, VIRT_LOG_FILE
+ * and VIRT_PID_FILE to run several servers on one host. */
 #define LIBVIRT_LOG_FILE "/home/alan/libvirt/log/libvirtd.log"
 #define LIBVIRT_PID_FILE "/home/alan/libvirt/libvirtd.pid"
 
-/* local socket connect */
-#define LIBVIRTD_SOCKET "/home/alan/libvirt/libvirtd.socket"
-#define SINGLE 1 // only support single client
-#define MAXCONN SINGLE
-
-#define MAX_VM_NUM 20
+#define MAXCONN 16
+#define CONN_IN_SIZE 4096       /* bytes of pipelined requests buffered per client */
 
 #define QEMU_BIN "/usr/local/bin/qemu-system-x86_64"
 
+/* cgroup v2 directory holding one leaf per vm, override with VIRT_CGROUP_ROOT
+ * (e.g. point it at a temporary directory tree for testing). */
+#define CGROUP_ROOT "/sys/fs/cgroup/simple-qemu"
+#define CGROUP_CONTROLLERS "+cpu +cpuset +memory +io"
+#define CPU_MAX_PERIOD 100000
+
+/* worker pool, override with VIRT_WORKERS and VIRT_JOB_QUEUE */
+#define WORKERS 4
+#define JOB_QUEUE 64
+#define JOB_LOG_SIZE 256
+
+/* Host capacity model used for admission, overridable with VIRT_CPU_POOL,
+ * VIRT_CPU_OVERCOMMIT, VIRT_MEM_OVERCOMMIT, VIRT_MEM_RESERVE and VIRT_ADMISSION. */
+#define PROC_ROOT "/proc"
+#define HUGEPAGE_PATH "/dev/hugepages"
+#define VCPU_UNIT 1000          /* one vCPU in the per-core accounting */
+#define CPU_OVERCOMMIT "1.0"
+#define MEM_OVERCOMMIT "1.0"
+#define MEM_RESERVE 1024        /* MB kept for the host */
+
+/* Rebalancer, VIRT_REBALANCE_INTERVAL=0 switches it off */
+#define REBALANCE_INTERVAL 10   /* seconds */
+#define REBALANCE_MOVES 2       /* moves allowed per interval */
+#define REBALANCE_WAIT_MIN 0.05 /* run-queue delay per second that makes a vm a candidate */
+#define REBALANCE_GAIN_MIN 0.30 /* cores of load a move must save */
+#define REBALANCE_COOLDOWN 3    /* intervals a moved vm stays put */
+
+/* Balloon reclaim driven by host memory pressure, VIRT_BALLOON_INTERVAL=0 switches it off */
+#define QMP_DIR "/home/alan/libvirt/qemu"
+#define QMP_TIMEOUT 2           /* seconds */
+#define PSI_DIR "/proc/pressure"
+#define BALLOON_INTERVAL 5      /* seconds */
+#define BALLOON_PSI_HIGH 10.0   /* memory "some" avg10 that starts reclaim */
+#define BALLOON_PSI_LOW 1.0     /* and the one that gives memory back */
+#define BALLOON_STEP 256        /* MB a balloon may move per interval */
+#define BALLOON_HOST_STEP 1024  /* MB all balloons together may move per interval */
+
+/* KSM density mode, VIRT_KSM_INTERVAL=0 leaves ksmd alone */
+#define KSM_DIR "/sys/kernel/mm/ksm"
+#define KSM_INTERVAL 10         /* seconds */
+#define KSM_CPU_MAX 0.10        /* ksmd may use 10% of a core */
+#define KSM_GAIN_MIN 64         /* pages merged per pass worth scanning faster for */
+#define KSM_SCAN_MIN 100
+#define KSM_SCAN_MAX 20000
+#define KSM_SLEEP_MIN 10        /* ms */
+#define KSM_SLEEP_MAX 1000
+
+/* tap + vhost-net guest networking */
+#define TUN_DEV "/dev/net/tun"
+#define VHOST_NET_DEV "/dev/vhost-net"
+#define TAP_NAME "qtap%03d"     /* a persistent tap of this name is attached, not created */
+#define NET_QUEUES_MAX 8
+#define VHOST_PIN_INTERVAL 2    /* seconds */
+#define VHOST_PIN_TRIES 10
+
+/* headless and microvm guests */
+#define MICROVM_KERNEL "/home/alan/libvirt/images/vmlinuz"
+#define MICROVM_APPEND "console=ttyS0 root=/dev/vda rw"
+#define STARTUP_PROBE_INTERVAL 50   /* ms */
+#define STARTUP_TIMEOUT 60          /* seconds */
+
+/* guest readiness, a guest agent answering guest-ping */
+#define READY_PROBE_INTERVAL 200    /* ms */
+#define READY_PING_INTERVAL 1       /* seconds */
+#define READY_TIMEOUT 300           /* seconds */
+#define READY_BUCKETS 12            /* 250 ms << n, the last one is open */
+
+/* Boot storms: admitted launches queue for one of a limited number of boot
+ * slots, VIRT_BOOT_MAX=0 boots them all at once. A vm holds its slot until its
+ * guest is ready, or VIRT_BOOT_HOLD seconds. */
+#define BOOT_INTERVAL 1             /* seconds */
+#define BOOT_MAX 8                  /* vms booting at once, the limit never goes above */
+#define BOOT_MIN 1
+#define BOOT_HOLD 120               /* seconds */
+#define BOOT_PSI_HIGH 40.0          /* cpu or io "some" avg10 that halves the limit */
+#define BOOT_PSI_LOW 10.0           /* and both below it let a busy limit grow by one */
+#define BOOT_BACKOFF 5              /* seconds between two halvings, avg10 is slow to fall */
+
+/* realtime guests, vCPUs on isolated cores no other vm is placed on */
+#define CPU_SYSFS "/sys/devices/system/cpu"
+#define RT_PRIO 50              /* SCHED_FIFO priority of the vCPU threads */
+
+/* NUMA placement, guest RAM follows the vm's cores. VIRT_NODE_SYSFS reads the
+ * topology from another tree (a fake one for testing), VIRT_NUMA_INTERVAL=0
+ * stops sampling numa_maps. */
+#define NODE_SYSFS "/sys/devices/system/node"
+#define MAX_NUMA_NODES 16
+#define NUMA_INTERVAL 30        /* seconds */
+
+/* page cache prewarm of shared backing images */
+#define IMAGE_DIR "/home/alan/libvirt/images"
+#define HOT_CHUNK (256 << 10)   /* bytes a hotness counter covers */
+#define HOT_CHAIN_MAX 8         /* backing files followed below an image */
+#define HOT_LEARN_INTERVAL 60   /* seconds between two learns of one image */
+#define HOT_WINDOW 4096         /* chunks probed per mincore() */
+#define HOT_RA_STEP (128 << 10) /* the kernel cuts a readahead() down to the device's window */
+#define QCOW2_MAGIC 0x514649fb  /* "QFI\xfb" */
+
+/* vCPU and DIMM hotplug driven by guest load, VIRT_HOTPLUG_INTERVAL=0 switches it off */
+#define HOTPLUG_INTERVAL 10         /* seconds */
+#define HOTPLUG_CPU_HIGH 0.80       /* busy share of the vCPUs that adds one */
+#define HOTPLUG_CPU_LOW 0.25        /* and the one that removes one */
+#define HOTPLUG_MEM_LOW 10          /* percent of guest RAM available that adds a DIMM */
+#define HOTPLUG_MEM_HIGH 40         /* and the one that removes one */
+#define HOTPLUG_UP_PASSES 2         /* intervals a trigger must hold to grow */
+#define HOTPLUG_DOWN_PASSES 6       /* and to shrink */
+#define DIMM_SIZE 512               /* MB */
+#define DIMM_MAX 32                 /* hotplug memory slots */
+#define VCPU_TIDS_MAX 64            /* vCPU threads the hotplug load is read from */
+#define HOTPLUG_LOG 32              /* decisions kept for the stats */
+
+/* guest disk throttling, VIRT_IO_INTERVAL=0 stops sampling and sharing out group budgets */
+#define IO_INTERVAL 2               /* seconds */
+#define IO_GROUPS 8
+#define IO_GROUP_FLOOR 0.05         /* share of a group's budget a busy member is sure of */
+#define IO_GROUP_HEADROOM 1.5       /* a member may grow this much over its last rate per interval */
+#define IO_RETUNE 0.10              /* relative change of a limit worth a block_set_io_throttle */
+
+/* launch pipeline tracing, dumped as Chrome trace JSON */
+#define TRACE_EVENTS 8192       /* spans kept per thread */
+#define TRACE_DIR "/home/alan/libvirt/log"
+
+/* federation, a coordinator placing launches on nodes */
+#define MAX_NODES 16
+#define NODE_ANNOUNCE_INTERVAL 1    /* seconds */
+#define NODE_TIMEOUT 5              /* seconds without an announce and a node is gone */
+#define FORWARD_TIMEOUT 10          /* seconds a node has to answer a forwarded request */
+#define FED_JOBS 256                /* forwarded job ids remembered */
+
+/* shared memory status table, VIRT_STATUS_SHM="" switches it off */
+#define STATUS_HEARTBEAT 1          /* seconds */
+
+#define MAX_PERIODIC 16
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
 #define ERR_EXIT(m, ...) \
 do \
 { \
@@ -44,32 +197,523 @@ while (0); \
 
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof(a[0]))
 
+typedef enum NET_BACKEND {
+    NET_USER,               /* slirp, no host setup */
+    NET_TAP,                /* tap + vhost-net, one queue pair per vCPU */
+} NET_BACKEND_T;
+
+/* Guest disk limits, 0 is unlimited. The disk may run at the burst rate for
+ * burst seconds, then at the sustained one until the bucket drained again. */
+typedef struct io_limits {
+    uint32_t iops;
+    uint32_t iops_burst;
+    uint32_t mbps;          /* MB/s */
+    uint32_t mbps_burst;
+    uint32_t burst;         /* seconds */
+} io_limits_t;
+
+/* Per-profile guest size and cgroup limits, a zero limit keeps the kernel default. */
+typedef struct qemu_profile {
+    const char *name;
+    const char *machine;    /* -machine type */
+    uint32_t mem;           /* guest RAM in MB */
+    uint32_t smp;
+    uint32_t cpu_weight;    /* cpu.weight [1-10000] */
+    uint32_t cpu_quota;     /* cpu.max in percent of one cpu, 0 is "max" */
+    uint32_t mem_overhead;  /* MB qemu may use above guest RAM, sets memory.high/max */
+    uint32_t io_weight;     /* io.weight [1-10000] */
+    bool hugepages;         /* back guest RAM with HUGEPAGE_PATH */
+    uint32_t balloon_floor; /* MB the balloon never squeezes the guest below, 0 never reclaims */
+    bool mem_merge;         /* let KSM merge identical guest pages */
+    NET_BACKEND_T net;
+    uint32_t net_queues;    /* tap queue pairs, 0 is one per vCPU */
+    bool headless;          /* serial console only, no SPICE/qxl/audio/usb */
+    bool realtime;          /* guest RAM locked, SCHED_FIFO vCPUs alone on realtime cores */
+    uint32_t max_smp;       /* vCPUs hotplug may grow to, smp is the floor */
+    uint32_t max_mem;       /* MB of guest RAM DIMM hotplug may grow to, mem is the floor */
+    io_limits_t io;         /* throttling of the guest disk */
+    bool guest_numa;        /* a guest NUMA node per host node the vm spans */
+} qemu_profile_t;
+
+typedef enum QEMU_STATE {
+    QEMU_LAUNCHING,
+    QEMU_RUNNING,
+    QEMU_PENDING,           /* admitted later, when capacity frees up */
+    QEMU_QUEUED,            /* admitted, launched once a boot slot frees up */
+    QEMU_KILLING,           /* keeps its capacity until qemu has exited */
+} QEMU_STATE_T;
+
 typedef struct qemu_proc {
     int vm_id;
     // char vm_name[64];
     pid_t pid;
     // bool running;
+    QEMU_STATE_T state;
+    struct job *kill_job;   /* kill requested while still launching */
+    qemu_profile_t *profile;
+    cpu_set_t cpus;
+    bool pinned;
+    bool admitted;          /* holds the cpus and memory below in host_cap */
+    uint32_t cpu_charge;    /* VCPU_UNIT share taken on each of the cpus */
+    uint32_t mem_reserved;  /* MB */
+    uint32_t huge_reserved; /* MB */
+    struct job *pending_job;    /* QEMU_PENDING and QEMU_QUEUED */
+    int boot_priority;      /* higher leaves the boot queue first */
+    struct timespec boot_queued;
+    uint64_t boot_wait_ns;  /* in the boot queue */
+    bool boot_held;         /* booted longer than VIRT_BOOT_HOLD, slot given back */
+    /* load measured by the rebalancer from /proc/<pid>/task/<tid>/schedstat */
+    uint64_t run_ns;
+    uint64_t wait_ns;
+    uint64_t vcpu_run_ns;   /* of the threads in vcpu_tids, 0 until sampled */
+    struct timespec sampled;
+    double cpu_usage;       /* cores busy */
+    double cpu_wait;        /* seconds waiting on a run queue per second */
+    uint64_t moved_tick;
+    uint32_t moves;
+    uint32_t balloon_target; /* MB of guest RAM left by the balloon */
+    uint64_t balloon_tick;
+    uint32_t rss;           /* MB */
+    uint64_t ksm_pages;     /* pages of this vm merged by KSM */
+    bool vhost;             /* tap queues are served by vhost-net */
+    bool vhost_pinned;
+    uint32_t vhost_pin_tries;
+    struct timespec launched;   /* fork of qemu */
+    int probe_fd;           /* QMP connection waiting for the greeting */
+    bool started;           /* QMP answered, the device model is up */
+    struct timespec requested;  /* launch request arrived */
+    int qga_fd;             /* guest agent channel until the guest is ready */
+    char qga_buf[256];
+    int qga_len;
+    struct timespec qga_pinged;
+    bool ready;
+    bool ready_timeout;
+    uint64_t ready_ns;      /* request to ready */
+    uint64_t prewarm_hot;   /* bytes of hot ranges in the backing images */
+    uint64_t prewarm_hit;   /* of them already in the page cache */
+    uint64_t prewarm_ns;
+    int rt_vcpus;           /* vCPU threads running SCHED_FIFO */
+    uint32_t smp;           /* vCPUs now, the profile's plus hotplugged ones */
+    uint32_t mem;           /* MB of guest RAM now, boot RAM plus DIMMs */
+    uint32_t hp_vcpus;      /* bit n: vCPU hp-cpu<n> plugged, or still being unplugged */
+    uint32_t hp_dimms;      /* bit n: DIMM dimm-hp<n> plugged, or still being unplugged */
+    uint32_t hp_backends;   /* bit n: its memory backend mem-hp<n> exists */
+    bool hp_busy;           /* a hotplug job is out */
+    bool hp_polling;        /* the balloon reports guest memory stats */
+    uint32_t hp_vcpus_going;    /* bit n: hp-cpu<n> asked to leave, the guest hasn't yet */
+    pid_t vcpu_tids[VCPU_TIDS_MAX];
+    int nr_vcpu_tids;       /* 0 until a hotplug job looked */
+    double hp_cpu;          /* busy share of its vCPUs over the last interval */
+    int hp_mem_avail;       /* percent of guest RAM the guest has available, -1 unknown */
+    int hp_cpu_up, hp_cpu_down;     /* intervals a trigger held */
+    int hp_mem_up, hp_mem_down;
+    io_limits_t io;         /* throttling qemu has on the disk */
+    io_limits_t io_share;   /* of its I/O group's budget */
+    bool io_busy;           /* an I/O job is out */
+    bool io_dirty;          /* and the limits changed meanwhile */
+    uint64_t io_ops;        /* query-blockstats counters at the last sample */
+    uint64_t io_bytes;
+    struct timespec io_sampled;
+    double io_iops;         /* rates over the last interval */
+    double io_mbps;
+    uint32_t numa_nodes;    /* bit n: it has cores on host node n, its RAM is bound there */
+    uint32_t numa_charge[MAX_NUMA_NODES];   /* MB held on each node */
+    bool numa_guest;        /* qemu got a guest node per host node */
+    bool numa_busy;         /* a numa_maps job is out */
+    bool numa_sampled;
+    uint32_t numa_mb[MAX_NUMA_NODES];       /* its memory found on each node */
     struct qemu_proc * next;
 } qemu_proc_t;
 
+typedef struct arglist {
+    char **argv;
+    int argc;
+    int size;
+} arglist_t;
+
+typedef struct job job_t;
+typedef void (*job_fn)(job_t *job);
+
+/* A slow operation handed to the worker pool. work() runs on a worker thread and
+ * must not touch the vm registry, done() runs back on the event loop thread. */
+struct job {
+    int id;
+    const char *name;
+    job_fn work;
+    job_fn done;
+    void *data;
+    int result;             /* 0 or -errno */
+    struct timespec submit;
+    struct timespec start;
+    struct timespec end;
+    int qmp_vm;             /* vm whose QMP monitor work() talks to, -1 none */
+    job_t *next;
+};
+
+typedef struct job_record {
+    int id;
+    JOB_STATE_T state;
+    int result;
+} job_record_t;
+
+typedef struct job_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_t *workers;
+    int nr_workers;
+    job_t **queue;          /* bounded ring shared by all workers */
+    int size;
+    int head;
+    int count;
+    job_t *done_head;       /* finished jobs waiting for the event loop */
+    job_t *done_tail;
+    int event_fd;
+    int next_id;
+    job_record_t records[JOB_LOG_SIZE];
+    /* only touched by the event loop */
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t rejected;
+    int max_depth;
+    uint64_t wait_ns;
+    uint64_t run_ns;
+    uint64_t max_wait_ns;
+    uint64_t max_run_ns;
+} job_pool_t;
+
+typedef enum ADMISSION_POLICY {
+    ADMISSION_QUEUE,
+    ADMISSION_REJECT,
+} ADMISSION_POLICY_T;
+
+typedef enum SCHED_FIT {
+    FIT_OK,
+    FIT_NO_CPU,
+    FIT_NO_MEM,
+    FIT_NO_HUGEPAGES,
+    FIT_NEVER,              /* bigger than the whole host */
+} SCHED_FIT_T;
+
+typedef struct host_capacity {
+    cpu_set_t pool;         /* cores vms may be placed on */
+    cpu_set_t rt_pool;      /* cores for realtime vCPUs only, never in pool */
+    cpu_set_t rt_used;      /* one realtime vCPU each */
+    int nr_cpus;
+    uint32_t cpu_cap;       /* VCPU_UNIT per vCPU a core may carry */
+    uint32_t *cpu_used;
+    uint64_t mem_total;     /* MB available to guests, overcommit applied */
+    uint64_t mem_used;
+    uint64_t huge_total;    /* MB of hugepages, never overcommitted */
+    uint64_t huge_used;
+    uint64_t admitted;
+    uint64_t queued;
+    uint64_t rejected;
+} host_capacity_t;
+
+/* Host nodes with cores of the pool, fewer than two and placement ignores them.
+ * A node's memory is its share of host_cap.mem_total, by its size. */
+typedef struct numa_host {
+    int nr_nodes;
+    uint32_t nodes;         /* bit n: node n is used */
+    int8_t node_of[CPU_SETSIZE];    /* -1 on no node */
+    cpu_set_t cpus[MAX_NUMA_NODES];
+    uint64_t mem_total[MAX_NUMA_NODES];     /* MB */
+    uint64_t mem_used[MAX_NUMA_NODES];
+    uint64_t local;         /* vms placed on one node */
+    uint64_t spanned;       /* and the ones that had to span nodes */
+} numa_host_t;
+
+typedef enum SERVER_ROLE {
+    ROLE_NODE,              /* runs vms, announces them when it has a coordinator */
+    ROLE_COORDINATOR,       /* runs none, places and forwards to its nodes */
+} SERVER_ROLE_T;
+
+typedef struct virt_conf {
+    const char *socket;
+    const char *log_file;
+    const char *pid_file;
+    SERVER_ROLE_T role;
+    const char *coordinator;    /* socket of our coordinator */
+    const char *cgroup_root;
+    const char *proc_root;
+    int workers;
+    int job_queue;
+    const char *cpu_pool;
+    double cpu_overcommit;
+    double mem_overcommit;
+    long mem_reserve;
+    ADMISSION_POLICY_T admission;
+    int rebalance_interval;
+    int rebalance_moves;
+    const char *qmp_dir;
+    const char *psi_dir;
+    int balloon_interval;
+    const char *ksm_dir;
+    int ksm_interval;
+    const char *bridge;     /* taps join it when set */
+    const char *microvm_kernel;
+    bool trace;
+    const char *trace_dir;
+    int ready_timeout;
+    int boot_max;           /* 0 no boot queue */
+    int boot_hold;
+    const char *image_dir;
+    bool prewarm;
+    long prewarm_lock;      /* MB of hot ranges kept locked in the page cache */
+    const char *rt_cpus;    /* realtime cores, isolcpus/nohz_full ones when unset */
+    const char *cpu_sysfs;
+    int rt_prio;
+    int hotplug_interval;
+    int io_interval;
+    const char *status_shm;
+    const char *node_sysfs;
+    int numa_interval;
+} virt_conf_t;
+
+typedef struct periodic_task {
+    const char *name;
+    int interval_ms;
+    void (*fn)(void);
+    struct timespec next;
+    bool asleep;            /* until periodic_wake() */
+} periodic_task_t;
+
+typedef struct rebalancer {
+    uint64_t tick;
+    uint64_t moves;
+    uint64_t over_budget;   /* moves worth doing but over the per-interval budget */
+    uint64_t failed;
+} rebalancer_t;
+
+typedef struct balloon_ctl {
+    uint64_t tick;
+    double psi;             /* last memory "some" avg10 */
+    uint64_t inflates;
+    uint64_t deflates;
+    uint64_t failed;
+    uint64_t reclaimed;     /* MB currently held by all balloons */
+} balloon_ctl_t;
+
+typedef enum HOTPLUG_ACTION {
+    HOTPLUG_NONE,           /* only look at the guest */
+    HOTPLUG_CPU_ADD,
+    HOTPLUG_CPU_DEL,
+    HOTPLUG_MEM_ADD,
+    HOTPLUG_MEM_DEL,
+} HOTPLUG_ACTION_T;
+
+/* a scaling decision and what triggered it */
+typedef struct hotplug_event {
+    time_t when;
+    int vm_id;
+    HOTPLUG_ACTION_T action;
+    uint32_t from;          /* vCPUs or MB */
+    uint32_t to;
+    double cpu;
+    int mem_avail;
+    const char *result;     /* NULL done */
+} hotplug_event_t;
+
+typedef struct hotplug_ctl {
+    uint64_t tick;
+    uint64_t cpu_adds;
+    uint64_t cpu_dels;
+    uint64_t mem_adds;
+    uint64_t mem_dels;
+    uint64_t refused;       /* no room left on the host */
+    uint64_t failed;
+    hotplug_event_t log[HOTPLUG_LOG];
+    uint64_t logged;
+} hotplug_ctl_t;
+
+/* a budget the running vms of one tenant share */
+typedef struct io_group {
+    char name[MAX_IO_GROUP];    /* "" is a free slot */
+    io_limits_t limits;
+    int members;
+    double iops;            /* of all members over the last interval */
+    double mbps;
+} io_group_t;
+
+/* limits a vm was given over its profile's, kept across its launches */
+typedef struct io_vm_conf {
+    bool own;
+    io_limits_t limits;
+    io_group_t *group;      /* NULL none */
+} io_vm_conf_t;
+
+typedef struct io_ctl {
+    uint64_t tick;
+    uint64_t retunes;       /* block_set_io_throttle that took */
+    uint64_t failed;
+    io_vm_conf_t vm[MAX_VM_NUM];
+    io_group_t groups[IO_GROUPS];
+} io_ctl_t;
+
+typedef struct boot_ctl {
+    int limit;              /* vms that may boot at once */
+    double cpu_psi;         /* "some" avg10 at the last look */
+    double io_psi;
+    struct timespec shrunk; /* last halving */
+    uint64_t queued;
+    uint64_t dequeued;      /* left the queue to boot, the ones wait_ns is of */
+    uint64_t passed;        /* left the queue ahead of earlier launches */
+    uint64_t wait_ns;       /* sum */
+    uint64_t max_wait_ns;
+    uint64_t shrinks;
+    uint64_t grows;
+    uint64_t held;          /* slots given back after VIRT_BOOT_HOLD without ready */
+} boot_ctl_t;
+
+typedef struct ksm_ctl {
+    bool running;           /* we switched ksmd on */
+    pid_t ksmd;
+    uint64_t ksmd_ticks;    /* utime + stime */
+    struct timespec sampled;
+    uint64_t pages_sharing;
+    uint64_t pages_shared;
+    uint64_t pages_to_scan;
+    uint64_t sleep_ms;
+    uint64_t gain;          /* pages merged during the last pass */
+    double cpu;             /* ksmd cores busy during the last pass */
+} ksm_ctl_t;
+
+/* boot cost of a profile, measured from fork to the QMP greeting */
+typedef struct profile_stats {
+    uint64_t started;
+    uint64_t timeouts;
+    uint64_t startup_ns;    /* sum */
+    uint64_t startup_min;
+    uint64_t startup_max;
+    uint64_t ready;
+    uint64_t ready_timeouts;
+    uint64_t ready_ns;      /* sum */
+    uint64_t ready_hist[READY_BUCKETS];
+    uint64_t prewarmed;     /* launches that found hot ranges to read ahead */
+    uint64_t prewarm_hot;   /* bytes, sum */
+    uint64_t prewarm_hit;
+    uint64_t prewarm_ns;
+    uint64_t ready_warm;    /* ready after a prewarm, the rest booted cold */
+    uint64_t ready_warm_ns;
+    uint64_t boot_queued;   /* launches that waited for a boot slot */
+    uint64_t boot_dequeued; /* and left the queue to boot */
+    uint64_t boot_wait_ns;  /* sum */
+} profile_stats_t;
+
+/* Boot hotness of a backing image, one counter per HOT_CHUNK. A counter is a
+ * shift register of the last eight learns, the top bit set when the guest
+ * brought the chunk into the page cache while booting: non-zero is hot, bigger
+ * is hotter. A chunk that was cached before the boot or read by the prewarm
+ * tells nothing, it keeps its counter unless the kernel evicted it meanwhile. */
+typedef struct hot_image {
+    char path[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    uint64_t size;
+    uint32_t nr_chunks;
+    uint8_t *hits;
+    uint8_t *warm;          /* cached before a boot or prewarmed, since the last learn */
+    uint64_t gen;           /* bumped by every learn */
+    struct timespec learned;
+    uint8_t *map;           /* whole image, MAP_SHARED, holds the locks */
+    uint64_t locked;        /* bytes */
+    uint64_t locked_gen;
+    struct hot_image *next;
+} hot_image_t;
+
+typedef struct prewarm_ctl {
+    pthread_mutex_t lock;   /* workers prewarm and learn concurrently */
+    hot_image_t *images;
+    uint64_t locked;        /* bytes over all images */
+    uint64_t learns;
+    uint64_t lock_failed;
+} prewarm_ctl_t;
+
+/* A node as its last announce described it, plus what we placed there since. */
+typedef struct fed_node {
+    char path[MAX_NODE_PATH];
+    virtc_t *vc;            /* forwarding connection, opened on first use */
+    bool alive;
+    struct timespec seen;
+    int fit;
+    int cpu_used;           /* VCPU_UNIT per vCPU */
+    int cpu_cap;
+    int mem_used;           /* MB */
+    int mem_total;
+    bool vms[MAX_VM_NUM];
+    struct timespec claimed[MAX_VM_NUM];    /* placed here, maybe not announced yet */
+    uint64_t placed;
+    uint64_t failed;
+} fed_node_t;
+
+typedef struct fed_job {
+    int id;                 /* the one our client got */
+    int node;
+    int remote_id;
+} fed_job_t;
+
+typedef struct federation {
+    fed_node_t nodes[MAX_NODES];    /* never removed, a node that comes back gets its slot */
+    int nr_nodes;
+    fed_job_t jobs[FED_JOBS];
+    int next_job;
+    uint64_t announces;
+    uint64_t placed;
+    uint64_t no_node;
+    uint64_t forwarded;
+    uint64_t forward_failed;
+    uint64_t timeouts;
+    /* node side */
+    virtc_t *up;            /* to the coordinator */
+    bool up_joined;
+} federation_t;
+
+typedef struct trace_event {
+    const char *name;       /* a string literal, never freed */
+    int vm_id;
+    uint64_t start;         /* ns, CLOCK_MONOTONIC */
+    uint64_t dur;
+} trace_event_t;
+
+/* One ring per thread, the lock is only ever contended by a dump. */
+typedef struct trace_buf {
+    pid_t tid;
+    pthread_mutex_t lock;
+    uint64_t count;
+    trace_event_t events[TRACE_EVENTS];
+    struct trace_buf *next;
+} trace_buf_t;
+
+typedef struct tracer {
+    int on;
+    pthread_mutex_t lock;   /* protects bufs */
+    trace_buf_t *bufs;
+} tracer_t;
+
+typedef struct client_conn {
+    int fd;
+    bool connected;
+    char in[CONN_IN_SIZE];  /* received, not handled yet; requests are only handled whole */
+    int in_len;
+    int in_pos;             /* read position in the request being handled */
+    int wait_vm;            /* MES_WAIT_READY pending, -1 none; not read meanwhile to keep replies in order */
+    struct timespec wait_deadline;
+    int fwd_node;           /* request forwarded to this node, -1 none; not read meanwhile either */
+    struct timespec fwd_deadline;
+    virtc_t *fwd_vc;        /* own connection to the node for a forwarded MES_WAIT_READY */
+    bool job_wait;          /* answered from a job's done(), not read meanwhile either */
+} client_conn_t;
+
 typedef struct libvirt_server {
     int listenfd;
-    int connfd;
+    client_conn_t conns[MAXCONN];
+    client_conn_t *cur;     /* connection whose message is being handled */
     fd_set listen_set;
     int log_fd;
-    char log_buf[1024];
-    bool connected;
     qemu_proc_t *qemu_head;
 } libvirt_server_t;
 
-typedef enum MESSAGE_TYPE {
-    MES_QUREY_QEMU,
-    MES_LAUNCH_QEMU,
-    MES_KILL_QEMU,
-    MES_GET_CPU_AFFINITY,
-    MES_ACK,
-} MESSAGE_TYPE_T;
-
 typedef enum OPTION_TYPE {
     OPT_NULL,
     OPT_QEMU_NUM,
@@ -84,17 +728,34 @@ typedef ATTR_UNUSED struct qemu_option {
 } qemu_option_t;
 
 static libvirt_server_t virt_server;
-
-static void logout(char *fmt, ...);
+static virt_conf_t virt_conf;
+static job_pool_t job_pool;
+static host_capacity_t host_cap;
+static numa_host_t numa_host;
+static periodic_task_t periodic_tasks[MAX_PERIODIC];
+static int nr_periodic_tasks;
+static rebalancer_t rebalancer;
+static balloon_ctl_t balloon_ctl;
+static ksm_ctl_t ksm_ctl;
+static boot_ctl_t boot_ctl;
+static hotplug_ctl_t hotplug_ctl;
+static io_ctl_t io_ctl;
+static virt_status_t *status_table;
+static tracer_t tracer;
+static prewarm_ctl_t prewarm_ctl;
+static federation_t fed;
+static __thread trace_buf_t *trace_local;
+
+static void logout(char *fmt, ...) __attribute__((format(printf, 1, 2)));
 static void create_daemon(void);
 static void init_log(void);
 static void init_pid_file(void);
 static int new_connect(void);
 static int recv_message(int * message_type);
 static int recv_vm_id(void);
-static qemu_proc_t * create_qemu_proc(void);
-static void fill_arglist(qemu_proc_t *qemu_proc);
-static void try_launch_qemu(void);
+static qemu_proc_t * create_qemu_proc(int vm_id, qemu_profile_t *profile);
+static void fill_arglist(qemu_proc_t *qemu_proc, arglist_t *args);
+static void try_launch_qemu(bool with_profile, bool with_priority);
 static void query_qemu(void);
 static void loop_event(void);
 static int server_init(void);
@@ -104,27 +765,167 @@ static char *message_str[] = {
     "Message launch qemu",
     "Message kill qemu",
     "Message get process cpu affinity",
+    "Message ack",
+    "Message launch qemu with profile",
+    "Message query job",
+    "Message query stats",
+    "Message query fit",
+    "Message trace",
+    "Message nack",
+    "Message wait ready",
+    "Message node announce",
+    "Message set io limits",
+    "Message set io group",
+    "Message launch qemu with priority",
+};
+
+/* Fields of each request as virt-proto.h lists them: i an int, s a string,
+ * n an int counting the ints behind it. */
+static const char *message_fields[] = {
+    [MES_QUREY_QEMU] = "",
+    [MES_LAUNCH_QEMU] = "i",
+    [MES_KILL_QEMU] = "i",
+    [MES_GET_CPU_AFFINITY] = "i",
+    [MES_LAUNCH_QEMU_PROFILE] = "is",
+    [MES_QUERY_JOB] = "i",
+    [MES_QUERY_STATS] = "",
+    [MES_QUERY_FIT] = "s",
+    [MES_TRACE] = "i",
+    [MES_WAIT_READY] = "ii",
+    [MES_NODE_ANNOUNCE] = "iiiiins",
+    [MES_SET_IO_LIMITS] = "iiiiiis",
+    [MES_SET_IO_GROUP] = "iiiiis",
+    [MES_LAUNCH_QEMU_PRIORITY] = "iis",
+};
+
+/* trace span name of a request, whatever the client sent */
+static const char *message_name(int message_type)
+{
+    if (message_type < 0 || message_type >= ARRAY_SIZE(message_str)) {
+        return "Message unknown";
+    }
+
+    return message_str[message_type];
+}
+
+#define PER_CPU 2
+static qemu_profile_t qemu_profiles[] = {
+    {
+        /* the first one is the default profile */
+        .name = "desktop",
+        .machine = "pc-i440fx-2.9",
+        .mem = 2048,
+        .smp = PER_CPU,
+        .cpu_weight = 100,
+        .cpu_quota = 0,
+        .mem_overhead = 512,
+        .io_weight = 100,
+        .balloon_floor = 1024,
+        .max_smp = 2 * PER_CPU,
+        .max_mem = 4096,
+        .io = { .iops = 2000, .iops_burst = 6000, .mbps = 100, .mbps_burst = 300, .burst = 30 },
+    },
+    {
+        .name = "batch",
+        .machine = "pc-i440fx-2.9",
+        .mem = 1024,
+        .smp = PER_CPU,
+        .cpu_weight = 50,
+        .cpu_quota = 150,
+        .mem_overhead = 256,
+        .io_weight = 50,
+        .balloon_floor = 512,
+        .net = NET_TAP,
+        .headless = true,
+        .io = { .iops = 1000, .iops_burst = 2000, .mbps = 80, .mbps_burst = 160, .burst = 10 },
+    },
+    {
+        /* CI guests booting a kernel straight into a virtio-mmio root disk */
+        .name = "micro",
+        .machine = "microvm",
+        .mem = 512,
+        .smp = 1,
+        .cpu_weight = 50,
+        .cpu_quota = 100,
+        .mem_overhead = 128,
+        .io_weight = 50,
+        .balloon_floor = 256,
+        .net = NET_TAP,
+        .headless = true,
+        .io = { .iops = 500, .iops_burst = 2000, .mbps = 40, .mbps_burst = 160, .burst = 10 },
+    },
+    {
+        /* many guests booted from the same golden image */
+        .name = "dense",
+        .machine = "pc-i440fx-2.9",
+        .mem = 2048,
+        .smp = PER_CPU,
+        .cpu_weight = 100,
+        .cpu_quota = 0,
+        .mem_overhead = 512,
+        .io_weight = 100,
+        .balloon_floor = 1024,
+        .mem_merge = true,
+        .net = NET_TAP,
+        .max_smp = 2 * PER_CPU,
+        .max_mem = 4096,
+        /* a long burst for the boot, the backing image is mostly in the page cache */
+        .io = { .iops = 1000, .iops_burst = 4000, .mbps = 60, .mbps_burst = 240, .burst = 60 },
+    },
+    {
+        /* media pipelines: no page faults, no preemption on the vCPUs */
+        .name = "rt",
+        .machine = "pc-i440fx-2.9",
+        .mem = 2048,
+        .smp = PER_CPU,
+        .cpu_weight = 100,
+        .cpu_quota = 0,
+        .mem_overhead = 512,
+        .io_weight = 100,
+        .net = NET_TAP,
+        .headless = true,
+        .realtime = true,
+    },
+    {
+        /* databases: wider than a socket, the guest sees the host's nodes it spans */
+        .name = "large",
+        .machine = "pc-i440fx-2.9",
+        .mem = 16384,
+        .smp = 4 * PER_CPU,
+        .cpu_weight = 200,
+        .cpu_quota = 0,
+        .mem_overhead = 1024,
+        .io_weight = 200,
+        .balloon_floor = 8192,
+        .net = NET_TAP,
+        .headless = true,
+        .io = { .iops = 8000, .iops_burst = 16000, .mbps = 400, .mbps_burst = 800, .burst = 30 },
+        .guest_numa = true,
+    },
 };
 
+static profile_stats_t profile_stats[ARRAY_SIZE(qemu_profiles)];
+
 #define INSTALL_GUEST_OS 0
 static char * qemu_common_option[] = {
     "qemu-system-x86_64",  // arg[0] is the name of process
     "-enable-kvm",
-    "-machine", "pc-i440fx-2.9,accel=kvm,usb=off",
     "-cpu", "host",
-    "-realtime", "mlock=off",
     /* "-uuid", "1fd24501-427f-42a2-8580-4804ace5b179", */
     "-no-user-config",
     "-nodefaults",
     "-rtc", "base=localtime,driftfix=slew",
-    "-no-hpet",
     "-boot", "strict=on",
+    /* "-msg", "timestamp=on", */
+};
+
+/* SPICE desktop devices, left out of headless profiles */
+static char * qemu_desktop_option[] = {
     /* usb host control */
     "-device", "ich9-usb-ehci1,id=usb,bus=pci.0,addr=0x7.0x7",
     "-device", "ich9-usb-uhci1,masterbus=usb.0,firstport=0,bus=pci.0,multifunction=on,addr=0x7",
     "-device", "ich9-usb-uhci2,masterbus=usb.0,firstport=2,bus=pci.0,addr=0x7.0x1",
     "-device", "ich9-usb-uhci2,masterbus=usb.0,firstport=4,bus=pci.0,addr=0x7.0x2",
-    "-device", "virtio-serial-pci,id=virtio-serial0,bus=pci.0,addr=0x5",
     /* boot device */
 #if INSTALL_GUEST_OS
     // "-cdrom", ISO_FILE,
@@ -133,9 +934,6 @@ static char * qemu_common_option[] = {
     "-drive", "file=" VIRTIO_ISO_FILE ",if=none,media=cdrom,id=drive-ide0-1-0,readonly=on,format=raw",
     "-device", "ide-drive,bus=ide.0,unit=1,drive=drive-ide0-1-0,id=ide0-1-0",
 #endif
-    /* tap net */
-    "-net", "nic,model=virtio",
-    "-net", "user,hostname=alan",
     "-chardev", "spicevmc,id=charchannel0,name=vdagent",
     "-device", "virtserialport,bus=virtio-serial0.0,nr=1,chardev=charchannel0,id=channel0,name=com.redhat.spice.0",
     "-k", "en-us",
@@ -148,26 +946,27 @@ static char * qemu_common_option[] = {
     "-device", "usb-redir,chardev=usbredirchardev2,id=usbredirdev2,bus=usb.0,port=2",
     "-chardev", "spicevmc,name=usbredir,id=usbredirchardev3",
     "-device", "usb-redir,chardev=usbredirchardev3,id=usbredirdev3,bus=usb.0,port=3",
-    "-device", "virtio-balloon-pci,id=balloon0,bus=pci.0,addr=0x6",
-    /* "-msg", "timestamp=on", */
 };
 
+/* Called from the worker threads as well, so format on the stack and
+ * let the single O_APPEND write keep lines whole. */
 static void logout(char *fmt, ...)
 {
+    char log_buf[1024];
     int lenth;
 
     va_list args;
 
     va_start (args, fmt);
-    lenth = vsprintf(virt_server.log_buf, fmt, args);
+    lenth = vsnprintf(log_buf, sizeof(log_buf), fmt, args);
     va_end(args);
 
-    if (lenth > 1024) {
-        lenth = 1024;
-        virt_server.log_buf[lenth - 1] = '\0';
+    if (lenth >= sizeof(log_buf)) {
+        lenth = sizeof(log_buf) - 1;
+        log_buf[lenth - 1] = '\n';
     }
 
-    if (write(virt_server.log_fd, virt_server.log_buf, lenth) == -1) {
+    if (write(virt_server.log_fd, log_buf, lenth) == -1) {
        ERR_EXIT("Error: write to debug file error.\n");
     }
 }
@@ -207,7 +1006,7 @@ static ATTR_UNUSED void create_daemon(void)
 
 static void init_log(void)
 {
-    virt_server.log_fd = open(LIBVIRT_LOG_FILE, O_RDWR | O_CLOEXEC | O_CREAT | O_APPEND, 0660);
+    virt_server.log_fd = open(virt_conf.log_file, O_RDWR | O_CLOEXEC | O_CREAT | O_APPEND, 0660);
     if (virt_server.log_fd == -1) {
         ERR_EXIT("Error: Open libvirt log file error\n");
     }
@@ -218,7 +1017,7 @@ static void init_pid_file()
 {
     char buf[16];
     int len;
-    int pid_fd = open(LIBVIRT_PID_FILE, O_RDWR | O_CLOEXEC | O_CREAT, 0660);
+    int pid_fd = open(virt_conf.pid_file, O_RDWR | O_CLOEXEC | O_CREAT, 0660);
     pid_t pid = getpid();
 
     logout("libvirtd pid is %d\n", pid);
@@ -231,39 +1030,91 @@ static void init_pid_file()
 
 static int new_connect(void)
 {
-    int flags;
-    virt_server.connfd = accept(virt_server.listenfd, NULL, NULL);
-    if (virt_server.connfd == -1) {
+    int i, fd;
+
+    fd = accept4(virt_server.listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
         logout("Error: accept error\n");
         return -1;
     }
-    flags = fcntl(virt_server.connfd, F_GETFD);
-    flags |= FD_CLOEXEC;
-    fcntl(virt_server.connfd, F_SETFD);
-    logout("virt-client connect\n");
-    virt_server.connected = true;
 
-    return 0;
+    for (i = 0; i < MAXCONN; i++) {
+        if (!virt_server.conns[i].connected) {
+            virt_server.conns[i].fd = fd;
+            virt_server.conns[i].connected = true;
+            virt_server.conns[i].in_len = 0;
+            virt_server.conns[i].wait_vm = -1;
+            virt_server.conns[i].fwd_node = -1;
+            virt_server.conns[i].fwd_vc = NULL;
+            virt_server.conns[i].job_wait = false;
+            logout("virt-client connect, slot %d\n", i);
+            return 0;
+        }
+    }
+
+    logout("too many virt-client, max is %d\n", MAXCONN);
+    close(fd);
+
+    return -1;
 }
 
 static int send_ack(void)
 {
     int ack = MES_ACK;
-    int ret = write(virt_server.connfd, &ack, sizeof(ack));
+    int ret = write(virt_server.cur->fd, &ack, sizeof(ack));
     if (ret == -1) {
         ERR_EXIT("Error: send ack error\n");
     }
     return 0;
 }
 
+/* refuse a field, the request gets no reply (see virt-proto.h) */
+static int send_nack(void)
+{
+    int nack = MES_NACK;
+    int ret = write(virt_server.cur->fd, &nack, sizeof(nack));
+    if (ret == -1) {
+        ERR_EXIT("Error: send nack error\n");
+    }
+    return 0;
+}
+
+static int send_int(int val)
+{
+    if (write(virt_server.cur->fd, &val, sizeof(val)) == -1) {
+        ERR_EXIT("Error: socket error\n");
+    }
+    return 0;
+}
+
+static void conn_close(client_conn_t *conn)
+{
+    close(conn->fd);
+    conn->fd = -1;
+    conn->connected = false;
+    logout("virt-client disconnect\n");
+}
+
+/* The next bytes of the request being handled, 0 past its end like a read()
+ * at EOF. conn_dispatch() only hands out whole requests. */
+static int conn_take(void *dst, int len)
+{
+    client_conn_t *conn = virt_server.cur;
+
+    if (!conn->connected || conn->in_pos + len > conn->in_len) {
+        return 0;
+    }
+    memcpy(dst, conn->in + conn->in_pos, len);
+    conn->in_pos += len;
+
+    return len;
+}
+
 static void do_recv_check(int ret)
 {
     if (ret <= 0) {
-        if (virt_server.connected) {
-            close(virt_server.connfd);
-            virt_server.connected = false;
-            virt_server.connfd = -1;
-            logout("virt-client disconnect\n");
+        if (virt_server.cur->connected) {
+            conn_close(virt_server.cur);
         } else {
             logout("virt-client disconnect already.\n");
         }
@@ -274,7 +1125,7 @@ static void do_recv_check(int ret)
 static int recv_message(int * message_type)
 {
     int ret;
-    ret = read(virt_server.connfd, message_type, sizeof(int));
+    ret = conn_take(message_type, sizeof(int));
 
     if (ret <= 0) {
         logout("recv message error\n");
@@ -282,6 +1133,13 @@ static int recv_message(int * message_type)
         return -1;
     }
 
+    if (*message_type < 0 || *message_type >= ARRAY_SIZE(message_str) ||
+            *message_type == MES_ACK || *message_type == MES_NACK) {
+        logout("unknown message type %d\n", *message_type);
+        send_nack();
+        return -1;
+    }
+
     send_ack();
 
     logout("%s\n", message_str[*message_type]);
@@ -291,7 +1149,7 @@ static int recv_message(int * message_type)
 static int recv_vm_id(void)
 {
     int ret, vm_id;
-    ret = read(virt_server.connfd, &vm_id, sizeof(int));
+    ret = conn_take(&vm_id, sizeof(int));
 
     if (ret <= 0) {
         do_recv_check(ret);
@@ -300,6 +1158,7 @@ static int recv_vm_id(void)
 
     if (vm_id < 0 || vm_id >= MAX_VM_NUM) {
         logout("vm_id range error\n");
+        send_nack();
         return -1;
     }
 
@@ -308,11 +1167,79 @@ static int recv_vm_id(void)
     return vm_id;
 }
 
+static int recv_int(int *val)
+{
+    int ret;
+    ret = conn_take(val, sizeof(int));
+
+    if (ret <= 0) {
+        do_recv_check(ret);
+        return -1;
+    }
+
+    send_ack();
+
+    return 0;
+}
+
+/* A string is sent as its lenth (int) followed by the characters, no '\0'. */
+static int recv_string(char *str, int size)
+{
+    int ret, len, pos;
+    ret = conn_take(&len, sizeof(int));
+
+    if (ret <= 0) {
+        do_recv_check(ret);
+        return -1;
+    }
+
+    if (len <= 0 || len >= size) {
+        logout("string lenth %d out of range\n", len);
+        /* skip the characters, the next request starts after them */
+        while (len > 0) {
+            ret = conn_take(str, len < size ? len : size);
+            if (ret <= 0) {
+                do_recv_check(ret);
+                return -1;
+            }
+            len -= ret;
+        }
+        send_nack();
+        return -1;
+    }
+
+    for (pos = 0; pos < len; pos += ret) {
+        ret = conn_take(str + pos, len - pos);
+        if (ret <= 0) {
+            do_recv_check(ret);
+            return -1;
+        }
+    }
+    str[len] = '\0';
+
+    send_ack();
+
+    return len;
+}
+
+static qemu_profile_t *find_profile(const char *name)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(qemu_profiles); i++) {
+        if (strcmp(qemu_profiles[i].name, name) == 0) {
+            return &qemu_profiles[i];
+        }
+    }
+
+    return NULL;
+}
+
 #if 0
 static int recv_option(qemu_option_t * opt) ATTR_UNUSED
 {
     int ret;
-    ret = read(virt_server.connfd, &(opt->type), sizeof(opt->type));
+    ret = read(virt_server.cur->fd, &(opt->type), sizeof(opt->type));
     if (ret == -1) {
         ERR_EXIT("Error: socket read error\n");
     }
@@ -321,7 +1248,7 @@ static int recv_option(qemu_option_t * opt) ATTR_UNUSED
         return 0;
     }
 
-    ret = read(virt_server.connfd, &(opt->size), sizeof(opt->size));
+    ret = read(virt_server.cur->fd, &(opt->size), sizeof(opt->size));
     if (ret == -1) {
         ERR_EXIT("Error: socket read error\n");
     }
@@ -332,15 +1259,10 @@ static int recv_option(qemu_option_t * opt) ATTR_UNUSED
 }
 #endif
 
-static qemu_proc_t* create_qemu_proc(void)
+static qemu_proc_t* create_qemu_proc(int vm_id, qemu_profile_t *profile)
 {
     qemu_proc_t ** item;
 
-    int vm_id = recv_vm_id();
-    if (vm_id == -1) {
-        return NULL;
-    }
-
     for(item = &virt_server.qemu_head; *item != NULL; item = &(*item)->next) {
         if ((*item)->vm_id == vm_id) {
             logout("qemu %d has already launched\n", vm_id);
@@ -351,78 +1273,209 @@ static qemu_proc_t* create_qemu_proc(void)
     *item = (qemu_proc_t *)calloc(1, sizeof(qemu_proc_t));
     if (*item == NULL) {
         logout("malloc qemu_proc error (%s)\n", strerror(errno));
+        return NULL;
     }
     (*item)->vm_id = vm_id;
+    (*item)->profile = profile;
+    (*item)->probe_fd = -1;
+    (*item)->qga_fd = -1;
+    clock_gettime(CLOCK_MONOTONIC, &(*item)->requested);
+    (*item)->balloon_target = profile->mem;
+    (*item)->smp = profile->smp;
+    (*item)->mem = profile->mem;
+    (*item)->hp_mem_avail = -1;
     (*item)->next = NULL;
 
-    logout("create a new qemu_proc, vm_id %d\n", vm_id);
+    logout("create a new qemu_proc, vm_id %d, profile %s\n", vm_id, profile->name);
 
     return *item;
 }
 
-#define NAME_OPT 2
-#define MEM_OPT 2
-#define SMP_OPT 2
-#define IMAGE_OPT 2
-#define SPICE_OPT 2
-#define DEBUG_OPT 2
-#define NULL_OPT 1
+#define BASE_PORT 9500
+
+static void arg_add(arglist_t *args, const char *fmt, ...)
+{
+    va_list ap;
+    char *arg;
+
+    /* keep one slot for the NULL terminator */
+    if (args->argc + 2 > args->size) {
+        args->size = args->size ? args->size * 2 : 64;
+        args->argv = realloc(args->argv, args->size * sizeof(char *));
+        if (args->argv == NULL) {
+            ERR_EXIT("Error: malloc arglist error\n");
+        }
+    }
+
+    va_start(ap, fmt);
+    if (vasprintf(&arg, fmt, ap) == -1) {
+        ERR_EXIT("Error: malloc arglist error\n");
+    }
+    va_end(ap);
 
-#define EXT_OPT_SIZE 13
+    args->argv[args->argc++] = arg;
+    args->argv[args->argc] = NULL;
+}
 
-static char buf[12][256];
-static char **arglist;
+static void arg_free(arglist_t *args)
+{
+    int i;
 
-#define BASE_PORT 9500
-#define PER_CPU 2
-static const uint32_t mem_defaut = 2048;
-static const uint32_t smp_defaut = PER_CPU;
+    for (i = 0; i < args->argc; i++) {
+        free(args->argv[i]);
+    }
+    free(args->argv);
+    memset(args, 0, sizeof(*args));
+}
 
-static void fill_arglist(qemu_proc_t * qemu_proc)
+/* microvm has no PCI bus, its virtio devices sit on virtio-mmio */
+static bool profile_mmio(const qemu_profile_t *profile)
 {
-    int pos;
-    int common_opt_size, i;
+    return strcmp(profile->machine, "microvm") == 0;
+}
+
+/* The guest NIC, with a MAC derived from the vm id so it survives relaunches. */
+static void net_device_args(qemu_proc_t *qemu_proc, arglist_t *args, int queues)
+{
+    int vm_id = qemu_proc->vm_id;
+
+    arg_add(args, "-device");
+    if (profile_mmio(qemu_proc->profile)) {
+        arg_add(args, "virtio-net-device,netdev=net0,mac=52:54:00:5e:%02x:%02x%s",
+                (vm_id >> 8) & 0xff, vm_id & 0xff, queues > 1 ? ",mq=on" : "");
+    } else if (queues > 1) {
+        arg_add(args, "virtio-net-pci,netdev=net0,mac=52:54:00:5e:%02x:%02x,mq=on,vectors=%d",
+                (vm_id >> 8) & 0xff, vm_id & 0xff, 2 * queues + 2);
+    } else {
+        arg_add(args, "virtio-net-pci,netdev=net0,mac=52:54:00:5e:%02x:%02x",
+                (vm_id >> 8) & 0xff, vm_id & 0xff);
+    }
+}
+
+/* Hotplug needs ACPI, which microvm goes without; realtime vCPUs, hugepage
+ * RAM and guest NUMA nodes are sized once at admission. */
+static bool profile_hotplug(const qemu_profile_t *profile)
+{
+    return (profile->max_smp > profile->smp || profile->max_mem > profile->mem) &&
+            !profile_mmio(profile) && !profile->realtime && !profile->hugepages &&
+            !profile->guest_numa;
+}
+
+static uint32_t profile_dimm_slots(const qemu_profile_t *profile)
+{
+    uint32_t slots = (profile->max_mem - profile->mem) / DIMM_SIZE;
+
+    return slots < DIMM_MAX ? slots : DIMM_MAX;
+}
+
+static void fill_arglist(qemu_proc_t * qemu_proc, arglist_t *args)
+{
+    int i;
     int vm_id = qemu_proc->vm_id;
-    common_opt_size = ARRAY_SIZE(qemu_common_option);
+    qemu_profile_t *profile = qemu_proc->profile;
+    bool mmio = profile_mmio(profile);
 
-    int count = common_opt_size + EXT_OPT_SIZE;
+    for (i = 0; i < ARRAY_SIZE(qemu_common_option); i++) {
+        arg_add(args, "%s", qemu_common_option[i]);
+    }
 
-    /* These options are just assigned once */
-    if (arglist == NULL) {
-        arglist = calloc(1, count * sizeof(char *));
-        for (i = 0, pos = 0; i < common_opt_size; i++, pos++) {
-            arglist[pos] = qemu_common_option[i];
-        }
+    /* bus of the vdagent and guest agent ports, ahead of both */
+    arg_add(args, "-device");
+    if (mmio) {
+        arg_add(args, "virtio-serial-device,id=virtio-serial0");
+    } else {
+        arg_add(args, "virtio-serial-pci,id=virtio-serial0,bus=pci.0,addr=0x5");
+    }
 
-        for (i = 0; i < EXT_OPT_SIZE - 1; i++, pos++) {
-            arglist[pos] = buf[i];
+    if (!profile->headless) {
+        for (i = 0; i < ARRAY_SIZE(qemu_desktop_option); i++) {
+            arg_add(args, "%s", qemu_desktop_option[i]);
         }
-        /* add extra NULL as the EOS of array */
-        arglist[pos++] = NULL;
     }
 
-    memset(buf, 0, sizeof(buf));
-    sprintf(buf[0], "-name");
-    sprintf(buf[1], "qemu-%03d", vm_id);
+    arg_add(args, "-machine");
+    /* qemu merges by default, only vms that opted in may share pages with ksmd */
+    arg_add(args, "%s,accel=kvm,usb=off,mem-merge=%s", profile->machine,
+            profile->mem_merge ? "on" : "off");
+    /* a realtime vCPU owns its core, let it idle in the guest instead of exiting */
+    arg_add(args, "-overcommit");
+    arg_add(args, profile->realtime ? "mem-lock=on,cpu-pm=on" : "mem-lock=off");
+    if (!mmio) {
+        arg_add(args, "-no-hpet");
+    }
+
+    arg_add(args, "-name");
+    arg_add(args, "qemu-%03d", vm_id);
+
+    arg_add(args, "-m");
+    if (profile_hotplug(profile) && profile->max_mem > profile->mem) {
+        /* room for DIMMs up to max_mem */
+        arg_add(args, "%u,slots=%u,maxmem=%uM", profile->mem,
+                profile_dimm_slots(profile), profile->mem + profile_dimm_slots(profile) * DIMM_SIZE);
+    } else {
+        arg_add(args, "%u", profile->mem);
+    }
+    if (profile->hugepages) {
+        arg_add(args, "-mem-path");
+        arg_add(args, HUGEPAGE_PATH);
+        arg_add(args, "-mem-prealloc");
+    }
+
+    arg_add(args, "-smp");
+    if (profile_hotplug(profile) && profile->max_smp > profile->smp) {
+        arg_add(args, "%u,maxcpus=%u", profile->smp, profile->max_smp);
+    } else {
+        arg_add(args, "%u", profile->smp);
+    }
+
+    arg_add(args, "-device");
+    if (mmio) {
+        arg_add(args, "virtio-blk-device,drive=drive-virtio-disk0-0-0,id=virtio-disk0-0-0");
+        /* no firmware to boot a disk, hand the kernel over directly */
+        arg_add(args, "-kernel");
+        arg_add(args, "%s", virt_conf.microvm_kernel);
+        arg_add(args, "-append");
+        arg_add(args, MICROVM_APPEND);
+    } else {
+        arg_add(args, "virtio-blk,bus=pci.0,addr=0x8,drive=drive-virtio-disk0-0-0,id=virtio-disk0-0-0");
+    }
 
-    sprintf(buf[2], "-m");
-    sprintf(buf[3], "%u", mem_defaut);
+    arg_add(args, "-chardev");
+    arg_add(args, "socket,id=qga0,path=%s/vm-%03d.qga,server=on,wait=off", virt_conf.qmp_dir, vm_id);
+    arg_add(args, "-device");
+    arg_add(args, "virtserialport,bus=virtio-serial0.0,nr=2,chardev=qga0,id=channel1,name=org.qemu.guest_agent.0");
 
-    sprintf(buf[4], "-smp");
-    sprintf(buf[5], "%u", smp_defaut);
+    arg_add(args, "-device");
+    if (mmio) {
+        arg_add(args, "virtio-balloon-device,id=balloon0");
+    } else {
+        arg_add(args, "virtio-balloon-pci,id=balloon0,bus=pci.0,addr=0x6");
+    }
 
-    sprintf(buf[6], "-drive");
-    sprintf(buf[7], "file=/home/alan/libvirt/images/vm-%03d,if=none,id=drive-virtio-disk0-0-0,format=qcow2,cache=none", vm_id);
+    if (profile->headless) {
+        /* -nodefaults left no display, give the guest a console to talk to */
+        arg_add(args, "-display");
+        arg_add(args, "none");
+        arg_add(args, "-serial");
+        arg_add(args, "unix:%s/vm-%03d.console,server=on,wait=off", virt_conf.qmp_dir, vm_id);
+    } else {
+        int port = BASE_PORT + vm_id;
+        arg_add(args, "-spice");
+        arg_add(args, "port=%d,disable-ticketing,jpeg-wan-compression=auto,streaming-video=all", port);
+    }
 
-    sprintf(buf[8], "-device");
-    sprintf(buf[9], "virtio-blk,bus=pci.0,addr=0x8,drive=drive-virtio-disk0-0-0,id=virtio-disk0-0-0");
+    arg_add(args, "-qmp");
+    arg_add(args, "unix:%s/vm-%03d.qmp,server=on,wait=off", virt_conf.qmp_dir, vm_id);
 
-    int port = BASE_PORT + vm_id;
-    sprintf(buf[10], "-spice");
-    sprintf(buf[11], "port=%d,disable-ticketing,jpeg-wan-compression=auto,streaming-video=all", port);
+    /* tap networks are added by the launch job once their fds are open */
+    if (profile->net == NET_USER) {
+        arg_add(args, "-netdev");
+        arg_add(args, "user,id=net0,hostname=alan");
+        net_device_args(qemu_proc, args, 1);
+    }
 
-    // sprintf(buf[12], "-D");
-    // sprintf(buf[13], "/home/alan/libvirt/log/vm-%d", qemu_proc->vm_id);
+    // arg_add(args, "-D");
+    // arg_add(args, "/home/alan/libvirt/log/vm-%d", qemu_proc->vm_id);
 }
 
 
@@ -440,7 +1493,7 @@ static void get_cpu_affintiy_status(void)
 
     int vm_id = recv_vm_id();
     if (vm_id == -1) {
-        goto send;
+        return;
     }
     qemu_proc_t *current;
 
@@ -450,7 +1503,7 @@ static void get_cpu_affintiy_status(void)
     }
 
     for (; current != NULL; current = current->next) {
-        if (current->vm_id == vm_id) {
+        if (current->vm_id == vm_id && current->state == QEMU_RUNNING) {
             pid = current->pid;
             find_vm_id = true;
             break;
@@ -490,200 +1543,7039 @@ send:
     len++;
 
     /* 1. send buffer lenth first */
-    if (write(virt_server.connfd, &len, sizeof(int)) == -1) {
+    if (write(virt_server.cur->fd, &len, sizeof(int)) == -1) {
         ERR_EXIT("Error: socket error\n");
     }
 
     /* 2. then send real data */
-    if (write(virt_server.connfd, buf, len) == -1) {
+    if (write(virt_server.cur->fd, buf, len) == -1) {
         ERR_EXIT("Error: socket error\n");
     }
 }
 
-static void set_cpu_affinity(int vm_id, pid_t pid)
+/* Where a vm's threads other than realtime vCPUs run: its own cores, or the
+ * general pool for a realtime vm, which keeps its realtime cores to the vCPUs. */
+static void vm_housekeeping_cpus(qemu_proc_t *qemu_proc, cpu_set_t *cpus)
 {
-    cpu_set_t mask;
-    int cpu_num = sysconf(_SC_NPROCESSORS_CONF);
-    int cpu_id = vm_id * PER_CPU;
-    int i;
+    *cpus = qemu_proc->profile->realtime ? host_cap.pool : qemu_proc->cpus;
+}
+
+/* the cgroup's cpuset.cpus, every core any thread of the vm may run on */
+static void vm_cgroup_cpus(qemu_proc_t *qemu_proc, cpu_set_t *cpus)
+{
+    vm_housekeeping_cpus(qemu_proc, cpus);
+    CPU_OR(cpus, cpus, &qemu_proc->cpus);
+}
 
-    if (cpu_id < 0 || cpu_id >= cpu_num) {
-        logout("cpu_id must be in the range [0-%d]\n", cpu_num);
+static void set_cpu_affinity(qemu_proc_t *qemu_proc, pid_t pid)
+{
+    cpu_set_t cpus;
+
+    if (!qemu_proc->pinned) {
         return;
     }
 
-    CPU_ZERO(&mask);
-    for (i = 0; i < PER_CPU; i++, cpu_id++) {
-        CPU_SET(cpu_id, &mask);
-    }
-    if (sched_setaffinity(pid, sizeof(mask), &mask) == -1) {
-        logout("bind process %d to cpu %d  failed\n", pid, cpu_id);
+    /* threads qemu starts from now on inherit it, the vCPUs move later */
+    vm_housekeeping_cpus(qemu_proc, &cpus);
+    if (sched_setaffinity(pid, sizeof(cpus), &cpus) == -1) {
+        logout("bind process %d to cpus failed (%s)\n", pid, strerror(errno));
         return;
     }
 }
 
-static void try_launch_qemu(void)
+/* Render a cpu set as a cpuset list, "0-1,4". */
+static int cpu_list_str(const cpu_set_t *mask, char *str, int size)
 {
-    /* int stat; */
-    /* int s_pid; */
+    int cpu_num = sysconf(_SC_NPROCESSORS_CONF);
+    int pos = 0;
+    int i, start;
 
-    qemu_proc_t * qemu_proc = create_qemu_proc();
-    if ( qemu_proc == NULL) {
-        logout("launch qemu failed\n");
-        return;
+    str[0] = '\0';
+    for (i = 0; i < cpu_num; i++) {
+        if (!CPU_ISSET(i, mask)) {
+            continue;
+        }
+        start = i;
+        while (i + 1 < cpu_num && CPU_ISSET(i + 1, mask)) {
+            i++;
+        }
+        if (start == i) {
+            pos += snprintf(str + pos, size - pos, "%s%d", pos ? "," : "", i);
+        } else {
+            pos += snprintf(str + pos, size - pos, "%s%d-%d", pos ? "," : "", start, i);
+        }
+        if (pos >= size) {
+            return -1;
+        }
     }
 
-    fill_arglist(qemu_proc);
-
-    pid_t pid = fork();
+    return pos;
+}
 
-    switch (pid) {
-        case -1: // error
-            ERR_EXIT("Error: fork error\n");
-            break;
-        case 0:  // sub-process
-            if (execv(QEMU_BIN, arglist) == -1) {
-                ERR_EXIT("Error: execute Qemu error.\n");
+/* Parse a cpuset list, "0-3,8", -1 on a malformed list. */
+static int parse_cpu_list(const char *str, cpu_set_t *mask)
+{
+    char *end;
+    long start, stop;
+
+    CPU_ZERO(mask);
+    while (*str != '\0' && *str != '\n') {
+        start = strtol(str, &end, 10);
+        if (end == str || start < 0) {
+            return -1;
+        }
+        stop = start;
+        if (*end == '-') {
+            str = end + 1;
+            stop = strtol(str, &end, 10);
+            if (end == str || stop < start) {
+                return -1;
             }
-            break;
-        default: // parent-process
-            qemu_proc->pid = pid;
-            set_cpu_affinity(qemu_proc->vm_id, pid);
-            logout("Launch Qemu, pid is %d\n", pid);
-            break;
+        }
+        for (; start <= stop && start < CPU_SETSIZE; start++) {
+            CPU_SET(start, mask);
+        }
+        str = end;
+        if (*str == ',') {
+            str++;
+        }
     }
+
+    return 0;
 }
 
-static void query_qemu(void)
+/* Read "Key:   value" from meminfo, the value is in kB (or a page count). */
+static long meminfo_value(const char *key)
 {
-    char buf[1024];
-    qemu_proc_t *item;
-    int pos = 0;
-    int ret;
-
-    pos = sprintf(buf, "\nNow running vm:\n");
-    pos += sprintf(buf + pos, "\tvm_id\t pid\n");
+    char path[PATH_MAX];
+    char line[256];
+    size_t key_len = strlen(key);
+    long val = -1;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/meminfo", virt_conf.proc_root);
+    fp = fopen(path, "re");
+    if (fp == NULL) {
+        return -1;
+    }
 
-    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
-        pos += sprintf(buf + pos, "\t%d\t %d\n", item->vm_id, item->pid);
-        if (pos >= 1024) {
-            pos = 1024;
-            buf[pos - 1] = '\0';
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+            val = strtol(line + key_len + 1, NULL, 10);
             break;
         }
     }
+    fclose(fp);
 
-    ret = write(virt_server.connfd, &pos, sizeof(pos));
-    if (ret == -1) {
-        ERR_EXIT("Error: socket error\n");
-    }
-
-    ret = write(virt_server.connfd, buf, pos);
-    if (ret == -1) {
-        ERR_EXIT("Error: socket error\n");
-    }
+    return val;
 }
 
-static int free_qemu_with_pid(pid_t pid)
+static int sysfs_read(const char *dir, const char *file, char *val, int size);
+
+/* VIRT_RT_CPUS, or the cores the kernel keeps the general scheduler and the
+ * tick off (isolcpus=, nohz_full=). */
+static void sched_init_rt(void)
 {
-    bool find_pid = false;
-    qemu_proc_t *prev, *current;
+    char val[1024];
+    cpu_set_t cpus;
+    int i;
 
-    prev = current = virt_server.qemu_head;
-    if(current == NULL) {
-        return 0;
+    CPU_ZERO(&host_cap.rt_pool);
+    if (virt_conf.rt_cpus) {
+        if (parse_cpu_list(virt_conf.rt_cpus, &host_cap.rt_pool) == -1) {
+            logout("sched: bad realtime cpus '%s'\n", virt_conf.rt_cpus);
+            CPU_ZERO(&host_cap.rt_pool);
+        }
+    } else {
+        if (sysfs_read(virt_conf.cpu_sysfs, "isolated", val, sizeof(val)) > 0 &&
+                parse_cpu_list(val, &cpus) == 0) {
+            CPU_OR(&host_cap.rt_pool, &host_cap.rt_pool, &cpus);
+        }
+        if (sysfs_read(virt_conf.cpu_sysfs, "nohz_full", val, sizeof(val)) > 0 &&
+                parse_cpu_list(val, &cpus) == 0) {
+            CPU_OR(&host_cap.rt_pool, &host_cap.rt_pool, &cpus);
+        }
+    }
+    for (i = host_cap.nr_cpus; i < CPU_SETSIZE; i++) {
+        CPU_CLR(i, &host_cap.rt_pool);
+    }
+    if (CPU_COUNT(&host_cap.rt_pool) == 0) {
+        return;
     }
 
-    for (; current != NULL; prev = current, current = current->next) {
-        if (current->pid == pid) {
-            find_pid = true;
+    /* housekeeping needs a core left */
+    for (i = 0; i < host_cap.nr_cpus; i++) {
+        if (CPU_ISSET(i, &host_cap.pool) && !CPU_ISSET(i, &host_cap.rt_pool)) {
             break;
-        } else {
-            continue;
         }
     }
+    if (i == host_cap.nr_cpus) {
+        logout("sched: no cpu left outside the realtime cpus, realtime off\n");
+        CPU_ZERO(&host_cap.rt_pool);
+        return;
+    }
 
-    if (find_pid) {
-        logout("find and free vm pid %d\n", current->pid);
-
-        if (prev == current) {
-            free(current);
-            virt_server.qemu_head = NULL;
-        } else {
-            prev->next = current->next;
-            free(current);
+    for (i = 0; i < host_cap.nr_cpus; i++) {
+        if (CPU_ISSET(i, &host_cap.rt_pool)) {
+            CPU_CLR(i, &host_cap.pool);
         }
-    } else {
-        logout("not find running qemu with pid %d\n", pid);
+    }
+    /* our workers and every qemu forked by them stay off the realtime cores */
+    if (sched_setaffinity(0, sizeof(host_cap.pool), &host_cap.pool) == -1) {
+        logout("sched: keep off realtime cpus failed (%s)\n", strerror(errno));
     }
 
-    return 0;
+    cpu_list_str(&host_cap.rt_pool, val, sizeof(val));
+    logout("sched: realtime cpus %s\n", val);
 }
 
-static int kill_qemu_with_vm_id(int vm_id)
+/* "Node 0 MemTotal:   32768 kB" of a node's meminfo */
+static long numa_meminfo_kb(const char *dir)
 {
-    bool find_vm_id = false;
-    qemu_proc_t *prev, *current;
-
-    prev = current = virt_server.qemu_head;
-    if(current == NULL) {
-        return 0;
+    char path[PATH_MAX];
+    char line[256];
+    char *key;
+    long val = -1;
+    FILE *fp;
+
+    if (snprintf(path, sizeof(path), "%s/meminfo", dir) >= (int)sizeof(path)) {
+        logout("path %s/meminfo too long\n", dir);
+        return -1;
     }
+    fp = fopen(path, "re");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        key = strstr(line, "MemTotal:");
+        if (key != NULL) {
+            val = strtol(key + strlen("MemTotal:"), NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+
+    return val;
+}
+
+/* Nodes with guest cores from VIRT_NODE_SYSFS; each gets the share of the
+ * guest memory its size is of the host's. Memory-only nodes are left out. */
+static void numa_init(void)
+{
+    char dir[PATH_MAX];
+    char val[1024];
+    long node_kb[MAX_NUMA_NODES] = { 0 };
+    long total_kb = 0;
+    cpu_set_t online, cores, guests;
+    int i, n;
+
+    memset(numa_host.node_of, -1, sizeof(numa_host.node_of));
+    if (sysfs_read(virt_conf.node_sysfs, "online", val, sizeof(val)) <= 0 ||
+            parse_cpu_list(val, &online) == -1) {
+        return;
+    }
+
+    CPU_OR(&guests, &host_cap.pool, &host_cap.rt_pool);
+    for (n = 0; n < CPU_SETSIZE; n++) {
+        if (!CPU_ISSET(n, &online)) {
+            continue;
+        }
+        if (n >= MAX_NUMA_NODES) {
+            logout("numa: node %d ignored, more than %d nodes\n", n, MAX_NUMA_NODES);
+            continue;
+        }
+        if (snprintf(dir, sizeof(dir), "%s/node%d", virt_conf.node_sysfs, n) >= (int)sizeof(dir)) {
+            logout("numa: path %s/node%d too long\n", virt_conf.node_sysfs, n);
+            return;
+        }
+        if (sysfs_read(dir, "cpulist", val, sizeof(val)) <= 0 || parse_cpu_list(val, &cores) == -1) {
+            continue;
+        }
+        CPU_AND(&cores, &cores, &guests);
+        node_kb[n] = numa_meminfo_kb(dir);
+        if (CPU_COUNT(&cores) == 0 || node_kb[n] <= 0) {
+            continue;
+        }
+        numa_host.cpus[n] = cores;
+        numa_host.nodes |= 1u << n;
+        numa_host.nr_nodes++;
+        total_kb += node_kb[n];
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (CPU_ISSET(i, &cores)) {
+                numa_host.node_of[i] = n;
+            }
+        }
+    }
+
+    if (numa_host.nr_nodes < 2) {
+        numa_host.nr_nodes = 0;
+        numa_host.nodes = 0;
+        memset(numa_host.node_of, -1, sizeof(numa_host.node_of));
+        return;
+    }
+
+    for (n = 0; n < MAX_NUMA_NODES; n++) {
+        if (numa_host.nodes & (1u << n)) {
+            numa_host.mem_total[n] = host_cap.mem_total * node_kb[n] / total_kb;
+            cpu_list_str(&numa_host.cpus[n], val, sizeof(val));
+            logout("numa: node %d, cpus %s, %" PRIu64 " MB memory\n", n, val, numa_host.mem_total[n]);
+        }
+    }
+}
+
+static void sched_init(void)
+{
+    int i, cpu_num = sysconf(_SC_NPROCESSORS_CONF);
+    long mem_kb, huge_pages, huge_kb;
+
+    if (cpu_num <= 0) {
+        ERR_EXIT("Error: can't count the cpus (%s)\n", strerror(errno));
+    }
+    /* the cpu sets stop there */
+    if (cpu_num > CPU_SETSIZE) {
+        cpu_num = CPU_SETSIZE;
+    }
+
+    if (virt_conf.cpu_pool == NULL || parse_cpu_list(virt_conf.cpu_pool, &host_cap.pool) == -1) {
+        if (virt_conf.cpu_pool) {
+            logout("sched: bad cpu pool '%s', use all cpus\n", virt_conf.cpu_pool);
+        }
+        CPU_ZERO(&host_cap.pool);
+        for (i = 0; i < cpu_num; i++) {
+            CPU_SET(i, &host_cap.pool);
+        }
+    }
+
+    host_cap.nr_cpus = cpu_num;
+    sched_init_rt();
+    host_cap.cpu_cap = virt_conf.cpu_overcommit * VCPU_UNIT;
+    host_cap.cpu_used = calloc(cpu_num, sizeof(uint32_t));
+    if (host_cap.cpu_used == NULL) {
+        ERR_EXIT("Error: malloc host capacity error\n");
+    }
+    for (i = 0; i < cpu_num; i++) {
+        if (!CPU_ISSET(i, &host_cap.pool)) {
+            host_cap.cpu_used[i] = host_cap.cpu_cap;
+        }
+    }
+
+    mem_kb = meminfo_value("MemTotal");
+    huge_pages = meminfo_value("HugePages_Total");
+    huge_kb = meminfo_value("Hugepagesize");
+
+    if (huge_pages > 0 && huge_kb > 0) {
+        host_cap.huge_total = (uint64_t)huge_pages * huge_kb >> 10;
+        mem_kb -= huge_pages * huge_kb;
+    }
+    if (mem_kb > 0 && (mem_kb >> 10) > virt_conf.mem_reserve) {
+        host_cap.mem_total = ((mem_kb >> 10) - virt_conf.mem_reserve) * virt_conf.mem_overcommit;
+    }
+
+    logout("sched: %d cpus in pool, %.2f vCPU per cpu, %" PRIu64 " MB memory, %" PRIu64 " MB hugepages\n",
+            CPU_COUNT(&host_cap.pool), (double)host_cap.cpu_cap / VCPU_UNIT,
+            host_cap.mem_total, host_cap.huge_total);
+
+    numa_init();
+}
+
+static const char *sched_fit_str(SCHED_FIT_T fit)
+{
+    switch (fit) {
+        case FIT_OK:
+            return "fits";
+        case FIT_NO_CPU:
+            return "not enough free cpu";
+        case FIT_NO_MEM:
+            return "not enough free memory";
+        case FIT_NO_HUGEPAGES:
+            return "not enough free hugepages";
+        case FIT_NEVER:
+        default:
+            return "larger than the host";
+    }
+}
+
+typedef struct cpu_slot {
+    uint32_t free;
+    int cpu;
+} cpu_slot_t;
+
+static int cpu_slot_cmp(const void *a, const void *b)
+{
+    const cpu_slot_t *x = a, *y = b;
+
+    if (x->free != y->free) {
+        return x->free < y->free ? -1 : 1;
+    }
+    return x->cpu - y->cpu;
+}
+
+static uint32_t profile_mem_need(const qemu_profile_t *profile)
+{
+    return profile->mem + profile->mem_overhead;
+}
+
+/* A vm is pinned to one core per vCPU, or to the whole pool when it has more
+ * vCPUs than that, and takes the same share of each of its cores. */
+static uint32_t sched_cpu_charge(uint32_t smp, int *nr_cpus)
+{
+    int pool = CPU_COUNT(&host_cap.pool);
+
+    *nr_cpus = smp < pool ? smp : pool;
+    if (*nr_cpus == 0) {
+        return UINT32_MAX;
+    }
+
+    return (smp * VCPU_UNIT + *nr_cpus - 1) / *nr_cpus;
+}
+
+static bool numa_cpu_on(int cpu, uint32_t nodes)
+{
+    return numa_host.node_of[cpu] >= 0 && (nodes & (1u << numa_host.node_of[cpu]));
+}
+
+/* bit n: some of cpus are on node n, 0 on a host placement sees as one node */
+static uint32_t numa_nodes_of(const cpu_set_t *cpus)
+{
+    uint32_t nodes = 0;
+    int i;
+
+    if (numa_host.nr_nodes < 2) {
+        return 0;
+    }
+    for (i = 0; i < host_cap.nr_cpus; i++) {
+        if (CPU_ISSET(i, cpus) && numa_host.node_of[i] >= 0) {
+            nodes |= 1u << numa_host.node_of[i];
+        }
+    }
+
+    return nodes;
+}
+
+/* Render a node mask as a cpuset.mems list, "0,1". */
+static int numa_list_str(uint32_t nodes, char *str, int size)
+{
+    int n, pos = 0;
+
+    str[0] = '\0';
+    for (n = 0; n < MAX_NUMA_NODES && pos < size; n++) {
+        if (nodes & (1u << n)) {
+            pos += snprintf(str + pos, size - pos, "%s%d", pos ? "," : "", n);
+        }
+    }
+
+    return pos < size ? pos : -1;
+}
+
+/* Split total over the vm's nodes as its cores are, the last node takes what
+ * rounding left; returns the number of nodes. */
+static int numa_split(const qemu_proc_t *qemu_proc, uint32_t total, uint32_t *part, int *node)
+{
+    int cores = CPU_COUNT(&qemu_proc->cpus);
+    uint32_t left = total;
+    cpu_set_t both;
+    int n, nr = 0;
+
+    for (n = 0; n < MAX_NUMA_NODES; n++) {
+        if (qemu_proc->numa_nodes & (1u << n)) {
+            CPU_AND(&both, &qemu_proc->cpus, &numa_host.cpus[n]);
+            part[nr] = (uint64_t)total * CPU_COUNT(&both) / cores;
+            left -= part[nr];
+            node[nr++] = n;
+        }
+    }
+    if (nr > 0) {
+        part[nr - 1] += left;
+    }
+
+    return nr;
+}
+
+/* The node with memory and cores for the whole vm whose cores fit it the
+ * tightest, -1 when it has to span nodes. slots are in best-fit order. */
+static int numa_pick(const cpu_slot_t *slots, int nr, int need, uint32_t mem)
+{
+    uint64_t sum[MAX_NUMA_NODES] = { 0 };
+    int count[MAX_NUMA_NODES] = { 0 };
+    int i, n, best = -1;
+
+    for (i = 0; i < nr; i++) {
+        n = numa_host.node_of[slots[i].cpu];
+        if (n >= 0 && count[n] < need) {
+            count[n]++;
+            sum[n] += slots[i].free;
+        }
+    }
+    for (n = 0; n < MAX_NUMA_NODES; n++) {
+        if (count[n] < need || numa_host.mem_used[n] + mem > numa_host.mem_total[n]) {
+            continue;
+        }
+        if (best == -1 || sum[n] < sum[best]) {
+            best = n;
+        }
+    }
+
+    return best;
+}
+
+/* Take need of the slots, all from node when it is not -1. A vm spanning nodes
+ * takes the nodes with the most room first, to span as few as it can. */
+static void numa_take(const cpu_slot_t *slots, int nr, int need, int node, cpu_set_t *cpus)
+{
+    int count[MAX_NUMA_NODES] = { 0 };
+    int i, n, best;
+
+    for (i = 0; i < nr; i++) {
+        if (numa_host.node_of[slots[i].cpu] >= 0) {
+            count[numa_host.node_of[slots[i].cpu]]++;
+        }
+    }
+
+    while (need > 0) {
+        if (node == -1) {
+            best = -1;
+            for (n = 0; n < MAX_NUMA_NODES; n++) {
+                if (count[n] > 0 && (best == -1 || count[n] > count[best])) {
+                    best = n;
+                }
+            }
+            if (best == -1) {
+                break;
+            }
+            node = best;
+        }
+        for (i = 0; i < nr && need > 0; i++) {
+            if (numa_host.node_of[slots[i].cpu] == node) {
+                CPU_SET(slots[i].cpu, cpus);
+                need--;
+            }
+        }
+        count[node] = 0;
+        node = -1;
+    }
+
+    /* cores on no node go last */
+    for (i = 0; i < nr && need > 0; i++) {
+        if (!CPU_ISSET(slots[i].cpu, cpus)) {
+            CPU_SET(slots[i].cpu, cpus);
+            need--;
+        }
+    }
+}
+
+/* Hold the vm's memory on the nodes of its cores, split as its cores are.
+ * Only the host total is a hard limit, a spanning vm may overrun a node. */
+static void numa_charge(qemu_proc_t *qemu_proc)
+{
+    uint32_t part[MAX_NUMA_NODES];
+    int node[MAX_NUMA_NODES];
+    int i, nr;
+
+    qemu_proc->numa_nodes = numa_nodes_of(&qemu_proc->cpus);
+    nr = numa_split(qemu_proc, qemu_proc->mem_reserved + qemu_proc->huge_reserved, part, node);
+    for (i = 0; i < nr; i++) {
+        qemu_proc->numa_charge[node[i]] = part[i];
+        numa_host.mem_used[node[i]] += part[i];
+    }
+}
+
+static void numa_uncharge(qemu_proc_t *qemu_proc)
+{
+    int n;
+
+    for (n = 0; n < MAX_NUMA_NODES; n++) {
+        numa_host.mem_used[n] -= qemu_proc->numa_charge[n];
+        qemu_proc->numa_charge[n] = 0;
+    }
+}
+
+/* A realtime vCPU is never overcommitted, it gets a free realtime core. */
+static SCHED_FIT_T sched_fit_rt(const qemu_profile_t *profile, cpu_set_t *cpus)
+{
+    int i, need = profile->smp;
+
+    for (i = 0; i < host_cap.nr_cpus && need > 0; i++) {
+        if (CPU_ISSET(i, &host_cap.rt_pool) && !CPU_ISSET(i, &host_cap.rt_used)) {
+            CPU_SET(i, cpus);
+            need--;
+        }
+    }
+    if (need > 0) {
+        CPU_ZERO(cpus);
+        return FIT_NO_CPU;
+    }
+
+    return FIT_OK;
+}
+
+/* Best fit: take the cores with the least room left that still carry the vm's
+ * share, so emptier cores stay free for larger vms.
+ * Cost is O(cpus log cpus) whatever the number of running vms. */
+static SCHED_FIT_T sched_fit(const qemu_profile_t *profile, cpu_set_t *cpus)
+{
+    cpu_slot_t slots[CPU_SETSIZE];
+    uint32_t mem = profile_mem_need(profile);
+    uint32_t charge = 0;
+    int i, nr = 0, need = 0;
+
+    CPU_ZERO(cpus);
+    if (profile->realtime) {
+        if (profile->smp > CPU_COUNT(&host_cap.rt_pool)) {
+            return FIT_NEVER;
+        }
+    } else {
+        charge = sched_cpu_charge(profile->smp, &need);
+        if (charge > host_cap.cpu_cap) {
+            return FIT_NEVER;
+        }
+    }
+
+    if (profile->hugepages) {
+        if (profile->mem > host_cap.huge_total) {
+            return FIT_NEVER;
+        }
+        if (host_cap.huge_used + profile->mem > host_cap.huge_total) {
+            return FIT_NO_HUGEPAGES;
+        }
+        mem = profile->mem_overhead;
+    }
+
+    if (mem > host_cap.mem_total) {
+        return FIT_NEVER;
+    }
+    if (host_cap.mem_used + mem > host_cap.mem_total) {
+        return FIT_NO_MEM;
+    }
+
+    if (profile->realtime) {
+        return sched_fit_rt(profile, cpus);
+    }
+
+    for (i = 0; i < host_cap.nr_cpus; i++) {
+        if (host_cap.cpu_cap - host_cap.cpu_used[i] >= charge) {
+            slots[nr].free = host_cap.cpu_cap - host_cap.cpu_used[i];
+            slots[nr].cpu = i;
+            nr++;
+        }
+    }
+    if (nr < need) {
+        return FIT_NO_CPU;
+    }
+
+    qsort(slots, nr, sizeof(cpu_slot_t), cpu_slot_cmp);
+    if (numa_host.nr_nodes > 1) {
+        numa_take(slots, nr, need, numa_pick(slots, nr, need, profile_mem_need(profile)), cpus);
+        return FIT_OK;
+    }
+    for (i = 0; i < need; i++) {
+        CPU_SET(slots[i].cpu, cpus);
+    }
+
+    return FIT_OK;
+}
+
+static SCHED_FIT_T sched_admit(qemu_proc_t *qemu_proc)
+{
+    qemu_profile_t *profile = qemu_proc->profile;
+    SCHED_FIT_T fit;
+    int i;
+
+    fit = sched_fit(profile, &qemu_proc->cpus);
+    if (fit != FIT_OK) {
+        return fit;
+    }
+
+    qemu_proc->cpu_charge = profile->realtime ? 0 : sched_cpu_charge(profile->smp, &i);
+    for (i = 0; i < host_cap.nr_cpus; i++) {
+        if (CPU_ISSET(i, &qemu_proc->cpus)) {
+            host_cap.cpu_used[i] += qemu_proc->cpu_charge;
+        }
+    }
+    if (profile->realtime) {
+        CPU_OR(&host_cap.rt_used, &host_cap.rt_used, &qemu_proc->cpus);
+    }
+
+    qemu_proc->huge_reserved = profile->hugepages ? profile->mem : 0;
+    qemu_proc->mem_reserved = profile_mem_need(profile) - qemu_proc->huge_reserved;
+    host_cap.huge_used += qemu_proc->huge_reserved;
+    host_cap.mem_used += qemu_proc->mem_reserved;
+    host_cap.admitted++;
+
+    numa_charge(qemu_proc);
+    if (__builtin_popcount(qemu_proc->numa_nodes) == 1) {
+        numa_host.local++;
+    } else if (qemu_proc->numa_nodes) {
+        numa_host.spanned++;
+    }
+    /* a guest spanning nodes sees them, its vCPUs and RAM split alike */
+    qemu_proc->numa_guest = profile->guest_numa && !profile->hugepages &&
+            __builtin_popcount(qemu_proc->numa_nodes) > 1;
+
+    qemu_proc->pinned = true;
+    qemu_proc->admitted = true;
+
+    return FIT_OK;
+}
+
+static void sched_release(qemu_proc_t *qemu_proc)
+{
+    int i;
+
+    if (!qemu_proc->admitted) {
+        return;
+    }
+
+    for (i = 0; i < host_cap.nr_cpus; i++) {
+        if (CPU_ISSET(i, &qemu_proc->cpus)) {
+            host_cap.cpu_used[i] -= qemu_proc->cpu_charge;
+            CPU_CLR(i, &host_cap.rt_used);
+        }
+    }
+    host_cap.mem_used -= qemu_proc->mem_reserved;
+    host_cap.huge_used -= qemu_proc->huge_reserved;
+    numa_uncharge(qemu_proc);
+    qemu_proc->admitted = false;
+}
+
+/* Take what a running vm needs for a new vCPU count and guest RAM, keeping the
+ * cores it has where it can; nothing changes unless it fits. */
+static SCHED_FIT_T sched_resize(qemu_proc_t *qemu_proc, uint32_t smp, uint32_t mem)
+{
+    cpu_slot_t slots[CPU_SETSIZE];
+    uint32_t charge, mem_need = mem + qemu_proc->profile->mem_overhead;
+    cpu_set_t cpus;
+    int i, nr = 0, need;
+
+    if (mem_need > qemu_proc->mem_reserved &&
+            host_cap.mem_used - qemu_proc->mem_reserved + mem_need > host_cap.mem_total) {
+        return FIT_NO_MEM;
+    }
+
+    charge = sched_cpu_charge(smp, &need);
+    for (i = 0; i < host_cap.nr_cpus; i++) {
+        if (CPU_ISSET(i, &qemu_proc->cpus)) {
+            host_cap.cpu_used[i] -= qemu_proc->cpu_charge;
+        }
+    }
+    for (i = 0; i < host_cap.nr_cpus; i++) {
+        if (host_cap.cpu_cap - host_cap.cpu_used[i] >= charge) {
+            /* its own cores sort first, then the others on its nodes */
+            slots[nr].free = CPU_ISSET(i, &qemu_proc->cpus) ? 0 : host_cap.cpu_cap - host_cap.cpu_used[i];
+            if (qemu_proc->numa_nodes && !numa_cpu_on(i, qemu_proc->numa_nodes)) {
+                slots[nr].free += host_cap.cpu_cap;
+            }
+            slots[nr].cpu = i;
+            nr++;
+        }
+    }
+
+    CPU_ZERO(&cpus);
+    if (nr >= need) {
+        qsort(slots, nr, sizeof(cpu_slot_t), cpu_slot_cmp);
+        for (i = 0; i < need; i++) {
+            CPU_SET(slots[i].cpu, &cpus);
+        }
+        qemu_proc->cpus = cpus;
+        qemu_proc->cpu_charge = charge;
+    }
+    for (i = 0; i < host_cap.nr_cpus; i++) {
+        if (CPU_ISSET(i, &qemu_proc->cpus)) {
+            host_cap.cpu_used[i] += qemu_proc->cpu_charge;
+        }
+    }
+    if (nr < need) {
+        return FIT_NO_CPU;
+    }
+
+    host_cap.mem_used = host_cap.mem_used - qemu_proc->mem_reserved + mem_need;
+    qemu_proc->mem_reserved = mem_need;
+    numa_uncharge(qemu_proc);
+    numa_charge(qemu_proc);
+
+    return FIT_OK;
+}
+
+static int render_sched_stats(char *buf, int size)
+{
+    uint64_t cpu_cap = 0, cpu_used = 0;
+    qemu_proc_t *item;
+    char cpus[256];
+    int i, pos;
+
+    for (i = 0; i < host_cap.nr_cpus; i++) {
+        if (CPU_ISSET(i, &host_cap.pool)) {
+            cpu_cap += host_cap.cpu_cap;
+            cpu_used += host_cap.cpu_used[i];
+        }
+    }
+
+    pos = snprintf(buf, size,
+            "scheduler:\n"
+            "\tvCPU %.1f/%.1f, memory %" PRIu64 "/%" PRIu64 " MB, hugepages %" PRIu64 "/%" PRIu64 " MB\n"
+            "\tadmitted %" PRIu64 ", queued %" PRIu64 ", rejected %" PRIu64 "\n",
+            (double)cpu_used / VCPU_UNIT, (double)cpu_cap / VCPU_UNIT,
+            host_cap.mem_used, host_cap.mem_total,
+            host_cap.huge_used, host_cap.huge_total,
+            host_cap.admitted, host_cap.queued, host_cap.rejected);
+    if (CPU_COUNT(&host_cap.rt_pool) == 0 || pos >= size) {
+        return pos;
+    }
+
+    cpu_list_str(&host_cap.rt_pool, cpus, sizeof(cpus));
+    pos += snprintf(buf + pos, size - pos, "\trealtime cpus %s, %d/%d used, SCHED_FIFO %d\n",
+            cpus, CPU_COUNT(&host_cap.rt_used), CPU_COUNT(&host_cap.rt_pool), virt_conf.rt_prio);
+    for (item = virt_server.qemu_head; item != NULL && pos < size; item = item->next) {
+        if (item->profile->realtime && item->admitted) {
+            cpu_list_str(&item->cpus, cpus, sizeof(cpus));
+            pos += snprintf(buf + pos, size - pos, "\tvm %d: realtime cpus %s, %d/%u vCPUs SCHED_FIFO\n",
+                    item->vm_id, cpus, item->rt_vcpus, item->profile->smp);
+        }
+    }
+
+    return pos;
+}
+
+/* Write a cgroupfs/sysfs attribute (created when the directory is a plain one). */
+static int sysfs_write(const char *dir, const char *file, const char *fmt, ...)
+{
+    char path[PATH_MAX];
+    char val[256];
+    int fd, len, ret;
+    va_list args;
+
+    va_start(args, fmt);
+    len = vsnprintf(val, sizeof(val), fmt, args);
+    va_end(args);
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, file) >= (int)sizeof(path)) {
+        logout("path %s/%s too long\n", dir, file);
+        return -1;
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        logout("open %s failed (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    ret = write(fd, val, len);
+    if (ret == -1) {
+        logout("write '%s' to %s failed (%s)\n", val, path, strerror(errno));
+    }
+    close(fd);
+
+    return ret == -1 ? -1 : 0;
+}
+
+static int sysfs_read(const char *dir, const char *file, char *val, int size)
+{
+    char path[PATH_MAX];
+    int fd, len;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, file) >= (int)sizeof(path)) {
+        logout("path %s/%s too long\n", dir, file);
+        return -1;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    len = read(fd, val, size - 1);
+    close(fd);
+    if (len < 0) {
+        return -1;
+    }
+
+    while (len > 0 && (val[len - 1] == '\n' || val[len - 1] == ' ')) {
+        len--;
+    }
+    val[len] = '\0';
+
+    return len;
+}
+
+static void cgroup_init(void)
+{
+    char *ctrl, *save;
+    char ctrls[] = CGROUP_CONTROLLERS;
+
+    if (mkdir(virt_conf.cgroup_root, 0755) == -1 && errno != EEXIST) {
+        logout("cgroup: create %s failed (%s)\n", virt_conf.cgroup_root, strerror(errno));
+        return;
+    }
+
+    if (sysfs_write(virt_conf.cgroup_root, "cgroup.subtree_control", "%s", ctrls) == 0) {
+        logout("cgroup root is %s\n", virt_conf.cgroup_root);
+        return;
+    }
+
+    /* enable one by one, a missing controller should not disable the others */
+    for (ctrl = strtok_r(ctrls, " ", &save); ctrl != NULL; ctrl = strtok_r(NULL, " ", &save)) {
+        sysfs_write(virt_conf.cgroup_root, "cgroup.subtree_control", "%s", ctrl);
+    }
+
+    logout("cgroup root is %s\n", virt_conf.cgroup_root);
+}
+
+static void cgroup_path(int vm_id, char *path, int size)
+{
+    snprintf(path, size, "%s/vm-%03d", virt_conf.cgroup_root, vm_id);
+}
+
+/* memory.max and memory.high of a vm's cgroup for mem MB of guest RAM */
+static void cgroup_set_mem(const char *path, uint32_t mem, uint32_t overhead)
+{
+    sysfs_write(path, "memory.max", "%" PRIu64, ((uint64_t)mem + overhead) << 20);
+    sysfs_write(path, "memory.high", "%" PRIu64, ((uint64_t)mem + overhead / 2) << 20);
+}
+
+/* Create the vm leaf and apply the profile limits before qemu is started,
+ * returns the leaf opened for clone3() or -1. */
+static int cgroup_create(qemu_proc_t *qemu_proc)
+{
+    qemu_profile_t *profile = qemu_proc->profile;
+    char path[PATH_MAX];
+    char val[256];
+    int fd;
+
+    cgroup_path(qemu_proc->vm_id, path, sizeof(path));
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        logout("cgroup: create %s failed (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (profile->cpu_weight) {
+        sysfs_write(path, "cpu.weight", "%u", profile->cpu_weight);
+    }
+
+    if (profile->cpu_quota) {
+        sysfs_write(path, "cpu.max", "%u %u",
+                profile->cpu_quota * (CPU_MAX_PERIOD / 100), CPU_MAX_PERIOD);
+    } else {
+        sysfs_write(path, "cpu.max", "max %u", CPU_MAX_PERIOD);
+    }
+
+    if (qemu_proc->pinned) {
+        cpu_set_t cpus;
+        vm_cgroup_cpus(qemu_proc, &cpus);
+        if (cpu_list_str(&cpus, val, sizeof(val)) > 0) {
+            sysfs_write(path, "cpuset.cpus", "%s", val);
+        }
+    }
+    /* guest RAM on the nodes of its cores, or anywhere its root allows */
+    if (qemu_proc->numa_nodes && numa_list_str(qemu_proc->numa_nodes, val, sizeof(val)) > 0) {
+        sysfs_write(path, "cpuset.mems", "%s", val);
+    } else if (sysfs_read(virt_conf.cgroup_root, "cpuset.mems.effective", val, sizeof(val)) > 0) {
+        sysfs_write(path, "cpuset.mems", "%s", val);
+    }
+
+    if (profile->mem_overhead) {
+        cgroup_set_mem(path, profile->mem, profile->mem_overhead);
+    }
+
+    if (profile->io_weight) {
+        sysfs_write(path, "io.weight", "default %u", profile->io_weight);
+    }
+
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        logout("cgroup: open %s failed (%s)\n", path, strerror(errno));
+    }
+
+    return fd;
+}
+
+static void cgroup_destroy(int vm_id)
+{
+    char path[PATH_MAX];
+
+    cgroup_path(vm_id, path, sizeof(path));
+    if (rmdir(path) == -1 && errno != ENOENT) {
+        logout("cgroup: remove %s failed (%s)\n", path, strerror(errno));
+    }
+}
+
+static void close_cgroup_fd(int *fd)
+{
+    if (*fd != -1) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+typedef struct net_fds {
+    int nr;
+    bool vhost;
+    int tap[NET_QUEUES_MAX];
+    int vhost_fd[NET_QUEUES_MAX];
+} net_fds_t;
+
+static int net_queues(const qemu_profile_t *profile)
+{
+    uint32_t nr = profile->net_queues ? profile->net_queues : profile->smp;
+
+    if (nr == 0) {
+        return 1;
+    }
+    return nr < NET_QUEUES_MAX ? nr : NET_QUEUES_MAX;
+}
+
+static void net_close(net_fds_t *net)
+{
+    int i;
+
+    for (i = 0; i < net->nr; i++) {
+        close(net->tap[i]);
+        if (net->vhost) {
+            close(net->vhost_fd[i]);
+        }
+    }
+    net->nr = 0;
+    net->vhost = false;
+}
+
+/* Bring the tap up and put it on the bridge, if there is one. */
+static int tap_up(const char *ifname)
+{
+    struct ifreq ifr;
+    int sock, err, ret = -1;
+
+    if (strlen(ifname) >= IFNAMSIZ || (virt_conf.bridge != NULL && strlen(virt_conf.bridge) >= IFNAMSIZ)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, IFNAMSIZ, "%s", ifname);
+    if (ioctl(sock, SIOCGIFFLAGS, &ifr) == -1) {
+        goto out;
+    }
+    ifr.ifr_flags |= IFF_UP;
+    if (ioctl(sock, SIOCSIFFLAGS, &ifr) == -1) {
+        goto out;
+    }
+
+    if (virt_conf.bridge != NULL) {
+        memset(&ifr, 0, sizeof(ifr));
+        snprintf(ifr.ifr_name, IFNAMSIZ, "%s", virt_conf.bridge);
+        ifr.ifr_ifindex = if_nametoindex(ifname);
+        /* EBUSY: a persistent tap that is already a port */
+        if (ioctl(sock, SIOCBRADDIF, &ifr) == -1 && errno != EBUSY) {
+            logout("net: add %s to bridge %s failed (%s)\n", ifname, virt_conf.bridge, strerror(errno));
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    err = errno;
+    close(sock);
+    errno = err;
+    return ret;
+}
+
+/* Open one multiqueue tap fd and one vhost-net fd per queue pair. They stay
+ * close-on-exec so concurrent launches don't inherit them, the child clears
+ * the flag right before exec. Without vhost-net qemu does the datapath itself. */
+static int net_open(qemu_proc_t *qemu_proc, net_fds_t *net)
+{
+    char ifname[IFNAMSIZ];
+    struct ifreq ifr;
+    int i, nr, err;
+
+    snprintf(ifname, sizeof(ifname), TAP_NAME, qemu_proc->vm_id);
+    nr = net_queues(qemu_proc->profile);
+    memset(net, 0, sizeof(*net));
+
+    for (i = 0; i < nr; i++) {
+        net->tap[i] = open(TUN_DEV, O_RDWR | O_CLOEXEC);
+        if (net->tap[i] == -1) {
+            goto fail;
+        }
+        memset(&ifr, 0, sizeof(ifr));
+        ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR | IFF_MULTI_QUEUE;
+        memcpy(ifr.ifr_name, ifname, IFNAMSIZ);
+        if (ioctl(net->tap[i], TUNSETIFF, &ifr) == -1) {
+            err = errno;
+            close(net->tap[i]);
+            errno = err;
+            goto fail;
+        }
+        net->nr++;
+    }
+
+    net->vhost = true;
+    for (i = 0; i < nr; i++) {
+        net->vhost_fd[i] = open(VHOST_NET_DEV, O_RDWR | O_CLOEXEC);
+        if (net->vhost_fd[i] == -1) {
+            logout("net: open %s failed (%s), vm %d runs without vhost\n",
+                    VHOST_NET_DEV, strerror(errno), qemu_proc->vm_id);
+            while (i-- > 0) {
+                close(net->vhost_fd[i]);
+            }
+            net->vhost = false;
+            break;
+        }
+    }
+
+    if (tap_up(ifname) == -1) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    err = errno;
+    logout("net: open tap %s queue %d failed (%s)\n", ifname, net->nr, strerror(err));
+    net_close(net);
+    errno = err;
+    return -1;
+}
+
+static void net_args(qemu_proc_t *qemu_proc, net_fds_t *net, arglist_t *args)
+{
+    char fds[NET_QUEUES_MAX * 12] = "", vhostfds[NET_QUEUES_MAX * 12] = "";
+    int i, pos = 0, vpos = 0;
+
+    for (i = 0; i < net->nr; i++) {
+        pos += snprintf(fds + pos, sizeof(fds) - pos, "%s%d", i ? ":" : "", net->tap[i]);
+        if (net->vhost) {
+            vpos += snprintf(vhostfds + vpos, sizeof(vhostfds) - vpos, "%s%d",
+                    i ? ":" : "", net->vhost_fd[i]);
+        }
+    }
+
+    arg_add(args, "-netdev");
+    if (net->vhost) {
+        arg_add(args, "tap,id=net0,fds=%s,vhost=on,vhostfds=%s", fds, vhostfds);
+    } else {
+        arg_add(args, "tap,id=net0,fds=%s", fds);
+    }
+    net_device_args(qemu_proc, args, net->nr);
+}
+
+/* in the child, hand the fds over to qemu */
+static void net_inherit(net_fds_t *net)
+{
+    int i;
+
+    for (i = 0; i < net->nr; i++) {
+        fcntl(net->tap[i], F_SETFD, 0);
+        if (net->vhost) {
+            fcntl(net->vhost_fd[i], F_SETFD, 0);
+        }
+    }
+}
+
+/* struct clone_args of linux/sched.h, which can't be mixed with glibc sched.h */
+struct qemu_clone_args {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t child_tid;
+    uint64_t parent_tid;
+    uint64_t exit_signal;
+    uint64_t stack;
+    uint64_t stack_size;
+    uint64_t tls;
+    uint64_t set_tid;
+    uint64_t set_tid_size;
+    uint64_t cgroup;
+};
+
+/* Fork the qemu process straight into its cgroup leaf with clone3(CLONE_INTO_CGROUP),
+ * the child never runs outside the limits. Kernels without it (or a cgroup root that
+ * isn't a cgroupfs) fall back to fork() and the child joins the leaf itself before exec. */
+static pid_t fork_into_cgroup(int cgroup_fd, bool *in_cgroup)
+{
+    pid_t pid;
+
+    *in_cgroup = false;
+    if (cgroup_fd == -1) {
+        return fork();
+    }
+
+#ifdef SYS_clone3
+    struct qemu_clone_args args;
+
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_INTO_CGROUP;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = cgroup_fd;
+
+    pid = syscall(SYS_clone3, &args, sizeof(args));
+    if (pid != -1) {
+        *in_cgroup = true;
+        return pid;
+    }
+    logout("cgroup: clone3 into cgroup failed (%s), fall back to fork\n", strerror(errno));
+#endif
+
+    return fork();
+}
+
+/* The worker only reads the vm, what the launch finds out goes here and
+ * launch_done copies it in on the event loop. */
+typedef struct launch_job {
+    qemu_proc_t *qemu_proc;
+    arglist_t args;
+    net_fds_t net;
+    int cgroup_fd;          /* the leaf, open until qemu is forked into it */
+    bool vhost;
+    struct timespec launched;
+    pid_t pid;
+    uint64_t prewarm_hot;
+    uint64_t prewarm_hit;
+    uint64_t prewarm_ns;
+} launch_job_t;
+
+static uint64_t ts_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1000000000ULL + b->tv_nsec - a->tv_nsec;
+}
+
+static void ts_add_ms(struct timespec *ts, int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static uint64_t ts_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static uint64_t trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts_ns(&ts);
+}
+
+/* Start a span, 0 while tracing is off so the matching trace_end() is a no-op. */
+static uint64_t trace_start(void)
+{
+    if (!__atomic_load_n(&tracer.on, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    return trace_now();
+}
+
+static trace_buf_t *trace_buf_new(void)
+{
+    trace_buf_t *buf = calloc(1, sizeof(trace_buf_t));
+
+    if (buf == NULL) {
+        return NULL;
+    }
+    buf->tid = syscall(SYS_gettid);
+    pthread_mutex_init(&buf->lock, NULL);
+
+    pthread_mutex_lock(&tracer.lock);
+    buf->next = tracer.bufs;
+    tracer.bufs = buf;
+    pthread_mutex_unlock(&tracer.lock);
+
+    trace_local = buf;
+    return buf;
+}
+
+static void trace_span(const char *name, int vm_id, uint64_t start, uint64_t end)
+{
+    trace_buf_t *buf = trace_local ? trace_local : trace_buf_new();
+    trace_event_t *ev;
+
+    if (buf == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&buf->lock);
+    ev = &buf->events[buf->count % TRACE_EVENTS];
+    ev->name = name;
+    ev->vm_id = vm_id;
+    ev->start = start;
+    ev->dur = end > start ? end - start : 0;
+    buf->count++;
+    pthread_mutex_unlock(&buf->lock);
+}
+
+static void trace_end(const char *name, int vm_id, uint64_t start)
+{
+    if (start != 0) {
+        trace_span(name, vm_id, start, trace_now());
+    }
+}
+
+static void trace_set(bool on)
+{
+    __atomic_store_n(&tracer.on, on, __ATOMIC_RELAXED);
+    logout("trace %s\n", on ? "on" : "off");
+}
+
+/* Write every buffered span as a Chrome trace ("X" complete events, ts/dur
+ * in microseconds), loadable in chrome://tracing and Perfetto. */
+static int trace_dump(char *path, int size, uint64_t *spans)
+{
+    trace_buf_t *buf, *copy;
+    trace_event_t *ev;
+    uint64_t i, first;
+    bool comma = false;
+    FILE *fp;
+
+    /* a thread's spans are copied out, its lock is never held across stdio */
+    copy = malloc(sizeof(trace_buf_t));
+    if (copy == NULL) {
+        return -ENOMEM;
+    }
+
+    snprintf(path, size, "%s/trace-%ld.json", virt_conf.trace_dir, (long)time(NULL));
+    fp = fopen(path, "we");
+    if (fp == NULL) {
+        free(copy);
+        return -errno;
+    }
+
+    *spans = 0;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    /* buffers are never freed and new ones go in front, the list walks unlocked */
+    pthread_mutex_lock(&tracer.lock);
+    buf = tracer.bufs;
+    pthread_mutex_unlock(&tracer.lock);
+
+    for (; buf != NULL; buf = buf->next) {
+        pthread_mutex_lock(&buf->lock);
+        copy->tid = buf->tid;
+        copy->count = buf->count;
+        memcpy(copy->events, buf->events, sizeof(copy->events));
+        pthread_mutex_unlock(&buf->lock);
+
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", comma ? ",\n" : "", getpid(), copy->tid,
+                copy->tid == getpid() ? "event loop" : "worker");
+        comma = true;
+
+        first = copy->count > TRACE_EVENTS ? copy->count - TRACE_EVENTS : 0;
+        for (i = first; i < copy->count; i++) {
+            ev = &copy->events[i % TRACE_EVENTS];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"virt\",\"ph\":\"X\",\"pid\":%d,"
+                    "\"tid\":%d,\"ts\":%" PRIu64 ".%03" PRIu64 ",\"dur\":%" PRIu64 ".%03" PRIu64,
+                    ev->name, getpid(), copy->tid, ev->start / 1000, ev->start % 1000,
+                    ev->dur / 1000, ev->dur % 1000);
+            if (ev->vm_id >= 0) {
+                fprintf(fp, ",\"args\":{\"vm_id\":%d}", ev->vm_id);
+            }
+            fprintf(fp, "}");
+        }
+        *spans += copy->count - first;
+    }
+    free(copy);
+
+    fprintf(fp, "\n]}\n");
+    if (fclose(fp) == EOF) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+static void trace_init(void)
+{
+    pthread_mutex_init(&tracer.lock, NULL);
+    if (virt_conf.trace) {
+        trace_set(true);
+    }
+}
+
+static job_record_t *job_record(int id)
+{
+    return &job_pool.records[(unsigned int)id % JOB_LOG_SIZE];
+}
+
+static void *job_worker(void *arg)
+{
+    job_t *job;
+    uint64_t one = 1;
+
+    while (1) {
+        pthread_mutex_lock(&job_pool.lock);
+        while (job_pool.count == 0) {
+            pthread_cond_wait(&job_pool.not_empty, &job_pool.lock);
+        }
+        job = job_pool.queue[job_pool.head];
+        job_pool.head = (job_pool.head + 1) % job_pool.size;
+        job_pool.count--;
+        job_record(job->id)->state = JOB_RUNNING;
+        pthread_mutex_unlock(&job_pool.lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &job->start);
+        job->work(job);
+        clock_gettime(CLOCK_MONOTONIC, &job->end);
+
+        if (__atomic_load_n(&tracer.on, __ATOMIC_RELAXED)) {
+            trace_span("queue", -1, ts_ns(&job->submit), ts_ns(&job->start));
+            trace_span(job->name, -1, ts_ns(&job->start), ts_ns(&job->end));
+        }
+
+        pthread_mutex_lock(&job_pool.lock);
+        job->next = NULL;
+        if (job_pool.done_tail) {
+            job_pool.done_tail->next = job;
+        } else {
+            job_pool.done_head = job;
+        }
+        job_pool.done_tail = job;
+        pthread_mutex_unlock(&job_pool.lock);
+
+        /* wake up the event loop */
+        if (write(job_pool.event_fd, &one, sizeof(one)) == -1) {
+            logout("job: notify event loop failed (%s)\n", strerror(errno));
+        }
+    }
+
+    return NULL;
+}
+
+static void job_pool_init(void)
+{
+    int i;
+
+    pthread_mutex_init(&job_pool.lock, NULL);
+    pthread_cond_init(&job_pool.not_empty, NULL);
+
+    job_pool.size = virt_conf.job_queue;
+    job_pool.queue = calloc(job_pool.size, sizeof(job_t *));
+    job_pool.nr_workers = virt_conf.workers;
+    job_pool.workers = calloc(job_pool.nr_workers, sizeof(pthread_t));
+    if (job_pool.queue == NULL || job_pool.workers == NULL) {
+        ERR_EXIT("Error: malloc job pool error\n");
+    }
+
+    job_pool.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (job_pool.event_fd == -1) {
+        ERR_EXIT("Error: eventfd error\n");
+    }
+
+    for (i = 0; i < job_pool.nr_workers; i++) {
+        if (pthread_create(&job_pool.workers[i], NULL, job_worker, NULL) != 0) {
+            ERR_EXIT("Error: create worker thread error\n");
+        }
+    }
+
+    logout("job pool: %d workers, queue depth %d\n", job_pool.nr_workers, job_pool.size);
+}
+
+static job_t *job_new(const char *name, job_fn work, job_fn done, void *data)
+{
+    job_t *job = calloc(1, sizeof(job_t));
+    if (job == NULL) {
+        logout("malloc job error (%s)\n", strerror(errno));
+        return NULL;
+    }
+
+    /* ids stay positive, -1 is a refusal on the wire */
+    job_pool.next_id = job_pool.next_id == INT_MAX ? 1 : job_pool.next_id + 1;
+    job->id = job_pool.next_id;
+    job->name = name;
+    job->work = work;
+    job->done = done;
+    job->data = data;
+    job->qmp_vm = -1;
+
+    pthread_mutex_lock(&job_pool.lock);
+    job_record(job->id)->id = job->id;
+    job_record(job->id)->state = JOB_QUEUED;
+    job_record(job->id)->result = 0;
+    pthread_mutex_unlock(&job_pool.lock);
+
+    return job;
+}
+
+/* Drop a job that was never submitted, its record keeps the result. */
+static void job_cancel(job_t *job, int result)
+{
+    pthread_mutex_lock(&job_pool.lock);
+    job_record(job->id)->state = result < 0 ? JOB_FAILED : JOB_DONE;
+    job_record(job->id)->result = result;
+    pthread_mutex_unlock(&job_pool.lock);
+
+    free(job->data);
+    free(job);
+}
+
+/* Queue the job, -1 if the queue is full. The caller still owns a rejected job. */
+static int job_submit(job_t *job)
+{
+    int depth;
+
+    clock_gettime(CLOCK_MONOTONIC, &job->submit);
+
+    pthread_mutex_lock(&job_pool.lock);
+    if (job_pool.count == job_pool.size) {
+        job_record(job->id)->state = JOB_FAILED;
+        job_record(job->id)->result = -EBUSY;
+        pthread_mutex_unlock(&job_pool.lock);
+        job_pool.rejected++;
+        logout("job %d (%s) rejected, queue is full\n", job->id, job->name);
+        return -1;
+    }
+    job_pool.queue[(job_pool.head + job_pool.count) % job_pool.size] = job;
+    depth = ++job_pool.count;
+    pthread_cond_signal(&job_pool.not_empty);
+    pthread_mutex_unlock(&job_pool.lock);
+
+    job_pool.submitted++;
+    if (depth > job_pool.max_depth) {
+        job_pool.max_depth = depth;
+    }
+
+    return 0;
+}
+
+/* A vm's QMP monitor takes one client at a time, a second connection waits for
+ * the first to close. Jobs that talk to it go to the pool one at a time per vm,
+ * the others wait here in submit order. Event loop only. */
+typedef struct qmp_chain {
+    bool busy;              /* a job of the vm is in the pool */
+    job_t *head;
+    job_t *tail;
+} qmp_chain_t;
+
+static qmp_chain_t qmp_chains[MAX_VM_NUM];
+
+/* job_submit for a job whose work() uses the vm's QMP monitor. A job that has
+ * to wait is accepted, it is submitted when the one before it is done. */
+static int job_submit_qmp(job_t *job, int vm_id)
+{
+    qmp_chain_t *chain = &qmp_chains[vm_id];
+
+    job->qmp_vm = vm_id;
+    if (!chain->busy) {
+        if (job_submit(job) == -1) {
+            return -1;
+        }
+        chain->busy = true;
+        return 0;
+    }
+
+    job->next = NULL;
+    if (chain->tail) {
+        chain->tail->next = job;
+    } else {
+        chain->head = job;
+    }
+    chain->tail = job;
+
+    return 0;
+}
+
+/* Hand the vm's monitor to the next waiting job. One the pool rejects still
+ * gets its done(), whoever submitted it counts on that. */
+static void qmp_chain_next(int vm_id)
+{
+    qmp_chain_t *chain = &qmp_chains[vm_id];
+    job_t *job;
+
+    chain->busy = false;
+    /* a done() may submit to the vm again */
+    while (!chain->busy && chain->head != NULL) {
+        job = chain->head;
+        chain->head = job->next;
+        if (chain->head == NULL) {
+            chain->tail = NULL;
+        }
+        if (job_submit(job) == 0) {
+            chain->busy = true;
+            break;
+        }
+        job->result = -EBUSY;
+        if (job->done) {
+            job->done(job);
+        }
+        free(job);
+    }
+}
+
+/* Completion events, called from the event loop when the eventfd is readable. */
+static void job_complete_events(void)
+{
+    job_t *job, *next;
+    uint64_t val, wait_ns, run_ns;
+
+    if (read(job_pool.event_fd, &val, sizeof(val)) == -1 && errno != EAGAIN) {
+        logout("job: read eventfd failed (%s)\n", strerror(errno));
+    }
+
+    pthread_mutex_lock(&job_pool.lock);
+    job = job_pool.done_head;
+    job_pool.done_head = job_pool.done_tail = NULL;
+    for (next = job; next != NULL; next = next->next) {
+        job_record(next->id)->state = next->result < 0 ? JOB_FAILED : JOB_DONE;
+        job_record(next->id)->result = next->result;
+    }
+    pthread_mutex_unlock(&job_pool.lock);
+
+    for (; job != NULL; job = next) {
+        next = job->next;
+
+        wait_ns = ts_diff_ns(&job->submit, &job->start);
+        run_ns = ts_diff_ns(&job->start, &job->end);
+        job_pool.completed++;
+        job_pool.wait_ns += wait_ns;
+        job_pool.run_ns += run_ns;
+        if (wait_ns > job_pool.max_wait_ns) {
+            job_pool.max_wait_ns = wait_ns;
+        }
+        if (run_ns > job_pool.max_run_ns) {
+            job_pool.max_run_ns = run_ns;
+        }
+        if (job->result < 0) {
+            job_pool.failed++;
+        }
+
+        logout("job %d (%s) %s in %" PRIu64 " us\n", job->id, job->name,
+                job->result < 0 ? "failed" : "done", (wait_ns + run_ns) / 1000);
+
+        if (job->done) {
+            job->done(job);
+        }
+        if (job->qmp_vm != -1) {
+            qmp_chain_next(job->qmp_vm);
+        }
+        free(job);
+    }
+}
+
+static qemu_proc_t *find_qemu_proc(int vm_id)
+{
+    qemu_proc_t *item;
+
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->vm_id == vm_id) {
+            return item;
+        }
+    }
+
+    return NULL;
+}
+
+static void unlink_qemu_proc(qemu_proc_t *qemu_proc)
+{
+    qemu_proc_t **item;
+
+    for (item = &virt_server.qemu_head; *item != NULL; item = &(*item)->next) {
+        if (*item == qemu_proc) {
+            *item = qemu_proc->next;
+            return;
+        }
+    }
+}
+
+static void sched_kick_pending(void);
+static void boot_kick(void);
+static void periodic_sleep(void (*fn)(void));
+static void periodic_wake(void (*fn)(void));
+static void startup_probe(void);
+static void ready_probe(void);
+static void ready_vm_gone(qemu_proc_t *qemu_proc);
+static void io_launch(qemu_proc_t *qemu_proc);
+
+/* Forget the vm and give its capacity to whoever is waiting for it. */
+static void release_qemu_proc(qemu_proc_t *qemu_proc)
+{
+    bool admitted = qemu_proc->admitted;
+
+    if (qemu_proc->probe_fd != -1) {
+        close(qemu_proc->probe_fd);
+    }
+    ready_vm_gone(qemu_proc);
+    sched_release(qemu_proc);
+    unlink_qemu_proc(qemu_proc);
+    free(qemu_proc);
+
+    if (admitted) {
+        sched_kick_pending();
+    }
+    if (virt_conf.boot_max > 0) {
+        boot_kick();
+    }
+}
+
+static void image_path(int vm_id, char *path, int size)
+{
+    snprintf(path, size, "%s/vm-%03d", virt_conf.image_dir, vm_id);
+}
+
+/* The overlay of a vm is its own and stays cache=none. Prewarmed backing
+ * files must go through the page cache, or reading them ahead is for nothing. */
+static void drive_args(qemu_proc_t *qemu_proc, arglist_t *args, bool backing_cached)
+{
+    const io_limits_t *io = &qemu_proc->io;
+    char path[PATH_MAX];
+    char throttle[512] = "";
+    int pos = 0;
+
+    if (io->iops) {
+        pos += snprintf(throttle + pos, sizeof(throttle) - pos, ",throttling.iops-total=%u", io->iops);
+    }
+    if (io->iops_burst) {
+        pos += snprintf(throttle + pos, sizeof(throttle) - pos,
+                ",throttling.iops-total-max=%u,throttling.iops-total-max-length=%u",
+                io->iops_burst, io->burst);
+    }
+    if (io->mbps) {
+        pos += snprintf(throttle + pos, sizeof(throttle) - pos, ",throttling.bps-total=%" PRIu64,
+                (uint64_t)io->mbps << 20);
+    }
+    if (io->mbps_burst) {
+        snprintf(throttle + pos, sizeof(throttle) - pos,
+                ",throttling.bps-total-max=%" PRIu64 ",throttling.bps-total-max-length=%u",
+                (uint64_t)io->mbps_burst << 20, io->burst);
+    }
+
+    image_path(qemu_proc->vm_id, path, sizeof(path));
+    arg_add(args, "-drive");
+    arg_add(args, "file=%s,if=none,id=drive-virtio-disk0-0-0,format=qcow2,cache=none%s%s", path,
+            backing_cached ? ",backing.cache.direct=off" : "", throttle);
+}
+
+/* A guest node per host node the vm spans, each with the vCPUs and RAM the vm
+ * has there; its RAM is bound to that host node alone. */
+static void numa_args(qemu_proc_t *qemu_proc, arglist_t *args)
+{
+    uint32_t vcpus[MAX_NUMA_NODES], mem[MAX_NUMA_NODES];
+    int node[MAX_NUMA_NODES];
+    uint32_t first = 0;
+    int g, nr;
+
+    if (!qemu_proc->numa_guest) {
+        return;
+    }
+
+    nr = numa_split(qemu_proc, qemu_proc->smp, vcpus, node);
+    numa_split(qemu_proc, qemu_proc->mem, mem, node);
+    for (g = 0; g < nr; g++) {
+        arg_add(args, "-object");
+        arg_add(args, "memory-backend-ram,id=ram-node%d,size=%uM,host-nodes=%d,policy=bind",
+                g, mem[g], node[g]);
+        arg_add(args, "-numa");
+        arg_add(args, "node,nodeid=%d,cpus=%u-%u,memdev=ram-node%d", g, first, first + vcpus[g] - 1, g);
+        first += vcpus[g];
+    }
+}
+
+/* Backing files below a qcow2 image, nearest first. A relative name is relative
+ * to the image naming it. Returns how many were found. */
+static int backing_chain(const char *image, char chain[][PATH_MAX], int max)
+{
+    const char *cur = image, *slash;
+    char name[PATH_MAX];
+    uint8_t hdr[20];
+    uint32_t magic, len;
+    uint64_t off;
+    int fd, n = 0;
+
+    while (n < max) {
+        fd = open(cur, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            break;
+        }
+        if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+            close(fd);
+            break;
+        }
+        memcpy(&magic, hdr, sizeof(magic));
+        memcpy(&off, hdr + 8, sizeof(off));
+        memcpy(&len, hdr + 16, sizeof(len));
+        off = be64toh(off);
+        len = be32toh(len);
+        if (be32toh(magic) != QCOW2_MAGIC || off == 0 || len == 0 || len >= sizeof(name) ||
+                pread(fd, name, len, off) != len) {
+            close(fd);
+            break;
+        }
+        close(fd);
+        name[len] = '\0';
+
+        /* json: and protocol specs are no files we could read ahead */
+        if (strchr(name, ':')) {
+            break;
+        }
+        slash = strrchr(cur, '/');
+        if (name[0] == '/' || slash == NULL) {
+            snprintf(chain[n], PATH_MAX, "%s", name);
+        } else if (snprintf(chain[n], PATH_MAX, "%.*s/%s", (int)(slash - cur), cur, name) >= PATH_MAX) {
+            break;
+        }
+        cur = chain[n++];
+    }
+
+    return n;
+}
+
+static uint64_t hot_chunk_len(hot_image_t *img, uint32_t chunk)
+{
+    uint64_t off = (uint64_t)chunk * HOT_CHUNK;
+
+    return img->size - off < HOT_CHUNK ? img->size - off : HOT_CHUNK;
+}
+
+/* Page cache residency of the chunks [first, first + nr), one byte per page. */
+static int hot_mincore(hot_image_t *img, uint32_t first, uint32_t nr, unsigned char *vec)
+{
+    uint64_t off = (uint64_t)first * HOT_CHUNK;
+    uint64_t len = (uint64_t)nr * HOT_CHUNK;
+
+    if (off + len > img->size) {
+        len = img->size - off;
+    }
+
+    return mincore(img->map + off, len, vec);
+}
+
+/* "hot <chunk size> <image size>", then "<chunk> <counter>" for every hot chunk */
+static void hot_load(hot_image_t *img)
+{
+    char path[PATH_MAX + 8];
+    unsigned long size;
+    unsigned chunk_size, chunk, hits;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s.hot", img->path);
+    fp = fopen(path, "re");
+    if (fp == NULL) {
+        return;
+    }
+
+    /* learnt on another image, or with another chunk size */
+    if (fscanf(fp, "hot %u %lu", &chunk_size, &size) == 2 &&
+            chunk_size == HOT_CHUNK && size == img->size) {
+        while (fscanf(fp, "%u %u", &chunk, &hits) == 2) {
+            if (chunk < img->nr_chunks) {
+                img->hits[chunk] = hits;
+            }
+        }
+    }
+    fclose(fp);
+}
+
+static void hot_save(hot_image_t *img)
+{
+    char path[PATH_MAX + 8], tmp[PATH_MAX + 16];
+    uint32_t i;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s.hot", img->path);
+    snprintf(tmp, sizeof(tmp), "%s.hot.tmp", img->path);
+    fp = fopen(tmp, "we");
+    if (fp == NULL) {
+        logout("prewarm: can't save %s (%s)\n", path, strerror(errno));
+        return;
+    }
+
+    fprintf(fp, "hot %u %" PRIu64 "\n", HOT_CHUNK, img->size);
+    for (i = 0; i < img->nr_chunks; i++) {
+        if (img->hits[i]) {
+            fprintf(fp, "%u %u\n", i, img->hits[i]);
+        }
+    }
+    if (fclose(fp) != 0 || rename(tmp, path) == -1) {
+        logout("prewarm: can't save %s (%s)\n", path, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+static void hot_unlock(hot_image_t *img)
+{
+    if (img->locked) {
+        munlock(img->map, img->size);
+        prewarm_ctl.locked -= img->locked;
+        img->locked = 0;
+    }
+    img->locked_gen = 0;
+}
+
+/* The hotness of an image, found by inode so every path to it shares one.
+ * An image that changed size was rewritten and starts cold. Call with the lock. */
+static hot_image_t *hot_find(const char *path, int fd)
+{
+    hot_image_t *img;
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        return NULL;
+    }
+
+    for (img = prewarm_ctl.images; img != NULL; img = img->next) {
+        if (img->dev == st.st_dev && img->ino == st.st_ino) {
+            break;
+        }
+    }
+
+    if (img != NULL && img->size == st.st_size) {
+        return img;
+    }
+
+    if (img == NULL) {
+        img = calloc(1, sizeof(hot_image_t));
+        if (img == NULL) {
+            return NULL;
+        }
+        img->dev = st.st_dev;
+        img->ino = st.st_ino;
+        img->next = prewarm_ctl.images;
+        prewarm_ctl.images = img;
+    } else {
+        hot_unlock(img);
+        munmap(img->map, img->size);
+        free(img->hits);
+        free(img->warm);
+    }
+
+    snprintf(img->path, sizeof(img->path), "%s", path);
+    img->size = st.st_size;
+    img->nr_chunks = (img->size + HOT_CHUNK - 1) / HOT_CHUNK;
+    img->hits = calloc(img->nr_chunks, 1);
+    img->warm = calloc(img->nr_chunks, 1);
+    img->map = mmap(NULL, img->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (img->hits == NULL || img->warm == NULL || img->map == MAP_FAILED) {
+        logout("prewarm: can't track %s (%s)\n", path, strerror(errno));
+        free(img->hits);
+        free(img->warm);
+        img->hits = NULL;
+        img->warm = NULL;
+        img->map = NULL;
+        img->size = 0;
+        img->nr_chunks = 0;
+        return NULL;
+    }
+    hot_load(img);
+
+    return img;
+}
+
+static void hot_read(int fd, uint64_t off, uint64_t len)
+{
+    uint64_t step;
+
+    for (; len; off += step, len -= step) {
+        step = len < HOT_RA_STEP ? len : HOT_RA_STEP;
+        if (readahead(fd, off, step) == -1) {
+            posix_fadvise(fd, off, step, POSIX_FADV_WILLNEED);
+        }
+    }
+}
+
+/* Read the hot chunks that are not cached yet in file order, and count what
+ * was cached already into the vm's hit rate. Whatever is cached now is marked
+ * warm, the next learn can't credit it to a guest. */
+static void hot_readahead(hot_image_t *img, int fd, launch_job_t *launch)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uint32_t per_chunk = HOT_CHUNK / page;
+    unsigned char *vec = malloc(HOT_WINDOW * per_chunk);
+    uint64_t len;
+    uint32_t w, n, c, p, pages, cached;
+
+    if (vec == NULL) {
+        return;
+    }
+
+    for (w = 0; w < img->nr_chunks; w += HOT_WINDOW) {
+        n = img->nr_chunks - w < HOT_WINDOW ? img->nr_chunks - w : HOT_WINDOW;
+        if (hot_mincore(img, w, n, vec) == -1) {
+            break;
+        }
+        for (c = 0; c < n; c++) {
+            len = hot_chunk_len(img, w + c);
+            pages = (len + page - 1) / page;
+            for (p = cached = 0; p < pages; p++) {
+                cached += vec[c * per_chunk + p] & 1;
+            }
+            if (cached || img->hits[w + c]) {
+                img->warm[w + c] = 1;
+            }
+            if (img->hits[w + c] == 0) {
+                continue;
+            }
+            launch->prewarm_hot += len;
+            launch->prewarm_hit += len * cached / pages;
+            if (cached < pages) {
+                hot_read(fd, (uint64_t)(w + c) * HOT_CHUNK, len);
+            }
+        }
+    }
+
+    free(vec);
+}
+
+static int hot_cmp(const void *a, const void *b, void *arg)
+{
+    hot_image_t *img = arg;
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    if (img->hits[x] != img->hits[y]) {
+        return img->hits[y] - img->hits[x];
+    }
+    return x < y ? -1 : x > y;
+}
+
+/* Keep the hottest chunks resident while VIRT_PREWARM_LOCK allows, first come
+ * first served between images. Redone whenever the image learnt something. */
+static void hot_lock(hot_image_t *img)
+{
+    uint64_t budget, len;
+    uint32_t *order, i, n = 0;
+
+    if (img->locked_gen == img->gen + 1) {
+        return;
+    }
+    hot_unlock(img);
+
+    order = malloc(img->nr_chunks * sizeof(uint32_t));
+    if (order == NULL) {
+        return;
+    }
+    for (i = 0; i < img->nr_chunks; i++) {
+        if (img->hits[i]) {
+            order[n++] = i;
+        }
+    }
+    qsort_r(order, n, sizeof(uint32_t), hot_cmp, img);
+
+    budget = ((uint64_t)virt_conf.prewarm_lock << 20) - prewarm_ctl.locked;
+    for (i = 0; i < n; i++) {
+        len = hot_chunk_len(img, order[i]);
+        if (len > budget) {
+            break;
+        }
+        if (mlock(img->map + (uint64_t)order[i] * HOT_CHUNK, len) == -1) {
+            if (prewarm_ctl.lock_failed++ == 0) {
+                logout("prewarm: mlock failed (%s), raise RLIMIT_MEMLOCK\n", strerror(errno));
+            }
+            break;
+        }
+        img->locked += len;
+        budget -= len;
+    }
+    prewarm_ctl.locked += img->locked;
+    img->locked_gen = img->gen + 1;
+    free(order);
+}
+
+/* Launch stage, before fork: read the hot ranges of the vm's backing images
+ * into the page cache so a boot storm reads every shared block once and in
+ * order, instead of each guest faulting it in at random. Returns whether the
+ * backing files are to be opened through the page cache: when something was
+ * prewarmed, or an image still has to learn from a boot. */
+static bool prewarm(launch_job_t *launch)
+{
+    char image[PATH_MAX], chain[HOT_CHAIN_MAX][PATH_MAX];
+    struct timespec start, end;
+    hot_image_t *img;
+    bool unlearnt = false;
+    int i, n, fd;
+
+    if (!virt_conf.prewarm) {
+        return false;
+    }
+    image_path(launch->qemu_proc->vm_id, image, sizeof(image));
+    n = backing_chain(image, chain, HOT_CHAIN_MAX);
+    if (n == 0) {
+        return false;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    /* one worker at a time, the ones behind find it all cached */
+    pthread_mutex_lock(&prewarm_ctl.lock);
+    for (i = 0; i < n; i++) {
+        fd = open(chain[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        img = hot_find(chain[i], fd);
+        if (img != NULL) {
+            unlearnt |= img->gen == 0;
+            hot_readahead(img, fd, launch);
+            if (virt_conf.prewarm_lock) {
+                hot_lock(img);
+            }
+        }
+        close(fd);
+    }
+    pthread_mutex_unlock(&prewarm_ctl.lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    launch->prewarm_ns = ts_diff_ns(&start, &end);
+
+    return launch->prewarm_hot > 0 || unlearnt;
+}
+
+/* What the guest read while booting is still in the page cache when it is
+ * ready: shift one learn into every counter of the image. Warm chunks only
+ * learn that they were evicted; chunks nobody needs anymore age out after
+ * eight learns once the kernel dropped them. */
+static void hot_learn(hot_image_t *img)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uint32_t per_chunk = HOT_CHUNK / page;
+    unsigned char *vec = malloc(HOT_WINDOW * per_chunk);
+    uint32_t w, n, c, p, pages;
+    bool cached;
+
+    if (vec == NULL) {
+        return;
+    }
+
+    for (w = 0; w < img->nr_chunks; w += HOT_WINDOW) {
+        n = img->nr_chunks - w < HOT_WINDOW ? img->nr_chunks - w : HOT_WINDOW;
+        if (hot_mincore(img, w, n, vec) == -1) {
+            break;
+        }
+        for (c = 0; c < n; c++) {
+            pages = (hot_chunk_len(img, w + c) + page - 1) / page;
+            for (p = 0, cached = false; p < pages && !cached; p++) {
+                cached = vec[c * per_chunk + p] & 1;
+            }
+            if (img->warm[w + c] && cached) {
+                continue;
+            }
+            img->hits[w + c] = (img->hits[w + c] >> 1) | (cached ? 0x80 : 0);
+        }
+    }
+    memset(img->warm, 0, img->nr_chunks);
+    free(vec);
+}
+
+static void learn_work(job_t *job)
+{
+    char image[PATH_MAX], chain[HOT_CHAIN_MAX][PATH_MAX];
+    struct timespec now;
+    hot_image_t *img;
+    int i, n, fd;
+
+    image_path(*(int *)job->data, image, sizeof(image));
+    n = backing_chain(image, chain, HOT_CHAIN_MAX);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&prewarm_ctl.lock);
+    for (i = 0; i < n; i++) {
+        fd = open(chain[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        img = hot_find(chain[i], fd);
+        close(fd);
+        /* a boot storm would age every counter out at once */
+        if (img == NULL || (img->gen &&
+                ts_diff_ns(&img->learned, &now) < HOT_LEARN_INTERVAL * 1000000000ULL)) {
+            continue;
+        }
+        hot_learn(img);
+        hot_save(img);
+        img->gen++;
+        img->learned = now;
+        prewarm_ctl.learns++;
+    }
+    pthread_mutex_unlock(&prewarm_ctl.lock);
+}
+
+static void learn_done(job_t *job)
+{
+    free(job->data);
+}
+
+static void prewarm_learn(qemu_proc_t *qemu_proc)
+{
+    int *data = malloc(sizeof(int));
+    job_t *job = data ? job_new("learn", learn_work, learn_done, data) : NULL;
+
+    if (job == NULL) {
+        free(data);
+        return;
+    }
+
+    *data = qemu_proc->vm_id;
+    if (job_submit(job) == -1) {
+        job_cancel(job, -EBUSY);
+    }
+}
+
+/* event loop side of the launch stage */
+static void prewarm_record(qemu_proc_t *qemu_proc)
+{
+    profile_stats_t *stats = &profile_stats[qemu_proc->profile - qemu_profiles];
+
+    if (qemu_proc->prewarm_hot == 0) {
+        return;
+    }
+
+    stats->prewarmed++;
+    stats->prewarm_hot += qemu_proc->prewarm_hot;
+    stats->prewarm_hit += qemu_proc->prewarm_hit;
+    stats->prewarm_ns += qemu_proc->prewarm_ns;
+    logout("vm %d prewarm: hot %" PRIu64 " MB, %" PRIu64 "%% cached, %" PRIu64 " ms\n", qemu_proc->vm_id,
+            qemu_proc->prewarm_hot >> 20, qemu_proc->prewarm_hit * 100 / qemu_proc->prewarm_hot,
+            qemu_proc->prewarm_ns / 1000000);
+}
+
+static void prewarm_init(void)
+{
+    pthread_mutex_init(&prewarm_ctl.lock, NULL);
+}
+
+typedef struct kill_job {
+    int vm_id;
+    pid_t pid;
+    qemu_proc_t *qemu_proc;     /* released once qemu is gone */
+} kill_job_t;
+
+static void launch_work(job_t *job)
+{
+    launch_job_t *launch = job->data;
+    qemu_proc_t *qemu_proc = launch->qemu_proc;
+    int vm_id = qemu_proc->vm_id;
+    char procs[PATH_MAX];
+    bool in_cgroup;
+    int pipefd[2];
+    int err, fd;
+    uint64_t t;
+
+    t = trace_start();
+    launch->cgroup_fd = cgroup_create(qemu_proc);
+    trace_end("cgroup", vm_id, t);
+
+    if (qemu_proc->profile->net == NET_TAP) {
+        t = trace_start();
+        err = net_open(qemu_proc, &launch->net);
+        trace_end("net", vm_id, t);
+        if (err == -1) {
+            job->result = -errno;
+            close_cgroup_fd(&launch->cgroup_fd);
+            cgroup_destroy(qemu_proc->vm_id);
+            return;
+        }
+        net_args(qemu_proc, &launch->net, &launch->args);
+        launch->vhost = launch->net.vhost;
+    }
+
+    t = trace_start();
+    drive_args(qemu_proc, &launch->args, prewarm(launch));
+    trace_end("prewarm", vm_id, t);
+    numa_args(qemu_proc, &launch->args);
+
+    /* the close-on-exec pipe reports whether execv() worked */
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        job->result = -errno;
+        net_close(&launch->net);
+        close_cgroup_fd(&launch->cgroup_fd);
+        cgroup_destroy(qemu_proc->vm_id);
+        return;
+    }
+
+    /* the child of a threaded process may only make async-signal-safe calls */
+    cgroup_path(vm_id, procs, sizeof(procs));
+    strncat(procs, "/cgroup.procs", sizeof(procs) - strlen(procs) - 1);
+
+    t = trace_start();
+    clock_gettime(CLOCK_MONOTONIC, &launch->launched);
+    pid_t pid = fork_into_cgroup(launch->cgroup_fd, &in_cgroup);
+
+    switch (pid) {
+        case -1: // error
+            job->result = -errno;
+            logout("Error: fork error (%s)\n", strerror(errno));
+            close(pipefd[0]);
+            close(pipefd[1]);
+            net_close(&launch->net);
+            close_cgroup_fd(&launch->cgroup_fd);
+            cgroup_destroy(qemu_proc->vm_id);
+            return;
+        case 0:  // sub-process
+            close(pipefd[0]);
+            if (!in_cgroup && launch->cgroup_fd != -1) {
+                fd = open(procs, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (fd != -1) {
+                    if (write(fd, "0", 1) == -1) {
+                        /* it runs outside its leaf, nothing to report it with */
+                    }
+                    close(fd);
+                }
+            }
+            net_inherit(&launch->net);
+            if (launch->cgroup_fd == -1 && qemu_proc->numa_nodes) {
+                /* no cpuset.mems to bind it, the policy survives exec */
+                unsigned long nodes = qemu_proc->numa_nodes;
+                syscall(SYS_set_mempolicy, MPOL_BIND, &nodes, MAX_NUMA_NODES + 1);
+            }
+            if (qemu_proc->profile->realtime) {
+                /* -overcommit mem-lock=on locks all guest RAM */
+                struct rlimit unlimited = { RLIM_INFINITY, RLIM_INFINITY };
+                setrlimit(RLIMIT_MEMLOCK, &unlimited);
+            }
+            execv(QEMU_BIN, launch->args.argv);
+            err = errno;
+            if (write(pipefd[1], &err, sizeof(err)) == -1) {
+                /* nothing to do, the parent sees EOF */
+            }
+            _exit(EXIT_FAILURE);
+        default: // parent-process
+            trace_end("fork", vm_id, t);
+            t = trace_start();
+            close(pipefd[1]);
+            net_close(&launch->net);
+            close_cgroup_fd(&launch->cgroup_fd);
+            break;
+    }
+
+    if (read(pipefd[0], &err, sizeof(err)) == sizeof(err)) {
+        logout("Error: execute Qemu error (%s).\n", strerror(err));
+        close(pipefd[0]);
+        waitpid(pid, NULL, 0);
+        cgroup_destroy(qemu_proc->vm_id);
+        job->result = -err;
+        return;
+    }
+    close(pipefd[0]);
+    /* until the pipe closed on exec */
+    trace_end("exec", vm_id, t);
+
+    launch->pid = pid;
+    t = trace_start();
+    set_cpu_affinity(qemu_proc, pid);
+    trace_end("affinity", vm_id, t);
+    logout("Launch Qemu, pid is %d\n", pid);
+}
+
+/* Read one QMP message (a JSON object on its own line), skipping async events. */
+static int qmp_read(int fd, char *reply, int size)
+{
+    int pos, ret;
+
+    while (1) {
+        for (pos = 0; pos < size - 1; pos++) {
+            ret = read(fd, reply + pos, 1);
+            if (ret <= 0) {
+                return -EIO;
+            }
+            if (reply[pos] == '\n') {
+                break;
+            }
+        }
+        reply[pos] = '\0';
+        if (strstr(reply, "\"event\"") == NULL) {
+            return strstr(reply, "\"error\"") ? -EIO : 0;
+        }
+    }
+}
+
+static void qmp_addr(int vm_id, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/vm-%03d.qmp", virt_conf.qmp_dir, vm_id);
+}
+
+/* Connect to the vm's QMP monitor and leave capabilities negotiation, -errno on error. */
+static int qmp_open(int vm_id)
+{
+    struct sockaddr_un addr;
+    struct timeval tv = { .tv_sec = QMP_TIMEOUT, .tv_usec = 0 };
+    char reply[1024];
+    const char *caps = "{\"execute\":\"qmp_capabilities\"}\n";
+    int fd, ret;
+
+    fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -errno;
+    }
+
+    qmp_addr(vm_id, &addr);
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    /* greeting, then the answer to qmp_capabilities */
+    if (qmp_read(fd, reply, sizeof(reply)) < 0 ||
+            write(fd, caps, strlen(caps)) == -1 ||
+            qmp_read(fd, reply, sizeof(reply)) < 0) {
+        close(fd);
+        return -EIO;
+    }
+
+    return fd;
+}
+
+static int qmp_execute(int fd, const char *cmd, char *reply, int size)
+{
+    if (write(fd, cmd, strlen(cmd)) == -1 || write(fd, "\n", 1) == -1) {
+        return -errno;
+    }
+
+    return qmp_read(fd, reply, size);
+}
+
+/* One-shot QMP command, blocking: only call it from the work() of a job
+ * submitted with job_submit_qmp(). */
+static int qmp_command(int vm_id, const char *cmd, char *reply, int size)
+{
+    char buf[1024];
+    int fd, ret;
+
+    fd = qmp_open(vm_id);
+    if (fd < 0) {
+        return fd;
+    }
+
+    if (reply == NULL) {
+        reply = buf;
+        size = sizeof(buf);
+    }
+    ret = qmp_execute(fd, cmd, reply, size);
+    close(fd);
+
+    if (ret < 0) {
+        logout("qmp: vm %d '%s' failed: %s\n", vm_id, cmd, reply);
+    }
+
+    return ret;
+}
+
+/* Pressure stall "some" and "full" avg10 of a resource under VIRT_PSI_DIR. */
+static int read_psi(const char *resource, double *some, double *full)
+{
+    char path[PATH_MAX];
+    char line[256];
+    double avg10;
+    FILE *fp;
+
+    *some = *full = 0;
+    snprintf(path, sizeof(path), "%s/%s", virt_conf.psi_dir, resource);
+    fp = fopen(path, "re");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "some avg10=%lf", &avg10) == 1) {
+            *some = avg10;
+        } else if (sscanf(line, "full avg10=%lf", &avg10) == 1) {
+            *full = avg10;
+        }
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+/* Resident set of a process in MB, 0 if it can't be read. */
+static uint32_t read_rss(pid_t pid)
+{
+    char path[PATH_MAX];
+    char line[256];
+    long rss_kb = 0;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%d/status", virt_conf.proc_root, pid);
+    fp = fopen(path, "re");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "VmRSS: %ld", &rss_kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+
+    return rss_kb >> 10;
+}
+
+static void kill_work(job_t *job)
+{
+    kill_job_t *kill_job = job->data;
+    uint64_t t = trace_start();
+
+    if (kill(kill_job->pid, SIGKILL) == -1) {
+        job->result = -errno;
+    }
+    /* the leaf can only be removed once qemu is gone */
+    waitpid(kill_job->pid, NULL, 0);
+    trace_end("kill", kill_job->vm_id, t);
+
+    t = trace_start();
+    cgroup_destroy(kill_job->vm_id);
+    trace_end("cgroup destroy", kill_job->vm_id, t);
+}
+
+static void kill_done(job_t *job)
+{
+    kill_job_t *kill_job = job->data;
+
+    if (kill_job->qemu_proc) {
+        release_qemu_proc(kill_job->qemu_proc);
+    }
+    free(kill_job);
+}
+
+static void launch_done(job_t *job)
+{
+    launch_job_t *launch = job->data;
+    qemu_proc_t *qemu_proc = launch->qemu_proc;
+    job_t *kill_job = qemu_proc->kill_job;
+
+    qemu_proc->pid = launch->pid;
+    qemu_proc->launched = launch->launched;
+    qemu_proc->vhost = launch->vhost;
+    qemu_proc->prewarm_hot = launch->prewarm_hot;
+    qemu_proc->prewarm_hit = launch->prewarm_hit;
+    qemu_proc->prewarm_ns = launch->prewarm_ns;
+    arg_free(&launch->args);
+    free(launch);
+
+    if (job->result < 0) {
+        logout("launch qemu %d failed (%s)\n", qemu_proc->vm_id, strerror(-job->result));
+        if (kill_job) {
+            job_cancel(kill_job, 0);
+        }
+        release_qemu_proc(qemu_proc);
+        return;
+    }
+
+    qemu_proc->state = QEMU_RUNNING;
+    periodic_wake(startup_probe);
+    periodic_wake(ready_probe);
+    prewarm_record(qemu_proc);
+
+    if (kill_job) {
+        ((kill_job_t *)kill_job->data)->pid = qemu_proc->pid;
+        ((kill_job_t *)kill_job->data)->qemu_proc = qemu_proc;
+        if (job_submit(kill_job) == -1) {
+            /* still tracked, a later kill can retry */
+            logout("vm %d keeps running, its kill was refused\n", qemu_proc->vm_id);
+            qemu_proc->kill_job = NULL;
+            job_cancel(kill_job, -EBUSY);
+            return;
+        }
+        qemu_proc->state = QEMU_KILLING;
+    }
+}
+
+/* A launch that could not be submitted, its vm never ran. */
+static void launch_drop(qemu_proc_t *qemu_proc, job_t *job)
+{
+    launch_job_t *launch = job->data;
+
+    arg_free(&launch->args);
+    job_cancel(job, -EBUSY);
+    sched_release(qemu_proc);
+    unlink_qemu_proc(qemu_proc);
+    free(qemu_proc);
+}
+
+/* Launched or about to be, and its guest not ready yet. A guest that never
+ * answers gives its slot back after VIRT_BOOT_HOLD seconds. */
+static bool boot_booting(const qemu_proc_t *qemu_proc, const struct timespec *now)
+{
+    if (qemu_proc->state == QEMU_LAUNCHING) {
+        return true;
+    }
+    if (qemu_proc->state != QEMU_RUNNING || qemu_proc->ready || qemu_proc->ready_timeout) {
+        return false;
+    }
+
+    return ts_diff_ns(&qemu_proc->launched, now) < virt_conf.boot_hold * 1000000000ULL;
+}
+
+static int boot_count(const qemu_proc_t *self, const struct timespec *now, int *waiting)
+{
+    qemu_proc_t *item;
+    int booting = 0;
+
+    *waiting = 0;
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item == self) {
+            continue;
+        }
+        if (item->state == QEMU_QUEUED) {
+            (*waiting)++;
+        } else if (boot_booting(item, now)) {
+            booting++;
+        }
+    }
+
+    return booting;
+}
+
+/* Boot an admitted launch now if a slot is free and none waits for one,
+ * queue it otherwise. -1 when it could not be submitted. */
+static int boot_submit(qemu_proc_t *qemu_proc, job_t *job)
+{
+    profile_stats_t *stats = &profile_stats[qemu_proc->profile - qemu_profiles];
+    struct timespec now;
+    int booting, waiting;
+
+    if (virt_conf.boot_max == 0) {
+        return job_submit(job);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    booting = boot_count(qemu_proc, &now, &waiting);
+    if (waiting == 0 && booting < boot_ctl.limit) {
+        return job_submit(job);
+    }
+
+    qemu_proc->state = QEMU_QUEUED;
+    qemu_proc->pending_job = job;
+    qemu_proc->boot_queued = now;
+    boot_ctl.queued++;
+    stats->boot_queued++;
+    logout("vm %d waits to boot, %d booting, %d waiting, limit %d\n", qemu_proc->vm_id,
+            booting, waiting, boot_ctl.limit);
+
+    return 0;
+}
+
+/* Highest priority first, then in arrival order. */
+static qemu_proc_t *boot_next(bool *passed)
+{
+    qemu_proc_t *item, *best = NULL, *first = NULL;
+
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->state != QEMU_QUEUED) {
+            continue;
+        }
+        if (first == NULL || ts_ns(&item->boot_queued) < ts_ns(&first->boot_queued)) {
+            first = item;
+        }
+        if (best == NULL || item->boot_priority > best->boot_priority ||
+                (item->boot_priority == best->boot_priority &&
+                 ts_ns(&item->boot_queued) < ts_ns(&best->boot_queued))) {
+            best = item;
+        }
+    }
+    *passed = best != first;
+
+    return best;
+}
+
+/* Launch queued vms while boot slots are free. */
+static void boot_kick(void)
+{
+    profile_stats_t *stats;
+    struct timespec now;
+    qemu_proc_t *item;
+    int booting, waiting;
+    bool passed;
+    job_t *job;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    booting = boot_count(NULL, &now, &waiting);
+    while (booting < boot_ctl.limit && (item = boot_next(&passed)) != NULL) {
+        job = item->pending_job;
+        item->pending_job = NULL;
+        item->state = QEMU_LAUNCHING;
+        item->boot_wait_ns = ts_diff_ns(&item->boot_queued, &now);
+
+        stats = &profile_stats[item->profile - qemu_profiles];
+        stats->boot_wait_ns += item->boot_wait_ns;
+        stats->boot_dequeued++;
+        boot_ctl.wait_ns += item->boot_wait_ns;
+        boot_ctl.dequeued++;
+        if (item->boot_wait_ns > boot_ctl.max_wait_ns) {
+            boot_ctl.max_wait_ns = item->boot_wait_ns;
+        }
+        if (passed) {
+            boot_ctl.passed++;
+        }
+        logout("vm %d boots after %" PRIu64 " ms in the queue, priority %d\n", item->vm_id,
+                item->boot_wait_ns / 1000000, item->boot_priority);
+
+        if (job_submit(job) == -1) {
+            launch_drop(item, job);
+            continue;
+        }
+        booting++;
+    }
+}
+
+/* Periodic: halve the limit while the host is short of cpu or disk, grow it by
+ * one while it is idle and the limit is what holds launches back. */
+static void boot_tick(void)
+{
+    struct timespec now;
+    qemu_proc_t *item;
+    int booting, waiting, limit;
+    double full;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    read_psi("cpu", &boot_ctl.cpu_psi, &full);
+    read_psi("io", &boot_ctl.io_psi, &full);
+    booting = boot_count(NULL, &now, &waiting);
+
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->state == QEMU_RUNNING && !item->ready && !item->ready_timeout &&
+                !item->boot_held && !boot_booting(item, &now)) {
+            item->boot_held = true;
+            boot_ctl.held++;
+        }
+    }
+
+    if (boot_ctl.cpu_psi >= BOOT_PSI_HIGH || boot_ctl.io_psi >= BOOT_PSI_HIGH) {
+        if (boot_ctl.limit > BOOT_MIN &&
+                ts_diff_ns(&boot_ctl.shrunk, &now) >= BOOT_BACKOFF * 1000000000ULL) {
+            /* from what really boots, a limit far above it would not slow anything */
+            limit = (booting < boot_ctl.limit ? booting : boot_ctl.limit) / 2;
+            boot_ctl.limit = limit > BOOT_MIN ? limit : BOOT_MIN;
+            boot_ctl.shrunk = now;
+            boot_ctl.shrinks++;
+            logout("boot: cpu pressure %.1f, io pressure %.1f, %d booting, limit down to %d\n",
+                    boot_ctl.cpu_psi, boot_ctl.io_psi, booting, boot_ctl.limit);
+        }
+    } else if (boot_ctl.cpu_psi < BOOT_PSI_LOW && boot_ctl.io_psi < BOOT_PSI_LOW &&
+            waiting > 0 && booting >= boot_ctl.limit && boot_ctl.limit < virt_conf.boot_max) {
+        boot_ctl.limit++;
+        boot_ctl.grows++;
+    }
+
+    boot_kick();
+}
+
+/* A storm usually starts with the host itself, begin halfway to the limit. */
+static void boot_init(void)
+{
+    boot_ctl.limit = virt_conf.boot_max / 2 > BOOT_MIN ? virt_conf.boot_max / 2 : BOOT_MIN;
+}
+
+static int render_boot_stats(char *buf, int size)
+{
+    profile_stats_t *stats;
+    struct timespec now;
+    qemu_proc_t *item;
+    int i, pos, booting, waiting;
+
+    if (virt_conf.boot_max == 0) {
+        return snprintf(buf, size, "boot queue: off\n");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    booting = boot_count(NULL, &now, &waiting);
+    pos = snprintf(buf, size,
+            "boot queue: limit %d/%d, booting %d, waiting %d, cpu pressure %.1f, io pressure %.1f\n"
+            "\tqueued %" PRIu64 ", wait avg %" PRIu64 " ms, max %" PRIu64 " ms, "
+            "passed by priority %" PRIu64 ", limit halved %" PRIu64 ", grown %" PRIu64 ", "
+            "slots held to timeout %" PRIu64 "\n",
+            boot_ctl.limit, virt_conf.boot_max, booting, waiting, boot_ctl.cpu_psi, boot_ctl.io_psi,
+            boot_ctl.queued, boot_ctl.dequeued ? boot_ctl.wait_ns / boot_ctl.dequeued / 1000000 : 0,
+            boot_ctl.max_wait_ns / 1000000, boot_ctl.passed, boot_ctl.shrinks, boot_ctl.grows,
+            boot_ctl.held);
+    /* ready is from the launch request, so it includes the wait */
+    for (i = 0; i < ARRAY_SIZE(qemu_profiles) && pos < size; i++) {
+        stats = &profile_stats[i];
+        if (stats->boot_queued == 0) {
+            continue;
+        }
+        pos += snprintf(buf + pos, size - pos,
+                "\t%-8s queued %" PRIu64 ", wait avg %" PRIu64 " ms, ready avg %" PRIu64 " ms\n",
+                qemu_profiles[i].name, stats->boot_queued,
+                stats->boot_dequeued ? stats->boot_wait_ns / stats->boot_dequeued / 1000000 : 0,
+                stats->ready ? stats->ready_ns / stats->ready / 1000000 : 0);
+    }
+    for (item = virt_server.qemu_head; item != NULL && pos < size; item = item->next) {
+        if (item->state == QEMU_QUEUED) {
+            pos += snprintf(buf + pos, size - pos, "\tvm %d: waiting %" PRIu64 " ms, priority %d\n",
+                    item->vm_id, ts_diff_ns(&item->boot_queued, &now) / 1000000, item->boot_priority);
+        } else if (boot_booting(item, &now)) {
+            pos += snprintf(buf + pos, size - pos, "\tvm %d: booting, waited %" PRIu64 " ms\n",
+                    item->vm_id, item->boot_wait_ns / 1000000);
+        }
+    }
+
+    return pos;
+}
+
+/* Parse the request and queue the launch, the client gets the job id back at once
+ * (-1 if it was refused) and the outcome comes later through MES_QUERY_JOB. */
+static void try_launch_qemu(bool with_profile, bool with_priority)
+{
+    qemu_profile_t *profile = &qemu_profiles[0];
+    char name[MAX_PROFILE_NAME];
+    launch_job_t *launch;
+    SCHED_FIT_T fit;
+    job_t *job;
+    int priority = 0;
+    uint64_t t = trace_start();
+
+    int vm_id = recv_vm_id();
+    if (with_priority && virt_server.cur->connected && recv_int(&priority) == -1) {
+        vm_id = -1;
+    }
+    if (vm_id == -1) {
+        /* the profile is already on its way, don't take it for the next request */
+        if (with_profile && virt_server.cur->connected) {
+            recv_string(name, sizeof(name));
+        }
+        logout("launch qemu failed\n");
+        return;
+    }
+
+    if (with_profile) {
+        if (recv_string(name, sizeof(name)) == -1) {
+            logout("launch qemu failed\n");
+            return;
+        }
+        profile = with_priority && strcmp(name, "-") == 0 ? &qemu_profiles[0] : find_profile(name);
+        if (profile == NULL) {
+            logout("unknown profile %s, launch qemu failed\n", name);
+            send_int(-1);
+            return;
+        }
+    }
+
+    trace_end("recv", vm_id, t);
+
+    qemu_proc_t * qemu_proc = create_qemu_proc(vm_id, profile);
+    if ( qemu_proc == NULL) {
+        logout("launch qemu failed\n");
+        send_int(-1);
+        return;
+    }
+    qemu_proc->boot_priority = priority;
+
+    launch = calloc(1, sizeof(launch_job_t));
+    job = launch ? job_new("launch", launch_work, launch_done, launch) : NULL;
+    if (job == NULL) {
+        free(launch);
+        unlink_qemu_proc(qemu_proc);
+        free(qemu_proc);
+        send_int(-1);
+        return;
+    }
+
+    /* counted in its I/O group from here, fill_arglist needs the throttling */
+    io_launch(qemu_proc);
+    launch->qemu_proc = qemu_proc;
+    t = trace_start();
+    fill_arglist(qemu_proc, &launch->args);
+    trace_end("fill_arglist", vm_id, t);
+
+    t = trace_start();
+    fit = sched_admit(qemu_proc);
+    trace_end("admission", vm_id, t);
+    if (fit != FIT_OK) {
+        if (fit == FIT_NEVER || virt_conf.admission == ADMISSION_REJECT) {
+            logout("vm %d rejected: %s\n", vm_id, sched_fit_str(fit));
+            host_cap.rejected++;
+            arg_free(&launch->args);
+            job_cancel(job, -ENOSPC);
+            release_qemu_proc(qemu_proc);
+            send_int(-1);
+            return;
+        }
+        logout("vm %d queued: %s\n", vm_id, sched_fit_str(fit));
+        host_cap.queued++;
+        qemu_proc->state = QEMU_PENDING;
+        qemu_proc->pending_job = job;
+        send_int(job->id);
+        return;
+    }
+
+    if (boot_submit(qemu_proc, job) == -1) {
+        arg_free(&launch->args);
+        job_cancel(job, -EBUSY);
+        release_qemu_proc(qemu_proc);
+        send_int(-1);
+        return;
+    }
+
+    send_int(job->id);
+}
+
+/* Admit queued launches in arrival order, a small vm may pass a large one that
+ * still doesn't fit. */
+static void sched_kick_pending(void)
+{
+    qemu_proc_t *item, *next;
+    job_t *job;
+
+    for (item = virt_server.qemu_head; item != NULL; item = next) {
+        next = item->next;
+        if (item->state != QEMU_PENDING || sched_admit(item) != FIT_OK) {
+            continue;
+        }
+
+        job = item->pending_job;
+        item->pending_job = NULL;
+        item->state = QEMU_LAUNCHING;
+        logout("vm %d admitted from the queue\n", item->vm_id);
+
+        if (boot_submit(item, job) == -1) {
+            launch_drop(item, job);
+        }
+    }
+}
+
+static void query_fit(void)
+{
+    qemu_profile_t *profile;
+    char name[MAX_PROFILE_NAME];
+    char buf[512];
+    char cpus[256];
+    cpu_set_t mask;
+    SCHED_FIT_T fit;
+    int len;
+
+    if (recv_string(name, sizeof(name)) == -1) {
+        return;
+    }
+
+    profile = find_profile(name);
+    if (profile == NULL) {
+        len = snprintf(buf, sizeof(buf), "unknown profile %s\n", name);
+    } else {
+        fit = sched_fit(profile, &mask);
+        if (fit == FIT_OK) {
+            cpu_list_str(&mask, cpus, sizeof(cpus));
+            len = snprintf(buf, sizeof(buf), "profile %s fits: cpus %s, memory %u MB%s\n",
+                    profile->name, cpus, profile_mem_need(profile),
+                    profile->hugepages ? " (hugepages)" : "");
+        } else {
+            len = snprintf(buf, sizeof(buf), "profile %s doesn't fit: %s (%s)\n", profile->name,
+                    sched_fit_str(fit), virt_conf.admission == ADMISSION_QUEUE && fit != FIT_NEVER ?
+                    "would be queued" : "would be rejected");
+        }
+    }
+
+    send_int(len);
+    if (write(virt_server.cur->fd, buf, len) == -1) {
+        ERR_EXIT("Error: socket error\n");
+    }
+}
+
+static void query_qemu(void)
+{
+    char buf[1024];
+    qemu_proc_t *item;
+    int pos = 0;
+    int ret;
+
+    pos = sprintf(buf, "\nNow running vm:\n");
+    pos += sprintf(buf + pos, "\tvm_id\t pid\t state\n");
+
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        pos += snprintf(buf + pos, sizeof(buf) - pos, "\t%d\t %d\t %s\n", item->vm_id, item->pid,
+                item->state == QEMU_RUNNING ? "running" :
+                item->state == QEMU_PENDING ? "pending" :
+                item->state == QEMU_QUEUED ? "queued" :
+                item->state == QEMU_KILLING ? "killing" : "launching");
+        if (pos >= 1024) {
+            pos = 1024;
+            buf[pos - 1] = '\0';
+            break;
+        }
+    }
+
+    ret = write(virt_server.cur->fd, &pos, sizeof(pos));
+    if (ret == -1) {
+        ERR_EXIT("Error: socket error\n");
+    }
+
+    ret = write(virt_server.cur->fd, buf, pos);
+    if (ret == -1) {
+        ERR_EXIT("Error: socket error\n");
+    }
+}
+
+static int free_qemu_with_pid(pid_t pid)
+{
+    bool find_pid = false;
+    qemu_proc_t *current;
+
+    current = virt_server.qemu_head;
+    if(current == NULL) {
+        return 0;
+    }
+
+    for (; current != NULL; current = current->next) {
+        if (current->pid == pid) {
+            find_pid = true;
+            break;
+        } else {
+            continue;
+        }
+    }
+
+    if (find_pid) {
+        logout("find and free vm pid %d\n", current->pid);
+        cgroup_destroy(current->vm_id);
+        release_qemu_proc(current);
+    } else {
+        logout("not find running qemu with pid %d\n", pid);
+    }
+
+    return 0;
+}
+
+/* Reap exited qemu. Only running ones are waited here, a launching child belongs
+ * to its worker until the launch job has finished. */
+static void reap_qemu(void)
+{
+    qemu_proc_t *item;
+    int status, vm_id;
+    pid_t pid;
+    uint64_t t;
+
+again:
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->state != QEMU_RUNNING) {
+            continue;
+        }
+        t = trace_start();
+        pid = waitpid(item->pid, &status, WNOHANG);
+        if (pid > 0) {
+            vm_id = item->vm_id;
+            logout("qemu sub-process (%d) exit, status (%d).\n", pid, status);
+            free_qemu_with_pid(pid);
+            trace_end("reap", vm_id, t);
+            goto again;
+        }
+    }
+}
+
+static int kill_qemu_with_vm_id(int vm_id)
+{
+    bool find_vm_id = false;
+    qemu_proc_t *current;
+    kill_job_t *data;
+    job_t *job;
+    int id;
+
+    current = virt_server.qemu_head;
+    if(current == NULL) {
+        logout("Can't find running qemu with vm_id %d\n", vm_id);
+        return -1;
+    }
+
+    for (; current != NULL; current = current->next) {
+        if (current->vm_id == vm_id) {
+            find_vm_id = true;
+            break;
+        } else {
+            continue;
+        }
+    }
+
+    if (!find_vm_id) {
+        logout("Can't find running qemu with vm_id %d\n", vm_id);
+        return -1;
+    }
+
+    if (current->kill_job) {
+        return current->kill_job->id;
+    }
+
+    data = calloc(1, sizeof(kill_job_t));
+    job = data ? job_new("kill", kill_work, kill_done, data) : NULL;
+    if (job == NULL) {
+        free(data);
+        return -1;
+    }
+    data->vm_id = vm_id;
+
+    if (current->state == QEMU_PENDING || current->state == QEMU_QUEUED) {
+        logout("vm %d is still queued, drop it\n", vm_id);
+        launch_job_t *launch = current->pending_job->data;
+        arg_free(&launch->args);
+        job_cancel(current->pending_job, -ECANCELED);
+        release_qemu_proc(current);
+        /* the record stays for MES_QUERY_JOB, the job goes */
+        id = job->id;
+        job_cancel(job, 0);
+        return id;
+    }
+
+    if (current->state == QEMU_LAUNCHING) {
+        /* submitted by launch_done() once the pid is known */
+        logout("vm %d is launching, kill it after launch\n", vm_id);
+        current->kill_job = job;
+        return job->id;
+    }
+
+    pid_t pid = current->pid;
+    logout("Find and kill vm, pid is %d\n", pid);
+    data->pid = pid;
+    data->qemu_proc = current;
+
+    /* kill_work waits for qemu, that never runs on the event loop */
+    if (job_submit(job) == -1) {
+        job_cancel(job, -EBUSY);
+        return -1;
+    }
+    /* its cores and memory are in use until kill_done */
+    current->state = QEMU_KILLING;
+    current->kill_job = job;
+
+    return job->id;
+}
+
+static void kill_qemu(void)
+{
+    int vm_id = recv_vm_id();
+
+    if (vm_id == -1) {
+        return;
+    }
+
+    send_int(kill_qemu_with_vm_id(vm_id));
+}
+
+static int read_task_schedstat(pid_t pid, pid_t tid, uint64_t *run_ns, uint64_t *wait_ns)
+{
+    char path[PATH_MAX];
+    FILE *fp;
+    int ret = -1;
+
+    snprintf(path, sizeof(path), "%s/%d/task/%d/schedstat", virt_conf.proc_root, pid, tid);
+    fp = fopen(path, "re");
+    if (fp == NULL) {
+        return -1;
+    }
+    if (fscanf(fp, "%" SCNu64 " %" SCNu64, run_ns, wait_ns) == 2) {
+        ret = 0;
+    }
+    fclose(fp);
+
+    return ret;
+}
+
+/* Sum run time and run-queue wait over every thread of the vm. */
+static int read_schedstat(pid_t pid, uint64_t *run_ns, uint64_t *wait_ns)
+{
+    char path[PATH_MAX];
+    struct dirent *ent;
+    uint64_t run, wait;
+    DIR *dir;
+
+    *run_ns = *wait_ns = 0;
+    snprintf(path, sizeof(path), "%s/%d/task", virt_conf.proc_root, pid);
+    dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] < '0' || ent->d_name[0] > '9') {
+            continue;
+        }
+        if (read_task_schedstat(pid, atoi(ent->d_name), &run, &wait) == 0) {
+            *run_ns += run;
+            *wait_ns += wait;
+        }
+    }
+    closedir(dir);
+
+    return 0;
+}
+
+static void sample_vm_load(qemu_proc_t *qemu_proc)
+{
+    struct timespec now;
+    uint64_t run_ns, wait_ns, vcpu_ns = 0, run, wait;
+    double secs;
+    int i;
+
+    if (read_schedstat(qemu_proc->pid, &run_ns, &wait_ns) == -1) {
+        return;
+    }
+    /* hotplug sizes on the vCPU threads alone, I/O and vhost threads aren't guest load */
+    for (i = 0; i < qemu_proc->nr_vcpu_tids; i++) {
+        if (read_task_schedstat(qemu_proc->pid, qemu_proc->vcpu_tids[i], &run, &wait) == 0) {
+            vcpu_ns += run;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (qemu_proc->sampled.tv_sec != 0) {
+        secs = ts_diff_ns(&qemu_proc->sampled, &now) / 1e9;
+        if (secs > 0 && run_ns >= qemu_proc->run_ns && wait_ns >= qemu_proc->wait_ns) {
+            qemu_proc->cpu_usage = (run_ns - qemu_proc->run_ns) / 1e9 / secs;
+            qemu_proc->cpu_wait = (wait_ns - qemu_proc->wait_ns) / 1e9 / secs;
+        }
+        if (secs > 0 && qemu_proc->vcpu_run_ns != 0 && vcpu_ns >= qemu_proc->vcpu_run_ns) {
+            qemu_proc->hp_cpu = (vcpu_ns - qemu_proc->vcpu_run_ns) / 1e9 / secs / qemu_proc->nr_vcpu_tids;
+        }
+    }
+
+    qemu_proc->run_ns = run_ns;
+    qemu_proc->wait_ns = wait_ns;
+    qemu_proc->vcpu_run_ns = vcpu_ns;
+    qemu_proc->sampled = now;
+}
+
+/* Pin every thread of the vm (and its cgroup) to a new cpu set. */
+typedef struct affinity_job {
+    int vm_id;
+    pid_t pid;
+    cpu_set_t cpus;         /* of all threads but realtime vCPUs */
+    cpu_set_t cgroup_cpus;
+    char mems[64];          /* cpuset.mems, "" leaves it */
+    int vhost;              /* vhost workers found and pinned */
+} affinity_job_t;
+
+/* Pin the tasks of dir whose comm is name, return how many were found. */
+static int pin_named_tasks(const char *path, const char *name, const cpu_set_t *cpus)
+{
+    char task[PATH_MAX];
+    char comm[32];
+    struct dirent *ent;
+    DIR *dir;
+    int found = 0;
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] < '0' || ent->d_name[0] > '9') {
+            continue;
+        }
+        snprintf(task, sizeof(task), "%s/%s", path, ent->d_name);
+        if (sysfs_read(task, "comm", comm, sizeof(comm)) <= 0 || strcmp(comm, name) != 0) {
+            continue;
+        }
+        if (sched_setaffinity(atoi(ent->d_name), sizeof(*cpus), cpus) == 0) {
+            found++;
+        }
+    }
+    closedir(dir);
+
+    return found;
+}
+
+/* vhost-net workers are "vhost-<qemu pid>", kernel threads on older kernels and
+ * tasks of qemu itself on newer ones, keep them on the vm's cores either way. */
+static int pin_vhost_threads(pid_t pid, const cpu_set_t *cpus)
+{
+    char path[PATH_MAX];
+    char name[32];
+    int found;
+
+    snprintf(name, sizeof(name), "vhost-%d", pid);
+    found = pin_named_tasks(virt_conf.proc_root, name, cpus);
+    snprintf(path, sizeof(path), "%s/%d/task", virt_conf.proc_root, pid);
+    found += pin_named_tasks(path, name, cpus);
+
+    return found;
+}
+
+static void affinity_work(job_t *job)
+{
+    affinity_job_t *data = job->data;
+    char path[PATH_MAX];
+    char list[256];
+    struct dirent *ent;
+    DIR *dir;
+
+    cgroup_path(data->vm_id, path, sizeof(path));
+    if (cpu_list_str(&data->cgroup_cpus, list, sizeof(list)) > 0) {
+        sysfs_write(path, "cpuset.cpus", "%s", list);
+    }
+    /* cgroup v2 migrates the pages along */
+    if (data->mems[0] != '\0') {
+        sysfs_write(path, "cpuset.mems", "%s", data->mems);
+    }
+
+    snprintf(path, sizeof(path), "%s/%d/task", virt_conf.proc_root, data->pid);
+    dir = opendir(path);
+    if (dir == NULL) {
+        job->result = -errno;
+        return;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] < '0' || ent->d_name[0] > '9') {
+            continue;
+        }
+        /* realtime vCPUs keep their own core */
+        if (sched_getscheduler(atoi(ent->d_name)) == SCHED_FIFO) {
+            continue;
+        }
+        if (sched_setaffinity(atoi(ent->d_name), sizeof(data->cpus), &data->cpus) == -1 &&
+                errno != ESRCH) {
+            job->result = -errno;
+        }
+    }
+    closedir(dir);
+
+    data->vhost = pin_vhost_threads(data->pid, &data->cpus);
+}
+
+static void affinity_done(job_t *job)
+{
+    affinity_job_t *data = job->data;
+    qemu_proc_t *qemu_proc = find_qemu_proc(data->vm_id);
+
+    if (data->vhost > 0 && qemu_proc != NULL && qemu_proc->pid == data->pid) {
+        qemu_proc->vhost_pinned = true;
+    }
+    if (job->result < 0) {
+        rebalancer.failed++;
+        logout("rebalance: pin vm %d failed (%s)\n",
+                ((affinity_job_t *)job->data)->vm_id, strerror(-job->result));
+    }
+    free(job->data);
+}
+
+static void submit_affinity(qemu_proc_t *qemu_proc)
+{
+    affinity_job_t *data = calloc(1, sizeof(affinity_job_t));
+    job_t *job = data ? job_new("affinity", affinity_work, affinity_done, data) : NULL;
+
+    if (job == NULL) {
+        free(data);
+        return;
+    }
+
+    data->vm_id = qemu_proc->vm_id;
+    data->pid = qemu_proc->pid;
+    vm_housekeeping_cpus(qemu_proc, &data->cpus);
+    vm_cgroup_cpus(qemu_proc, &data->cgroup_cpus);
+    if (qemu_proc->numa_nodes) {
+        numa_list_str(qemu_proc->numa_nodes, data->mems, sizeof(data->mems));
+    }
+    if (job_submit(job) == -1) {
+        job_cancel(job, -EBUSY);
+    }
+}
+
+typedef struct rt_job {
+    int vm_id;
+    cpu_set_t cpus;         /* one realtime core per vCPU */
+    int vcpus;              /* switched to SCHED_FIFO */
+} rt_job_t;
+
+/* query-cpus-fast lists the vCPUs in index order, each with its thread id.
+ * vCPU n goes alone onto the n-th realtime core of the vm under SCHED_FIFO. */
+static void rt_work(job_t *job)
+{
+    rt_job_t *data = job->data;
+    struct sched_param param = { .sched_priority = virt_conf.rt_prio };
+    char reply[4096];
+    cpu_set_t core;
+    char *pos;
+    int cpu = -1, ret;
+    pid_t tid;
+
+    ret = qmp_command(data->vm_id, "{\"execute\":\"query-cpus-fast\"}", reply, sizeof(reply));
+    if (ret < 0) {
+        job->result = ret;
+        return;
+    }
+
+    for (pos = strstr(reply, "\"thread-id\":"); pos != NULL; pos = strstr(pos + 1, "\"thread-id\":")) {
+        tid = atoi(pos + strlen("\"thread-id\":"));
+        for (cpu++; cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &data->cpus); cpu++) {
+        }
+        if (tid <= 0 || cpu == CPU_SETSIZE) {
+            break;
+        }
+        CPU_ZERO(&core);
+        CPU_SET(cpu, &core);
+        /* move first, a FIFO thread on a shared core could starve it */
+        if (sched_setaffinity(tid, sizeof(core), &core) == -1 ||
+                sched_setscheduler(tid, SCHED_FIFO, &param) == -1) {
+            job->result = -errno;
+            continue;
+        }
+        data->vcpus++;
+    }
+}
+
+static void rt_done(job_t *job)
+{
+    rt_job_t *data = job->data;
+    qemu_proc_t *qemu_proc = find_qemu_proc(data->vm_id);
+    char cpus[256];
+
+    if (qemu_proc != NULL) {
+        qemu_proc->rt_vcpus = data->vcpus;
+    }
+    cpu_list_str(&data->cpus, cpus, sizeof(cpus));
+    if (job->result < 0) {
+        /* EPERM with RT_GROUP_SCHED: the vm's cgroup has no cpu.rt_runtime_us */
+        logout("realtime: vm %d, %d vCPUs SCHED_FIFO on cpus %s, failed (%s)\n", data->vm_id,
+                data->vcpus, cpus, strerror(-job->result));
+    } else {
+        logout("realtime: vm %d, %d vCPUs SCHED_FIFO %d on cpus %s\n", data->vm_id,
+                data->vcpus, virt_conf.rt_prio, cpus);
+    }
+    free(job->data);
+}
+
+/* the vCPU threads exist once qemu greets on QMP */
+static void rt_setup(qemu_proc_t *qemu_proc)
+{
+    rt_job_t *data = calloc(1, sizeof(rt_job_t));
+    job_t *job = data ? job_new("realtime", rt_work, rt_done, data) : NULL;
+
+    if (job == NULL) {
+        free(data);
+        return;
+    }
+
+    data->vm_id = qemu_proc->vm_id;
+    data->cpus = qemu_proc->cpus;
+    if (job_submit_qmp(job, qemu_proc->vm_id) == -1) {
+        job_cancel(job, -EBUSY);
+    }
+}
+
+typedef struct numa_pin_job {
+    int vm_id;
+    int nr;                 /* guest nodes */
+    uint32_t vcpus[MAX_NUMA_NODES];     /* of each, in vCPU index order */
+    cpu_set_t cpus[MAX_NUMA_NODES];     /* the vm's cores on its host node */
+    int pinned;
+} numa_pin_job_t;
+
+/* The vCPUs of a guest node run on the cores of its host node only. */
+static void numa_pin_work(job_t *job)
+{
+    numa_pin_job_t *data = job->data;
+    char reply[4096];
+    char *pos;
+    uint32_t left;
+    int g = 0, ret;
+    pid_t tid;
+
+    ret = qmp_command(data->vm_id, "{\"execute\":\"query-cpus-fast\"}", reply, sizeof(reply));
+    if (ret < 0) {
+        job->result = ret;
+        return;
+    }
+
+    left = data->vcpus[0];
+    for (pos = strstr(reply, "\"thread-id\":"); pos != NULL; pos = strstr(pos + 1, "\"thread-id\":")) {
+        tid = atoi(pos + strlen("\"thread-id\":"));
+        while (left == 0 && ++g < data->nr) {
+            left = data->vcpus[g];
+        }
+        if (tid <= 0 || g == data->nr) {
+            break;
+        }
+        left--;
+        if (sched_setaffinity(tid, sizeof(data->cpus[g]), &data->cpus[g]) == -1) {
+            job->result = -errno;
+            continue;
+        }
+        data->pinned++;
+    }
+}
+
+static void numa_pin_done(job_t *job)
+{
+    numa_pin_job_t *data = job->data;
+
+    if (job->result < 0) {
+        logout("numa: vm %d, %d vCPUs pinned to their nodes, failed (%s)\n", data->vm_id,
+                data->pinned, strerror(-job->result));
+    } else {
+        logout("numa: vm %d, %d vCPUs pinned to %d nodes\n", data->vm_id, data->pinned, data->nr);
+    }
+    free(job->data);
+}
+
+/* the vCPU threads exist once qemu greets on QMP */
+static void numa_pin_setup(qemu_proc_t *qemu_proc)
+{
+    numa_pin_job_t *data = calloc(1, sizeof(numa_pin_job_t));
+    job_t *job = data ? job_new("numa pin", numa_pin_work, numa_pin_done, data) : NULL;
+    int node[MAX_NUMA_NODES];
+    int g;
+
+    if (job == NULL) {
+        free(data);
+        return;
+    }
+
+    data->vm_id = qemu_proc->vm_id;
+    data->nr = numa_split(qemu_proc, qemu_proc->smp, data->vcpus, node);
+    for (g = 0; g < data->nr; g++) {
+        CPU_AND(&data->cpus[g], &qemu_proc->cpus, &numa_host.cpus[node[g]]);
+    }
+    if (job_submit_qmp(job, qemu_proc->vm_id) == -1) {
+        job_cancel(job, -EBUSY);
+    }
+}
+
+typedef struct numa_job {
+    int vm_id;
+    pid_t pid;
+    uint32_t mb[MAX_NUMA_NODES];
+} numa_job_t;
+
+/* Sum the "N<node>=<pages>" of every mapping in /proc/<pid>/numa_maps, in
+ * the mapping's kernelpagesize_kB. */
+static void numa_maps_work(job_t *job)
+{
+    numa_job_t *data = job->data;
+    uint64_t kb[MAX_NUMA_NODES] = { 0 };
+    long pages[MAX_NUMA_NODES];
+    char path[PATH_MAX];
+    char *line = NULL, *tok, *save, *end;
+    size_t len = 0;
+    long page_kb, n;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%d/numa_maps", virt_conf.proc_root, data->pid);
+    fp = fopen(path, "re");
+    if (fp == NULL) {
+        job->result = -errno;
+        return;
+    }
+
+    while (getline(&line, &len, fp) != -1) {
+        memset(pages, 0, sizeof(pages));
+        page_kb = 4;
+        for (tok = strtok_r(line, " \n", &save); tok != NULL; tok = strtok_r(NULL, " \n", &save)) {
+            if (strncmp(tok, "kernelpagesize_kB=", strlen("kernelpagesize_kB=")) == 0) {
+                page_kb = atol(tok + strlen("kernelpagesize_kB="));
+            } else if (tok[0] == 'N' && tok[1] >= '0' && tok[1] <= '9') {
+                n = strtol(tok + 1, &end, 10);
+                if (*end == '=' && n < MAX_NUMA_NODES) {
+                    pages[n] = atol(end + 1);
+                }
+            }
+        }
+        for (n = 0; n < MAX_NUMA_NODES; n++) {
+            kb[n] += (uint64_t)pages[n] * page_kb;
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    for (n = 0; n < MAX_NUMA_NODES; n++) {
+        data->mb[n] = kb[n] >> 10;
+    }
+}
+
+static void numa_maps_done(job_t *job)
+{
+    numa_job_t *data = job->data;
+    qemu_proc_t *qemu_proc = find_qemu_proc(data->vm_id);
+
+    if (qemu_proc != NULL && qemu_proc->pid == data->pid) {
+        qemu_proc->numa_busy = false;
+        if (job->result == 0) {
+            memcpy(qemu_proc->numa_mb, data->mb, sizeof(data->mb));
+            qemu_proc->numa_sampled = true;
+        }
+    }
+    free(job->data);
+}
+
+/* Periodic: where the memory of each bound vm really is. */
+static void numa_sample(void)
+{
+    numa_job_t *data;
+    qemu_proc_t *item;
+    job_t *job;
+
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->state != QEMU_RUNNING || item->numa_nodes == 0 || item->numa_busy) {
+            continue;
+        }
+        data = calloc(1, sizeof(numa_job_t));
+        job = data ? job_new("numa maps", numa_maps_work, numa_maps_done, data) : NULL;
+        if (job == NULL) {
+            free(data);
+            return;
+        }
+        data->vm_id = item->vm_id;
+        data->pid = item->pid;
+        if (job_submit(job) == -1) {
+            job_cancel(job, -EBUSY);
+            return;
+        }
+        item->numa_busy = true;
+    }
+}
+
+static int render_numa_stats(char *buf, int size)
+{
+    uint64_t total, remote;
+    qemu_proc_t *item;
+    char list[256];
+    int n, pos;
+
+    if (numa_host.nr_nodes < 2) {
+        return 0;
+    }
+
+    pos = snprintf(buf, size, "numa:\n\tvms on one node %" PRIu64 ", spanning nodes %" PRIu64 "\n",
+            numa_host.local, numa_host.spanned);
+    for (n = 0; n < MAX_NUMA_NODES && pos < size; n++) {
+        if (numa_host.nodes & (1u << n)) {
+            cpu_list_str(&numa_host.cpus[n], list, sizeof(list));
+            pos += snprintf(buf + pos, size - pos, "\tnode %d: cpus %s, memory %" PRIu64 "/%" PRIu64 " MB\n",
+                    n, list, numa_host.mem_used[n], numa_host.mem_total[n]);
+        }
+    }
+
+    for (item = virt_server.qemu_head; item != NULL && pos < size; item = item->next) {
+        if (item->numa_nodes == 0) {
+            continue;
+        }
+        numa_list_str(item->numa_nodes, list, sizeof(list));
+        pos += snprintf(buf + pos, size - pos, "\tvm %d: nodes %s%s", item->vm_id, list,
+                item->numa_guest ? " (guest nodes)" : "");
+        if (!item->numa_sampled) {
+            pos += snprintf(buf + pos, size - pos, "\n");
+            continue;
+        }
+        total = remote = 0;
+        for (n = 0; n < MAX_NUMA_NODES && pos < size; n++) {
+            if (item->numa_mb[n] == 0) {
+                continue;
+            }
+            pos += snprintf(buf + pos, size - pos, ", node %d %u MB", n, item->numa_mb[n]);
+            total += item->numa_mb[n];
+            if (!(item->numa_nodes & (1u << n))) {
+                remote += item->numa_mb[n];
+            }
+        }
+        if (pos < size) {
+            pos += snprintf(buf + pos, size - pos, ", %.1f%% remote\n",
+                    total ? 100.0 * remote / total : 0.0);
+        }
+    }
+
+    return pos;
+}
+
+/* vhost workers only show up once qemu has set up the device, pin them
+ * shortly after launch; the rebalancer's moves take them along later. */
+static void vhost_pin(void)
+{
+    qemu_proc_t *item;
+
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->state != QEMU_RUNNING || !item->pinned || !item->vhost ||
+                item->vhost_pinned || item->vhost_pin_tries >= VHOST_PIN_TRIES) {
+            continue;
+        }
+        if (++item->vhost_pin_tries == VHOST_PIN_TRIES) {
+            logout("net: no vhost workers found for vm %d\n", item->vm_id);
+        }
+        submit_affinity(item);
+    }
+}
+
+static int vm_load_cmp(const void *a, const void *b)
+{
+    const qemu_proc_t *x = *(qemu_proc_t * const *)a, *y = *(qemu_proc_t * const *)b;
+
+    if (x->cpu_wait != y->cpu_wait) {
+        return x->cpu_wait > y->cpu_wait ? -1 : 1;
+    }
+    return x->vm_id - y->vm_id;
+}
+
+typedef struct core_load {
+    double load;
+    int cpu;
+} core_load_t;
+
+static int core_load_cmp(const void *a, const void *b)
+{
+    const core_load_t *x = a, *y = b;
+
+    if (x->load != y->load) {
+        return x->load < y->load ? -1 : 1;
+    }
+    return x->cpu - y->cpu;
+}
+
+static void core_load_add(double *load, qemu_proc_t *qemu_proc, double sign)
+{
+    int i, nr = CPU_COUNT(&qemu_proc->cpus);
+
+    for (i = 0; i < host_cap.nr_cpus && nr > 0; i++) {
+        if (CPU_ISSET(i, &qemu_proc->cpus)) {
+            load[i] += sign * qemu_proc->cpu_usage / nr;
+            host_cap.cpu_used[i] += sign > 0 ? qemu_proc->cpu_charge : -qemu_proc->cpu_charge;
+        }
+    }
+}
+
+static double avg_core_load(const double *load, const cpu_set_t *cpus)
+{
+    double sum = 0;
+    int i, nr = 0;
+
+    for (i = 0; i < host_cap.nr_cpus; i++) {
+        if (CPU_ISSET(i, cpus)) {
+            sum += load[i];
+            nr++;
+        }
+    }
+
+    return nr ? sum / nr : 0;
+}
+
+/* Try to move one vm to the least loaded cores of its nodes that still have
+ * room for it, true when the move is worth at least REBALANCE_GAIN_MIN cores of load. */
+static bool rebalance_vm(qemu_proc_t *qemu_proc, double *load, bool apply)
+{
+    core_load_t cores[CPU_SETSIZE];
+    int i, nr = 0, need = CPU_COUNT(&qemu_proc->cpus);
+    double cur_load, new_load;
+    cpu_set_t target;
+
+    core_load_add(load, qemu_proc, -1);
+    cur_load = avg_core_load(load, &qemu_proc->cpus);
+
+    for (i = 0; i < host_cap.nr_cpus; i++) {
+        /* its memory stays on its nodes */
+        if (qemu_proc->numa_nodes && !numa_cpu_on(i, qemu_proc->numa_nodes)) {
+            continue;
+        }
+        if (host_cap.cpu_cap - host_cap.cpu_used[i] >= qemu_proc->cpu_charge) {
+            cores[nr].load = load[i];
+            cores[nr].cpu = i;
+            nr++;
+        }
+    }
+
+    if (nr < need) {
+        core_load_add(load, qemu_proc, 1);
+        return false;
+    }
+
+    qsort(cores, nr, sizeof(core_load_t), core_load_cmp);
+    CPU_ZERO(&target);
+    for (i = 0; i < need; i++) {
+        CPU_SET(cores[i].cpu, &target);
+    }
+    new_load = avg_core_load(load, &target);
+
+    if (CPU_EQUAL(&target, &qemu_proc->cpus) || cur_load - new_load < REBALANCE_GAIN_MIN || !apply) {
+        core_load_add(load, qemu_proc, 1);
+        return !CPU_EQUAL(&target, &qemu_proc->cpus) && cur_load - new_load >= REBALANCE_GAIN_MIN;
+    }
+
+    char from[256], to[256];
+    cpu_list_str(&qemu_proc->cpus, from, sizeof(from));
+    cpu_list_str(&target, to, sizeof(to));
+    logout("rebalance: move vm %d from cpus %s (load %.2f) to %s (load %.2f), usage %.2f, wait %.3f\n",
+            qemu_proc->vm_id, from, cur_load, to, new_load, qemu_proc->cpu_usage, qemu_proc->cpu_wait);
+
+    qemu_proc->cpus = target;
+    qemu_proc->moved_tick = rebalancer.tick;
+    qemu_proc->moves++;
+    core_load_add(load, qemu_proc, 1);
+    submit_affinity(qemu_proc);
+    rebalancer.moves++;
+
+    return true;
+}
+
+/* Periodic pass: measure every vm, then move the ones waiting the most for a cpu
+ * onto quieter cores, at most virt_conf.rebalance_moves per interval. */
+static void rebalance(void)
+{
+    qemu_proc_t *vms[MAX_VM_NUM];
+    double *load;
+    qemu_proc_t *item;
+    int i, nr = 0, moved = 0;
+
+    rebalancer.tick++;
+
+    load = calloc(host_cap.nr_cpus, sizeof(double));
+    if (load == NULL) {
+        return;
+    }
+
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->state != QEMU_RUNNING || !item->admitted) {
+            continue;
+        }
+        sample_vm_load(item);
+        for (i = 0; i < host_cap.nr_cpus; i++) {
+            if (CPU_ISSET(i, &item->cpus)) {
+                load[i] += item->cpu_usage / CPU_COUNT(&item->cpus);
+            }
+        }
+        /* realtime vms own their cores, guest NUMA vCPUs stay on their nodes' */
+        if (!item->profile->realtime && !item->numa_guest && item->cpu_wait >= REBALANCE_WAIT_MIN &&
+                (item->moves == 0 || rebalancer.tick - item->moved_tick > REBALANCE_COOLDOWN) &&
+                nr < MAX_VM_NUM) {
+            vms[nr++] = item;
+        }
+    }
+
+    qsort(vms, nr, sizeof(qemu_proc_t *), vm_load_cmp);
+    for (i = 0; i < nr; i++) {
+        if (moved >= virt_conf.rebalance_moves) {
+            if (rebalance_vm(vms[i], load, false)) {
+                rebalancer.over_budget++;
+            }
+            continue;
+        }
+        if (rebalance_vm(vms[i], load, true)) {
+            moved++;
+        }
+    }
+
+    free(load);
+}
+
+static int render_rebalance_stats(char *buf, int size)
+{
+    qemu_proc_t *item;
+    char cpus[256];
+    int pos;
+
+    if (virt_conf.rebalance_interval == 0) {
+        return snprintf(buf, size, "rebalancer: off\n");
+    }
+
+    pos = snprintf(buf, size, "rebalancer: every %d s, %" PRIu64 " passes\n"
+            "\tmoves %" PRIu64 ", over budget %" PRIu64 ", failed %" PRIu64 "\n",
+            virt_conf.rebalance_interval, rebalancer.tick,
+            rebalancer.moves, rebalancer.over_budget, rebalancer.failed);
+
+    for (item = virt_server.qemu_head; item != NULL && pos < size; item = item->next) {
+        if (item->state != QEMU_RUNNING) {
+            continue;
+        }
+        cpu_list_str(&item->cpus, cpus, sizeof(cpus));
+        pos += snprintf(buf + pos, size - pos, "\tvm %d: cpus %s, usage %.2f, wait %.3f, moves %u\n",
+                item->vm_id, cpus, item->cpu_usage, item->cpu_wait, item->moves);
+    }
+
+    return pos;
+}
+
+typedef struct balloon_job {
+    int vm_id;
+    uint32_t target;        /* MB */
+    uint32_t prev;
+} balloon_job_t;
+
+static void balloon_work(job_t *job)
+{
+    balloon_job_t *data = job->data;
+    char cmd[128];
+
+    snprintf(cmd, sizeof(cmd), "{\"execute\":\"balloon\",\"arguments\":{\"value\":%" PRIu64 "}}",
+            (uint64_t)data->target << 20);
+    job->result = qmp_command(data->vm_id, cmd, NULL, 0);
+}
+
+static void balloon_done(job_t *job)
+{
+    balloon_job_t *data = job->data;
+    qemu_proc_t *qemu_proc = find_qemu_proc(data->vm_id);
+
+    if (job->result < 0) {
+        balloon_ctl.failed++;
+        /* the guest still has what it had */
+        if (qemu_proc && qemu_proc->balloon_target == data->target) {
+            qemu_proc->balloon_target = data->prev;
+        }
+    }
+    free(job->data);
+}
+
+static void balloon_set(qemu_proc_t *qemu_proc, uint32_t target)
+{
+    balloon_job_t *data = calloc(1, sizeof(balloon_job_t));
+    job_t *job = data ? job_new("balloon", balloon_work, balloon_done, data) : NULL;
+
+    if (job == NULL) {
+        free(data);
+        return;
+    }
+
+    data->vm_id = qemu_proc->vm_id;
+    data->target = target;
+    data->prev = qemu_proc->balloon_target;
+    if (job_submit_qmp(job, qemu_proc->vm_id) == -1) {
+        job_cancel(job, -EBUSY);
+        return;
+    }
+
+    logout("balloon: vm %d %s to %u MB (rss %u MB, psi %.2f)\n", qemu_proc->vm_id,
+            target < data->prev ? "inflate" : "deflate", target, qemu_proc->rss, balloon_ctl.psi);
+    if (target < data->prev) {
+        balloon_ctl.inflates++;
+    } else {
+        balloon_ctl.deflates++;
+    }
+    qemu_proc->balloon_target = target;
+}
+
+/* Periodic pass: under memory pressure take memory back from the guests with the
+ * most room above their floor, give it back once the pressure is gone. Every
+ * balloon moves at most BALLOON_STEP and all of them BALLOON_HOST_STEP per pass. */
+static void balloon_reclaim(void)
+{
+    qemu_proc_t *item, *best;
+    double full;
+    uint32_t budget = BALLOON_HOST_STEP, step, room, best_room;
+    bool reclaim;
+
+    if (read_psi("memory", &balloon_ctl.psi, &full) == -1) {
+        return;
+    }
+    balloon_ctl.tick++;
+
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->state == QEMU_RUNNING) {
+            item->rss = read_rss(item->pid);
+        }
+    }
+
+    if (balloon_ctl.psi >= BALLOON_PSI_HIGH) {
+        reclaim = true;
+    } else if (balloon_ctl.psi <= BALLOON_PSI_LOW) {
+        reclaim = false;
+    } else {
+        return;
+    }
+
+    while (budget > 0) {
+        best = NULL;
+        best_room = 0;
+        for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+            /* one move per vm and pass */
+            if (item->state != QEMU_RUNNING || item->profile->balloon_floor == 0 ||
+                    item->balloon_tick == balloon_ctl.tick) {
+                continue;
+            }
+            if (reclaim) {
+                /* at its floor, or its rss unknown */
+                if (item->balloon_target <= item->profile->balloon_floor || item->rss == 0) {
+                    continue;
+                }
+                room = item->balloon_target - item->profile->balloon_floor;
+                /* a guest using little of what it has gives first */
+                if (item->rss < item->balloon_target) {
+                    room += (item->balloon_target - item->rss) / 2;
+                }
+            } else {
+                room = item->mem - item->balloon_target;
+            }
+            if (room > best_room) {
+                best = item;
+                best_room = room;
+            }
+        }
+        if (best == NULL) {
+            break;
+        }
+
+        if (reclaim) {
+            step = best->balloon_target - best->profile->balloon_floor;
+        } else {
+            step = best->mem - best->balloon_target;
+        }
+        step = step < BALLOON_STEP ? step : BALLOON_STEP;
+        step = step < budget ? step : budget;
+        if (step == 0) {
+            best->balloon_tick = balloon_ctl.tick;
+            continue;
+        }
+        budget -= step;
+
+        balloon_set(best, reclaim ? best->balloon_target - step : best->balloon_target + step);
+        best->balloon_tick = balloon_ctl.tick;
+    }
+
+    balloon_ctl.reclaimed = 0;
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        balloon_ctl.reclaimed += item->mem - item->balloon_target;
+    }
+}
+
+static int render_balloon_stats(char *buf, int size)
+{
+    qemu_proc_t *item;
+    int pos;
+
+    if (virt_conf.balloon_interval == 0) {
+        return snprintf(buf, size, "balloon: off\n");
+    }
+
+    pos = snprintf(buf, size, "balloon: every %d s, memory psi %.2f\n"
+            "\tinflates %" PRIu64 ", deflates %" PRIu64 ", failed %" PRIu64 ", reclaimed %" PRIu64 " MB\n",
+            virt_conf.balloon_interval, balloon_ctl.psi, balloon_ctl.inflates,
+            balloon_ctl.deflates, balloon_ctl.failed, balloon_ctl.reclaimed);
+
+    for (item = virt_server.qemu_head; item != NULL && pos < size; item = item->next) {
+        if (item->state != QEMU_RUNNING) {
+            continue;
+        }
+        pos += snprintf(buf + pos, size - pos, "\tvm %d: balloon %u/%u MB, floor %u MB, rss %u MB\n",
+                item->vm_id, item->balloon_target, item->mem,
+                item->profile->balloon_floor, item->rss);
+    }
+
+    return pos;
+}
+
+/* One hotplug step and a look at the guest afterwards: its vCPUs, DIMMs and
+ * available memory. Devices are named after their slot, hp-cpu<n> is vCPU n
+ * and dimm-hp<n>/mem-hp<n> DIMM n with its backend. */
+typedef struct hotplug_job {
+    int vm_id;
+    pid_t pid;
+    HOTPLUG_ACTION_T action;
+    int index;
+    uint32_t from;
+    uint32_t to;
+    double cpu;             /* the trigger */
+    int mem_avail;
+    uint32_t mem_limit;     /* MB of guest RAM its cgroup allows */
+    uint32_t overhead;
+    bool polling;
+    uint32_t backends;
+    /* found afterwards */
+    uint32_t vcpus;
+    bool vcpus_known;
+    uint32_t dimms;
+    bool dimms_known;
+    pid_t tids[VCPU_TIDS_MAX];
+    int nr_tids;
+    int avail;              /* percent, -1 unknown */
+} hotplug_job_t;
+
+static const char *hotplug_action_str[] = {
+    [HOTPLUG_NONE] = "none",
+    [HOTPLUG_CPU_ADD] = "add vCPU",
+    [HOTPLUG_CPU_DEL] = "remove vCPU",
+    [HOTPLUG_MEM_ADD] = "add DIMM",
+    [HOTPLUG_MEM_DEL] = "remove DIMM",
+};
+
+static void hotplug_record(int vm_id, HOTPLUG_ACTION_T action, uint32_t from, uint32_t to,
+        double cpu, int mem_avail, const char *result)
+{
+    hotplug_event_t *ev = &hotplug_ctl.log[hotplug_ctl.logged++ % HOTPLUG_LOG];
+
+    ev->when = time(NULL);
+    ev->vm_id = vm_id;
+    ev->action = action;
+    ev->from = from;
+    ev->to = to;
+    ev->cpu = cpu;
+    ev->mem_avail = mem_avail;
+    ev->result = result;
+    logout("hotplug: vm %d %s, %u -> %u, cpu %.0f%%, memory available %d%%%s%s\n", vm_id,
+            hotplug_action_str[action], from, to, cpu * 100, mem_avail,
+            result ? ": " : "", result ? result : "");
+}
+
+/* The first empty slot of query-hotpluggable-cpus, plugged with its own props. */
+static int hotplug_cpu_add(int fd, int index)
+{
+    char reply[8192];
+    char cmd[512];
+    char type[64];
+    char *pos, *end, *props, *type_pos;
+    int depth, len;
+
+    if (qmp_execute(fd, "{\"execute\":\"query-hotpluggable-cpus\"}", reply, sizeof(reply)) < 0) {
+        return -EIO;
+    }
+
+    /* one object per slot in the array, the ones with a qom-path are taken */
+    pos = strchr(reply, '[');
+    while (pos != NULL && (pos = strchr(pos, '{')) != NULL) {
+        for (end = pos, depth = 0; *end != '\0'; end++) {
+            if (*end == '{') {
+                depth++;
+            } else if (*end == '}' && --depth == 0) {
+                break;
+            }
+        }
+        if (*end == '\0') {
+            break;
+        }
+        *end = '\0';
+
+        props = strstr(pos, "\"props\":");
+        type_pos = strstr(pos, "\"type\":");
+        if (strstr(pos, "\"qom-path\":") == NULL && props != NULL && type_pos != NULL &&
+                sscanf(type_pos, "\"type\": \"%63[^\"]\"", type) == 1 &&
+                (props = strchr(props, '{')) != NULL) {
+            len = strcspn(props + 1, "}");
+            snprintf(cmd, sizeof(cmd),
+                    "{\"execute\":\"device_add\",\"arguments\":{\"driver\":\"%s\",\"id\":\"hp-cpu%d\",%.*s}}",
+                    type, index, len, props + 1);
+            if (qmp_execute(fd, cmd, reply, sizeof(reply)) < 0) {
+                logout("hotplug: hp-cpu%d: %s\n", index, reply);
+                return -EIO;
+            }
+            return 0;
+        }
+        pos = end + 1;
+    }
+
+    return -ENOSPC;
+}
+
+static int hotplug_mem_add(int fd, int index, uint32_t *backends)
+{
+    char reply[1024];
+    char cmd[256];
+
+    snprintf(cmd, sizeof(cmd), "{\"execute\":\"object-add\",\"arguments\":{\"qom-type\":"
+            "\"memory-backend-ram\",\"id\":\"mem-hp%d\",\"size\":%" PRIu64 "}}", index,
+            (uint64_t)DIMM_SIZE << 20);
+    if (qmp_execute(fd, cmd, reply, sizeof(reply)) < 0) {
+        logout("hotplug: mem-hp%d: %s\n", index, reply);
+        return -EIO;
+    }
+    *backends |= 1U << index;
+
+    snprintf(cmd, sizeof(cmd), "{\"execute\":\"device_add\",\"arguments\":{\"driver\":\"pc-dimm\","
+            "\"id\":\"dimm-hp%d\",\"memdev\":\"mem-hp%d\"}}", index, index);
+    if (qmp_execute(fd, cmd, reply, sizeof(reply)) < 0) {
+        logout("hotplug: dimm-hp%d: %s\n", index, reply);
+        /* the backend is freed with the look afterwards */
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* Unplugging asks the guest, the device stays until it lets go. */
+static int hotplug_device_del(int fd, const char *id)
+{
+    char reply[1024];
+    char cmd[128];
+
+    snprintf(cmd, sizeof(cmd), "{\"execute\":\"device_del\",\"arguments\":{\"id\":\"%s\"}}", id);
+    if (qmp_execute(fd, cmd, reply, sizeof(reply)) < 0) {
+        logout("hotplug: %s: %s\n", id, reply);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static long long qmp_number(const char *reply, const char *key)
+{
+    const char *pos = strstr(reply, key);
+
+    return pos ? strtoll(pos + strlen(key), NULL, 10) : -1;
+}
+
+static void hotplug_look(int fd, hotplug_job_t *data)
+{
+    char reply[8192];
+    char cmd[256];
+    char id[32];
+    long long avail, total;
+    char *pos;
+    pid_t tid;
+    int i;
+
+    /* a plugged vCPU's qom-path ends in its id */
+    if (qmp_execute(fd, "{\"execute\":\"query-hotpluggable-cpus\"}", reply, sizeof(reply)) == 0) {
+        data->vcpus_known = true;
+        for (i = 0; i < 32; i++) {
+            snprintf(id, sizeof(id), "/hp-cpu%d\"", i);
+            if (strstr(reply, id) != NULL) {
+                data->vcpus |= 1U << i;
+            }
+        }
+    }
+
+    if (qmp_execute(fd, "{\"execute\":\"query-cpus-fast\"}", reply, sizeof(reply)) == 0) {
+        for (pos = strstr(reply, "\"thread-id\":"); pos != NULL && data->nr_tids < VCPU_TIDS_MAX;
+                pos = strstr(pos + 1, "\"thread-id\":")) {
+            tid = atoi(pos + strlen("\"thread-id\":"));
+            if (tid > 0) {
+                data->tids[data->nr_tids++] = tid;
+            }
+        }
+    }
+
+    if (qmp_execute(fd, "{\"execute\":\"query-memory-devices\"}", reply, sizeof(reply)) == 0) {
+        data->dimms_known = true;
+        for (i = 0; i < DIMM_MAX; i++) {
+            snprintf(id, sizeof(id), "\"dimm-hp%d\"", i);
+            if (strstr(reply, id) != NULL) {
+                data->dimms |= 1U << i;
+            }
+        }
+        /* a backend whose DIMM is gone is freed, that's the end of an unplug */
+        for (i = 0; i < DIMM_MAX; i++) {
+            if (!(data->backends & (1U << i)) || (data->dimms & (1U << i))) {
+                continue;
+            }
+            snprintf(cmd, sizeof(cmd), "{\"execute\":\"object-del\",\"arguments\":{\"id\":\"mem-hp%d\"}}", i);
+            if (qmp_execute(fd, cmd, reply, sizeof(reply)) == 0) {
+                data->backends &= ~(1U << i);
+            }
+        }
+    }
+
+    snprintf(cmd, sizeof(cmd), "{\"execute\":\"qom-get\",\"arguments\":{\"path\":"
+            "\"/machine/peripheral/balloon0\",\"property\":\"guest-stats\"}}");
+    if (qmp_execute(fd, cmd, reply, sizeof(reply)) == 0) {
+        avail = qmp_number(reply, "\"stat-available-memory\":");
+        if (avail < 0) {
+            avail = qmp_number(reply, "\"stat-free-memory\":");
+        }
+        total = qmp_number(reply, "\"stat-total-memory\":");
+        if (avail >= 0 && total > 0) {
+            data->avail = avail * 100 / total;
+        }
+    }
+}
+
+static void hotplug_work(job_t *job)
+{
+    hotplug_job_t *data = job->data;
+    char path[PATH_MAX];
+    char cmd[256];
+    char reply[1024];
+    char id[32];
+    int fd;
+
+    fd = qmp_open(data->vm_id);
+    if (fd < 0) {
+        job->result = fd;
+        return;
+    }
+
+    /* the balloon reports guest memory only when asked to poll it */
+    if (!data->polling) {
+        snprintf(cmd, sizeof(cmd), "{\"execute\":\"qom-set\",\"arguments\":{\"path\":"
+                "\"/machine/peripheral/balloon0\",\"property\":\"guest-stats-polling-interval\","
+                "\"value\":%d}}", virt_conf.hotplug_interval);
+        data->polling = qmp_execute(fd, cmd, reply, sizeof(reply)) == 0;
+    }
+
+    cgroup_path(data->vm_id, path, sizeof(path));
+    switch (data->action) {
+        case HOTPLUG_CPU_ADD:
+            job->result = hotplug_cpu_add(fd, data->index);
+            break;
+        case HOTPLUG_CPU_DEL:
+            snprintf(id, sizeof(id), "hp-cpu%d", data->index);
+            job->result = hotplug_device_del(fd, id);
+            break;
+        case HOTPLUG_MEM_ADD:
+            /* qemu may grow by the DIMM before the guest sees it */
+            if (data->overhead) {
+                cgroup_set_mem(path, data->mem_limit, data->overhead);
+            }
+            job->result = hotplug_mem_add(fd, data->index, &data->backends);
+            break;
+        case HOTPLUG_MEM_DEL:
+            snprintf(id, sizeof(id), "dimm-hp%d", data->index);
+            job->result = hotplug_device_del(fd, id);
+            break;
+        case HOTPLUG_NONE:
+            break;
+    }
+
+    hotplug_look(fd, data);
+    close(fd);
+
+    if (data->action != HOTPLUG_MEM_ADD && data->overhead) {
+        cgroup_set_mem(path, data->mem_limit, data->overhead);
+    }
+}
+
+/* Follow what the guest really has: failed plugs and finished unplugs give
+ * their capacity back. */
+static void hotplug_done(job_t *job)
+{
+    hotplug_job_t *data = job->data;
+    qemu_proc_t *qemu_proc = find_qemu_proc(data->vm_id);
+    qemu_profile_t *profile;
+    uint32_t smp, mem;
+    bool moved = false;
+
+    if (qemu_proc == NULL || qemu_proc->pid != data->pid) {
+        free(job->data);
+        return;
+    }
+    profile = qemu_proc->profile;
+    qemu_proc->hp_busy = false;
+    qemu_proc->hp_polling = data->polling;
+    qemu_proc->hp_mem_avail = data->avail;
+    qemu_proc->hp_backends = data->backends;
+
+    if (data->action != HOTPLUG_NONE) {
+        hotplug_record(data->vm_id, data->action, data->from, data->to, data->cpu, data->mem_avail,
+                job->result < 0 ? strerror(-job->result) : NULL);
+        if (job->result < 0) {
+            hotplug_ctl.failed++;
+        }
+    }
+
+    if (data->vcpus_known) {
+        qemu_proc->hp_vcpus = data->vcpus;
+        qemu_proc->hp_vcpus_going &= data->vcpus;
+    }
+    if (data->action == HOTPLUG_CPU_DEL && job->result == 0) {
+        qemu_proc->hp_vcpus_going |= (1U << data->index) & qemu_proc->hp_vcpus;
+    }
+    /* other threads, the load is measured afresh from the next sample */
+    if (data->nr_tids > 0 && (data->nr_tids != qemu_proc->nr_vcpu_tids ||
+            memcmp(data->tids, qemu_proc->vcpu_tids, data->nr_tids * sizeof(pid_t)) != 0)) {
+        memcpy(qemu_proc->vcpu_tids, data->tids, data->nr_tids * sizeof(pid_t));
+        qemu_proc->nr_vcpu_tids = data->nr_tids;
+        qemu_proc->vcpu_run_ns = 0;
+    }
+    if (data->dimms_known) {
+        qemu_proc->hp_dimms = data->dimms;
+    }
+    smp = profile->smp + __builtin_popcount(qemu_proc->hp_vcpus);
+    mem = profile->mem + __builtin_popcount(qemu_proc->hp_dimms) * DIMM_SIZE;
+    if (smp != qemu_proc->smp || mem != qemu_proc->mem) {
+        if (sched_resize(qemu_proc, smp, mem) == FIT_OK) {
+            if (smp < qemu_proc->smp) {
+                hotplug_ctl.cpu_dels++;
+            }
+            if (mem < qemu_proc->mem) {
+                hotplug_ctl.mem_dels++;
+            }
+            moved = smp != qemu_proc->smp;
+            qemu_proc->smp = smp;
+            qemu_proc->mem = mem;
+        } else {
+            logout("hotplug: vm %d has %u vCPUs and %u MB, more than it holds\n",
+                    data->vm_id, smp, mem);
+        }
+    }
+    /* a deflated balloon stays deflated, an inflated one keeps its target */
+    if (qemu_proc->balloon_target > qemu_proc->mem ||
+            (data->action == HOTPLUG_MEM_ADD && qemu_proc->balloon_target == data->from)) {
+        qemu_proc->balloon_target = qemu_proc->mem;
+    }
+
+    if (data->action == HOTPLUG_CPU_ADD && job->result == 0) {
+        hotplug_ctl.cpu_adds++;
+        moved = true;
+    } else if (data->action == HOTPLUG_MEM_ADD && job->result == 0) {
+        hotplug_ctl.mem_adds++;
+    }
+    /* new vCPU threads, or fewer cores */
+    if (moved) {
+        submit_affinity(qemu_proc);
+    }
+
+    free(job->data);
+}
+
+static void hotplug_submit(qemu_proc_t *qemu_proc, HOTPLUG_ACTION_T action, int index,
+        uint32_t from, uint32_t to)
+{
+    hotplug_job_t *data = calloc(1, sizeof(hotplug_job_t));
+    job_t *job = data ? job_new("hotplug", hotplug_work, hotplug_done, data) : NULL;
+
+    if (job == NULL) {
+        free(data);
+        return;
+    }
+
+    data->vm_id = qemu_proc->vm_id;
+    data->pid = qemu_proc->pid;
+    data->action = action;
+    data->index = index;
+    data->from = from;
+    data->to = to;
+    data->cpu = qemu_proc->hp_cpu;
+    data->mem_avail = qemu_proc->hp_mem_avail;
+    data->mem_limit = qemu_proc->mem;
+    data->overhead = qemu_proc->profile->mem_overhead;
+    data->polling = qemu_proc->hp_polling;
+    data->backends = qemu_proc->hp_backends;
+    data->avail = -1;
+    if (job_submit_qmp(job, qemu_proc->vm_id) == -1) {
+        job_cancel(job, -EBUSY);
+        return;
+    }
+    qemu_proc->hp_busy = true;
+}
+
+static void hotplug_count(double val, double high, double low, int *up, int *down)
+{
+    if (val >= high) {
+        (*up)++;
+        *down = 0;
+    } else if (val <= low) {
+        (*down)++;
+        *up = 0;
+    } else {
+        *up = *down = 0;
+    }
+}
+
+/* Grow when a trigger held HOTPLUG_UP_PASSES intervals, shrink after
+ * HOTPLUG_DOWN_PASSES; one step per vm and interval, vCPUs first. */
+static HOTPLUG_ACTION_T hotplug_decide(qemu_proc_t *qemu_proc)
+{
+    qemu_profile_t *profile = qemu_proc->profile;
+    /* the balloon owns the RAM of a guest it inflated */
+    bool mem_free = qemu_proc->balloon_target == qemu_proc->mem;
+
+    hotplug_count(qemu_proc->hp_cpu, HOTPLUG_CPU_HIGH, HOTPLUG_CPU_LOW,
+            &qemu_proc->hp_cpu_up, &qemu_proc->hp_cpu_down);
+    if (qemu_proc->hp_mem_avail >= 0) {
+        /* little available is high demand */
+        hotplug_count(100 - qemu_proc->hp_mem_avail, 100 - HOTPLUG_MEM_LOW, 100 - HOTPLUG_MEM_HIGH,
+                &qemu_proc->hp_mem_up, &qemu_proc->hp_mem_down);
+    } else {
+        qemu_proc->hp_mem_up = qemu_proc->hp_mem_down = 0;
+    }
+
+    if (qemu_proc->hp_cpu_up >= HOTPLUG_UP_PASSES && qemu_proc->smp < profile->max_smp) {
+        return HOTPLUG_CPU_ADD;
+    }
+    if (qemu_proc->hp_mem_up >= HOTPLUG_UP_PASSES && mem_free &&
+            __builtin_popcount(qemu_proc->hp_dimms | qemu_proc->hp_backends) < profile_dimm_slots(profile)) {
+        return HOTPLUG_MEM_ADD;
+    }
+    if (qemu_proc->hp_cpu_down >= HOTPLUG_DOWN_PASSES && qemu_proc->hp_vcpus != 0) {
+        return HOTPLUG_CPU_DEL;
+    }
+    if (qemu_proc->hp_mem_down >= HOTPLUG_DOWN_PASSES && mem_free && qemu_proc->hp_dimms != 0) {
+        return HOTPLUG_MEM_DEL;
+    }
+
+    return HOTPLUG_NONE;
+}
+
+/* Periodic pass: sample every vm with hotplug headroom and take at most one
+ * step on it, the capacity for a plug is taken before the plug. */
+static void hotplug_scale(void)
+{
+    HOTPLUG_ACTION_T action;
+    qemu_proc_t *item;
+    SCHED_FIT_T fit;
+    uint32_t from = 0, to = 0;
+    int index;
+
+    hotplug_ctl.tick++;
+
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->state != QEMU_RUNNING || !item->started || !item->admitted ||
+                !profile_hotplug(item->profile) || item->hp_busy) {
+            continue;
+        }
+
+        sample_vm_load(item);
+        action = hotplug_decide(item);
+        index = -1;
+        fit = FIT_OK;
+        switch (action) {
+            case HOTPLUG_CPU_ADD:
+                for (index = 0; item->hp_vcpus & (1U << index); index++) {
+                }
+                from = item->smp;
+                to = item->smp + 1;
+                fit = sched_resize(item, to, item->mem);
+                if (fit == FIT_OK) {
+                    item->smp = to;
+                    item->hp_vcpus |= 1U << index;
+                }
+                item->hp_cpu_up = 0;
+                break;
+            case HOTPLUG_CPU_DEL:
+                /* last in, first out */
+                index = 31 - __builtin_clz(item->hp_vcpus);
+                from = item->smp;
+                to = item->smp - 1;
+                item->hp_cpu_down = 0;
+                break;
+            case HOTPLUG_MEM_ADD:
+                for (index = 0; (item->hp_dimms | item->hp_backends) & (1U << index); index++) {
+                }
+                from = item->mem;
+                to = item->mem + DIMM_SIZE;
+                fit = sched_resize(item, item->smp, to);
+                if (fit == FIT_OK) {
+                    item->mem = to;
+                    item->hp_dimms |= 1U << index;
+                }
+                item->hp_mem_up = 0;
+                break;
+            case HOTPLUG_MEM_DEL:
+                index = 31 - __builtin_clz(item->hp_dimms);
+                from = item->mem;
+                to = item->mem - DIMM_SIZE;
+                item->hp_mem_down = 0;
+                break;
+            case HOTPLUG_NONE:
+                break;
+        }
+
+        if (fit != FIT_OK) {
+            hotplug_ctl.refused++;
+            hotplug_record(item->vm_id, action, from, to, item->hp_cpu, item->hp_mem_avail,
+                    sched_fit_str(fit));
+            action = HOTPLUG_NONE;
+        }
+        /* with no step a job only looks: for the vCPU threads, an unplug the guest
+         * still owes, or the guest memory stats a DIMM decision needs */
+        if (action == HOTPLUG_NONE && item->nr_vcpu_tids != 0 && item->hp_vcpus_going == 0 &&
+                item->profile->max_mem <= item->profile->mem) {
+            continue;
+        }
+        hotplug_submit(item, action, index, from, to);
+    }
+}
+
+static int render_hotplug_stats(char *buf, int size)
+{
+    hotplug_event_t *ev;
+    qemu_proc_t *item;
+    struct tm tm;
+    char when[16];
+    uint64_t i;
+    int pos;
+
+    if (virt_conf.hotplug_interval == 0) {
+        return snprintf(buf, size, "hotplug: off\n");
+    }
+
+    pos = snprintf(buf, size, "hotplug: every %d s, %" PRIu64 " passes\n"
+            "\tvCPU +%" PRIu64 " -%" PRIu64 ", DIMM +%" PRIu64 " -%" PRIu64 ", "
+            "refused %" PRIu64 ", failed %" PRIu64 "\n",
+            virt_conf.hotplug_interval, hotplug_ctl.tick, hotplug_ctl.cpu_adds,
+            hotplug_ctl.cpu_dels, hotplug_ctl.mem_adds, hotplug_ctl.mem_dels,
+            hotplug_ctl.refused, hotplug_ctl.failed);
+
+    for (item = virt_server.qemu_head; item != NULL && pos < size; item = item->next) {
+        if (item->state != QEMU_RUNNING || !profile_hotplug(item->profile)) {
+            continue;
+        }
+        pos += snprintf(buf + pos, size - pos,
+                "\tvm %d: vCPU %u [%u-%u] busy %.0f%%, memory %u MB [%u-%u] available %d%%\n",
+                item->vm_id, item->smp, item->profile->smp, item->profile->max_smp,
+                item->hp_cpu * 100, item->mem, item->profile->mem,
+                item->profile->mem + profile_dimm_slots(item->profile) * DIMM_SIZE,
+                item->hp_mem_avail);
+    }
+
+    /* newest first */
+    for (i = hotplug_ctl.logged; i > 0 && hotplug_ctl.logged - i < HOTPLUG_LOG && pos < size; i--) {
+        ev = &hotplug_ctl.log[(i - 1) % HOTPLUG_LOG];
+        localtime_r(&ev->when, &tm);
+        strftime(when, sizeof(when), "%H:%M:%S", &tm);
+        pos += snprintf(buf + pos, size - pos,
+                "\t%s vm %d %s %u -> %u, busy %.0f%%, available %d%%%s%s\n", when, ev->vm_id,
+                hotplug_action_str[ev->action], ev->from, ev->to, ev->cpu * 100, ev->mem_avail,
+                ev->result ? ": " : "", ev->result ? ev->result : "");
+    }
+
+    return pos;
+}
+
+/* Guest disk throttling. qemu gets the limits with the -drive throttling.*
+ * options at launch and through block_set_io_throttle afterwards. The budget
+ * of an I/O group is shared out among its vms on this host every interval:
+ * each member what it used plus headroom, what's left evenly on top, so the
+ * members never get more than the budget together. */
+typedef struct io_job {
+    int vm_id;
+    pid_t pid;
+    bool apply;
+    io_limits_t limits;
+    /* found afterwards */
+    bool sampled;
+    uint64_t ops;
+    uint64_t bytes;
+    struct timespec when;
+} io_job_t;
+
+static uint32_t io_min(uint32_t a, uint32_t b)
+{
+    if (a == 0 || b == 0) {
+        return a + b;
+    }
+    return a < b ? a : b;
+}
+
+/* the rate a burst reaches, the sustained one without a burst */
+static uint32_t io_peak(uint32_t rate, uint32_t burst)
+{
+    return rate == 0 ? 0 : burst > rate ? burst : rate;
+}
+
+/* as qemu takes them: a burst above a sustained rate, lasting a second at least */
+static void io_normalize(io_limits_t *io)
+{
+    if (io->iops == 0 || io->iops_burst <= io->iops) {
+        io->iops_burst = 0;
+    }
+    if (io->mbps == 0 || io->mbps_burst <= io->mbps) {
+        io->mbps_burst = 0;
+    }
+    if (io->iops_burst == 0 && io->mbps_burst == 0) {
+        io->burst = 0;
+    } else if (io->burst == 0) {
+        io->burst = 1;
+    }
+}
+
+/* the tighter of two limits */
+static void io_combine(io_limits_t *io, const io_limits_t *a, const io_limits_t *b)
+{
+    io->iops = io_min(a->iops, b->iops);
+    io->iops_burst = io_min(io_peak(a->iops, a->iops_burst), io_peak(b->iops, b->iops_burst));
+    io->mbps = io_min(a->mbps, b->mbps);
+    io->mbps_burst = io_min(io_peak(a->mbps, a->mbps_burst), io_peak(b->mbps, b->mbps_burst));
+    io->burst = io_min(a->burst, b->burst);
+    io_normalize(io);
+}
+
+/* its own limits or the profile's, within its share of the group's */
+static void io_target(const qemu_proc_t *qemu_proc, io_limits_t *io)
+{
+    const io_vm_conf_t *conf = &io_ctl.vm[qemu_proc->vm_id];
+    const io_limits_t *own = conf->own ? &conf->limits : &qemu_proc->profile->io;
+
+    if (conf->group != NULL) {
+        io_combine(io, own, &qemu_proc->io_share);
+    } else {
+        *io = *own;
+        io_normalize(io);
+    }
+}
+
+static bool io_differs(uint32_t a, uint32_t b)
+{
+    if (a == 0 || b == 0) {
+        return a != b;
+    }
+    return (a > b ? a - b : b - a) > IO_RETUNE * b;
+}
+
+static bool io_changed(const io_limits_t *a, const io_limits_t *b)
+{
+    return io_differs(a->iops, b->iops) || io_differs(a->iops_burst, b->iops_burst) ||
+            io_differs(a->mbps, b->mbps) || io_differs(a->mbps_burst, b->mbps_burst) ||
+            a->burst != b->burst;
+}
+
+/* Water-filling: members wanting less than an even share of what's left get
+ * what they want, the others split the rest. Anything still left when all
+ * are satisfied goes evenly on top. */
+static void io_split(double budget, const double *want, double *share, int n)
+{
+    bool done[MAX_VM_NUM] = { false };
+    double left = budget;
+    int i, nr_left = n;
+    bool more = true;
+
+    while (more && nr_left > 0) {
+        more = false;
+        for (i = 0; i < n; i++) {
+            if (!done[i] && want[i] <= left / nr_left) {
+                share[i] = want[i];
+                left -= want[i];
+                done[i] = true;
+                nr_left--;
+                more = true;
+            }
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!done[i]) {
+            share[i] = left / nr_left;
+        } else if (nr_left == 0) {
+            share[i] += left / n;
+        }
+    }
+}
+
+/* one budget, 0 unlimited, over members that ran at rate[i] */
+static void io_shares(uint32_t budget, const double *rate, uint32_t *share, int n)
+{
+    double want[MAX_VM_NUM], split[MAX_VM_NUM];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        want[i] = rate[i] * IO_GROUP_HEADROOM;
+        if (want[i] < budget * IO_GROUP_FLOOR) {
+            want[i] = budget * IO_GROUP_FLOOR;
+        }
+    }
+    io_split(budget, want, split, n);
+
+    for (i = 0; i < n; i++) {
+        share[i] = budget == 0 ? 0 : split[i] < 1 ? 1 : split[i];
+    }
+}
+
+/* A member's burst is the group's burst scaled down to its share. */
+static void io_group_share(io_group_t *group)
+{
+    const io_limits_t *budget = &group->limits;
+    qemu_proc_t *members[MAX_VM_NUM];
+    double iops[MAX_VM_NUM], mbps[MAX_VM_NUM];
+    uint32_t iops_share[MAX_VM_NUM], mbps_share[MAX_VM_NUM];
+    qemu_proc_t *item;
+    io_limits_t *share;
+    int i, n = 0;
+
+    group->iops = group->mbps = 0;
+    for (item = virt_server.qemu_head; item != NULL && n < MAX_VM_NUM; item = item->next) {
+        if (io_ctl.vm[item->vm_id].group != group) {
+            continue;
+        }
+        iops[n] = item->io_iops;
+        mbps[n] = item->io_mbps;
+        group->iops += item->io_iops;
+        group->mbps += item->io_mbps;
+        members[n++] = item;
+    }
+    group->members = n;
+    if (n == 0) {
+        return;
+    }
+
+    io_shares(budget->iops, iops, iops_share, n);
+    io_shares(budget->mbps, mbps, mbps_share, n);
+    for (i = 0; i < n; i++) {
+        share = &members[i]->io_share;
+        share->iops = iops_share[i];
+        share->iops_burst = budget->iops ? (uint64_t)budget->iops_burst * iops_share[i] / budget->iops : 0;
+        share->mbps = mbps_share[i];
+        share->mbps_burst = budget->mbps ? (uint64_t)budget->mbps_burst * mbps_share[i] / budget->mbps : 0;
+        share->burst = budget->burst;
+        io_normalize(share);
+    }
+}
+
+static int io_throttle(int fd, const io_limits_t *io)
+{
+    char cmd[512];
+    char reply[1024];
+    int pos;
+
+    /* the whole set, what's left out is unlimited */
+    pos = snprintf(cmd, sizeof(cmd), "{\"execute\":\"block_set_io_throttle\",\"arguments\":{"
+            "\"id\":\"virtio-disk0-0-0\",\"iops\":%u,\"iops_rd\":0,\"iops_wr\":0,"
+            "\"bps\":%" PRIu64 ",\"bps_rd\":0,\"bps_wr\":0", io->iops, (uint64_t)io->mbps << 20);
+    if (io->iops_burst) {
+        pos += snprintf(cmd + pos, sizeof(cmd) - pos, ",\"iops_max\":%u,\"iops_max_length\":%u",
+                io->iops_burst, io->burst);
+    }
+    if (io->mbps_burst) {
+        pos += snprintf(cmd + pos, sizeof(cmd) - pos, ",\"bps_max\":%" PRIu64 ",\"bps_max_length\":%u",
+                (uint64_t)io->mbps_burst << 20, io->burst);
+    }
+    snprintf(cmd + pos, sizeof(cmd) - pos, "}}");
+
+    if (qmp_execute(fd, cmd, reply, sizeof(reply)) < 0) {
+        logout("io: %s\n", reply);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static void io_blockstats(int fd, io_job_t *data)
+{
+    char reply[16384];
+    const char *dev;
+    long long rd, wr, rd_ops, wr_ops;
+
+    if (qmp_execute(fd, "{\"execute\":\"query-blockstats\"}", reply, sizeof(reply)) < 0) {
+        return;
+    }
+
+    /* the disk's stats come before the ones of the nodes below it */
+    dev = strstr(reply, "\"drive-virtio-disk0-0-0\"");
+    if (dev == NULL) {
+        return;
+    }
+    rd = qmp_number(dev, "\"rd_bytes\":");
+    wr = qmp_number(dev, "\"wr_bytes\":");
+    rd_ops = qmp_number(dev, "\"rd_operations\":");
+    wr_ops = qmp_number(dev, "\"wr_operations\":");
+    if (rd < 0 || wr < 0 || rd_ops < 0 || wr_ops < 0) {
+        return;
+    }
+
+    data->sampled = true;
+    data->bytes = rd + wr;
+    data->ops = rd_ops + wr_ops;
+    clock_gettime(CLOCK_MONOTONIC, &data->when);
+}
+
+static void io_work(job_t *job)
+{
+    io_job_t *data = job->data;
+    int fd;
+
+    fd = qmp_open(data->vm_id);
+    if (fd < 0) {
+        job->result = fd;
+        return;
+    }
+
+    if (data->apply) {
+        job->result = io_throttle(fd, &data->limits);
+    }
+    io_blockstats(fd, data);
+    close(fd);
+}
+
+static void io_submit(qemu_proc_t *qemu_proc, bool sample);
+
+static void io_done(job_t *job)
+{
+    io_job_t *data = job->data;
+    qemu_proc_t *qemu_proc = find_qemu_proc(data->vm_id);
+    double secs;
+
+    if (qemu_proc == NULL || qemu_proc->pid != data->pid) {
+        free(job->data);
+        return;
+    }
+    qemu_proc->io_busy = false;
+
+    if (data->apply && job->result == 0) {
+        qemu_proc->io = data->limits;
+        io_ctl.retunes++;
+    } else if (data->apply) {
+        io_ctl.failed++;
+        logout("io: vm %d keeps its throttling (%s)\n", data->vm_id, strerror(-job->result));
+    }
+
+    if (data->sampled) {
+        if (qemu_proc->io_sampled.tv_sec != 0 && data->ops >= qemu_proc->io_ops &&
+                data->bytes >= qemu_proc->io_bytes) {
+            secs = ts_diff_ns(&qemu_proc->io_sampled, &data->when) / 1e9;
+            if (secs > 0) {
+                qemu_proc->io_iops = (data->ops - qemu_proc->io_ops) / secs;
+                qemu_proc->io_mbps = (data->bytes - qemu_proc->io_bytes) / secs / (1 << 20);
+            }
+        }
+        qemu_proc->io_ops = data->ops;
+        qemu_proc->io_bytes = data->bytes;
+        qemu_proc->io_sampled = data->when;
+    }
+    free(job->data);
+
+    if (qemu_proc->io_dirty) {
+        qemu_proc->io_dirty = false;
+        io_submit(qemu_proc, false);
+    }
+}
+
+/* Change the vm's throttling if its target moved, and sample its disk when asked. */
+static void io_submit(qemu_proc_t *qemu_proc, bool sample)
+{
+    io_limits_t target;
+    io_job_t *data;
+    job_t *job;
+    bool apply;
+
+    io_target(qemu_proc, &target);
+    apply = io_changed(&target, &qemu_proc->io);
+    if (!apply && !sample) {
+        return;
+    }
+    if (qemu_proc->io_busy) {
+        qemu_proc->io_dirty |= apply;
+        return;
+    }
+
+    data = calloc(1, sizeof(io_job_t));
+    job = data ? job_new("io", io_work, io_done, data) : NULL;
+    if (job == NULL) {
+        free(data);
+        return;
+    }
+
+    data->vm_id = qemu_proc->vm_id;
+    data->pid = qemu_proc->pid;
+    data->apply = apply;
+    data->limits = target;
+    if (job_submit_qmp(job, qemu_proc->vm_id) == -1) {
+        job_cancel(job, -EBUSY);
+        return;
+    }
+    qemu_proc->io_busy = true;
+}
+
+static void io_retune(bool sample)
+{
+    qemu_proc_t *item;
+    int i;
+
+    for (i = 0; i < IO_GROUPS; i++) {
+        if (io_ctl.groups[i].name[0] != '\0') {
+            io_group_share(&io_ctl.groups[i]);
+        }
+    }
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->state == QEMU_RUNNING && item->started) {
+            io_submit(item, sample);
+        }
+    }
+}
+
+static void io_tick(void)
+{
+    io_ctl.tick++;
+    io_retune(true);
+}
+
+/* the throttling a vm boots with, its group shared out with it counted in */
+static void io_launch(qemu_proc_t *qemu_proc)
+{
+    io_group_t *group = io_ctl.vm[qemu_proc->vm_id].group;
+
+    if (group != NULL) {
+        io_group_share(group);
+    }
+    io_target(qemu_proc, &qemu_proc->io);
+}
+
+/* NULL if there's none by that name, and no room for it when create is set */
+static io_group_t *io_group_find(const char *name, bool create)
+{
+    io_group_t *free_slot = NULL;
+    int i;
+
+    for (i = 0; i < IO_GROUPS; i++) {
+        if (strcmp(io_ctl.groups[i].name, name) == 0) {
+            return &io_ctl.groups[i];
+        }
+        if (free_slot == NULL && io_ctl.groups[i].name[0] == '\0') {
+            free_slot = &io_ctl.groups[i];
+        }
+    }
+    if (create && free_slot != NULL) {
+        memset(free_slot, 0, sizeof(io_group_t));
+        strcpy(free_slot->name, name);
+        return free_slot;
+    }
+
+    return NULL;
+}
+
+static void io_limits_from(io_limits_t *io, const int *val)
+{
+    io->iops = val[0];
+    io->iops_burst = val[1];
+    io->mbps = val[2];
+    io->mbps_burst = val[3];
+    io->burst = val[4];
+}
+
+/* MES_SET_IO_LIMITS, see virt-proto.h */
+static void set_io_limits(void)
+{
+    char name[MAX_IO_GROUP];
+    io_vm_conf_t *conf;
+    io_group_t *group = NULL;
+    int val[5];
+    int vm_id, i;
+
+    vm_id = recv_vm_id();
+    for (i = 0; i < ARRAY_SIZE(val); i++) {
+        if (recv_int(&val[i]) == -1) {
+            return;
+        }
+    }
+    if (recv_string(name, sizeof(name)) == -1 || vm_id == -1) {
+        return;
+    }
+
+    if (strcmp(name, "-") != 0) {
+        group = io_group_find(name, false);
+        if (group == NULL) {
+            logout("io: vm %d can't join I/O group %s, it has no budget\n", vm_id, name);
+            send_int(-1);
+            return;
+        }
+    }
+
+    conf = &io_ctl.vm[vm_id];
+    conf->own = true;
+    for (i = 0; i < ARRAY_SIZE(val); i++) {
+        if (val[i] < 0) {
+            conf->own = false;
+        }
+    }
+    if (conf->own) {
+        io_limits_from(&conf->limits, val);
+    }
+    conf->group = group;
+    logout("io: vm %d has %s limits%s%s\n", vm_id, conf->own ? "its own" : "its profile's",
+            group ? ", group " : "", group ? group->name : "");
+
+    io_retune(false);
+    send_int(0);
+}
+
+/* MES_SET_IO_GROUP, see virt-proto.h */
+static void set_io_group(void)
+{
+    char name[MAX_IO_GROUP];
+    io_group_t *group;
+    int val[5];
+    bool remove = true;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(val); i++) {
+        if (recv_int(&val[i]) == -1) {
+            return;
+        }
+        if (val[i] != 0) {
+            remove = false;
+        }
+    }
+    if (recv_string(name, sizeof(name)) == -1) {
+        return;
+    }
+
+    if (strcmp(name, "-") == 0) {
+        send_int(-1);
+        return;
+    }
+    for (i = 0; i < ARRAY_SIZE(val); i++) {
+        if (val[i] < 0) {
+            logout("io: group %s with a negative limit\n", name);
+            send_int(-1);
+            return;
+        }
+    }
+
+    group = io_group_find(name, !remove);
+    if (remove) {
+        if (group != NULL) {
+            /* its members go back to their own limits */
+            for (i = 0; i < MAX_VM_NUM; i++) {
+                if (io_ctl.vm[i].group == group) {
+                    io_ctl.vm[i].group = NULL;
+                }
+            }
+            group->name[0] = '\0';
+            logout("io: group %s removed\n", name);
+            io_retune(false);
+        }
+        send_int(0);
+        return;
+    }
+    if (group == NULL) {
+        logout("io: no room for group %s, max is %d groups\n", name, IO_GROUPS);
+        send_int(-1);
+        return;
+    }
+
+    io_limits_from(&group->limits, val);
+    logout("io: group %s: %u IOPS, %u MB/s\n", name, group->limits.iops, group->limits.mbps);
+    io_retune(false);
+    send_int(0);
+}
+
+static int io_limits_str(const io_limits_t *io, char *str, int size)
+{
+    int pos = 0;
+
+    if (io->iops == 0 && io->mbps == 0) {
+        return snprintf(str, size, "unlimited");
+    }
+    if (io->iops) {
+        pos += snprintf(str + pos, size - pos, "%u IOPS", io->iops);
+        if (io->iops_burst) {
+            pos += snprintf(str + pos, size - pos, " (%u for %u s)", io->iops_burst, io->burst);
+        }
+    }
+    if (io->mbps && pos < size) {
+        pos += snprintf(str + pos, size - pos, "%s%u MB/s", pos ? ", " : "", io->mbps);
+        if (io->mbps_burst && pos < size) {
+            pos += snprintf(str + pos, size - pos, " (%u for %u s)", io->mbps_burst, io->burst);
+        }
+    }
+
+    return pos;
+}
+
+static int render_io_stats(char *buf, int size)
+{
+    io_group_t *group;
+    qemu_proc_t *item;
+    char limits[128];
+    int i, pos;
+
+    if (virt_conf.io_interval == 0) {
+        pos = snprintf(buf, size, "io: sampling off, %" PRIu64 " retunes, %" PRIu64 " failed\n",
+                io_ctl.retunes, io_ctl.failed);
+    } else {
+        pos = snprintf(buf, size,
+                "io: every %d s, %" PRIu64 " passes, %" PRIu64 " retunes, %" PRIu64 " failed\n",
+                virt_conf.io_interval, io_ctl.tick, io_ctl.retunes, io_ctl.failed);
+    }
+
+    for (item = virt_server.qemu_head; item != NULL && pos < size; item = item->next) {
+        if (item->state != QEMU_RUNNING) {
+            continue;
+        }
+        group = io_ctl.vm[item->vm_id].group;
+        io_limits_str(&item->io, limits, sizeof(limits));
+        pos += snprintf(buf + pos, size - pos, "\tvm %d: %.0f IOPS, %.1f MB/s, limit %s%s%s\n",
+                item->vm_id, item->io_iops, item->io_mbps, limits,
+                group ? ", group " : "", group ? group->name : "");
+    }
+
+    for (i = 0; i < IO_GROUPS && pos < size; i++) {
+        group = &io_ctl.groups[i];
+        if (group->name[0] == '\0') {
+            continue;
+        }
+        io_limits_str(&group->limits, limits, sizeof(limits));
+        pos += snprintf(buf + pos, size - pos, "\tgroup %s: %d vms, %.0f IOPS, %.1f MB/s of %s\n",
+                group->name, group->members, group->iops, group->mbps, limits);
+    }
+
+    return pos;
+}
+
+static void startup_record(qemu_proc_t *qemu_proc, bool timeout)
+{
+    profile_stats_t *stats = &profile_stats[qemu_proc->profile - qemu_profiles];
+    struct timespec now;
+    uint64_t ns;
+
+    qemu_proc->started = true;
+    if (qemu_proc->probe_fd != -1) {
+        close(qemu_proc->probe_fd);
+        qemu_proc->probe_fd = -1;
+    }
+
+    if (timeout) {
+        stats->timeouts++;
+        logout("vm %d: no QMP greeting after %d s\n", qemu_proc->vm_id, STARTUP_TIMEOUT);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = ts_diff_ns(&qemu_proc->launched, &now);
+    if (trace_start()) {
+        trace_span("startup", qemu_proc->vm_id, ts_ns(&qemu_proc->launched), ts_ns(&now));
+    }
+    if (stats->started == 0 || ns < stats->startup_min) {
+        stats->startup_min = ns;
+    }
+    if (ns > stats->startup_max) {
+        stats->startup_max = ns;
+    }
+    stats->startup_ns += ns;
+    stats->started++;
+    logout("vm %d (%s) started in %" PRIu64 " ms\n", qemu_proc->vm_id, qemu_proc->profile->name,
+            ns / 1000000);
+    if (qemu_proc->profile->realtime) {
+        rt_setup(qemu_proc);
+    }
+    if (qemu_proc->numa_guest) {
+        numa_pin_setup(qemu_proc);
+    }
+}
+
+/* qemu accepts on its QMP socket early but only greets once the machine is
+ * built and the main loop runs, so the greeting marks the device model as up.
+ * Poll with non-blocking sockets from the event loop, no worker waits on it. */
+static void startup_probe(void)
+{
+    struct sockaddr_un addr;
+    struct timespec now;
+    qemu_proc_t *item;
+    int ret, starting = 0;
+    char c;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->state != QEMU_RUNNING || item->started) {
+            continue;
+        }
+        starting++;
+        if (ts_diff_ns(&item->launched, &now) > STARTUP_TIMEOUT * 1000000000ULL) {
+            startup_record(item, true);
+            continue;
+        }
+
+        if (item->probe_fd == -1) {
+            item->probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (item->probe_fd == -1) {
+                continue;
+            }
+            qmp_addr(item->vm_id, &addr);
+            if (connect(item->probe_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 &&
+                    errno != EINPROGRESS) {
+                /* socket not there yet */
+                close(item->probe_fd);
+                item->probe_fd = -1;
+                continue;
+            }
+        }
+
+        ret = recv(item->probe_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (ret == 1) {
+            startup_record(item, false);
+        } else if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            close(item->probe_fd);
+            item->probe_fd = -1;
+        }
+    }
+
+    /* launch_done() wakes it for the next vm */
+    if (starting == 0) {
+        periodic_sleep(startup_probe);
+    }
+}
+
+static int render_profile_stats(char *buf, int size)
+{
+    profile_stats_t *stats;
+    qemu_proc_t *item;
+    uint64_t rss, running;
+    int i, pos;
+
+    pos = snprintf(buf, size, "profiles:\n");
+    for (i = 0; i < ARRAY_SIZE(qemu_profiles) && pos < size; i++) {
+        stats = &profile_stats[i];
+        rss = running = 0;
+        for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+            if (item->profile == &qemu_profiles[i] && item->state == QEMU_RUNNING) {
+                rss += read_rss(item->pid);
+                running++;
+            }
+        }
+        pos += snprintf(buf + pos, size - pos,
+                "\t%-8s %s, running %" PRIu64 ", rss avg %" PRIu64 " MB, started %" PRIu64 ", "
+                "startup avg %" PRIu64 " ms (min %" PRIu64 ", max %" PRIu64 "), timeouts %" PRIu64 "\n",
+                qemu_profiles[i].name, qemu_profiles[i].headless ? "headless" : "desktop",
+                running, running ? rss / running : 0, stats->started,
+                stats->started ? stats->startup_ns / stats->started / 1000000 : 0,
+                stats->startup_min / 1000000, stats->startup_max / 1000000, stats->timeouts);
+    }
+
+    return pos;
+}
+
+/* Answer a connection that was held for it, not virt_server.cur; a client that
+ * went away meanwhile is closed. */
+static void conn_send(client_conn_t *conn, const void *buf, int len)
+{
+    if (!conn->connected) {
+        return;
+    }
+    if (send(conn->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len) {
+        logout("virt-client gone before its answer\n");
+        close(conn->fd);
+        conn->fd = -1;
+        conn->connected = false;
+    }
+}
+
+static bool conn_held(const client_conn_t *conn)
+{
+    return conn->wait_vm != -1 || conn->fwd_node != -1 || conn->job_wait;
+}
+
+/* Answer a MES_WAIT_READY and let the connection be read again. The client
+ * may have given up meanwhile, so never raise SIGPIPE here. */
+static void ready_reply(client_conn_t *conn, int val)
+{
+    conn->wait_vm = -1;
+    conn_send(conn, &val, sizeof(val));
+}
+
+static int ready_ms(qemu_proc_t *qemu_proc)
+{
+    return qemu_proc->ready_ns / 1000000;
+}
+
+static void ready_notify(qemu_proc_t *qemu_proc, int val)
+{
+    client_conn_t *conn;
+    int i;
+
+    for (i = 0; i < MAXCONN; i++) {
+        conn = &virt_server.conns[i];
+        if (conn->connected && conn->wait_vm == qemu_proc->vm_id) {
+            ready_reply(conn, val);
+        }
+    }
+}
+
+static void ready_record(qemu_proc_t *qemu_proc, bool timeout)
+{
+    profile_stats_t *stats = &profile_stats[qemu_proc->profile - qemu_profiles];
+    struct timespec now;
+    int bucket;
+
+    if (qemu_proc->qga_fd != -1) {
+        close(qemu_proc->qga_fd);
+        qemu_proc->qga_fd = -1;
+    }
+
+    if (timeout) {
+        qemu_proc->ready_timeout = true;
+        stats->ready_timeouts++;
+        logout("vm %d: guest not ready after %d s\n", qemu_proc->vm_id, virt_conf.ready_timeout);
+        ready_notify(qemu_proc, -ETIMEDOUT);
+        if (virt_conf.boot_max > 0) {
+            boot_kick();
+        }
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    qemu_proc->ready = true;
+    qemu_proc->ready_ns = ts_diff_ns(&qemu_proc->requested, &now);
+    if (trace_start()) {
+        trace_span("ready", qemu_proc->vm_id, ts_ns(&qemu_proc->requested), ts_ns(&now));
+    }
+
+    for (bucket = 0; bucket < READY_BUCKETS - 1; bucket++) {
+        if (qemu_proc->ready_ns < (250000000ULL << bucket)) {
+            break;
+        }
+    }
+    stats->ready_hist[bucket]++;
+    stats->ready_ns += qemu_proc->ready_ns;
+    stats->ready++;
+    if (qemu_proc->prewarm_hot) {
+        stats->ready_warm_ns += qemu_proc->ready_ns;
+        stats->ready_warm++;
+    }
+
+    logout("vm %d (%s) ready in %d ms%s\n", qemu_proc->vm_id, qemu_proc->profile->name,
+            ready_ms(qemu_proc), qemu_proc->prewarm_hot ? ", prewarmed" : "");
+    ready_notify(qemu_proc, ready_ms(qemu_proc));
+    if (virt_conf.prewarm) {
+        prewarm_learn(qemu_proc);
+    }
+    if (virt_conf.boot_max > 0) {
+        boot_kick();
+    }
+}
+
+static void ready_vm_gone(qemu_proc_t *qemu_proc)
+{
+    if (qemu_proc->qga_fd != -1) {
+        close(qemu_proc->qga_fd);
+        qemu_proc->qga_fd = -1;
+    }
+    ready_notify(qemu_proc, -ESRCH);
+}
+
+/* The agent only reads its port once the guest booted far enough to start it,
+ * until then qemu holds our pings back. Any "return" line means it answered. */
+static void ready_read(qemu_proc_t *qemu_proc)
+{
+    char *line, *end;
+    int ret;
+
+    ret = recv(qemu_proc->qga_fd, qemu_proc->qga_buf + qemu_proc->qga_len,
+            sizeof(qemu_proc->qga_buf) - 1 - qemu_proc->qga_len, MSG_DONTWAIT);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (ret <= 0) {
+        /* qemu dropped the channel, connect again on the next probe */
+        close(qemu_proc->qga_fd);
+        qemu_proc->qga_fd = -1;
+        qemu_proc->qga_len = 0;
+        return;
+    }
+
+    qemu_proc->qga_len += ret;
+    qemu_proc->qga_buf[qemu_proc->qga_len] = '\0';
+
+    line = qemu_proc->qga_buf;
+    while ((end = strchr(line, '\n')) != NULL) {
+        *end = '\0';
+        if (strstr(line, "\"return\"") != NULL) {
+            ready_record(qemu_proc, false);
+            return;
+        }
+        line = end + 1;
+    }
+
+    /* keep the partial line, drop one that never ends */
+    qemu_proc->qga_len = strlen(line);
+    if (qemu_proc->qga_len >= sizeof(qemu_proc->qga_buf) - 1) {
+        qemu_proc->qga_len = 0;
+    }
+    memmove(qemu_proc->qga_buf, line, qemu_proc->qga_len);
+}
+
+static void ready_ping(qemu_proc_t *qemu_proc, const struct timespec *now)
+{
+    const char *ping = "{\"execute\":\"guest-ping\"}\n";
+
+    if (qemu_proc->qga_pinged.tv_sec != 0 &&
+            ts_diff_ns(&qemu_proc->qga_pinged, now) < READY_PING_INTERVAL * 1000000000ULL) {
+        return;
+    }
+    /* a full socket means the agent isn't reading yet, the queued ping will do */
+    send(qemu_proc->qga_fd, ping, strlen(ping), MSG_NOSIGNAL | MSG_DONTWAIT);
+    qemu_proc->qga_pinged = *now;
+}
+
+/* Connect to the guest agent channel of every booting vm, ping it, and time
+ * out vms and waiting clients; the answers are read from the event loop. */
+static void ready_probe(void)
+{
+    struct sockaddr_un addr;
+    struct timespec now;
+    qemu_proc_t *item;
+    client_conn_t *conn;
+    int i, busy = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->state != QEMU_RUNNING || item->ready || item->ready_timeout) {
+            continue;
+        }
+        busy++;
+        if (ts_diff_ns(&item->requested, &now) > virt_conf.ready_timeout * 1000000000ULL) {
+            ready_record(item, true);
+            continue;
+        }
+
+        if (item->qga_fd == -1) {
+            item->qga_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (item->qga_fd == -1) {
+                continue;
+            }
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/vm-%03d.qga",
+                    virt_conf.qmp_dir, item->vm_id);
+            if (connect(item->qga_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+                close(item->qga_fd);
+                item->qga_fd = -1;
+                continue;
+            }
+            item->qga_len = 0;
+            item->qga_pinged.tv_sec = 0;
+        }
+        ready_ping(item, &now);
+    }
+
+    for (i = 0; i < MAXCONN; i++) {
+        conn = &virt_server.conns[i];
+        if (conn->connected && conn->wait_vm != -1) {
+            busy++;
+            if (ts_ns(&now) >= ts_ns(&conn->wait_deadline)) {
+                ready_reply(conn, -ETIMEDOUT);
+            }
+        }
+    }
+
+    /* woken by launch_done() and wait_ready() */
+    if (busy == 0) {
+        periodic_sleep(ready_probe);
+    }
+}
+
+/* qga channels for select(), returns the highest fd */
+static int ready_fd_set(fd_set *set, int maxfd)
+{
+    qemu_proc_t *item;
+
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->qga_fd != -1) {
+            FD_SET(item->qga_fd, set);
+            if (item->qga_fd > maxfd) {
+                maxfd = item->qga_fd;
+            }
+        }
+    }
+
+    return maxfd;
+}
+
+static void ready_events(fd_set *set)
+{
+    qemu_proc_t *item;
+
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->qga_fd != -1 && FD_ISSET(item->qga_fd, set)) {
+            ready_read(item);
+        }
+    }
+}
+
+/* MES_WAIT_READY: vm id and a timeout in ms, answered with the launch-to-ready
+ * latency in ms once the guest is ready, or -errno: ENOENT no such vm,
+ * ESRCH it went away, ETIMEDOUT not ready in time. */
+static void wait_ready(void)
+{
+    client_conn_t *conn = virt_server.cur;
+    qemu_proc_t *qemu_proc;
+    int vm_id, timeout_ms;
+
+    vm_id = recv_vm_id();
+    if (recv_int(&timeout_ms) == -1 || vm_id == -1) {
+        return;
+    }
+
+    qemu_proc = find_qemu_proc(vm_id);
+    if (qemu_proc == NULL) {
+        send_int(-ENOENT);
+        return;
+    }
+    if (qemu_proc->ready) {
+        send_int(ready_ms(qemu_proc));
+        return;
+    }
+    if (qemu_proc->ready_timeout || timeout_ms <= 0) {
+        send_int(-ETIMEDOUT);
+        return;
+    }
+
+    conn->wait_vm = vm_id;
+    clock_gettime(CLOCK_MONOTONIC, &conn->wait_deadline);
+    ts_add_ms(&conn->wait_deadline, timeout_ms);
+    periodic_wake(ready_probe);
+}
+
+static int render_ready_stats(char *buf, int size)
+{
+    profile_stats_t *stats;
+    qemu_proc_t *item;
+    int i, b, pos;
+
+    pos = snprintf(buf, size, "ready (launch request to guest agent answering):\n");
+    for (i = 0; i < ARRAY_SIZE(qemu_profiles) && pos < size; i++) {
+        stats = &profile_stats[i];
+        if (stats->ready == 0 && stats->ready_timeouts == 0) {
+            continue;
+        }
+        pos += snprintf(buf + pos, size - pos,
+                "\t%-8s ready %" PRIu64 ", avg %" PRIu64 " ms, timeouts %" PRIu64 "\n\t\t",
+                qemu_profiles[i].name, stats->ready,
+                stats->ready ? stats->ready_ns / stats->ready / 1000000 : 0, stats->ready_timeouts);
+        for (b = 0; b < READY_BUCKETS && pos < size; b++) {
+            if (b < READY_BUCKETS - 1) {
+                pos += snprintf(buf + pos, size - pos, "<%lums:%" PRIu64 " ", 250UL << b, stats->ready_hist[b]);
+            } else {
+                pos += snprintf(buf + pos, size - pos, "more:%" PRIu64 "\n", stats->ready_hist[b]);
+            }
+        }
+    }
+
+    for (item = virt_server.qemu_head; item != NULL && pos < size; item = item->next) {
+        if (item->ready) {
+            pos += snprintf(buf + pos, size - pos, "\tvm %d: ready in %d ms\n", item->vm_id, ready_ms(item));
+        } else if (item->state == QEMU_RUNNING) {
+            pos += snprintf(buf + pos, size - pos, "\tvm %d: %s\n", item->vm_id,
+                    item->ready_timeout ? "not ready, timed out" : "booting");
+        }
+    }
+
+    return pos;
+}
+
+/* Time saved is the gap between guests booting after a prewarm and cold ones
+ * (nothing learnt yet, or VIRT_PREWARM=0) of the same profile. */
+static int render_prewarm_stats(char *buf, int size)
+{
+    profile_stats_t *stats;
+    hot_image_t *img;
+    uint64_t cold, warm_ms, cold_ms, hot;
+    uint32_t c;
+    int i, pos;
+
+    pos = snprintf(buf, size, "prewarm (hot ranges of backing images read ahead): %s, "
+            "locked %" PRIu64 "/%ld MB, learns %" PRIu64 ", lock failures %" PRIu64 "\n",
+            virt_conf.prewarm ? "on" : "off",
+            prewarm_ctl.locked >> 20, virt_conf.prewarm_lock, prewarm_ctl.learns,
+            prewarm_ctl.lock_failed);
+    for (i = 0; i < ARRAY_SIZE(qemu_profiles) && pos < size; i++) {
+        stats = &profile_stats[i];
+        if (stats->prewarmed == 0) {
+            continue;
+        }
+        cold = stats->ready - stats->ready_warm;
+        warm_ms = stats->ready_warm ? stats->ready_warm_ns / stats->ready_warm / 1000000 : 0;
+        cold_ms = cold ? (stats->ready_ns - stats->ready_warm_ns) / cold / 1000000 : 0;
+        pos += snprintf(buf + pos, size - pos,
+                "\t%-8s prewarmed %" PRIu64 ", hot avg %" PRIu64 " MB, hit rate %" PRIu64 "%%, "
+                "prewarm avg %" PRIu64 " ms, ready warm %" PRIu64 " ms (%" PRIu64 "), "
+                "cold %" PRIu64 " ms (%" PRIu64 "), saved %ld ms\n",
+                qemu_profiles[i].name, stats->prewarmed, (stats->prewarm_hot / stats->prewarmed) >> 20,
+                stats->prewarm_hot ? stats->prewarm_hit * 100 / stats->prewarm_hot : 0,
+                stats->prewarm_ns / stats->prewarmed / 1000000, warm_ms, stats->ready_warm,
+                cold_ms, cold, stats->ready_warm && cold ? (long)cold_ms - (long)warm_ms : 0);
+    }
+
+    /* never wait on a worker in the middle of a readahead */
+    if (pthread_mutex_trylock(&prewarm_ctl.lock) != 0) {
+        return pos;
+    }
+    for (img = prewarm_ctl.images; img != NULL && pos < size; img = img->next) {
+        for (c = 0, hot = 0; c < img->nr_chunks; c++) {
+            hot += img->hits[c] ? hot_chunk_len(img, c) : 0;
+        }
+        pos += snprintf(buf + pos, size - pos, "\t%s: %" PRIu64 " MB, hot %" PRIu64 " MB, locked %" PRIu64 " MB\n",
+                img->path, img->size >> 20, hot >> 20, img->locked >> 20);
+    }
+    pthread_mutex_unlock(&prewarm_ctl.lock);
+
+    return pos;
+}
+
+static int ksm_read(const char *file, uint64_t *val)
+{
+    char buf[64];
+
+    if (sysfs_read(virt_conf.ksm_dir, file, buf, sizeof(buf)) <= 0) {
+        return -1;
+    }
+    *val = strtoull(buf, NULL, 10);
+
+    return 0;
+}
+
+/* ksmd is a kernel thread, look it up by name once. */
+static pid_t find_ksmd(void)
+{
+    char path[PATH_MAX];
+    char comm[32];
+    struct dirent *ent;
+    pid_t pid = 0;
+    DIR *dir;
+
+    dir = opendir(virt_conf.proc_root);
+    if (dir == NULL) {
+        return 0;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] < '0' || ent->d_name[0] > '9') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", virt_conf.proc_root, ent->d_name);
+        if (sysfs_read(path, "comm", comm, sizeof(comm)) > 0 && strcmp(comm, "ksmd") == 0) {
+            pid = atoi(ent->d_name);
+            break;
+        }
+    }
+    closedir(dir);
+
+    return pid;
+}
+
+/* utime + stime of a process in clock ticks */
+static uint64_t read_cpu_ticks(pid_t pid)
+{
+    char path[PATH_MAX];
+    char buf[1024];
+    unsigned long utime, stime;
+    char *p;
+
+    snprintf(path, sizeof(path), "%s/%d", virt_conf.proc_root, pid);
+    if (sysfs_read(path, "stat", buf, sizeof(buf)) <= 0) {
+        return 0;
+    }
+
+    /* skip "pid (comm) ", comm may hold spaces */
+    p = strrchr(buf, ')');
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                &utime, &stime) != 2) {
+        return 0;
+    }
+
+    return utime + stime;
+}
+
+static uint64_t read_ksm_merging_pages(pid_t pid)
+{
+    char path[PATH_MAX];
+    char buf[64];
+
+    snprintf(path, sizeof(path), "%s/%d", virt_conf.proc_root, pid);
+    if (sysfs_read(path, "ksm_merging_pages", buf, sizeof(buf)) <= 0) {
+        return 0;
+    }
+
+    return strtoull(buf, NULL, 10);
+}
+
+/* Periodic pass: run ksmd only while a mem-merge vm is up, scan faster while
+ * it keeps finding pages to merge and back off when it stops paying or costs
+ * more than KSM_CPU_MAX of a core. */
+static void ksm_tune(void)
+{
+    qemu_proc_t *item;
+    struct timespec now;
+    uint64_t sharing, ticks, scan, sleep_ms;
+    bool wanted = false;
+    uint64_t run;
+    double secs;
+
+    for (item = virt_server.qemu_head; item != NULL; item = item->next) {
+        if (item->state == QEMU_RUNNING && item->profile->mem_merge) {
+            wanted = true;
+            item->ksm_pages = read_ksm_merging_pages(item->pid);
+        }
+    }
+
+    /* a ksmd the admin runs is left running */
+    if (wanted && !ksm_ctl.running && (ksm_read("run", &run) == -1 || run != 1)) {
+        if (sysfs_write(virt_conf.ksm_dir, "run", "1") == 0) {
+            logout("ksm: start ksmd\n");
+            ksm_ctl.running = true;
+        }
+    } else if (!wanted && ksm_ctl.running) {
+        if (sysfs_write(virt_conf.ksm_dir, "run", "0") == 0) {
+            logout("ksm: stop ksmd\n");
+            ksm_ctl.running = false;
+        }
+    }
+
+    if (ksm_read("pages_sharing", &sharing) == -1) {
+        return;
+    }
+    ksm_read("pages_shared", &ksm_ctl.pages_shared);
+    ksm_read("pages_to_scan", &ksm_ctl.pages_to_scan);
+    ksm_read("sleep_millisecs", &ksm_ctl.sleep_ms);
+
+    if (ksm_ctl.ksmd == 0) {
+        ksm_ctl.ksmd = find_ksmd();
+    }
+    ticks = ksm_ctl.ksmd ? read_cpu_ticks(ksm_ctl.ksmd) : 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (ksm_ctl.sampled.tv_sec != 0) {
+        secs = ts_diff_ns(&ksm_ctl.sampled, &now) / 1e9;
+        ksm_ctl.gain = sharing > ksm_ctl.pages_sharing ? sharing - ksm_ctl.pages_sharing : 0;
+        ksm_ctl.cpu = secs > 0 && ticks >= ksm_ctl.ksmd_ticks ?
+                (ticks - ksm_ctl.ksmd_ticks) / (double)sysconf(_SC_CLK_TCK) / secs : 0;
+    }
+    ksm_ctl.pages_sharing = sharing;
+    ksm_ctl.ksmd_ticks = ticks;
+    ksm_ctl.sampled = now;
+
+    if (!ksm_ctl.running || ksm_ctl.pages_to_scan == 0) {
+        return;
+    }
+
+    scan = ksm_ctl.pages_to_scan;
+    sleep_ms = ksm_ctl.sleep_ms;
+    if (ksm_ctl.cpu > KSM_CPU_MAX || ksm_ctl.gain < KSM_GAIN_MIN) {
+        scan = scan / 2 > KSM_SCAN_MIN ? scan / 2 : KSM_SCAN_MIN;
+        sleep_ms = sleep_ms * 2 < KSM_SLEEP_MAX ? sleep_ms * 2 : KSM_SLEEP_MAX;
+    } else {
+        scan = scan * 2 < KSM_SCAN_MAX ? scan * 2 : KSM_SCAN_MAX;
+        sleep_ms = sleep_ms / 2 > KSM_SLEEP_MIN ? sleep_ms / 2 : KSM_SLEEP_MIN;
+    }
+
+    if (scan != ksm_ctl.pages_to_scan || sleep_ms != ksm_ctl.sleep_ms) {
+        logout("ksm: pages_to_scan %" PRIu64 " -> %" PRIu64 ", sleep %" PRIu64 " -> %" PRIu64 " ms "
+                "(gain %" PRIu64 " pages, cpu %.3f)\n",
+                ksm_ctl.pages_to_scan, scan, ksm_ctl.sleep_ms, sleep_ms, ksm_ctl.gain, ksm_ctl.cpu);
+        sysfs_write(virt_conf.ksm_dir, "pages_to_scan", "%" PRIu64, scan);
+        sysfs_write(virt_conf.ksm_dir, "sleep_millisecs", "%" PRIu64, sleep_ms);
+    }
+}
+
+static int render_ksm_stats(char *buf, int size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    qemu_proc_t *item;
+    int pos;
+
+    if (virt_conf.ksm_interval == 0) {
+        return snprintf(buf, size, "ksm: off\n");
+    }
+
+    /* pages_sharing counts the extra mappings of a merged page, i.e. the pages saved */
+    pos = snprintf(buf, size, "ksm: %s, pages_to_scan %" PRIu64 ", sleep %" PRIu64 " ms, ksmd cpu %.3f\n"
+            "\tsaved %" PRIu64 " MB host-wide (%" PRIu64 " shared pages, %" PRIu64 " sharing)\n",
+            ksm_ctl.running ? "running" : "stopped", ksm_ctl.pages_to_scan, ksm_ctl.sleep_ms,
+            ksm_ctl.cpu, ksm_ctl.pages_sharing * page >> 20,
+            ksm_ctl.pages_shared, ksm_ctl.pages_sharing);
+
+    for (item = virt_server.qemu_head; item != NULL && pos < size; item = item->next) {
+        if (item->state != QEMU_RUNNING || !item->profile->mem_merge) {
+            continue;
+        }
+        pos += snprintf(buf + pos, size - pos, "\tvm %d: %" PRIu64 " MB merged\n",
+                item->vm_id, item->ksm_pages * page >> 20);
+    }
+
+    return pos;
+}
+
+/* The status table in shared memory, see virt-proto.h. Rebuilt on every turn
+ * of the event loop, the readers only see a write when something changed or
+ * the heartbeat is due. */
+static void status_write_begin(void)
+{
+    __atomic_store_n(&status_table->seq, status_table->seq + 1, __ATOMIC_RELAXED);
+    /* a reader seeing any of what follows sees the odd seq */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void status_write_end(void)
+{
+    __atomic_store_n(&status_table->seq, status_table->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void status_init(void)
+{
+    void *table;
+    int fd;
+
+    if (virt_conf.status_shm[0] == '\0') {
+        return;
+    }
+
+    /* a table left behind is reused, its readers keep their mapping */
+    fd = open(virt_conf.status_shm, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1 || ftruncate(fd, sizeof(virt_status_t)) == -1) {
+        logout("status table %s: %s\n", virt_conf.status_shm, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    table = mmap(NULL, sizeof(virt_status_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (table == MAP_FAILED) {
+        logout("status table %s: %s\n", virt_conf.status_shm, strerror(errno));
+        return;
+    }
+    status_table = table;
+
+    /* even if the last server died halfway through a write */
+    status_table->seq &= ~1ULL;
+    status_write_begin();
+    status_table->magic = VIRT_STATUS_MAGIC;
+    status_table->size = sizeof(virt_status_t);
+    status_table->server_pid = getpid();
+    status_table->nr_vms = 0;
+    status_table->heartbeat = 0;
+    status_table->generation++;
+    status_write_end();
+}
+
+static void status_fill(virt_status_vm_t *vm, qemu_proc_t *qemu_proc)
+{
+    int cpu;
+
+    memset(vm, 0, sizeof(virt_status_vm_t));
+    vm->vm_id = qemu_proc->vm_id;
+    vm->pid = qemu_proc->pid;
+    switch (qemu_proc->state) {
+        case QEMU_LAUNCHING:
+            vm->state = VM_LAUNCHING;
+            break;
+        case QEMU_RUNNING:
+            vm->state = VM_RUNNING;
+            break;
+        case QEMU_PENDING:
+            vm->state = VM_PENDING;
+            break;
+        case QEMU_QUEUED:
+            vm->state = VM_QUEUED;
+            break;
+        case QEMU_KILLING:
+            vm->state = VM_KILLING;
+            break;
+    }
+    vm->flags = (qemu_proc->started ? VM_STARTED : 0) | (qemu_proc->ready ? VM_READY : 0) |
+            (qemu_proc->pinned ? VM_PINNED : 0) | (qemu_proc->profile->realtime ? VM_REALTIME : 0);
+    snprintf(vm->profile, sizeof(vm->profile), "%s", qemu_proc->profile->name);
+    for (cpu = 0; cpu < VIRT_STATUS_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &qemu_proc->cpus)) {
+            vm->cpus[cpu / 64] |= 1ULL << (cpu % 64);
+        }
+    }
+    vm->smp = qemu_proc->smp;
+    vm->mem = qemu_proc->mem;
+    vm->balloon = qemu_proc->balloon_target;
+    vm->rss = qemu_proc->rss;
+    vm->cpu_usage = qemu_proc->cpu_usage * 1000;
+    vm->cpu_wait = qemu_proc->cpu_wait * 1000;
+    vm->ready_ms = qemu_proc->ready ? ready_ms(qemu_proc) : -1;
+    vm->iops = qemu_proc->io_iops;
+    vm->io_kbps = qemu_proc->io_mbps * 1024;
+    vm->moves = qemu_proc->moves;
+    vm->ksm_pages = qemu_proc->ksm_pages;
+}
+
+static void status_publish(void)
+{
+    virt_status_vm_t vms[MAX_VM_NUM];
+    qemu_proc_t *item;
+    struct timespec now;
+    bool changed;
+    int n = 0;
+
+    if (status_table == NULL) {
+        return;
+    }
+
+    for (item = virt_server.qemu_head; item != NULL && n < MAX_VM_NUM; item = item->next) {
+        status_fill(&vms[n++], item);
+    }
+    changed = n != status_table->nr_vms ||
+            memcmp(vms, status_table->vms, n * sizeof(virt_status_vm_t)) != 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!changed && now.tv_sec < status_table->heartbeat + STATUS_HEARTBEAT) {
+        return;
+    }
+
+    status_write_begin();
+    if (changed) {
+        memcpy(status_table->vms, vms, n * sizeof(virt_status_vm_t));
+        status_table->nr_vms = n;
+        status_table->generation++;
+    }
+    status_table->heartbeat = now.tv_sec;
+    status_write_end();
+}
+
+static void query_job(void)
+{
+    job_record_t record;
+    int id;
+
+    if (recv_int(&id) == -1) {
+        return;
+    }
+
+    /* the id is the client's, only positive ones were ever handed out */
+    record.id = 0;
+    if (id > 0) {
+        pthread_mutex_lock(&job_pool.lock);
+        record = *job_record(id);
+        pthread_mutex_unlock(&job_pool.lock);
+    }
+
+    if (id <= 0 || record.id != id) {
+        record.state = JOB_UNKNOWN;
+        record.result = 0;
+    }
+
+    send_int(record.state);
+    send_int(record.result);
+}
+
+static int render_job_stats(char *buf, int size)
+{
+    int depth;
+    uint64_t n = job_pool.completed ? job_pool.completed : 1;
+
+    pthread_mutex_lock(&job_pool.lock);
+    depth = job_pool.count;
+    pthread_mutex_unlock(&job_pool.lock);
+
+    return snprintf(buf, size,
+            "jobs:\n"
+            "\tworkers %d, queue depth %d/%d (max %d)\n"
+            "\tsubmitted %" PRIu64 ", completed %" PRIu64 ", failed %" PRIu64 ", rejected %" PRIu64 "\n"
+            "\tqueue wait avg %" PRIu64 " us, max %" PRIu64 " us\n"
+            "\trun time avg %" PRIu64 " us, max %" PRIu64 " us\n",
+            job_pool.nr_workers, depth, job_pool.size, job_pool.max_depth,
+            job_pool.submitted, job_pool.completed, job_pool.failed, job_pool.rejected,
+            job_pool.wait_ns / n / 1000, job_pool.max_wait_ns / 1000,
+            job_pool.run_ns / n / 1000, job_pool.max_run_ns / 1000);
+}
+
+#define STATS_BUF_SIZE 8192
+
+static void query_stats(void)
+{
+    char *buf = malloc(STATS_BUF_SIZE);
+    int pos = 0;
+
+    if (buf == NULL) {
+        send_int(0);
+        return;
+    }
+
+    pos += render_job_stats(buf + pos, STATS_BUF_SIZE - pos);
+    if (pos < STATS_BUF_SIZE) {
+        pos += render_sched_stats(buf + pos, STATS_BUF_SIZE - pos);
+    }
+    if (pos < STATS_BUF_SIZE) {
+        pos += render_rebalance_stats(buf + pos, STATS_BUF_SIZE - pos);
+    }
+    if (pos < STATS_BUF_SIZE) {
+        pos += render_balloon_stats(buf + pos, STATS_BUF_SIZE - pos);
+    }
+    if (pos < STATS_BUF_SIZE) {
+        pos += render_ksm_stats(buf + pos, STATS_BUF_SIZE - pos);
+    }
+    if (pos < STATS_BUF_SIZE) {
+        pos += render_hotplug_stats(buf + pos, STATS_BUF_SIZE - pos);
+    }
+    if (pos < STATS_BUF_SIZE) {
+        pos += render_io_stats(buf + pos, STATS_BUF_SIZE - pos);
+    }
+    if (pos < STATS_BUF_SIZE) {
+        pos += render_numa_stats(buf + pos, STATS_BUF_SIZE - pos);
+    }
+    if (pos < STATS_BUF_SIZE) {
+        pos += render_profile_stats(buf + pos, STATS_BUF_SIZE - pos);
+    }
+    if (pos < STATS_BUF_SIZE) {
+        pos += render_ready_stats(buf + pos, STATS_BUF_SIZE - pos);
+    }
+    if (pos < STATS_BUF_SIZE) {
+        pos += render_boot_stats(buf + pos, STATS_BUF_SIZE - pos);
+    }
+    if (pos < STATS_BUF_SIZE) {
+        pos += render_prewarm_stats(buf + pos, STATS_BUF_SIZE - pos);
+    }
+    if (pos >= STATS_BUF_SIZE) {
+        pos = STATS_BUF_SIZE - 1;
+    }
+
+    send_int(pos);
+    if (write(virt_server.cur->fd, buf, pos) == -1) {
+        ERR_EXIT("Error: socket error\n");
+    }
+    free(buf);
+}
+
+/* The dump writes a file of up to TRACE_EVENTS spans a thread, so it runs on a
+ * worker and the client is held until done() answers it. */
+typedef struct trace_dump_job {
+    client_conn_t *conn;
+    char path[PATH_MAX];
+    uint64_t spans;
+} trace_dump_job_t;
+
+static bool trace_dumping;
+
+static void trace_dump_work(job_t *job)
+{
+    trace_dump_job_t *data = job->data;
+
+    job->result = trace_dump(data->path, sizeof(data->path), &data->spans);
+}
+
+static void trace_dump_done(job_t *job)
+{
+    trace_dump_job_t *data = job->data;
+    char reply[sizeof(int) + PATH_MAX + 64];
+    int len;
+
+    if (job->result < 0) {
+        len = snprintf(reply + sizeof(int), sizeof(reply) - sizeof(int),
+                "trace dump failed (%s)", strerror(-job->result));
+    } else {
+        len = snprintf(reply + sizeof(int), sizeof(reply) - sizeof(int),
+                "%" PRIu64 " spans written to %s", data->spans, data->path);
+    }
+    if (len >= (int)(sizeof(reply) - sizeof(int))) {
+        len = sizeof(reply) - sizeof(int) - 1;
+    }
+    memcpy(reply, &len, sizeof(int));
+
+    trace_dumping = false;
+    data->conn->job_wait = false;
+    conn_send(data->conn, reply, sizeof(int) + len);
+    free(job->data);
+}
+
+/* 0 if the client is answered by the job */
+static int trace_dump_submit(client_conn_t *conn)
+{
+    trace_dump_job_t *data;
+    job_t *job;
+
+    if (trace_dumping) {
+        return -EALREADY;
+    }
+    data = calloc(1, sizeof(trace_dump_job_t));
+    job = data ? job_new("trace dump", trace_dump_work, trace_dump_done, data) : NULL;
+    if (job == NULL) {
+        free(data);
+        return -ENOMEM;
+    }
+
+    data->conn = conn;
+    if (job_submit(job) == -1) {
+        job_cancel(job, -EBUSY);
+        return -EBUSY;
+    }
+    trace_dumping = true;
+    conn->job_wait = true;
+    return 0;
+}
+
+/* 0 stops tracing, 1 starts it, 2 dumps the buffers; answers with a status line */
+static void trace_ctl(void)
+{
+    char reply[PATH_MAX + 64];
+    int op, ret, len;
+
+    if (recv_int(&op) == -1) {
+        return;
+    }
+
+    switch (op) {
+        case 0:
+        case 1:
+            trace_set(op);
+            len = snprintf(reply, sizeof(reply), "trace %s", op ? "on" : "off");
+            break;
+        case 2:
+            ret = trace_dump_submit(virt_server.cur);
+            if (ret == 0) {
+                return;
+            }
+            len = snprintf(reply, sizeof(reply), "trace dump failed (%s)", strerror(-ret));
+            break;
+        default:
+            len = snprintf(reply, sizeof(reply), "unknown trace op %d", op);
+            break;
+    }
+
+    send_int(len);
+    if (write(virt_server.cur->fd, reply, len) == -1) {
+        ERR_EXIT("Error: socket error\n");
+    }
+}
 
-    for (; current != NULL; prev = current, current = current->next) {
-        if (current->vm_id == vm_id) {
-            find_vm_id = true;
+/*
+ * Federation. A server started with VIRT_ROLE=coordinator runs no vms itself.
+ * Nodes, servers started with VIRT_COORDINATOR=<its socket>, announce their
+ * capacity and vms every NODE_ANNOUNCE_INTERVAL; the coordinator places each
+ * launch on the least loaded node the profile fits on and forwards it, and
+ * forwards every request about a vm to the node that announced it. Clients
+ * talk to it like to any server. vm ids are the fleet's, one vm lives on one
+ * node.
+ */
+
+typedef struct fed_forward {
+    client_conn_t *conn;
+    int node;
+    int vm_id;
+} fed_forward_t;
+
+static bool fed_node_has(const fed_node_t *node, int vm_id, const struct timespec *now)
+{
+    if (!node->alive) {
+        return false;
+    }
+    if (node->vms[vm_id]) {
+        return true;
+    }
+    return node->claimed[vm_id].tv_sec != 0 &&
+            ts_diff_ns(&node->claimed[vm_id], now) < NODE_TIMEOUT * 1000000000ULL;
+}
+
+/* the node holding vm_id, -1 none */
+static int fed_find_vm(int vm_id)
+{
+    struct timespec now;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < fed.nr_nodes; i++) {
+        if (fed_node_has(&fed.nodes[i], vm_id, &now)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* The alive node with the lowest vCPU load the profile fits on, the one with
+ * more memory left on a tie; -1 none. */
+static int fed_place(const qemu_profile_t *profile)
+{
+    int bit = profile - qemu_profiles;
+    uint32_t mem = profile_mem_need(profile);
+    double load, best_load = 0, mem_load, best_mem_load = 0;
+    fed_node_t *node;
+    int i, best = -1;
+
+    for (i = 0; i < fed.nr_nodes; i++) {
+        node = &fed.nodes[i];
+        if (!node->alive || !(node->fit & (1 << bit)) || node->mem_used + mem > node->mem_total) {
+            continue;
+        }
+        load = node->cpu_cap ? (double)node->cpu_used / node->cpu_cap : 1;
+        mem_load = node->mem_total ? (double)node->mem_used / node->mem_total : 1;
+        if (best == -1 || load < best_load || (load == best_load && mem_load < best_mem_load)) {
+            best = i;
+            best_load = load;
+            best_mem_load = mem_load;
+        }
+    }
+
+    return best;
+}
+
+/* Count the launch against the node until its next announce has it. */
+static void fed_claim(fed_node_t *node, int vm_id, const qemu_profile_t *profile)
+{
+    clock_gettime(CLOCK_MONOTONIC, &node->claimed[vm_id]);
+    if (!profile->realtime) {
+        node->cpu_used += profile->smp * VCPU_UNIT;
+    }
+    node->mem_used += profile_mem_need(profile);
+}
+
+static virtc_t *fed_node_vc(fed_node_t *node)
+{
+    int err;
+
+    if (node->vc == NULL) {
+        node->vc = virtc_open(node->path, &err);
+        if (node->vc == NULL) {
+            logout("node %s unreachable: %s\n", node->path, virtc_strerror(err));
+        }
+    }
+
+    return node->vc;
+}
+
+/* Hold the current connection until the node answers or timeout_ms passes. */
+static fed_forward_t *fed_forward_new(int node, int vm_id)
+{
+    fed_forward_t *fwd = malloc(sizeof(fed_forward_t));
+
+    if (fwd != NULL) {
+        fwd->conn = virt_server.cur;
+        fwd->node = node;
+        fwd->vm_id = vm_id;
+    }
+
+    return fwd;
+}
+
+static void fed_hold(fed_forward_t *fwd, int timeout_ms)
+{
+    client_conn_t *conn = fwd->conn;
+
+    conn->fwd_node = fwd->node;
+    clock_gettime(CLOCK_MONOTONIC, &conn->fwd_deadline);
+    ts_add_ms(&conn->fwd_deadline, timeout_ms);
+    fed.forwarded++;
+}
+
+static void fed_reply(fed_forward_t *fwd, const void *buf, int len)
+{
+    fwd->conn->fwd_node = -1;
+    conn_send(fwd->conn, buf, len);
+    free(fwd);
+}
+
+static void fed_reply_text(fed_forward_t *fwd, const char *text, int len)
+{
+    char *buf = malloc(sizeof(int) + len);
+
+    if (buf == NULL) {
+        len = 0;
+        fed_reply(fwd, &len, sizeof(len));
+        return;
+    }
+    memcpy(buf, &len, sizeof(int));
+    memcpy(buf + sizeof(int), text, len);
+    fed_reply(fwd, buf, sizeof(int) + len);
+    free(buf);
+}
+
+static void fed_forward_failed(fed_forward_t *fwd, int err)
+{
+    fed_node_t *node = &fed.nodes[fwd->node];
+
+    node->failed++;
+    fed.forward_failed++;
+    logout("vm %d on node %s: %s\n", fwd->vm_id, node->path, virtc_strerror(err));
+}
+
+/* a job id of our own for a job of a node */
+static int fed_job_add(int node, int remote_id)
+{
+    fed_job_t *job;
+
+    /* ids stay positive, -1 is a refusal on the wire */
+    fed.next_job = fed.next_job == INT_MAX ? 1 : fed.next_job + 1;
+    job = &fed.jobs[fed.next_job % FED_JOBS];
+    job->id = fed.next_job;
+    job->node = node;
+    job->remote_id = remote_id;
+
+    return job->id;
+}
+
+static void fed_job_done(virtc_t *vc, const virtc_reply_t *reply, void *arg)
+{
+    fed_forward_t *fwd = arg;
+    int val = -1;
+
+    if (reply->err == 0) {
+        val = fed_job_add(fwd->node, reply->job_id);
+    } else {
+        fed_forward_failed(fwd, reply->err);
+    }
+    fed_reply(fwd, &val, sizeof(val));
+}
+
+static void fed_launch_done(virtc_t *vc, const virtc_reply_t *reply, void *arg)
+{
+    fed_forward_t *fwd = arg;
+    fed_node_t *node = &fed.nodes[fwd->node];
+
+    if (reply->err == 0) {
+        node->placed++;
+        fed.placed++;
+        logout("vm %d placed on node %s\n", fwd->vm_id, node->path);
+    } else {
+        node->claimed[fwd->vm_id].tv_sec = 0;
+    }
+    fed_job_done(vc, reply, arg);
+}
+
+static void fed_launch(bool with_profile, bool with_priority)
+{
+    qemu_profile_t *profile = &qemu_profiles[0];
+    char name[MAX_PROFILE_NAME];
+    fed_forward_t *fwd;
+    fed_node_t *node;
+    int vm_id, n, priority = 0;
+
+    vm_id = recv_vm_id();
+    if (with_priority && virt_server.cur->connected && recv_int(&priority) == -1) {
+        vm_id = -1;
+    }
+    if (vm_id == -1) {
+        if (with_profile && virt_server.cur->connected) {
+            recv_string(name, sizeof(name));
+        }
+        return;
+    }
+    if (with_profile) {
+        if (recv_string(name, sizeof(name)) == -1) {
+            return;
+        }
+        profile = with_priority && strcmp(name, "-") == 0 ? &qemu_profiles[0] : find_profile(name);
+        if (profile == NULL) {
+            logout("unknown profile %s, launch qemu failed\n", name);
+            send_int(-1);
+            return;
+        }
+    }
+
+    n = fed_find_vm(vm_id);
+    if (n != -1) {
+        logout("vm %d already on node %s\n", vm_id, fed.nodes[n].path);
+        send_int(-1);
+        return;
+    }
+
+    n = fed_place(profile);
+    if (n == -1) {
+        logout("vm %d (%s) fits on no node\n", vm_id, profile->name);
+        fed.no_node++;
+        send_int(-1);
+        return;
+    }
+
+    node = &fed.nodes[n];
+    fwd = fed_forward_new(n, vm_id);
+    if (fwd == NULL || fed_node_vc(node) == NULL ||
+            (with_priority ?
+             virtc_launch_priority(node->vc, vm_id, profile->name, priority, fed_launch_done, fwd) :
+             virtc_launch(node->vc, vm_id, profile->name, fed_launch_done, fwd)) < 0) {
+        free(fwd);
+        node->failed++;
+        send_int(-1);
+        return;
+    }
+    fed_claim(node, vm_id, profile);
+    fed_hold(fwd, FORWARD_TIMEOUT * 1000);
+}
+
+static void fed_kill(void)
+{
+    fed_forward_t *fwd;
+    int vm_id, n;
+
+    vm_id = recv_vm_id();
+    if (vm_id == -1) {
+        return;
+    }
+
+    n = fed_find_vm(vm_id);
+    fwd = n == -1 ? NULL : fed_forward_new(n, vm_id);
+    if (fwd == NULL || fed_node_vc(&fed.nodes[n]) == NULL ||
+            virtc_kill(fed.nodes[n].vc, vm_id, fed_job_done, fwd) < 0) {
+        free(fwd);
+        send_int(-1);
+        return;
+    }
+    fed_hold(fwd, FORWARD_TIMEOUT * 1000);
+}
+
+static void fed_text_done(virtc_t *vc, const virtc_reply_t *reply, void *arg)
+{
+    fed_forward_t *fwd = arg;
+    char buf[128];
+    int len;
+
+    if (reply->err == 0) {
+        fed_reply_text(fwd, reply->text, reply->len);
+        return;
+    }
+
+    fed_forward_failed(fwd, reply->err);
+    len = snprintf(buf, sizeof(buf), "node %s: %s\n", fed.nodes[fwd->node].path,
+            virtc_strerror(reply->err));
+    fed_reply_text(fwd, buf, len < sizeof(buf) ? len : sizeof(buf) - 1);
+}
+
+static void fed_cpu_affinity(void)
+{
+    fed_forward_t *fwd;
+    char buf[64];
+    int vm_id, n, len;
+
+    vm_id = recv_vm_id();
+    if (vm_id == -1) {
+        return;
+    }
+
+    n = fed_find_vm(vm_id);
+    fwd = n == -1 ? NULL : fed_forward_new(n, vm_id);
+    if (fwd == NULL || fed_node_vc(&fed.nodes[n]) == NULL ||
+            virtc_cpu_affinity(fed.nodes[n].vc, vm_id, fed_text_done, fwd) < 0) {
+        free(fwd);
+        len = sprintf(buf, "cpu affinity: vm %d on no node\n", vm_id);
+        send_int(len);
+        if (write(virt_server.cur->fd, buf, len) == -1) {
+            ERR_EXIT("Error: socket error\n");
+        }
+        return;
+    }
+    fed_hold(fwd, FORWARD_TIMEOUT * 1000);
+}
+
+static void fed_query_job_done(virtc_t *vc, const virtc_reply_t *reply, void *arg)
+{
+    fed_forward_t *fwd = arg;
+    int val[2] = { JOB_UNKNOWN, 0 };
+
+    if (reply->err == 0) {
+        val[0] = reply->state;
+        val[1] = reply->result;
+    } else {
+        fed_forward_failed(fwd, reply->err);
+    }
+    fed_reply(fwd, val, sizeof(val));
+}
+
+static void fed_query_job(void)
+{
+    fed_forward_t *fwd;
+    fed_job_t *job;
+    int id;
+
+    if (recv_int(&id) == -1) {
+        return;
+    }
+
+    job = &fed.jobs[(unsigned int)id % FED_JOBS];
+    fwd = (id <= 0 || job->id != id) ? NULL : fed_forward_new(job->node, -1);
+    if (fwd == NULL || fed_node_vc(&fed.nodes[job->node]) == NULL ||
+            virtc_query_job(fed.nodes[job->node].vc, job->remote_id, fed_query_job_done, fwd) < 0) {
+        free(fwd);
+        send_int(JOB_UNKNOWN);
+        send_int(0);
+        return;
+    }
+    fed_hold(fwd, FORWARD_TIMEOUT * 1000);
+}
+
+static void fed_wait_ready_done(virtc_t *vc, const virtc_reply_t *reply, void *arg)
+{
+    fed_forward_t *fwd = arg;
+    int val = reply->ready_ms;
+
+    if (reply->err != 0) {
+        /* the node's own -errno, or it couldn't be asked */
+        val = reply->result < 0 ? reply->result : -EIO;
+        if (val == -EIO) {
+            fed_forward_failed(fwd, reply->err);
+        }
+    }
+    fed_reply(fwd, &val, sizeof(val));
+}
+
+/* A wait holds the node's connection until it answers, so it gets one of its own
+ * and the node's other requests don't queue behind it. */
+static void fed_wait_ready(void)
+{
+    client_conn_t *conn = virt_server.cur;
+    fed_forward_t *fwd;
+    int vm_id, timeout_ms, n, err;
+
+    vm_id = recv_vm_id();
+    if (recv_int(&timeout_ms) == -1 || vm_id == -1) {
+        return;
+    }
+
+    n = fed_find_vm(vm_id);
+    if (n == -1) {
+        send_int(-ENOENT);
+        return;
+    }
+
+    fwd = fed_forward_new(n, vm_id);
+    conn->fwd_vc = fwd ? virtc_open(fed.nodes[n].path, &err) : NULL;
+    if (conn->fwd_vc == NULL ||
+            virtc_wait_ready(conn->fwd_vc, vm_id, timeout_ms, fed_wait_ready_done, fwd) < 0) {
+        virtc_close(conn->fwd_vc);
+        conn->fwd_vc = NULL;
+        free(fwd);
+        send_int(-EIO);
+        return;
+    }
+    fed_hold(fwd, (timeout_ms > 0 ? timeout_ms : 0) + FORWARD_TIMEOUT * 1000);
+}
+
+static int render_fed_stats(char *buf, int size)
+{
+    fed_node_t *node;
+    int i, j, nr_vms, alive = 0, pos;
+
+    for (i = 0; i < fed.nr_nodes; i++) {
+        alive += fed.nodes[i].alive;
+    }
+
+    pos = snprintf(buf, size,
+            "federation:\n"
+            "\tnodes %d/%d alive, announces %" PRIu64 "\n"
+            "\tplaced %" PRIu64 ", fit on no node %" PRIu64 ", forwarded %" PRIu64 ", "
+            "failed %" PRIu64 ", timed out %" PRIu64 "\n",
+            alive, fed.nr_nodes, fed.announces, fed.placed, fed.no_node,
+            fed.forwarded, fed.forward_failed, fed.timeouts);
+
+    for (i = 0; i < fed.nr_nodes && pos < size; i++) {
+        node = &fed.nodes[i];
+        nr_vms = 0;
+        for (j = 0; j < MAX_VM_NUM; j++) {
+            nr_vms += node->vms[j];
+        }
+        pos += snprintf(buf + pos, size - pos,
+                "\t%s: %s, vCPU %.1f/%.1f, memory %d/%d MB, vms %d, placed %" PRIu64 ", failed %" PRIu64 "\n",
+                node->path, node->alive ? "up" : "gone",
+                (double)node->cpu_used / VCPU_UNIT, (double)node->cpu_cap / VCPU_UNIT,
+                node->mem_used, node->mem_total, nr_vms, node->placed, node->failed);
+    }
+
+    return pos < size ? pos : size - 1;
+}
+
+static void fed_send_text(const char *buf, int len)
+{
+    send_int(len);
+    if (write(virt_server.cur->fd, buf, len) == -1) {
+        ERR_EXIT("Error: socket error\n");
+    }
+}
+
+static void fed_query_qemu(void)
+{
+    char buf[2048];
+    struct timespec now;
+    int i, n, pos;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pos = sprintf(buf, "\nNow running vm:\n\tvm_id\t node\n");
+    for (i = 0; i < MAX_VM_NUM && pos < sizeof(buf); i++) {
+        for (n = 0; n < fed.nr_nodes; n++) {
+            if (fed_node_has(&fed.nodes[n], i, &now)) {
+                pos += snprintf(buf + pos, sizeof(buf) - pos, "\t%d\t %s%s\n", i,
+                        fed.nodes[n].path, fed.nodes[n].vms[i] ? "" : " (placing)");
+                break;
+            }
+        }
+    }
+
+    fed_send_text(buf, pos < sizeof(buf) ? pos : sizeof(buf) - 1);
+}
+
+static void fed_query_stats(void)
+{
+    char buf[STATS_BUF_SIZE];
+
+    fed_send_text(buf, render_fed_stats(buf, sizeof(buf)));
+}
+
+static void fed_query_fit(void)
+{
+    qemu_profile_t *profile;
+    char name[MAX_PROFILE_NAME];
+    char buf[256];
+    int n, len;
+
+    if (recv_string(name, sizeof(name)) == -1) {
+        return;
+    }
+
+    profile = find_profile(name);
+    n = profile ? fed_place(profile) : -1;
+    if (profile == NULL) {
+        len = snprintf(buf, sizeof(buf), "unknown profile %s\n", name);
+    } else if (n == -1) {
+        len = snprintf(buf, sizeof(buf), "profile %s fits on no node\n", profile->name);
+    } else {
+        len = snprintf(buf, sizeof(buf), "profile %s fits, would go to node %s\n",
+                profile->name, fed.nodes[n].path);
+    }
+
+    fed_send_text(buf, len < sizeof(buf) ? len : sizeof(buf) - 1);
+}
+
+static void fed_status_done(virtc_t *vc, const virtc_reply_t *reply, void *arg)
+{
+    fed_forward_t *fwd = arg;
+    int val = 0;
+
+    if (reply->err) {
+        fed_forward_failed(fwd, reply->err);
+        val = -1;
+    }
+    fed_reply(fwd, &val, sizeof(val));
+}
+
+static void fed_recv_io(int *val, virtc_io_t *io)
+{
+    io->iops = val[0];
+    io->iops_burst = val[1];
+    io->mbps = val[2];
+    io->mbps_burst = val[3];
+    io->burst = val[4];
+}
+
+/* Only the node running the vm learns its limits, a vm on no node is refused. */
+static void fed_set_io_limits(void)
+{
+    char name[MAX_IO_GROUP];
+    fed_forward_t *fwd;
+    virtc_io_t io;
+    int val[5];
+    int vm_id, n, i;
+
+    vm_id = recv_vm_id();
+    for (i = 0; i < ARRAY_SIZE(val); i++) {
+        if (recv_int(&val[i]) == -1) {
+            return;
+        }
+    }
+    if (recv_string(name, sizeof(name)) == -1 || vm_id == -1) {
+        return;
+    }
+    fed_recv_io(val, &io);
+
+    n = fed_find_vm(vm_id);
+    fwd = n == -1 ? NULL : fed_forward_new(n, vm_id);
+    if (fwd == NULL || fed_node_vc(&fed.nodes[n]) == NULL ||
+            virtc_set_io_limits(fed.nodes[n].vc, vm_id, &io,
+            strcmp(name, "-") ? name : NULL, fed_status_done, fwd) < 0) {
+        free(fwd);
+        send_int(-1);
+        return;
+    }
+    fed_hold(fwd, FORWARD_TIMEOUT * 1000);
+}
+
+static void fed_group_done(virtc_t *vc, const virtc_reply_t *reply, void *arg)
+{
+    fed_node_t *node = &fed.nodes[(intptr_t)arg];
+
+    if (reply->err) {
+        logout("io group on node %s: %s\n", node->path, virtc_strerror(reply->err));
+    }
+}
+
+/* A group's budget is per host, every node gets it. */
+static void fed_set_io_group(void)
+{
+    char name[MAX_IO_GROUP];
+    virtc_io_t io;
+    int val[5];
+    int i, sent = 0;
+
+    for (i = 0; i < ARRAY_SIZE(val); i++) {
+        if (recv_int(&val[i]) == -1) {
+            return;
+        }
+    }
+    if (recv_string(name, sizeof(name)) == -1) {
+        return;
+    }
+    fed_recv_io(val, &io);
+
+    for (i = 0; i < fed.nr_nodes; i++) {
+        if (fed.nodes[i].alive && fed_node_vc(&fed.nodes[i]) != NULL &&
+                virtc_set_io_group(fed.nodes[i].vc, name, &io, fed_group_done, (void *)(intptr_t)i) == 0) {
+            sent++;
+        }
+    }
+    send_int(sent ? 0 : -1);
+}
+
+/* MES_NODE_ANNOUNCE, see virt-proto.h */
+static void node_announce(void)
+{
+    int val[6], vms[MAX_VM_NUM];
+    char path[MAX_NODE_PATH];
+    fed_node_t *node = NULL;
+    int i, n;
+
+    for (i = 0; i < ARRAY_SIZE(val); i++) {
+        if (recv_int(&val[i]) == -1) {
+            return;
+        }
+    }
+    n = val[5];
+    if (n < 0 || n > MAX_VM_NUM) {
+        /* no telling where the request ends */
+        logout("node announce with %d vms\n", n);
+        do_recv_check(0);
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        if (recv_int(&vms[i]) == -1) {
+            return;
+        }
+    }
+    if (recv_string(path, sizeof(path)) == -1) {
+        return;
+    }
+
+    if (virt_conf.role != ROLE_COORDINATOR) {
+        logout("node %s announced, but this is no coordinator\n", path);
+        send_int(-1);
+        return;
+    }
+
+    for (i = 0; i < fed.nr_nodes; i++) {
+        if (strcmp(fed.nodes[i].path, path) == 0) {
+            node = &fed.nodes[i];
             break;
-        } else {
+        }
+    }
+    if (node == NULL) {
+        if (fed.nr_nodes == MAX_NODES) {
+            logout("node %s refused, max is %d nodes\n", path, MAX_NODES);
+            send_int(-1);
+            return;
+        }
+        node = &fed.nodes[fed.nr_nodes++];
+        strcpy(node->path, path);
+    }
+    if (!node->alive) {
+        logout("node %s joined\n", path);
+    }
+
+    node->alive = true;
+    clock_gettime(CLOCK_MONOTONIC, &node->seen);
+    node->fit = val[0];
+    node->cpu_used = val[1];
+    node->cpu_cap = val[2];
+    node->mem_used = val[3];
+    node->mem_total = val[4];
+    memset(node->vms, 0, sizeof(node->vms));
+    for (i = 0; i < n; i++) {
+        if (vms[i] >= 0 && vms[i] < MAX_VM_NUM) {
+            node->vms[vms[i]] = true;
+            node->claimed[vms[i]].tv_sec = 0;
+        }
+    }
+    fed.announces++;
+
+    send_int(0);
+}
+
+static void fed_node_gone(fed_node_t *node)
+{
+    /* fails what is still forwarded to it, which releases the clients */
+    virtc_close(node->vc);
+    node->vc = NULL;
+}
+
+/* coordinator: forget silent nodes, give up on forwards that took too long */
+static void fed_tick(void)
+{
+    struct timespec now;
+    client_conn_t *conn;
+    fed_node_t *node;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (i = 0; i < MAXCONN; i++) {
+        conn = &virt_server.conns[i];
+        if (!conn->connected || conn->fwd_node == -1 || ts_ns(&now) < ts_ns(&conn->fwd_deadline)) {
             continue;
         }
+        node = &fed.nodes[conn->fwd_node];
+        logout("node %s didn't answer in time\n", node->path);
+        fed.timeouts++;
+        if (conn->fwd_vc != NULL) {
+            virtc_close(conn->fwd_vc);
+            conn->fwd_vc = NULL;
+        } else {
+            fed_node_gone(node);
+        }
     }
 
-    if (find_vm_id) {
-        pid_t pid = current->pid;
-        logout("Find and kill vm, pid is %d\n", pid);
+    for (i = 0; i < fed.nr_nodes; i++) {
+        node = &fed.nodes[i];
+        if (node->alive && ts_diff_ns(&node->seen, &now) > NODE_TIMEOUT * 1000000000ULL) {
+            logout("node %s gone, no announce for %d s\n", node->path, NODE_TIMEOUT);
+            node->alive = false;
+            fed_node_gone(node);
+        }
+    }
+}
 
-        if (prev == current) {
-            free(current);
-            virt_server.qemu_head = NULL;
-        } else {
-            prev->next = current->next;
-            free(current);
+static void fed_announce_done(virtc_t *vc, const virtc_reply_t *reply, void *arg)
+{
+    if (reply->err == 0 && !fed.up_joined) {
+        logout("joined the coordinator at %s\n", virt_conf.coordinator);
+    } else if (reply->err != 0 && fed.up_joined) {
+        logout("announce to %s failed: %s\n", virt_conf.coordinator, virtc_strerror(reply->err));
+    }
+    fed.up_joined = reply->err == 0;
+}
+
+/* node: tell the coordinator what fits here and which vms we hold */
+static void fed_announce(void)
+{
+    int vms[MAX_VM_NUM];
+    virtc_node_t node;
+    qemu_proc_t *item;
+    cpu_set_t mask;
+    int i, err;
+
+    if (fed.up == NULL) {
+        fed.up = virtc_open(virt_conf.coordinator, &err);
+        if (fed.up == NULL) {
+            if (fed.up_joined) {
+                logout("coordinator at %s unreachable: %s\n", virt_conf.coordinator,
+                        virtc_strerror(err));
+                fed.up_joined = false;
+            }
+            return;
+        }
+    }
+    /* still waiting for the last one, a busy coordinator gets no backlog */
+    if (virtc_pending(fed.up) > 0) {
+        return;
+    }
+
+    memset(&node, 0, sizeof(node));
+    node.path = virt_conf.socket;
+    for (i = 0; i < ARRAY_SIZE(qemu_profiles); i++) {
+        if (sched_fit(&qemu_profiles[i], &mask) == FIT_OK) {
+            node.fit |= 1 << i;
+        }
+    }
+    for (i = 0; i < host_cap.nr_cpus; i++) {
+        if (CPU_ISSET(i, &host_cap.pool)) {
+            node.cpu_cap += host_cap.cpu_cap;
+            node.cpu_used += host_cap.cpu_used[i];
         }
+    }
+    node.mem_used = host_cap.mem_used;
+    node.mem_total = host_cap.mem_total;
+    for (item = virt_server.qemu_head; item != NULL && node.nr_vms < MAX_VM_NUM; item = item->next) {
+        vms[node.nr_vms++] = item->vm_id;
+    }
+    node.vms = vms;
 
-        kill(pid, 9);
-    } else {
-        logout("Can't find running qemu with vm_id %d\n", vm_id);
+    if (virtc_announce(fed.up, &node, fed_announce_done, NULL) < 0) {
+        virtc_close(fed.up);
+        fed.up = NULL;
+    }
+}
+
+/* Requests a coordinator answers for the fleet, -1 for the ones it answers as
+ * any server does. */
+static int fed_handle_message(int message_type)
+{
+    switch (message_type) {
+        case MES_QUREY_QEMU:
+            fed_query_qemu();
+            break;
+        case MES_LAUNCH_QEMU:
+            fed_launch(false, false);
+            break;
+        case MES_LAUNCH_QEMU_PROFILE:
+            fed_launch(true, false);
+            break;
+        case MES_LAUNCH_QEMU_PRIORITY:
+            fed_launch(true, true);
+            break;
+        case MES_KILL_QEMU:
+            fed_kill();
+            break;
+        case MES_GET_CPU_AFFINITY:
+            fed_cpu_affinity();
+            break;
+        case MES_QUERY_JOB:
+            fed_query_job();
+            break;
+        case MES_QUERY_STATS:
+            fed_query_stats();
+            break;
+        case MES_QUERY_FIT:
+            fed_query_fit();
+            break;
+        case MES_WAIT_READY:
+            fed_wait_ready();
+            break;
+        case MES_SET_IO_LIMITS:
+            fed_set_io_limits();
+            break;
+        case MES_SET_IO_GROUP:
+            fed_set_io_group();
+            break;
+        default:
+            return -1;
     }
 
     return 0;
 }
 
-static void kill_qemu(void)
+static int fed_vc_fd_set(virtc_t *vc, fd_set *rset, fd_set *wset, int maxfd)
 {
-    int vm_id = recv_vm_id();
+    int fd;
 
-    if (vm_id == -1) {
-        return;
+    if (vc == NULL) {
+        return maxfd;
+    }
+
+    fd = virtc_fd(vc);
+    FD_SET(fd, rset);
+    if (virtc_events(vc) & POLLOUT) {
+        FD_SET(fd, wset);
+    }
+
+    return fd > maxfd ? fd : maxfd;
+}
+
+/* connections to nodes or to the coordinator for select(), returns the highest fd */
+static int fed_fd_set(fd_set *rset, fd_set *wset, int maxfd)
+{
+    int i;
+
+    maxfd = fed_vc_fd_set(fed.up, rset, wset, maxfd);
+    for (i = 0; i < fed.nr_nodes; i++) {
+        maxfd = fed_vc_fd_set(fed.nodes[i].vc, rset, wset, maxfd);
+    }
+    for (i = 0; i < MAXCONN; i++) {
+        maxfd = fed_vc_fd_set(virt_server.conns[i].fwd_vc, rset, wset, maxfd);
+    }
+
+    return maxfd;
+}
+
+/* NULL once the connection broke, its requests have failed by then */
+static virtc_t *fed_vc_events(virtc_t *vc, fd_set *rset, fd_set *wset)
+{
+    if (vc == NULL || (!FD_ISSET(virtc_fd(vc), rset) && !FD_ISSET(virtc_fd(vc), wset))) {
+        return vc;
+    }
+    if (virtc_process(vc) < 0) {
+        virtc_close(vc);
+        return NULL;
     }
 
-    kill_qemu_with_vm_id(vm_id);
+    return vc;
+}
+
+static void fed_events(fd_set *rset, fd_set *wset)
+{
+    client_conn_t *conn;
+    int i;
+
+    fed.up = fed_vc_events(fed.up, rset, wset);
+    for (i = 0; i < fed.nr_nodes; i++) {
+        fed.nodes[i].vc = fed_vc_events(fed.nodes[i].vc, rset, wset);
+    }
+    for (i = 0; i < MAXCONN; i++) {
+        conn = &virt_server.conns[i];
+        conn->fwd_vc = fed_vc_events(conn->fwd_vc, rset, wset);
+        if (conn->fwd_vc != NULL && virtc_pending(conn->fwd_vc) == 0) {
+            virtc_close(conn->fwd_vc);
+            conn->fwd_vc = NULL;
+        }
+    }
 }
 
 static int handle_message(void)
 {
     int message_type;
+    uint64_t t;
 
     if (recv_message(&message_type) == -1) {
         return -1;
     }
+    t = trace_start();
+
+    if (virt_conf.role == ROLE_COORDINATOR && fed_handle_message(message_type) == 0) {
+        trace_end(message_name(message_type), -1, t);
+        return 0;
+    }
 
     switch (message_type) {
         case MES_QUREY_QEMU:
             query_qemu();
             break;
         case MES_LAUNCH_QEMU:
-            try_launch_qemu();
+            try_launch_qemu(false, false);
+            break;
+        case MES_LAUNCH_QEMU_PROFILE:
+            try_launch_qemu(true, false);
+            break;
+        case MES_LAUNCH_QEMU_PRIORITY:
+            try_launch_qemu(true, true);
             break;
         case MES_KILL_QEMU:
             kill_qemu();
@@ -691,39 +8583,232 @@ static int handle_message(void)
         case MES_GET_CPU_AFFINITY:
             get_cpu_affintiy_status();
             break;
+        case MES_QUERY_JOB:
+            query_job();
+            break;
+        case MES_QUERY_STATS:
+            query_stats();
+            break;
+        case MES_QUERY_FIT:
+            query_fit();
+            break;
+        case MES_TRACE:
+            trace_ctl();
+            break;
+        case MES_WAIT_READY:
+            wait_ready();
+            break;
+        case MES_NODE_ANNOUNCE:
+            node_announce();
+            break;
+        case MES_SET_IO_LIMITS:
+            set_io_limits();
+            break;
+        case MES_SET_IO_GROUP:
+            set_io_group();
+            break;
         default:
             logout("unknown message type %d\n", message_type);
             break;
     }
+    trace_end(message_name(message_type), -1, t);
 
     return 0;
 }
 
-#if 0
-static ATTR_UNUSED void wait_child(void)
+static int conn_int(const client_conn_t *conn, int pos)
 {
-    int status;
-    pid_t pid;
-    do {
-        pid = waitpid(-1, &status, WNOHANG);
-        if (pid > 0) {
-            logout("qemu sub-process (%d) exit, status (%d).\n", pid, status);
-            free_qemu_with_pid(pid);
-        } else if (pid == -1) {
-            logout("waitpid error: %s\n", strerror(errno));
-            break;
+    int val;
+
+    memcpy(&val, conn->in + pos, sizeof(int));
+    return val;
+}
+
+/* Length of the request at the head of the buffer, 0 while part of it is still
+ * on its way, -1 if it can't be framed. An unknown type is one int long, its
+ * fields are read as the next requests (see virt-proto.h). */
+static int request_len(const client_conn_t *conn)
+{
+    const char *field;
+    int type, pos = sizeof(int), n;
+
+    if (conn->in_len < sizeof(int)) {
+        return 0;
+    }
+    type = conn_int(conn, 0);
+    if (type < 0 || type >= ARRAY_SIZE(message_fields) || message_fields[type] == NULL) {
+        return sizeof(int);
+    }
+
+    for (field = message_fields[type]; *field != '\0'; field++) {
+        if (pos + (int)sizeof(int) > conn->in_len) {
+            return pos + sizeof(int) > CONN_IN_SIZE ? -1 : 0;
+        }
+        n = conn_int(conn, pos);
+        pos += sizeof(int);
+        if (*field == 's' && n > CONN_IN_SIZE) {
+            return -1;
+        } else if (*field == 's' && n > 0) {
+            pos += n;
+        } else if (*field == 'n') {
+            if (n < 0 || n > MAX_VM_NUM) {
+                return -1;
+            }
+            pos += n * sizeof(int);
+        }
+        if (pos > CONN_IN_SIZE) {
+            return -1;
         }
-    } while (pid > 0);
+    }
+
+    return pos <= conn->in_len ? pos : 0;
+}
+
+/* Take whatever the client sent, select() said it won't block. */
+static void conn_read(client_conn_t *conn)
+{
+    int ret;
+
+    ret = read(conn->fd, conn->in + conn->in_len, CONN_IN_SIZE - conn->in_len);
+    if (ret == -1 && errno == EINTR) {
+        return;
+    }
+    if (ret <= 0) {
+        conn_close(conn);
+        return;
+    }
+    conn->in_len += ret;
+}
+
+/* Handle the complete requests of a client in order, until one has to wait
+ * for its answer. A slow client only ever delays itself. */
+static void conn_dispatch(client_conn_t *conn)
+{
+    int len;
+
+    while (conn->connected && !conn_held(conn)) {
+        len = request_len(conn);
+        if (len == 0) {
+            return;
+        }
+        if (len == -1) {
+            logout("virt-client sent a request that can't be framed\n");
+            conn_close(conn);
+            return;
+        }
+
+        virt_server.cur = conn;
+        conn->in_pos = 0;
+        handle_message();
+        if (!conn->connected) {
+            return;
+        }
+        memmove(conn->in, conn->in + len, conn->in_len - len);
+        conn->in_len -= len;
+    }
+}
+
+static void conns_dispatch(void)
+{
+    int i;
+
+    for (i = 0; i < MAXCONN; i++) {
+        conn_dispatch(&virt_server.conns[i]);
+    }
+}
+
+/* Run fn every interval_ms from the event loop, an interval of 0 disables it. */
+static void periodic_add(const char *name, int interval_ms, void (*fn)(void))
+{
+    periodic_task_t *task;
+
+    if (interval_ms <= 0) {
+        logout("periodic task %s is off\n", name);
+        return;
+    }
+
+    if (nr_periodic_tasks == MAX_PERIODIC) {
+        ERR_EXIT("Error: too many periodic tasks\n");
+    }
+
+    task = &periodic_tasks[nr_periodic_tasks++];
+    task->name = name;
+    task->interval_ms = interval_ms;
+    task->fn = fn;
+    clock_gettime(CLOCK_MONOTONIC, &task->next);
+    ts_add_ms(&task->next, interval_ms);
+}
+
+static periodic_task_t *periodic_find(void (*fn)(void))
+{
+    int i;
+
+    for (i = 0; i < nr_periodic_tasks; i++) {
+        if (periodic_tasks[i].fn == fn) {
+            return &periodic_tasks[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* A task with nothing to watch stops waking the event loop. */
+static void periodic_sleep(void (*fn)(void))
+{
+    periodic_task_t *task = periodic_find(fn);
+
+    if (task) {
+        task->asleep = true;
+    }
+}
+
+/* Run it again, first one interval from now. */
+static void periodic_wake(void (*fn)(void))
+{
+    periodic_task_t *task = periodic_find(fn);
+
+    if (task && task->asleep) {
+        task->asleep = false;
+        clock_gettime(CLOCK_MONOTONIC, &task->next);
+        ts_add_ms(&task->next, task->interval_ms);
+    }
+}
+
+/* Run the due tasks and shorten the select() timeout to the next one. */
+static void periodic_run(struct timeval *timeout)
+{
+    periodic_task_t *task;
+    struct timespec now;
+    int64_t wait_ns;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < nr_periodic_tasks; i++) {
+        task = &periodic_tasks[i];
+        if (task->asleep) {
+            continue;
+        }
+        wait_ns = (task->next.tv_sec - now.tv_sec) * 1000000000LL + task->next.tv_nsec - now.tv_nsec;
+        if (wait_ns <= 0) {
+            task->fn();
+            task->next = now;
+            ts_add_ms(&task->next, task->interval_ms);
+            wait_ns = task->interval_ms * 1000000LL;
+        }
+        if (wait_ns < timeout->tv_sec * 1000000000LL + timeout->tv_usec * 1000LL) {
+            timeout->tv_sec = wait_ns / 1000000000LL;
+            timeout->tv_usec = (wait_ns % 1000000000LL) / 1000;
+        }
+    }
 }
-#endif
 
 static void loop_event(void)
 {
-    int fd, maxfd;
-    int status;
-    pid_t pid;
+    int fd, maxfd, i;
+    client_conn_t *conn;
 
     fd_set *listen_set = &virt_server.listen_set;
+    fd_set write_set;
 
     struct timeval timeout = {
         .tv_sec = 60, // 1 min
@@ -740,20 +8825,38 @@ static void loop_event(void)
          * The signal handler is deperacted because of the multi-thread safe
          * problem.
          * */
-        pid = waitpid(-1, &status, WNOHANG);
-        if (pid > 0) {
-            logout("qemu sub-process (%d) exit, status (%d).\n", pid, status);
-            free_qemu_with_pid(pid);
+        reap_qemu();
+
+        periodic_run(&timeout);
+
+        /* clients a periodic task answered may have requests buffered */
+        conns_dispatch();
+
+        /* whatever the last turn changed, and the heartbeat when nothing did */
+        status_publish();
+        if (status_table != NULL && timeout.tv_sec >= STATUS_HEARTBEAT) {
+            timeout.tv_sec = STATUS_HEARTBEAT;
+            timeout.tv_usec = 0;
         }
 
         FD_ZERO(listen_set);
+        FD_ZERO(&write_set);
         FD_SET(virt_server.listenfd, listen_set);
-        if (virt_server.connected) {
-            FD_SET(virt_server.connfd, listen_set);
+        FD_SET(job_pool.event_fd, listen_set);
+        maxfd = virt_server.listenfd > job_pool.event_fd ? virt_server.listenfd : job_pool.event_fd;
+        maxfd = ready_fd_set(listen_set, maxfd);
+        maxfd = fed_fd_set(listen_set, &write_set, maxfd);
+        for (i = 0; i < MAXCONN; i++) {
+            conn = &virt_server.conns[i];
+            if (conn->connected && !conn_held(conn) && conn->in_len < CONN_IN_SIZE) {
+                FD_SET(conn->fd, listen_set);
+                if (conn->fd > maxfd) {
+                    maxfd = conn->fd;
+                }
+            }
         }
 
-        maxfd = virt_server.connfd > virt_server.listenfd ? virt_server.connfd + 1: virt_server.listenfd + 1;
-        fd = select(maxfd, listen_set, NULL, NULL, &timeout);
+        fd = select(maxfd + 1, listen_set, &write_set, NULL, &timeout);
         /* logout("---- test select ----\n"); */
 
         if (fd == -1) {
@@ -765,12 +8868,24 @@ static void loop_event(void)
             }
         }
 
-        if (FD_ISSET(virt_server.listenfd, listen_set)) {
-            new_connect();
+        if (FD_ISSET(job_pool.event_fd, listen_set)) {
+            job_complete_events();
+        }
+
+        ready_events(listen_set);
+
+        fed_events(listen_set, &write_set);
+
+        for (i = 0; i < MAXCONN; i++) {
+            conn = &virt_server.conns[i];
+            if (conn->connected && !conn_held(conn) && FD_ISSET(conn->fd, listen_set)) {
+                conn_read(conn);
+            }
         }
+        conns_dispatch();
 
-        if (FD_ISSET(virt_server.connfd, listen_set)) {
-            handle_message();
+        if (FD_ISSET(virt_server.listenfd, listen_set)) {
+            new_connect();
         }
     }
     logout("==== stop loop ====\n");
@@ -778,19 +8893,32 @@ static void loop_event(void)
 
 static int server_init(void)
 {
-    virt_server.connected = false;
+    int i;
+
+    for (i = 0; i < MAXCONN; i++) {
+        virt_server.conns[i].fd = -1;
+        virt_server.conns[i].connected = false;
+        virt_server.conns[i].wait_vm = -1;
+        virt_server.conns[i].fwd_node = -1;
+        virt_server.conns[i].fwd_vc = NULL;
+        virt_server.conns[i].job_wait = false;
+    }
     virt_server.qemu_head = NULL;
     virt_server.listenfd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (virt_server.listenfd == -1) {
         ERR_EXIT("Error: socket error\n");
     }
 
-    unlink(LIBVIRTD_SOCKET);
-
     struct sockaddr_un servaddr;
+    if (strlen(virt_conf.socket) >= sizeof(servaddr.sun_path)) {
+        ERR_EXIT("Error: socket path %s too long\n", virt_conf.socket);
+    }
+
+    unlink(virt_conf.socket);
+
     memset(&servaddr, 0, sizeof(servaddr));
     servaddr.sun_family = AF_UNIX;
-    strcpy(servaddr.sun_path, LIBVIRTD_SOCKET);
+    strcpy(servaddr.sun_path, virt_conf.socket);
 
     if (bind(virt_server.listenfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) == -1) {
         ERR_EXIT("Error: bind error\n");
@@ -825,8 +8953,188 @@ static ATTR_UNUSED void set_signal(void)
     sigaction(SIGCHLD, &action, NULL);
 }
 
+static const char *conf_str(const char *env, const char *def)
+{
+    const char *val = getenv(env);
+
+    return (val != NULL && *val != '\0') ? val : def;
+}
+
+/* Numeric setting, falls back to the default when unset or out of [min, max]. */
+static long conf_long(const char *env, long def, long min, long max)
+{
+    const char *val = getenv(env);
+    char *end;
+    long num;
+
+    if (val == NULL || *val == '\0') {
+        return def;
+    }
+
+    num = strtol(val, &end, 0);
+    if (*end != '\0' || num < min || num > max) {
+        return def;
+    }
+
+    return num;
+}
+
+static double conf_double(const char *env, const char *def)
+{
+    double num = strtod(conf_str(env, def), NULL);
+
+    return num > 0 ? num : strtod(def, NULL);
+}
+
+static void load_conf(void)
+{
+    virt_conf.socket = conf_str("VIRT_SOCKET", LIBVIRTD_SOCKET);
+    virt_conf.log_file = conf_str("VIRT_LOG_FILE", LIBVIRT_LOG_FILE);
+    virt_conf.pid_file = conf_str("VIRT_PID_FILE", LIBVIRT_PID_FILE);
+    virt_conf.role = strcmp(conf_str("VIRT_ROLE", "node"), "coordinator") == 0 ?
+            ROLE_COORDINATOR : ROLE_NODE;
+    virt_conf.coordinator = getenv("VIRT_COORDINATOR");
+    virt_conf.cgroup_root = conf_str("VIRT_CGROUP_ROOT", CGROUP_ROOT);
+    virt_conf.workers = conf_long("VIRT_WORKERS", WORKERS, 1, 256);
+    virt_conf.job_queue = conf_long("VIRT_JOB_QUEUE", JOB_QUEUE, 1, 65536);
+    virt_conf.proc_root = conf_str("VIRT_PROC_ROOT", PROC_ROOT);
+    virt_conf.cpu_pool = getenv("VIRT_CPU_POOL");
+    virt_conf.cpu_overcommit = conf_double("VIRT_CPU_OVERCOMMIT", CPU_OVERCOMMIT);
+    virt_conf.mem_overcommit = conf_double("VIRT_MEM_OVERCOMMIT", MEM_OVERCOMMIT);
+    virt_conf.mem_reserve = conf_long("VIRT_MEM_RESERVE", MEM_RESERVE, 0, LONG_MAX);
+    virt_conf.admission = strcmp(conf_str("VIRT_ADMISSION", "queue"), "reject") == 0 ?
+            ADMISSION_REJECT : ADMISSION_QUEUE;
+    virt_conf.rebalance_interval = conf_long("VIRT_REBALANCE_INTERVAL", REBALANCE_INTERVAL, 0, 86400);
+    virt_conf.rebalance_moves = conf_long("VIRT_REBALANCE_MOVES", REBALANCE_MOVES, 0, MAX_VM_NUM);
+    virt_conf.qmp_dir = conf_str("VIRT_QMP_DIR", QMP_DIR);
+    virt_conf.psi_dir = conf_str("VIRT_PSI_DIR", PSI_DIR);
+    virt_conf.balloon_interval = conf_long("VIRT_BALLOON_INTERVAL", BALLOON_INTERVAL, 0, 86400);
+    virt_conf.ksm_dir = conf_str("VIRT_KSM_DIR", KSM_DIR);
+    virt_conf.ksm_interval = conf_long("VIRT_KSM_INTERVAL", KSM_INTERVAL, 0, 86400);
+    virt_conf.bridge = getenv("VIRT_BRIDGE");
+    virt_conf.microvm_kernel = conf_str("VIRT_MICROVM_KERNEL", MICROVM_KERNEL);
+    virt_conf.trace = conf_long("VIRT_TRACE", 0, 0, 1);
+    virt_conf.trace_dir = conf_str("VIRT_TRACE_DIR", TRACE_DIR);
+    virt_conf.ready_timeout = conf_long("VIRT_READY_TIMEOUT", READY_TIMEOUT, 1, 86400);
+    virt_conf.boot_max = conf_long("VIRT_BOOT_MAX", BOOT_MAX, 0, MAX_VM_NUM);
+    virt_conf.boot_hold = conf_long("VIRT_BOOT_HOLD", BOOT_HOLD, 1, 86400);
+    virt_conf.image_dir = conf_str("VIRT_IMAGE_DIR", IMAGE_DIR);
+    virt_conf.prewarm = conf_long("VIRT_PREWARM", 1, 0, 1);
+    virt_conf.prewarm_lock = conf_long("VIRT_PREWARM_LOCK", 0, 0, LONG_MAX >> 20);
+    virt_conf.rt_cpus = getenv("VIRT_RT_CPUS");
+    virt_conf.cpu_sysfs = conf_str("VIRT_CPU_SYSFS", CPU_SYSFS);
+    virt_conf.rt_prio = conf_long("VIRT_RT_PRIO", RT_PRIO, 1, 99);
+    virt_conf.hotplug_interval = conf_long("VIRT_HOTPLUG_INTERVAL", HOTPLUG_INTERVAL, 0, 86400);
+    virt_conf.io_interval = conf_long("VIRT_IO_INTERVAL", IO_INTERVAL, 0, 86400);
+    virt_conf.node_sysfs = conf_str("VIRT_NODE_SYSFS", NODE_SYSFS);
+    virt_conf.numa_interval = conf_long("VIRT_NUMA_INTERVAL", NUMA_INTERVAL, 0, 86400);
+    /* set but empty switches it off */
+    virt_conf.status_shm = getenv("VIRT_STATUS_SHM");
+    if (virt_conf.status_shm == NULL) {
+        virt_conf.status_shm = VIRT_STATUS_SHM;
+    }
+}
+
+#ifdef SCHED_BENCH
+/* make sched-bench: time the admission/placement path against a synthetic host,
+ * bin/sched-bench [cpus] [vms] [rounds] [nodes] */
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    int cpus = argc > 1 ? atoi(argv[1]) : 256;
+    int nr_vms = argc > 2 ? atoi(argv[2]) : 4096;
+    int rounds = argc > 3 ? atoi(argv[3]) : 100000;
+    int nodes = argc > 4 ? atoi(argv[4]) : 1;
+    qemu_proc_t *vms;
+    uint64_t start, admit_ns, churn_ns;
+    int i, placed = 0, churn_ok = 0;
+
+    load_conf();
+    virt_server.log_fd = STDERR_FILENO;
+    if (cpus <= 0 || cpus > CPU_SETSIZE || nr_vms <= 0 || rounds < 0 ||
+            nodes <= 0 || nodes > MAX_NUMA_NODES || nodes > cpus) {
+        ERR_EXIT("usage: sched-bench [cpus] [vms] [rounds] [nodes]\n");
+    }
+
+    /* 4 vCPU per core and 8 GB of RAM per core, hugepages for a quarter of it */
+    host_cap.nr_cpus = cpus;
+    host_cap.cpu_cap = 4 * VCPU_UNIT;
+    host_cap.cpu_used = calloc(cpus, sizeof(uint32_t));
+    for (i = 0; i < cpus; i++) {
+        CPU_SET(i, &host_cap.pool);
+    }
+    host_cap.mem_total = cpus * 6144ULL;
+    host_cap.huge_total = cpus * 2048ULL;
+
+    /* nodes of equal size, consecutive cores */
+    memset(numa_host.node_of, -1, sizeof(numa_host.node_of));
+    if (nodes > 1) {
+        for (i = 0; i < cpus; i++) {
+            numa_host.node_of[i] = i * nodes / cpus;
+            CPU_SET(i, &numa_host.cpus[numa_host.node_of[i]]);
+        }
+        for (i = 0; i < nodes; i++) {
+            numa_host.nodes |= 1u << i;
+            numa_host.mem_total[i] = host_cap.mem_total / nodes;
+        }
+        numa_host.nr_nodes = nodes;
+    }
+
+    vms = calloc(nr_vms, sizeof(qemu_proc_t));
+    if (vms == NULL || host_cap.cpu_used == NULL) {
+        ERR_EXIT("Error: malloc error\n");
+    }
+
+    srand(1);
+    start = bench_now_ns();
+    for (i = 0; i < nr_vms; i++) {
+        vms[i].vm_id = i;
+        vms[i].profile = &qemu_profiles[i % ARRAY_SIZE(qemu_profiles)];
+        if (sched_admit(&vms[i]) == FIT_OK) {
+            placed++;
+        }
+    }
+    admit_ns = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    for (i = 0; i < rounds; i++) {
+        qemu_proc_t *vm = &vms[rand() % nr_vms];
+        if (vm->admitted) {
+            sched_release(vm);
+        } else if (sched_admit(vm) == FIT_OK) {
+            churn_ok++;
+        }
+    }
+    churn_ns = bench_now_ns() - start;
+
+    printf("host: %d cpus, %.0f vCPU slots, %" PRIu64 " MB memory, %" PRIu64 " MB hugepages\n", cpus,
+            (double)cpus * host_cap.cpu_cap / VCPU_UNIT, host_cap.mem_total, host_cap.huge_total);
+    printf("fill: %d/%d vms placed, %.0f ns per decision\n", placed, nr_vms,
+            (double)admit_ns / nr_vms);
+    printf("churn: %d rounds, %d admitted, %.0f ns per decision\n", rounds, churn_ok,
+            rounds ? (double)churn_ns / rounds : 0.0);
+    printf("final: memory %" PRIu64 "/%" PRIu64 " MB, hugepages %" PRIu64 "/%" PRIu64 " MB\n",
+            host_cap.mem_used, host_cap.mem_total, host_cap.huge_used, host_cap.huge_total);
+    if (numa_host.nr_nodes > 1) {
+        printf("numa: %d nodes, %" PRIu64 " placements on one node, %" PRIu64 " spanning\n",
+                numa_host.nr_nodes, numa_host.local, numa_host.spanned);
+    }
+
+    return 0;
+}
+#elif !defined(VIRT_TEST)
+/* the tests under tests/ include this file with VIRT_TEST and bring their own main */
 int main(int argc, char *argv[])
 {
+    load_conf();
+
     init_log();
 
     create_daemon();
@@ -837,7 +9145,46 @@ int main(int argc, char *argv[])
 
     server_init();
 
+    trace_init();
+
+    job_pool_init();
+
+    /* a coordinator only places and forwards, its nodes run the vms */
+    if (virt_conf.role == ROLE_COORDINATOR) {
+        logout("coordinator on %s\n", virt_conf.socket);
+        periodic_add("federation", 1000, fed_tick);
+        loop_event();
+        return 0;
+    }
+
+    cgroup_init();
+
+    sched_init();
+
+    prewarm_init();
+
+    status_init();
+
+    boot_init();
+
+    periodic_add("rebalance", virt_conf.rebalance_interval * 1000, rebalance);
+    periodic_add("balloon", virt_conf.balloon_interval * 1000, balloon_reclaim);
+    periodic_add("ksm", virt_conf.ksm_interval * 1000, ksm_tune);
+    periodic_add("vhost", VHOST_PIN_INTERVAL * 1000, vhost_pin);
+    periodic_add("startup", STARTUP_PROBE_INTERVAL, startup_probe);
+    periodic_sleep(startup_probe);
+    periodic_add("ready", READY_PROBE_INTERVAL, ready_probe);
+    periodic_sleep(ready_probe);
+    periodic_add("boot", virt_conf.boot_max ? BOOT_INTERVAL * 1000 : 0, boot_tick);
+    periodic_add("hotplug", virt_conf.hotplug_interval * 1000, hotplug_scale);
+    periodic_add("io", virt_conf.io_interval * 1000, io_tick);
+    periodic_add("numa", virt_conf.numa_interval * 1000, numa_sample);
+    if (virt_conf.coordinator != NULL) {
+        periodic_add("announce", NODE_ANNOUNCE_INTERVAL * 1000, fed_announce);
+    }
+
     loop_event();
 
     return 0;
 }
+#endif
@@ -0,0 +1,742 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "virtc.h"
+
+#define VIRTC_TEXT_MAX (16 << 20)   /* anything longer is a broken stream */
+#define VIRTC_READ_SIZE 4096
+#define VIRTC_STATUS_SPINS (1 << 20)    /* reads of an odd seq before giving up */
+
+typedef enum REPLY_KIND {
+    REPLY_INT,              /* job id */
+    REPLY_INT2,             /* job state and result */
+    REPLY_READY,            /* latency or -errno */
+    REPLY_TEXT,
+} REPLY_KIND_T;
+
+typedef struct virtc_req {
+    MESSAGE_TYPE_T type;
+    REPLY_KIND_T kind;
+    int acks;               /* ACK/NACKs still to come, one for the type and each field */
+    int answered;
+    bool nacked;
+    virtc_cb cb;
+    void *arg;
+    struct virtc_req *next;
+} virtc_req_t;
+
+typedef struct virtc_buf {
+    char *data;
+    size_t len;             /* valid bytes */
+    size_t pos;             /* consumed bytes */
+    size_t size;
+} virtc_buf_t;
+
+struct virtc {
+    int fd;
+    int err;                /* set once the connection broke */
+    virtc_buf_t out;
+    virtc_buf_t in;
+    virtc_req_t *head;
+    virtc_req_t *tail;
+    int pending;
+};
+
+static char *virtc_err_str[] = {
+    "success",
+    "system call failed",
+    "out of memory",
+    "invalid argument",
+    "connection closed",
+    "protocol error",
+    "request refused by server",
+    "launch/kill refused by server",
+    "timed out",
+    "no such vm",
+};
+
+const char *virtc_strerror(int err)
+{
+    if (err < 0) {
+        err = -err;
+    }
+    if (err >= sizeof(virtc_err_str) / sizeof(virtc_err_str[0])) {
+        return "unknown error";
+    }
+    return virtc_err_str[err];
+}
+
+/* make room for size more bytes, dropping what was consumed already */
+static int buf_reserve(virtc_buf_t *buf, size_t size)
+{
+    size_t want;
+    char *data;
+
+    if (buf->pos > 0) {
+        memmove(buf->data, buf->data + buf->pos, buf->len - buf->pos);
+        buf->len -= buf->pos;
+        buf->pos = 0;
+    }
+
+    if (buf->len + size <= buf->size) {
+        return 0;
+    }
+
+    want = buf->size ? buf->size : VIRTC_READ_SIZE;
+    while (want < buf->len + size) {
+        want *= 2;
+    }
+    data = realloc(buf->data, want);
+    if (data == NULL) {
+        return -VIRTC_ENOMEM;
+    }
+    buf->data = data;
+    buf->size = want;
+
+    return 0;
+}
+
+static void buf_put(virtc_buf_t *buf, const void *data, size_t len)
+{
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static size_t buf_avail(const virtc_buf_t *buf)
+{
+    return buf->len - buf->pos;
+}
+
+static int buf_peek_int(const virtc_buf_t *buf, size_t off)
+{
+    int val;
+
+    memcpy(&val, buf->data + buf->pos + off, sizeof(val));
+    return val;
+}
+
+static void virtc_complete(virtc_t *vc, virtc_reply_t *reply)
+{
+    virtc_req_t *req = vc->head;
+
+    vc->head = req->next;
+    if (vc->head == NULL) {
+        vc->tail = NULL;
+    }
+    vc->pending--;
+
+    reply->type = req->type;
+    if (req->cb) {
+        req->cb(vc, reply, req->arg);
+    }
+    free(req);
+}
+
+/* The connection is unusable from now on, fail everything still queued. */
+static int virtc_fail(virtc_t *vc, int err)
+{
+    virtc_reply_t reply;
+
+    if (vc->err == 0) {
+        vc->err = err;
+    }
+    while (vc->head) {
+        memset(&reply, 0, sizeof(reply));
+        reply.err = vc->err;
+        virtc_complete(vc, &reply);
+    }
+
+    return vc->err;
+}
+
+static int virtc_flush(virtc_t *vc)
+{
+    ssize_t ret;
+
+    while (buf_avail(&vc->out) > 0) {
+        ret = send(vc->fd, vc->out.data + vc->out.pos, buf_avail(&vc->out),
+                MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EPIPE ? -VIRTC_ECLOSED : -VIRTC_ESYS;
+        }
+        vc->out.pos += ret;
+    }
+
+    return 0;
+}
+
+/* Consume every complete answer in the input buffer. */
+static int virtc_parse(virtc_t *vc)
+{
+    virtc_buf_t *in = &vc->in;
+    virtc_reply_t reply;
+    virtc_req_t *req;
+    char *text;
+    int val, len;
+
+    while ((req = vc->head) != NULL) {
+        while (req->acks > 0) {
+            if (buf_avail(in) < sizeof(int)) {
+                return 0;
+            }
+            val = buf_peek_int(in, 0);
+            in->pos += sizeof(int);
+            if (val == MES_NACK) {
+                /* a refused message type leaves the fields to be read as requests */
+                if (req->answered == 0) {
+                    return -VIRTC_EPROTO;
+                }
+                req->nacked = true;
+            } else if (val != MES_ACK) {
+                return -VIRTC_EPROTO;
+            }
+            req->answered++;
+            req->acks--;
+        }
+
+        memset(&reply, 0, sizeof(reply));
+        if (req->nacked) {
+            reply.err = -VIRTC_ENACK;
+            virtc_complete(vc, &reply);
+            continue;
+        }
+
+        switch (req->kind) {
+            case REPLY_INT:
+                if (buf_avail(in) < sizeof(int)) {
+                    return 0;
+                }
+                reply.job_id = buf_peek_int(in, 0);
+                if (reply.job_id == -1) {
+                    reply.err = -VIRTC_EREFUSED;
+                }
+                in->pos += sizeof(int);
+                virtc_complete(vc, &reply);
+                break;
+            case REPLY_READY:
+                if (buf_avail(in) < sizeof(int)) {
+                    return 0;
+                }
+                val = buf_peek_int(in, 0);
+                if (val >= 0) {
+                    reply.ready_ms = val;
+                } else {
+                    reply.result = val;
+                    reply.err = val == -ETIMEDOUT ? -VIRTC_ETIMEDOUT : -VIRTC_ENOVM;
+                }
+                in->pos += sizeof(int);
+                virtc_complete(vc, &reply);
+                break;
+            case REPLY_INT2:
+                if (buf_avail(in) < 2 * sizeof(int)) {
+                    return 0;
+                }
+                reply.state = buf_peek_int(in, 0);
+                reply.result = buf_peek_int(in, sizeof(int));
+                in->pos += 2 * sizeof(int);
+                virtc_complete(vc, &reply);
+                break;
+            case REPLY_TEXT:
+                if (buf_avail(in) < sizeof(int)) {
+                    return 0;
+                }
+                len = buf_peek_int(in, 0);
+                if (len < 0 || len > VIRTC_TEXT_MAX) {
+                    return -VIRTC_EPROTO;
+                }
+                if (buf_avail(in) < sizeof(int) + len) {
+                    return 0;
+                }
+                text = malloc(len + 1);
+                if (text == NULL) {
+                    return -VIRTC_ENOMEM;
+                }
+                memcpy(text, in->data + in->pos + sizeof(int), len);
+                text[len] = '\0';
+                in->pos += sizeof(int) + len;
+                reply.text = text;
+                reply.len = len;
+                virtc_complete(vc, &reply);
+                free(text);
+                break;
+        }
+    }
+
+    /* nobody asked for these bytes */
+    return buf_avail(in) > 0 ? -VIRTC_EPROTO : 0;
+}
+
+int virtc_process(virtc_t *vc)
+{
+    ssize_t ret;
+    bool closed = false;
+    int err;
+
+    if (vc->err) {
+        return virtc_fail(vc, vc->err);
+    }
+
+    err = virtc_flush(vc);
+    if (err < 0) {
+        return virtc_fail(vc, err);
+    }
+
+    while (1) {
+        err = buf_reserve(&vc->in, VIRTC_READ_SIZE);
+        if (err < 0) {
+            return virtc_fail(vc, err);
+        }
+        ret = recv(vc->fd, vc->in.data + vc->in.len, vc->in.size - vc->in.len, MSG_DONTWAIT);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return virtc_fail(vc, -VIRTC_ESYS);
+        }
+        if (ret == 0) {
+            closed = true;
+            break;
+        }
+        vc->in.len += ret;
+    }
+
+    /* answers that made it before a close still count */
+    err = virtc_parse(vc);
+    if (err < 0) {
+        return virtc_fail(vc, err);
+    }
+    if (closed) {
+        return virtc_fail(vc, -VIRTC_ECLOSED);
+    }
+
+    return 0;
+}
+
+static int virtc_request(virtc_t *vc, MESSAGE_TYPE_T type, REPLY_KIND_T kind,
+        const int *ints, int nr_ints, const char *str, int str_max, virtc_cb cb, void *arg)
+{
+    virtc_req_t *req;
+    int i, len = 0, err;
+    size_t size;
+
+    if (vc->err) {
+        return vc->err;
+    }
+
+    if (str) {
+        len = strlen(str);
+        if (len <= 0 || len >= str_max) {
+            return -VIRTC_EINVAL;
+        }
+    }
+
+    req = calloc(1, sizeof(virtc_req_t));
+    size = (1 + nr_ints + (str ? 1 : 0)) * sizeof(int) + len;
+    if (req == NULL || buf_reserve(&vc->out, size) < 0) {
+        free(req);
+        return -VIRTC_ENOMEM;
+    }
+
+    buf_put(&vc->out, &type, sizeof(int));
+    for (i = 0; i < nr_ints; i++) {
+        buf_put(&vc->out, &ints[i], sizeof(int));
+    }
+    if (str) {
+        buf_put(&vc->out, &len, sizeof(len));
+        buf_put(&vc->out, str, len);
+    }
+
+    req->type = type;
+    req->kind = kind;
+    req->acks = 1 + nr_ints + (str ? 1 : 0);
+    req->cb = cb;
+    req->arg = arg;
+    if (vc->tail) {
+        vc->tail->next = req;
+    } else {
+        vc->head = req;
+    }
+    vc->tail = req;
+    vc->pending++;
+
+    /* send right away if the socket takes it, failures show up in virtc_process() */
+    err = virtc_flush(vc);
+    if (err < 0) {
+        vc->err = err;
+    }
+
+    return 0;
+}
+
+static bool vm_id_valid(int vm_id)
+{
+    return vm_id >= 0 && vm_id < MAX_VM_NUM;
+}
+
+int virtc_query_qemu(virtc_t *vc, virtc_cb cb, void *arg)
+{
+    return virtc_request(vc, MES_QUREY_QEMU, REPLY_TEXT, NULL, 0, NULL, 0, cb, arg);
+}
+
+int virtc_launch(virtc_t *vc, int vm_id, const char *profile, virtc_cb cb, void *arg)
+{
+    if (!vm_id_valid(vm_id)) {
+        return -VIRTC_EINVAL;
+    }
+    return virtc_request(vc, profile ? MES_LAUNCH_QEMU_PROFILE : MES_LAUNCH_QEMU, REPLY_INT,
+            &vm_id, 1, profile, MAX_PROFILE_NAME, cb, arg);
+}
+
+int virtc_launch_priority(virtc_t *vc, int vm_id, const char *profile, int priority,
+        virtc_cb cb, void *arg)
+{
+    int ints[2] = { vm_id, priority };
+
+    if (!vm_id_valid(vm_id)) {
+        return -VIRTC_EINVAL;
+    }
+    return virtc_request(vc, MES_LAUNCH_QEMU_PRIORITY, REPLY_INT, ints, 2, profile ? profile : "-",
+            MAX_PROFILE_NAME, cb, arg);
+}
+
+int virtc_kill(virtc_t *vc, int vm_id, virtc_cb cb, void *arg)
+{
+    if (!vm_id_valid(vm_id)) {
+        return -VIRTC_EINVAL;
+    }
+    return virtc_request(vc, MES_KILL_QEMU, REPLY_INT, &vm_id, 1, NULL, 0, cb, arg);
+}
+
+int virtc_cpu_affinity(virtc_t *vc, int vm_id, virtc_cb cb, void *arg)
+{
+    if (!vm_id_valid(vm_id)) {
+        return -VIRTC_EINVAL;
+    }
+    return virtc_request(vc, MES_GET_CPU_AFFINITY, REPLY_TEXT, &vm_id, 1, NULL, 0, cb, arg);
+}
+
+int virtc_query_job(virtc_t *vc, int job_id, virtc_cb cb, void *arg)
+{
+    return virtc_request(vc, MES_QUERY_JOB, REPLY_INT2, &job_id, 1, NULL, 0, cb, arg);
+}
+
+int virtc_query_stats(virtc_t *vc, virtc_cb cb, void *arg)
+{
+    return virtc_request(vc, MES_QUERY_STATS, REPLY_TEXT, NULL, 0, NULL, 0, cb, arg);
+}
+
+int virtc_query_fit(virtc_t *vc, const char *profile, virtc_cb cb, void *arg)
+{
+    if (profile == NULL) {
+        return -VIRTC_EINVAL;
+    }
+    return virtc_request(vc, MES_QUERY_FIT, REPLY_TEXT, NULL, 0, profile, MAX_PROFILE_NAME, cb, arg);
+}
+
+int virtc_trace(virtc_t *vc, int op, virtc_cb cb, void *arg)
+{
+    if (op < 0 || op > 2) {
+        return -VIRTC_EINVAL;
+    }
+    return virtc_request(vc, MES_TRACE, REPLY_TEXT, &op, 1, NULL, 0, cb, arg);
+}
+
+int virtc_wait_ready(virtc_t *vc, int vm_id, int timeout_ms, virtc_cb cb, void *arg)
+{
+    int ints[2] = { vm_id, timeout_ms };
+
+    if (!vm_id_valid(vm_id)) {
+        return -VIRTC_EINVAL;
+    }
+    return virtc_request(vc, MES_WAIT_READY, REPLY_READY, ints, 2, NULL, 0, cb, arg);
+}
+
+int virtc_announce(virtc_t *vc, const virtc_node_t *node, virtc_cb cb, void *arg)
+{
+    int ints[6 + MAX_VM_NUM];
+    int i;
+
+    if (node->path == NULL || node->nr_vms < 0 || node->nr_vms > MAX_VM_NUM) {
+        return -VIRTC_EINVAL;
+    }
+
+    ints[0] = node->fit;
+    ints[1] = node->cpu_used;
+    ints[2] = node->cpu_cap;
+    ints[3] = node->mem_used;
+    ints[4] = node->mem_total;
+    ints[5] = node->nr_vms;
+    for (i = 0; i < node->nr_vms; i++) {
+        ints[6 + i] = node->vms[i];
+    }
+    return virtc_request(vc, MES_NODE_ANNOUNCE, REPLY_INT, ints, 6 + node->nr_vms,
+            node->path, MAX_NODE_PATH, cb, arg);
+}
+
+static void io_ints(const virtc_io_t *io, int def, int *ints)
+{
+    ints[0] = io ? io->iops : def;
+    ints[1] = io ? io->iops_burst : def;
+    ints[2] = io ? io->mbps : def;
+    ints[3] = io ? io->mbps_burst : def;
+    ints[4] = io ? io->burst : def;
+}
+
+int virtc_set_io_limits(virtc_t *vc, int vm_id, const virtc_io_t *io, const char *group,
+        virtc_cb cb, void *arg)
+{
+    int ints[6];
+
+    if (!vm_id_valid(vm_id)) {
+        return -VIRTC_EINVAL;
+    }
+    ints[0] = vm_id;
+    io_ints(io, -1, ints + 1);
+    return virtc_request(vc, MES_SET_IO_LIMITS, REPLY_INT, ints, 6, group ? group : "-",
+            MAX_IO_GROUP, cb, arg);
+}
+
+int virtc_set_io_group(virtc_t *vc, const char *group, const virtc_io_t *io, virtc_cb cb, void *arg)
+{
+    int ints[5];
+
+    if (group == NULL || strcmp(group, "-") == 0) {
+        return -VIRTC_EINVAL;
+    }
+    io_ints(io, 0, ints);
+    return virtc_request(vc, MES_SET_IO_GROUP, REPLY_INT, ints, 5, group, MAX_IO_GROUP, cb, arg);
+}
+
+virtc_t *virtc_open(const char *path, int *err)
+{
+    struct sockaddr_un addr;
+    virtc_t *vc;
+
+    if (path == NULL) {
+        path = getenv("VIRT_SOCKET");
+    }
+    if (path == NULL || *path == '\0') {
+        path = LIBVIRTD_SOCKET;
+    }
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        *err = -VIRTC_EINVAL;
+        return NULL;
+    }
+
+    vc = calloc(1, sizeof(virtc_t));
+    if (vc == NULL) {
+        *err = -VIRTC_ENOMEM;
+        return NULL;
+    }
+
+    vc->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (vc->fd == -1) {
+        free(vc);
+        *err = -VIRTC_ESYS;
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* a unix socket connects at once or fails, EAGAIN means the backlog is full */
+    if (connect(vc->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int saved = errno;
+        close(vc->fd);
+        free(vc);
+        errno = saved;
+        *err = -VIRTC_ESYS;
+        return NULL;
+    }
+
+    *err = 0;
+    return vc;
+}
+
+void virtc_close(virtc_t *vc)
+{
+    if (vc == NULL) {
+        return;
+    }
+    virtc_fail(vc, -VIRTC_ECLOSED);
+    close(vc->fd);
+    free(vc->out.data);
+    free(vc->in.data);
+    free(vc);
+}
+
+int virtc_fd(virtc_t *vc)
+{
+    return vc->fd;
+}
+
+int virtc_events(virtc_t *vc)
+{
+    return POLLIN | (buf_avail(&vc->out) > 0 ? POLLOUT : 0);
+}
+
+int virtc_pending(virtc_t *vc)
+{
+    return vc->pending;
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int virtc_wait(virtc_t *vc, int timeout_ms)
+{
+    long long deadline = now_ms() + timeout_ms;
+    struct pollfd pfd;
+    int ret, left;
+
+    while (vc->pending > 0) {
+        if (vc->err) {
+            return virtc_fail(vc, vc->err);
+        }
+
+        left = -1;
+        if (timeout_ms >= 0) {
+            left = deadline - now_ms();
+            if (left < 0) {
+                left = 0;
+            }
+        }
+
+        pfd.fd = vc->fd;
+        pfd.events = virtc_events(vc);
+        ret = poll(&pfd, 1, left);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -VIRTC_ESYS;
+        }
+        if (ret == 0) {
+            return -VIRTC_ETIMEDOUT;
+        }
+
+        ret = virtc_process(vc);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+struct virtc_status {
+    const virt_status_t *table;
+};
+
+virtc_status_t *virtc_status_open(const char *path, int *err)
+{
+    virtc_status_t *st;
+    struct stat sb;
+    void *table;
+    int fd;
+
+    if (path == NULL) {
+        path = getenv("VIRT_STATUS_SHM");
+    }
+    if (path == NULL || *path == '\0') {
+        path = VIRT_STATUS_SHM;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        *err = -VIRTC_ESYS;
+        return NULL;
+    }
+    if (fstat(fd, &sb) == -1 || sb.st_size < sizeof(virt_status_t)) {
+        close(fd);
+        *err = -VIRTC_EPROTO;
+        return NULL;
+    }
+    table = mmap(NULL, sizeof(virt_status_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (table == MAP_FAILED) {
+        *err = -VIRTC_ESYS;
+        return NULL;
+    }
+
+    st = malloc(sizeof(virtc_status_t));
+    if (st == NULL) {
+        munmap(table, sizeof(virt_status_t));
+        *err = -VIRTC_ENOMEM;
+        return NULL;
+    }
+    st->table = table;
+
+    *err = 0;
+    return st;
+}
+
+void virtc_status_close(virtc_status_t *st)
+{
+    if (st == NULL) {
+        return;
+    }
+    munmap((void *)st->table, sizeof(virt_status_t));
+    free(st);
+}
+
+uint64_t virtc_status_generation(virtc_status_t *st)
+{
+    return __atomic_load_n(&st->table->generation, __ATOMIC_ACQUIRE);
+}
+
+int virtc_status_read(virtc_status_t *st, virt_status_t *table)
+{
+    const virt_status_t *shm = st->table;
+    uint64_t seq;
+    int spins;
+
+    for (spins = 0; spins < VIRTC_STATUS_SPINS; spins++) {
+        seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(table, shm, sizeof(virt_status_t));
+        /* the copy happens before the second look at seq */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+
+        if (table->magic != VIRT_STATUS_MAGIC || table->size != sizeof(virt_status_t) ||
+                table->nr_vms < 0 || table->nr_vms > MAX_VM_NUM) {
+            return -VIRTC_EPROTO;
+        }
+        return 0;
+    }
+
+    return -VIRTC_ETIMEDOUT;
+}
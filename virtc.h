@@ -0,0 +1,123 @@
+#ifndef VIRTC_H
+#define VIRTC_H
+
+/*
+ * libvirtc - asynchronous client of virt-server.
+ *
+ * One connection carries any number of requests. They are queued and sent
+ * back to back without waiting for the answers, the server answers in order
+ * and each answer runs the request's callback. Nothing blocks: add
+ * virtc_fd() to your poll/epoll set with virtc_events() (POLLIN and POLLOUT
+ * have the values of EPOLLIN and EPOLLOUT) and call virtc_process() when it
+ * is ready, or let virtc_wait() do that for you.
+ *
+ * Functions return 0 (or a positive count) on success and a negative
+ * VIRTC_E* code on failure. Callbacks may queue new requests but must not
+ * close the connection.
+ */
+
+#include "virt-proto.h"
+
+enum {
+    VIRTC_OK,
+    VIRTC_ESYS,         /* a system call failed, errno tells which */
+    VIRTC_ENOMEM,
+    VIRTC_EINVAL,       /* bad argument, nothing was sent */
+    VIRTC_ECLOSED,      /* the server went away, or virtc_close() was called */
+    VIRTC_EPROTO,       /* the server answered something unexpected */
+    VIRTC_ENACK,        /* the server refused a field of the request */
+    VIRTC_EREFUSED,     /* launch or kill refused, see the server log */
+    VIRTC_ETIMEDOUT,
+    VIRTC_ENOVM,        /* no such vm, or it went away */
+};
+
+typedef struct virtc virtc_t;
+
+typedef struct virtc_reply {
+    MESSAGE_TYPE_T type;    /* of the request */
+    int err;                /* 0 or -VIRTC_E* */
+    int job_id;             /* launch and kill */
+    JOB_STATE_T state;      /* query job */
+    int result;             /* query job: 0 or -errno of the finished job */
+    int ready_ms;           /* wait ready: launch request to guest ready */
+    const char *text;       /* text replies, valid during the callback only */
+    int len;
+} virtc_reply_t;
+
+typedef void (*virtc_cb)(virtc_t *vc, const virtc_reply_t *reply, void *arg);
+
+/* path NULL connects to $VIRT_SOCKET or else LIBVIRTD_SOCKET, *err is set when
+ * NULL is returned */
+virtc_t *virtc_open(const char *path, int *err);
+/* pending requests complete with VIRTC_ECLOSED */
+void virtc_close(virtc_t *vc);
+
+int virtc_fd(virtc_t *vc);
+int virtc_events(virtc_t *vc);
+int virtc_process(virtc_t *vc);
+int virtc_pending(virtc_t *vc);
+/* process until no request is pending, timeout_ms < 0 waits forever */
+int virtc_wait(virtc_t *vc, int timeout_ms);
+
+int virtc_query_qemu(virtc_t *vc, virtc_cb cb, void *arg);
+/* profile NULL launches with the server's default profile */
+int virtc_launch(virtc_t *vc, int vm_id, const char *profile, virtc_cb cb, void *arg);
+/* the same, higher priority boots before the launches queued with a lower one */
+int virtc_launch_priority(virtc_t *vc, int vm_id, const char *profile, int priority,
+        virtc_cb cb, void *arg);
+int virtc_kill(virtc_t *vc, int vm_id, virtc_cb cb, void *arg);
+int virtc_cpu_affinity(virtc_t *vc, int vm_id, virtc_cb cb, void *arg);
+int virtc_query_job(virtc_t *vc, int job_id, virtc_cb cb, void *arg);
+int virtc_query_stats(virtc_t *vc, virtc_cb cb, void *arg);
+int virtc_query_fit(virtc_t *vc, const char *profile, virtc_cb cb, void *arg);
+/* 0 stops tracing, 1 starts it, 2 dumps it */
+int virtc_trace(virtc_t *vc, int op, virtc_cb cb, void *arg);
+/* complete once the guest of vm_id is usable, VIRTC_ETIMEDOUT after timeout_ms */
+int virtc_wait_ready(virtc_t *vc, int vm_id, int timeout_ms, virtc_cb cb, void *arg);
+
+/* federation: what a node reports to its coordinator, see MES_NODE_ANNOUNCE */
+typedef struct virtc_node {
+    const char *path;       /* socket the node listens on, requests are forwarded there */
+    int fit;                /* bit n: profile n fits now */
+    int cpu_used;           /* vCPU in thousandths */
+    int cpu_cap;
+    int mem_used;           /* MB */
+    int mem_total;
+    int nr_vms;             /* at most MAX_VM_NUM */
+    const int *vms;
+} virtc_node_t;
+
+/* VIRTC_EREFUSED when the server is no coordinator */
+int virtc_announce(virtc_t *vc, const virtc_node_t *node, virtc_cb cb, void *arg);
+
+/* guest disk limits, see MES_SET_IO_LIMITS */
+typedef struct virtc_io {
+    int iops;
+    int iops_burst;
+    int mbps;               /* MB/s */
+    int mbps_burst;
+    int burst;              /* seconds a burst may last */
+} virtc_io_t;
+
+/* io NULL gives the vm its profile's limits back, group NULL takes it out of
+ * its I/O group */
+int virtc_set_io_limits(virtc_t *vc, int vm_id, const virtc_io_t *io, const char *group,
+        virtc_cb cb, void *arg);
+/* the budget the vms of group share on a host, io NULL removes the group */
+int virtc_set_io_group(virtc_t *vc, const char *group, const virtc_io_t *io, virtc_cb cb, void *arg);
+
+/* Status table, see virt-proto.h: read straight from shared memory without
+ * asking the server. path NULL opens $VIRT_STATUS_SHM or else VIRT_STATUS_SHM. */
+typedef struct virtc_status virtc_status_t;
+
+virtc_status_t *virtc_status_open(const char *path, int *err);
+void virtc_status_close(virtc_status_t *st);
+/* grows whenever a vm changes, cheap enough to poll */
+uint64_t virtc_status_generation(virtc_status_t *st);
+/* a consistent copy of the table, VIRTC_EPROTO if the server writes another
+ * layout and VIRTC_ETIMEDOUT if it never finishes a write */
+int virtc_status_read(virtc_status_t *st, virt_status_t *table);
+
+const char *virtc_strerror(int err);
+
+#endif